@@ -16,11 +16,36 @@
 #include <stdlib.h>
 #include <time.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <limits.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <malloc.h>
+#include <signal.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 /*** constants ***/
 #define WEISS_VERSION "0.1.0"
 #define WEISS_TAB_AS_SPACES 1
 #define WEISS_TAB_STOP 4
+#define WEISS_ESC_TIMEOUT_MS 50 // default wait for the rest of an escape sequence
 #define WEISS_QUIT_CONFIRM_COUNTER 1
 #define WEISS_BACKSPACE_APPEND 1
 #define WEISS_DISPLAY_DIRT_COUNTER 1
@@ -34,17 +59,24 @@ enum editorKey {
     ARROW_RIGHT,
     ARROW_UP,
     ARROW_DOWN,
-    CTRL_ARROW_LEFT,
-    CTRL_ARROW_RIGHT,
-    CTRL_ARROW_UP,
-    CTRL_ARROW_DOWN,
     DEL_KEY,
     HOME_KEY,
     END_KEY,
     PAGE_UP,
     PAGE_DOWN,
+    UNKNOWN_KEY, // an escape sequence we don't bind
 };
 
+// NOTE: modifiers reported by the terminal are or'ed into the key.
+#define KEY_SHIFT (1 << 16)
+#define KEY_ALT (1 << 17)
+#define KEY_CTRL (1 << 18)
+
+#define CTRL_ARROW_LEFT (KEY_CTRL | ARROW_LEFT)
+#define CTRL_ARROW_RIGHT (KEY_CTRL | ARROW_RIGHT)
+#define CTRL_ARROW_UP (KEY_CTRL | ARROW_UP)
+#define CTRL_ARROW_DOWN (KEY_CTRL | ARROW_DOWN)
+
 enum editorHighlight {
     HL_NORMAL = 0,
     HL_COMMENT,
@@ -53,7 +85,11 @@ enum editorHighlight {
     HL_KEYWORD2,
     HL_STRING,
     HL_NUMBER,
-    HL_MATCH
+    HL_MATCH,
+    HL_MATCH_OTHER,
+    HL_CURSOR,
+    HL_SELECTION,
+    HL_BRACKET
 };
 
 #define HL_HIGHLIGHT_NUMBERS (1<<0)
@@ -71,36 +107,226 @@ struct editorSyntax {
     int flags;
 };
 
+struct bracketSum {
+    int sum; // openers less closers
+    int min; // lowest running sum, 0 included
+    int n; // brackets of either kind
+};
+
 typedef struct erow {
     int idx;
     int size;
     int rsize;
+    int coldOff; // where a cold row's text starts in its block
     char *chars;
     char *render;
     unsigned char *hl;
     int hl_open_comment;
+    unsigned char ascii; // NOTE: row holds no bytes >= 0x80, so byte == column.
+    unsigned char crlf; // ends in \r\n on disk, see file i/o
+    int *rxcache; // display column per chars offset, for non-ascii rows.
+    int memChars; // chars bytes and allocator slack the row is
+    int memSlack; // charged for in its buffer's mem
+    struct bracketSum brackets; // outside strings and comments
+    struct coldBlock *cold; // set while the row is compressed, see cold rows
 } erow;
 
-struct editorConfig {
+struct searchPattern {
+    char *needle; // case folded when icase is set
+    int len;
+    int icase;
+    int rare; // offset of the byte fed to the memchr filter
+    int skip[256];
+    struct regex *rx; // set for regex patterns, needle is then the source
+    struct searchPattern *clones; // per worker slot, a regex's DFA isn't shared
+    int nclones;
+};
+
+struct searchMatch {
+    int row;
+    int col;
+    int len;
+};
+
+struct matchIndexSlice {
+    int lo; // rows [lo, hi)
+    int hi;
+    struct searchMatch *m;
+    int count;
+    int cap;
+};
+
+struct matchIndex {
+    struct editorBuffer *buf; // rows indexed; the worker never looks at B
+    int active;
+    struct searchPattern pat;
+    struct searchMatch *m; // sorted by (row, col)
+    int count;
+    int cap;
+    int scanned; // rows [0, scanned) are indexed
+    int finished; // worker reached the end of the buffer
+    int cancel;
+    int running;
+    pthread_t thread;
+    int cur_row; // current match, -1 when there is none
+    int cur_col;
+    int cur_len;
+    int cur; // cached position of the current match in m
+    struct matchIndexSlice *slices; // one round of the worker pool
+    int nslices;
+};
+
+enum undoKind {
+    UNDO_NONE = 0,
+    UNDO_INSERT,
+    UNDO_DELETE,
+    UNDO_OTHER
+};
+
+struct rowMemory {
+    long long chars;
+    long long render;
+    long long hl;
+    long long rxcache;
+    long long slack; // allocator rounding and chunk headers
+    long long cold; // compressed blocks, see cold rows
+};
+
+struct undoLine {
+    char *chars;
+    int size;
+};
+
+struct undoHunk {
+    int group; // hunks sharing a group are undone as one step
+    int at;
+    int nold; // rows the edit replaced, saved in old
+    struct undoLine *old;
+    int nnew; // rows the edit left in their place
+    int cx, cy; // cursor before the edit
+};
+
+struct undoStack {
+    struct undoHunk *h;
+    int count;
+    int cap;
+};
+
+struct editorCursor {
     int cx, cy;
-    int rx; // added ry to keep track of last farthest y
     int px;
-    int rowoff;
-    int coloff;
-    int screenRows;
-    int screenCols;
+    int primary; // the main cursor, in lists that hold all of them
+};
+
+struct cursorSet {
+    struct editorCursor *c; // sorted by (cy, cx)
+    int count;
+    int cap;
+};
+
+struct keyMacro {
+    int *keys;
+    int count;
+    int cap;
+    int recording;
+    int playing;
+    int pos; // next key to replay
+};
+
+struct lineBlock {
+    int rows;
+    long long bytes; // each row with its newline, as on disk
+    int blanks; // empty rows
+    struct bracketSum brackets;
+    int dirty; // rows changed since the sums were taken
+};
+
+struct lineIndex {
+    struct lineBlock *block;
+    int nblocks;
+    int cap;
+    long long *tree; // 1-based Fenwick trees over the blocks' bytes,
+    int *blank; // empty rows
+    int *count; // and rows
+    int tcap;
+    struct bracketSum *brackets; // segment tree, leaves at [bcap, 2 * bcap)
+    int bcap;
+    int dirty; // some block is
+    int built; // the blocks cover the rows; queries build them first
+};
+
+struct editorBuffer {
     int numRows;
     erow *row;
     int dirty;
-    int mode;
     char *filename;
-    char statusMsg[80];
-    time_t statusMsgTime;
+    int loaded; // rows read in; files are opened lazily
+    long long diskSize; // bytes when last read or written
+    struct rowMemory mem; // kept up to date as rows change
+    long long hotFloor; // hot row bytes left by the last cold sweep
+    struct hexFile *hex; // shown as bytes, with no rows; see hex view
+    int crlf; // most lines read ended in \r\n, and new rows will too
+    int mixedEol; // lines read ended both ways
+    int noFinalEol; // the last line read had no newline, nor will it on save
+    int shortRead; // a read error cut the file short; saving asks for a name
+    int bom; // the file started with a UTF-8 byte order mark
+    int badUtf8; // the file isn't valid UTF-8
     struct editorSyntax *syntax;
+    struct matchIndex match;
+    struct lineIndex lines;
+    struct undoStack undo;
+    struct undoStack redo;
+    int undoGroup;
+    int undoKind; // kind of the last edit, UNDO_NONE once sealed
+    int undoKeypress; // keypress the last edit happened on
+};
+
+struct editorView {
+    struct editorBuffer *buf;
+    int cx, cy;
+    int rx; // added ry to keep track of last farthest y
+    int px; // preferred display column for vertical moves
+    int rowoff;
+    int coloff;
+    int top, left; // screen position of the view
+    int screenRows; // text rows, the view's status bar not included
+    int screenCols;
+    struct cursorSet cursors; // besides the main one
+    int markSet;
+    int mx, my; // the other end of the selection
+    long long hexCur, hexTop; // cursor and first byte shown, in a hex buffer
+    int hexLow; // the cursor is on the low nibble
+    int hexText; // typing goes to the text column
+};
+
+struct layoutNode {
+    struct layoutNode *parent;
+    struct layoutNode *child[2]; // both NULL for a leaf
+    int vertical; // children side by side rather than stacked
+    struct editorView *view; // leaves only
+    int top, left, rows, cols;
+};
+
+struct editorConfig {
+    int screenRows; // whole terminal, less the message bar and one status bar
+    int screenCols;
+    int mode;
+    char statusMsg[160];
+    time_t statusMsgTime;
+    int keypresses;
+    int escTimeout; // ms to wait for the rest of an escape sequence
+    struct keyMacro macro;
+    struct editorBuffer **buffers;
+    int nbuffers;
+    struct layoutNode *layout;
+    pthread_mutex_t lock;
+    int lockWanted;
     struct termios orig_termios;
 };
 
 struct editorConfig E;
+struct editorBuffer *B; // buffer of the current view
+struct editorView *V; // view with the cursor, or the one being drawn
 
 /*** filetypes ***/
 
@@ -132,6 +358,56 @@ void editorSetStatusMessage(const char *fmt, ...);
 int editorReadKey(void);
 void editorRefreshScreen(void);
 char *editorPrompt(char *prompt, void (*callback)(char *, int));
+char *editorPromptEmpty(char *prompt, void (*callback)(char *, int));
+void matchIndexUpdateRow(int at);
+void matchIndexInsertRow(int at);
+void matchIndexDelRow(int at);
+void lineIndexRowChanged(int at);
+void lineIndexRowsInserted(int at, int n);
+void lineIndexRowsDeleted(int at, int n);
+void lineIndexReset(void);
+void matchIndexReset(struct matchIndex *mi);
+void matchIndexResume(struct matchIndex *mi);
+void editorUndoBegin(int kind);
+void editorUndoRecord(int at, int nold, int nnew);
+void editorUndoRecordRow(int at, char *chars, int size);
+void editorUndoSeal(void);
+void editorUndoClear(void);
+struct regex *rxCompile(const char *pat, int icase, const char **err);
+int rxFind(struct regex *rx, const char *s, int len, int from, int *mlen);
+void rxFree(struct regex *rx);
+void editorFreeRows(void);
+void textFree(char *t);
+void editorRowThaw(erow *row);
+void coldBlockRelease(struct coldBlock *b);
+int editorReadByte(char *c, int ms);
+void editorProcessKeypress(void);
+void editorMoveCursor(int key);
+void editorCursorsInsert(int c);
+void editorCursorsNewline(void);
+void editorCursorsClear(void);
+int editorSelection(int *sy, int *sx, int *ey, int *ex);
+void editorMarkClear(void);
+struct layoutNode *layoutFirstLeaf(struct layoutNode *n);
+struct layoutNode *layoutNextLeaf(struct layoutNode *n);
+void editorBufferLoad(struct editorBuffer *b);
+void editorLayoutResize(void);
+void editorBufferOpen(const char *filename);
+struct editorBuffer *editorBufferNew(const char *filename);
+void editorStreamRead(void);
+void editorStreamEdited(int to);
+int serverActive(void);
+int serverPending(void);
+int serverHandle(int fd);
+void serverParseAll(void);
+int serverInputFill(int ms);
+void serverRefreshAll(void);
+int serverFrame(const char *b, int len);
+int serverWrite(const char *b, int len);
+int serverDetach(void);
+void serverBufferGone(struct editorBuffer *dead, struct editorBuffer *next);
+struct editorView *serverViewOf(struct editorBuffer *b, struct editorView *except);
+char *editorPathAbsolute(const char *name);
 
 /*** term settings ***/
 
@@ -173,8 +449,9 @@ void enableRawMode()
     raw.c_oflag &= ~(OPOST);
     raw.c_cflag |= (CS8);
     raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+    // NOTE: reads never block; waiting is done in epoll/poll instead.
     raw.c_cc[VMIN] = 0;
-    raw.c_cc[VTIME] = 1;
+    raw.c_cc[VTIME] = 0;
 
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1)
     {
@@ -197,7 +474,7 @@ int getCursorPosition(int *rows, int *cols)
 
     while (i < sizeof(buf) - 1)
     {
-        if (read(STDIN_FILENO, &buf[i], 1) != 1)
+        if (!editorReadByte(&buf[i], E.escTimeout))
         {
             break;
         }
@@ -241,1086 +518,9973 @@ int getWindowSize(int *rows, int *cols)
     }
 }
 
-/*** syntax highlighting ***/
+/*** locking ***/
 
-int is_separator(int c)
+/*
+ * The main thread owns the buffer whenever it isn't blocked on input;
+ * background workers take E.lock in short slices and step aside as soon
+ * as the main thread asks for it back.
+ */
+
+void editorLock(void)
 {
-    return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+    __atomic_store_n(&E.lockWanted, 1, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&E.lock);
+    __atomic_store_n(&E.lockWanted, 0, __ATOMIC_RELEASE);
 }
 
-void editorUpdateSyntax(erow *row)
+void editorUnlock(void)
 {
-    row->hl = realloc(row->hl, row->rsize);
-    memset(row->hl, HL_NORMAL, row->rsize);
-
-    if (E.syntax == NULL) { return; }
+    pthread_mutex_unlock(&E.lock);
+}
 
-    char **keywords = E.syntax->keywords;
+void editorYieldLock(void)
+{
+    pthread_mutex_unlock(&E.lock);
+    while (__atomic_load_n(&E.lockWanted, __ATOMIC_ACQUIRE)) { sched_yield(); }
+    pthread_mutex_lock(&E.lock);
+}
 
-    char *scs = E.syntax->singleline_comment_start;
-    char *mcs = E.syntax->multiline_comment_start;
-    char *mce = E.syntax->multiline_comment_end;
+/*** events ***/
 
-    int scs_len = scs ? strlen(scs) : 0;
-    int mcs_len = scs ? strlen(mcs) : 0;
-    int mce_len = scs ? strlen(mce) : 0;
+/*
+ * The main thread sleeps in epoll until there is input. Resizes arrive
+ * through a signalfd, timers through one timerfd armed for the nearest
+ * deadline, and background threads call editorWake() when they have
+ * something worth showing. Everything but input ends in a redraw.
+ */
 
-    int prev_sep = 1;
-    int in_string = 0;
-    int in_comment = (row->idx > 0 && E.row[row->idx - 1].hl_open_comment);
+enum editorTimer {
+    TIMER_STATUS_MSG = 0,
+    TIMER_COUNT
+};
 
-    int i = 0;
-    while (i < row->rsize)
-    {
-        char c = row->render[i];
-        unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
+struct eventLoop {
+    int epfd;
+    int sigfd;
+    int timerfd;
+    int wakefd;
+    int streamfd; // a pipe read into a buffer, see editorStreamRead
+    long long deadline[TIMER_COUNT]; // monotonic ms, 0 when disarmed
+    void (*fire[TIMER_COUNT])(void);
+};
 
-        if (scs_len && !in_string && !in_comment)
-        {
-            if (!strncmp(&row->render[i], scs, scs_len))
-            {
-                memset(&row->hl[i], HL_COMMENT, row->rsize - i);
-                break;
-            }
-        }
+struct eventLoop events = { -1, -1, -1, -1, -1, {0}, {0} };
 
-        if (mcs_len && mce_len && !in_string)
-        {
-            if (in_comment)
-            {
-                row->hl[i] = HL_MLCOMMENT;
-                if (!strncmp(&row->render[i], mce, mce_len))
-                {
-                    memset(&row->hl[i], HL_MLCOMMENT, mce_len);
-                    i += mce_len;
-                    in_comment = 0;
-                    prev_sep = 1;
-                    continue;
-                }
-                else
-                {
-                    i++;
-                    continue;
-                }
-            }
-            else if (!strncmp(&row->render[i], mcs, mcs_len))
-            {
-                memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
-                i += mcs_len;
-                in_comment = 1;
-                continue;
-            }
-        }
+long long editorNowMs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-        if (E.syntax->flags & HL_HIGHLIGHT_STRINGS)
-        {
-            if (in_string)
-            {
-                row->hl[i] = HL_STRING;
-                if (c == '\\' && i + 1 < row->rsize)
-                {
-                    row->hl[i + 1] = HL_STRING;
-                    i += 2;
-                    continue;
-                }
-                if (c == in_string) { in_string = 0; }
-                i++;
-                prev_sep = 1;
-                continue;
-            }
-            else
-            {
-                if (c == '"' || c == '\'')
-                {
-                    in_string = c;
-                    row->hl[i] = HL_STRING;
-                    i++;
-                    continue;
-                }
-            }
-        }
+void editorEventWatch(int fd)
+{
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (epoll_ctl(events.epfd, EPOLL_CTL_ADD, fd, &ev) == -1) { die("epoll_ctl"); }
+}
 
-        if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS)
-        {
-            if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) ||
-                (c == '.' && prev_hl == HL_NUMBER))
-            {
-                row->hl[i] = HL_NUMBER;
-                i++;
-                prev_sep = 0;
-                continue;
-            }
-        }
+void editorEventsInit(void)
+{
+    // NOTE: blocked before any thread starts, so all of them inherit it
+    // and the signalfd is the only place SIGWINCH shows up.
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGWINCH);
+    if (pthread_sigmask(SIG_BLOCK, &mask, NULL) != 0) { die("sigmask"); }
+
+    events.epfd = epoll_create1(EPOLL_CLOEXEC);
+    events.sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    events.timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    events.wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (events.epfd == -1 || events.sigfd == -1 || events.timerfd == -1 ||
+        events.wakefd == -1)
+    {
+        die("events");
+    }
 
-        if (prev_sep)
-        {
-            int j;
-            for (j = 0; keywords[j]; j++)
-            {
-                int klen = strlen(keywords[j]);
-                int kw2 = keywords[j][klen - 1] == '|';
-                if (kw2) klen--;
+    editorEventWatch(events.sigfd);
+    editorEventWatch(events.timerfd);
+    editorEventWatch(events.wakefd);
+}
 
-                if (!strncmp(&row->render[i], keywords[j], klen) &&
-                    is_separator(row->render[i + klen]))
-                {
-                    memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-                    i += klen;
-                    break;
-                }
+void editorWake(void)
+{
+    // NOTE: safe from any thread; wake-ups pending at once collapse into
+    // a single redraw.
+    uint64_t one = 1;
+    if (write(events.wakefd, &one, sizeof(one)) == -1) { return; }
+}
 
-                if (keywords[j] != NULL)
-                {
-                    prev_sep = 0;
-                    continue;
-                }
-            }
+void editorTimerArm(void)
+{
+    long long next = 0;
+    for (int i = 0; i < TIMER_COUNT; i++)
+    {
+        if (events.deadline[i] && (next == 0 || events.deadline[i] < next))
+        {
+            next = events.deadline[i];
         }
-
-        prev_sep = is_separator(c);
-        i++;
     }
 
-    int changed = (row->hl_open_comment != in_comment);
-    row->hl_open_comment = in_comment;
-    if (changed && row->idx + 1 < E.numRows)
+    struct itimerspec its = {0};
+    if (next)
     {
-        editorUpdateSyntax(&E.row[row->idx + 1]);
+        long long ms = next - editorNowMs();
+        if (ms < 1) { ms = 1; }
+        its.it_value.tv_sec = ms / 1000;
+        its.it_value.tv_nsec = (ms % 1000) * 1000000;
     }
+    timerfd_settime(events.timerfd, 0, &its, NULL);
 }
 
-int editorSyntaxToColor(int hl)
+void editorTimerSet(int timer, int ms, void (*fire)(void))
 {
-    switch (hl)
+    /*
+     * Runs `fire` (with E.lock held) once `ms` have passed, followed by
+     * a redraw; a NULL `fire` only redraws. Re-setting a timer moves it.
+     */
+    if (events.timerfd == -1) { return; }
+    events.deadline[timer] = editorNowMs() + ms;
+    events.fire[timer] = fire;
+    editorTimerArm();
+}
+
+void editorTimerFire(void)
+{
+    uint64_t expirations;
+    if (read(events.timerfd, &expirations, sizeof(expirations)) == -1) { return; }
+
+    long long now = editorNowMs();
+    for (int i = 0; i < TIMER_COUNT; i++)
     {
-        case HL_COMMENT:
-        case HL_MLCOMMENT: return 36;
-        case HL_KEYWORD1: return 33;
-        case HL_KEYWORD2: return 32;
-        case HL_STRING: return 35;
-        case HL_NUMBER: return 31;
-        case HL_MATCH: return 7;
-        default: return 37;
+        if (events.deadline[i] && events.deadline[i] <= now)
+        {
+            events.deadline[i] = 0;
+            if (events.fire[i]) { events.fire[i](); }
+        }
     }
+    editorTimerArm();
 }
 
-void editorSelectSyntaxHighlight()
+void editorHandleResize(void)
 {
-    E.syntax = NULL;
-    if (E.filename == NULL) { return; }
+    struct signalfd_siginfo si;
+    while (read(events.sigfd, &si, sizeof(si)) == sizeof(si)) {}
+
+    int rows, cols;
+    if (getWindowSize(&rows, &cols) == -1) { return; }
+    E.screenRows = rows > 3 ? rows - 2 : 1;
+    E.screenCols = cols > 0 ? cols : 1;
+    editorLayoutResize();
+}
 
-    char *ext = strrchr(E.filename, '.');
+/*
+ * Terminal input is read in whole chunks into a ring, so a burst of keys
+ * (a paste, key repeat, an escape sequence) costs one read() instead of
+ * one per byte.
+ */
 
-    if (!ext || ext == E.filename) { return; }
+#define INPUT_RING_SIZE 4096 // power of two
 
-    for (unsigned int j = 0; j < HLDB_ENTRIES; j++)
-    {
-        struct editorSyntax *s = &HLDB[j];
-        unsigned int i = 0;
-        while (s->filematch[i])
-        {
-            int is_ext = (s->filematch[i][0] == '.');
-            if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
-                (!is_ext && strstr(E.filename, s->filematch[i])))
-            {
-                E.syntax = s;
+struct inputRing {
+    unsigned char buf[INPUT_RING_SIZE];
+    unsigned int head; // next byte to decode
+    unsigned int tail; // next byte to fill
+    int closed; // the server's client hung up, see server
+};
 
-                int filerow;
-                for (filerow = 0; filerow < E.numRows; filerow++)
-                {
-                    editorUpdateSyntax(&E.row[filerow]);
-                }
+struct inputRing input;
 
-                return;
-            }
-            i++;
-        }
+int editorInputFill(int ms)
+{
+    /*
+     * Waits at most `ms` for terminal input and appends what's there to
+     * the ring. Returns 0 on timeout.
+     */
+    if (serverActive()) { return serverInputFill(ms); }
+    struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+    while (1)
+    {
+        int ready = poll(&pfd, 1, ms);
+        if (ready == -1 && errno != EINTR) { die("poll"); }
+        if (ready == 0) { return 0; }
+        if (ready == 1) { break; }
     }
+
+    unsigned int used = input.tail - input.head;
+    if (used == INPUT_RING_SIZE) { return 1; }
+    unsigned int at = input.tail & (INPUT_RING_SIZE - 1);
+    unsigned int room = INPUT_RING_SIZE - used;
+    if (room > INPUT_RING_SIZE - at) { room = INPUT_RING_SIZE - at; }
+
+    int nread = read(STDIN_FILENO, &input.buf[at], room);
+    if (nread == -1 && errno != EAGAIN && errno != EINTR) { die("read"); }
+    if (nread == 0 && (pfd.revents & (POLLHUP | POLLERR))) { exit(1); }
+    if (nread > 0) { input.tail += nread; }
+    return nread > 0;
 }
 
-/*** row ops ***/
+int editorPeekByte(int ms)
+{
+    // NOTE: returns -1 if nothing arrives within `ms`.
+    if (input.head == input.tail && !editorInputFill(ms)) { return -1; }
+    return input.buf[input.head & (INPUT_RING_SIZE - 1)];
+}
 
-int editorRowCxToRx(erow *row, int cx)
+int editorReadByte(char *c, int ms)
 {
-    int rx = 0;
-    int j;
-    for (j = 0; j < cx; j++)
-    {
-        if (row->chars[j] == '\t')
-        {
-            rx += (WEISS_TAB_STOP - 1) - (rx % WEISS_TAB_STOP);
-        }
-        rx++;
-    }
-    return rx;
+    /*
+     * Takes one byte of terminal input, waiting at most `ms` for it.
+     * Returns 0 on timeout.
+     */
+    int b = editorPeekByte(ms);
+    if (b == -1) { return 0; }
+    input.head++;
+    *c = b;
+    return 1;
 }
 
-int editorRowRxToCx(erow *row, int rx)
+void editorEventsPoll(void)
 {
-    int cur_rx = 0;
-    int cx;
+    /*
+     * Waits for one round of events. Called without E.lock, which is only
+     * taken to handle events that need a redraw.
+     */
+    struct epoll_event ev[4];
+    int n = epoll_wait(events.epfd, ev, 4, -1);
+    if (n == -1)
+    {
+        if (errno == EINTR) { return; }
+        die("epoll_wait");
+    }
 
-    for (cx = 0; cx < row->size; cx++)
+    int readable = 0, resize = 0, timer = 0, wake = 0, piped = 0, served = 0;
+    for (int i = 0; i < n; i++)
     {
-        if (row->chars[cx] == '\t')
+        int fd = ev[i].data.fd;
+        if (fd == STDIN_FILENO) { readable = 1; }
+        else if (fd == events.sigfd) { resize = 1; }
+        else if (fd == events.timerfd) { timer = 1; }
+        else if (fd == events.wakefd) { wake = 1; }
+        else if (fd == events.streamfd) { piped = 1; }
+        else { served = 1; }
+    }
+    if (wake)
+    {
+        uint64_t count;
+        if (read(events.wakefd, &count, sizeof(count)) == -1) { wake = 0; }
+    }
+
+    if (resize || timer || wake || piped || served)
+    {
+        editorLock();
+        if (resize) { editorHandleResize(); }
+        if (timer) { editorTimerFire(); }
+        if (piped) { editorStreamRead(); }
+        for (int i = 0; served && i < n; i++) { serverHandle(ev[i].data.fd); }
+        if (wake) { serverParseAll(); }
+        // NOTE: a pending key repaints the screen anyway.
+        if (!readable && !serverPending())
         {
-            cur_rx += (WEISS_TAB_STOP - 1) - (cur_rx % WEISS_TAB_STOP);
+            if (serverActive()) { serverRefreshAll(); }
+            else { editorRefreshScreen(); }
         }
-        cur_rx++;
+        editorUnlock();
+    }
+    if (readable) { editorInputFill(0); }
+}
 
-        if (cur_rx > rx) { return cx; }
+void editorWaitInput(void)
+{
+    // NOTE: returns once there is input to decode, without E.lock held.
+    while (input.head == input.tail)
+    {
+        if (input.closed)
+        {
+            // NOTE: escapes unwind whatever prompt the client left open.
+            input.buf[input.tail++ & (INPUT_RING_SIZE - 1)] = '\x1b';
+            return;
+        }
+        // NOTE: keys the server has buffered don't wake epoll again.
+        if (serverActive() && serverInputFill(0)) { continue; }
+        editorEventsPoll();
     }
-    return cx;
 }
 
-void editorUpdateRow(erow *row)
+/*** profiler ***/
+
+/*
+ * Frame timings are always collected: a few monotonic clock reads per
+ * frame, kept in a ring. A frame starts when its key is read and ends
+ * once it has been written out. Alt-p shows a summary in the message bar.
+ */
+
+#define PROF_SAMPLES 256 // power of two
+
+enum profPhase {
+    PROF_KEY = 0, // handling the key, up to the refresh
+    PROF_SCROLL,
+    PROF_ROWS,
+    PROF_WRITE,
+    PROF_PHASES
+};
+
+struct frameSample {
+    int latency; // us from the key to the write, -1 if no key caused the frame
+    int phase[PROF_PHASES]; // us
+    int bytes;
+    int reallocs;
+};
+
+struct profiler {
+    int visible;
+    long long keyAt; // when the frame's key was read, 0 if none was
+    struct frameSample cur;
+    struct frameSample ring[PROF_SAMPLES];
+    unsigned int count;
+};
+
+struct profiler prof;
+
+long long profNowUs(void)
 {
-    int tabs = 0;
-    int j;
-    for (j = 0; j < row->size; j++)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void profKey(void)
+{
+    // NOTE: a frame is charged to the first key read since the last one.
+    if (prof.keyAt == 0) { prof.keyAt = profNowUs(); }
+}
+
+void profAdd(int phase, long long since)
+{
+    prof.cur.phase[phase] += profNowUs() - since;
+}
+
+void profFrameEnd(int bytes)
+{
+    prof.cur.bytes = bytes;
+    prof.cur.latency = prof.keyAt ? (int)(profNowUs() - prof.keyAt) : -1;
+    prof.ring[prof.count++ & (PROF_SAMPLES - 1)] = prof.cur;
+    memset(&prof.cur, 0, sizeof(prof.cur));
+    prof.keyAt = 0;
+}
+
+int profCmp(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+int profSummary(char *buf, int len)
+{
+    /*
+     * Latency percentiles are over the frames in the ring a key caused,
+     * phase times are averages, and bytes and reallocs are the last
+     * frame's.
+     */
+    int frames = prof.count < PROF_SAMPLES ? (int)prof.count : PROF_SAMPLES;
+    if (frames == 0) { return snprintf(buf, len, "no frames yet"); }
+
+    int lat[PROF_SAMPLES];
+    int n = 0;
+    long long phase[PROF_PHASES] = {0};
+    for (int i = 0; i < frames; i++)
     {
-        if (row->chars[j] == '\t') { tabs++; }
+        struct frameSample *s = &prof.ring[i];
+        if (s->latency >= 0) { lat[n++] = s->latency; }
+        for (int p = 0; p < PROF_PHASES; p++) { phase[p] += s->phase[p]; }
     }
+    qsort(lat, n, sizeof(int), profCmp);
+    int p50 = n ? lat[(n - 1) / 2] : 0;
+    int p99 = n ? lat[(n * 99 + 99) / 100 - 1] : 0;
+
+    struct frameSample *last = &prof.ring[(prof.count - 1) & (PROF_SAMPLES - 1)];
+    return snprintf(buf, len, "p50 %.1fms p99 %.1fms | key %lld scroll %lld rows %lld write %lld us"
+                    " | %.1fKB %d reallocs",
+                    p50 / 1000.0, p99 / 1000.0, phase[PROF_KEY] / frames,
+                    phase[PROF_SCROLL] / frames, phase[PROF_ROWS] / frames,
+                    phase[PROF_WRITE] / frames, last->bytes / 1024.0, last->reallocs);
+}
 
-    free(row->render);
-    row->render = malloc(row->size + tabs * (WEISS_TAB_STOP - 1) + 1);
+/*** tracing ***/
 
-    int idx = 0;
-    for (j = 0; j < row->size; j++)
+/*
+ * WEISS_TRACE=file turns on tracing: begin/end events from every thread
+ * go into a ring allocated up front, oldest overwritten first. The ring
+ * is written out as Chrome trace-event JSON (Perfetto, chrome://tracing)
+ * on exit, or on Alt-t.
+ */
+
+#define TRACE_EVENTS (1 << 16) // power of two
+
+struct traceEvent {
+    const char *name; // static strings only
+    char ph; // 'B' or 'E'
+    int tid;
+    int n; // argument shown in the viewer, -1 for none
+    long long ns;
+};
+
+struct traceRing {
+    char *path;
+    struct traceEvent *ev; // NULL when tracing is off
+    unsigned int count; // events ever recorded
+    long long origin;
+};
+
+struct traceRing trace;
+
+long long traceNow(void)
+{
+    if (trace.ev == NULL) { return 0; }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void traceRecord(const char *name, char ph, long long ns, int n)
+{
+    if (trace.ev == NULL) { return; }
+    // NOTE: each thread claims its own slot, so recording takes no lock.
+    unsigned int i = __atomic_fetch_add(&trace.count, 1, __ATOMIC_RELAXED);
+    struct traceEvent *e = &trace.ev[i & (TRACE_EVENTS - 1)];
+    e->name = name;
+    e->ph = ph;
+    e->tid = (int)syscall(SYS_gettid);
+    e->n = n;
+    e->ns = ns;
+}
+
+void traceBegin(const char *name)
+{
+    traceRecord(name, 'B', traceNow(), -1);
+}
+
+void traceEnd(const char *name, int n)
+{
+    traceRecord(name, 'E', traceNow(), n);
+}
+
+void traceSpan(const char *name, long long since, int n)
+{
+    // NOTE: for spans only worth keeping once they turn out long.
+    traceRecord(name, 'B', since, -1);
+    traceRecord(name, 'E', traceNow(), n);
+}
+
+int traceDump(void)
+{
+    /*
+     * Writes the ring out, oldest event first. Returns the number of
+     * events written, or -1.
+     */
+    if (trace.ev == NULL) { return -1; }
+    FILE *fp = fopen(trace.path, "w");
+    if (fp == NULL) { return -1; }
+
+    unsigned int count = __atomic_load_n(&trace.count, __ATOMIC_RELAXED);
+    unsigned int first = count > TRACE_EVENTS ? count - TRACE_EVENTS : 0;
+    int pid = getpid();
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for (unsigned int i = first; i < count; i++)
     {
-        if (row->chars[j] == '\t')
+        struct traceEvent *e = &trace.ev[i & (TRACE_EVENTS - 1)];
+        fprintf(fp, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f",
+                i == first ? "" : ",\n", e->name, e->ph, pid, e->tid,
+                (e->ns - trace.origin) / 1000.0);
+        if (e->n >= 0) { fprintf(fp, ",\"args\":{\"n\":%d}", e->n); }
+        fputc('}', fp);
+    }
+    fprintf(fp, "\n]}\n");
+    fclose(fp);
+    return count - first;
+}
+
+void traceExit(void)
+{
+    traceDump();
+}
+
+void traceInit(void)
+{
+    char *path = getenv("WEISS_TRACE");
+    if (path == NULL || *path == '\0') { return; }
+    trace.path = strdup(path);
+    trace.ev = calloc(TRACE_EVENTS, sizeof(struct traceEvent));
+    trace.origin = traceNow();
+    atexit(traceExit);
+}
+
+/*** worker pool ***/
+
+/*
+ * A fixed set of threads that run one batch of tasks at a time. The
+ * caller always holds E.lock and works on the batch too, so tasks may
+ * read the buffer freely but must only write to their own task state.
+ */
+
+#define WORKER_POOL_MAX 16
+
+struct workerPool {
+    int size; // threads including the caller, 0 until first use
+    int started;
+    pthread_t threads[WORKER_POOL_MAX];
+    pthread_mutex_t mu;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    void (*fn)(void *arg, int task, int slot);
+    void *arg;
+    int tasks;
+    int next; // first unclaimed task
+    int pending; // tasks claimed or not, that haven't finished
+};
+
+struct workerPool workers = {
+    .mu = PTHREAD_MUTEX_INITIALIZER,
+    .work = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+};
+
+int workerPoolSize(void)
+{
+    if (workers.size == 0)
+    {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        if (n < 1) { n = 1; }
+        if (n > WORKER_POOL_MAX) { n = WORKER_POOL_MAX; }
+        workers.size = n;
+    }
+    return workers.size;
+}
+
+void *workerPoolThread(void *arg)
+{
+    int slot = (int)(intptr_t)arg;
+
+    pthread_mutex_lock(&workers.mu);
+    while (1)
+    {
+        while (workers.next >= workers.tasks)
         {
-            row->render[idx++] = '%';
-            while (idx % WEISS_TAB_STOP != 0) { row->render[idx++] = ' '; }
+            pthread_cond_wait(&workers.work, &workers.mu);
         }
-        else
+        int task = workers.next++;
+        void (*fn)(void *, int, int) = workers.fn;
+        void *fnarg = workers.arg;
+        pthread_mutex_unlock(&workers.mu);
+
+        fn(fnarg, task, slot);
+
+        pthread_mutex_lock(&workers.mu);
+        if (--workers.pending == 0) { pthread_cond_signal(&workers.done); }
+    }
+    return NULL;
+}
+
+void workerPoolRun(void (*fn)(void *arg, int task, int slot), void *arg, int tasks)
+{
+    /*
+     * Runs fn(arg, task, slot) for every task in [0, tasks) and returns
+     * once all of them are done. `slot` names the thread, 0 being the
+     * caller, so tasks can keep per-thread scratch state.
+     */
+    if (tasks <= 1 || workerPoolSize() == 1)
+    {
+        for (int i = 0; i < tasks; i++) { fn(arg, i, 0); }
+        return;
+    }
+
+    pthread_mutex_lock(&workers.mu);
+    while (workers.started < workers.size - 1)
+    {
+        int slot = workers.started + 1;
+        if (pthread_create(&workers.threads[workers.started], NULL,
+                           workerPoolThread, (void *)(intptr_t)slot) != 0)
         {
-            row->render[idx++] = row->chars[j];
+            workers.size = workers.started + 1;
+            break;
         }
+        workers.started++;
     }
-    row->render[idx] = '\0';
-    row->rsize = idx;
 
-    editorUpdateSyntax(row);
+    workers.fn = fn;
+    workers.arg = arg;
+    workers.tasks = tasks;
+    workers.next = 0;
+    workers.pending = tasks;
+    pthread_cond_broadcast(&workers.work);
+
+    while (workers.next < workers.tasks)
+    {
+        int task = workers.next++;
+        pthread_mutex_unlock(&workers.mu);
+        fn(arg, task, 0);
+        pthread_mutex_lock(&workers.mu);
+        workers.pending--;
+    }
+    while (workers.pending > 0) { pthread_cond_wait(&workers.done, &workers.mu); }
+    pthread_mutex_unlock(&workers.mu);
 }
 
-void editorInsertRow(int at, char *s, size_t len)
+/*** utf8 ***/
+
+#define UTF8_IS_CONT(c) (((unsigned char)(c) & 0xC0) == 0x80)
+
+int utf8IsAscii(const char *s, int len)
+{
+    int i = 0;
+#if defined(__SSE2__)
+    // NOTE: or four vectors together so the common case costs one
+    // movemask per 64 bytes.
+    for (; i + 64 <= len; i += 64)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(s + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(s + i + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *)(s + i + 32));
+        __m128i d = _mm_loadu_si128((const __m128i *)(s + i + 48));
+        __m128i m = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+        if (_mm_movemask_epi8(m)) { return 0; }
+    }
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+        if (_mm_movemask_epi8(v)) { return 0; }
+    }
+#endif
+    for (; i < len; i++)
+    {
+        if ((unsigned char)s[i] & 0x80) { return 0; }
+    }
+    return 1;
+}
+
+int utf8Decode(const char *s, int len, int *cp)
 {
-    if (at < 0 || at > E.numRows) { return; }
+    /*
+     * Decodes one codepoint from s, returning the number of bytes consumed.
+     * Malformed, overlong or truncated sequences consume a single byte and
+     * yield -1 so callers can render the raw byte.
+     */
+    const unsigned char *u = (const unsigned char *)s;
+    int n, c;
 
-    E.row = realloc(E.row, sizeof(erow) * (E.numRows + 1));
-    memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numRows - at));
-    for (int j = at + 1; j <= E.numRows; j++) { E.row[j].idx++; }
+    if (u[0] < 0x80) { *cp = u[0]; return 1; }
+    else if ((u[0] & 0xE0) == 0xC0) { n = 2; c = u[0] & 0x1F; }
+    else if ((u[0] & 0xF0) == 0xE0) { n = 3; c = u[0] & 0x0F; }
+    else if ((u[0] & 0xF8) == 0xF0) { n = 4; c = u[0] & 0x07; }
+    else { *cp = -1; return 1; }
 
-    E.row[at].idx = at;
+    if (n > len) { *cp = -1; return 1; }
+    for (int i = 1; i < n; i++)
+    {
+        if (!UTF8_IS_CONT(u[i])) { *cp = -1; return 1; }
+        c = (c << 6) | (u[i] & 0x3F);
+    }
 
-    E.row[at].size = len;
-    E.row[at].chars = malloc(len + 1);
-    memcpy(E.row[at].chars, s, len);
-    E.row[at].chars[len] = '\0';
+    if ((n == 2 && c < 0x80) || (n == 3 && c < 0x800) ||
+        (n == 4 && (c < 0x10000 || c > 0x10FFFF)) ||
+        (c >= 0xD800 && c <= 0xDFFF))
+    {
+        *cp = -1;
+        return 1;
+    }
 
-    E.row[at].rsize = 0;
-    E.row[at].render = NULL;
-    E.row[at].hl = NULL;
-    E.row[at].hl_open_comment = 0;
-    editorUpdateRow(&E.row[at]);
+    *cp = c;
+    return n;
+}
 
-    E.numRows++;
-    E.dirty++;
+int utf8Valid(const char *s, int len)
+{
+    int i = 0;
+    while (i < len)
+    {
+        if ((unsigned char)s[i] < 0x80) { i++; continue; }
+        int cp;
+        i += utf8Decode(&s[i], len - i, &cp);
+        if (cp < 0) { return 0; }
+    }
+    return 1;
 }
 
-void editorMoveCursorParagraphUp() {
-    if (E.cy <= 0) return;  // Already at the top.
+struct utf8Range { int lo, hi; };
 
-    int target = E.cy;
-    // Search upward for a blank row.
-    for (int i = E.cy - 1; i >= 0; i--) {
-        if (E.row[i].size == 0) {
-            // Found a blank line. Now, jump to the first non-blank row before it.
-            for (int j = i - 1; j >= 0; j--) {
-                if (E.row[j].size != 0) {
-                    target = j;
-                    break;
+// NOTE: zero-width combining marks and joiners.
+const struct utf8Range utf8ZeroWidth[] = {
+    {0x0300, 0x036F}, {0x0483, 0x0489}, {0x0591, 0x05BD}, {0x0610, 0x061A},
+    {0x064B, 0x065F}, {0x0670, 0x0670}, {0x06D6, 0x06DC}, {0x0E31, 0x0E31},
+    {0x0E34, 0x0E3A}, {0x0E47, 0x0E4E}, {0x1AB0, 0x1AFF}, {0x1DC0, 0x1DFF},
+    {0x200B, 0x200F}, {0x202A, 0x202E}, {0x2060, 0x2064}, {0x20D0, 0x20FF},
+    {0xFE00, 0xFE0F}, {0xFE20, 0xFE2F}, {0xFEFF, 0xFEFF}, {0xE0100, 0xE01EF},
+};
+
+// NOTE: east asian wide/fullwidth blocks and emoji, drawn two columns wide.
+const struct utf8Range utf8Wide[] = {
+    {0x1100, 0x115F}, {0x231A, 0x231B}, {0x2329, 0x232A}, {0x23E9, 0x23EC},
+    {0x23F0, 0x23F0}, {0x23F3, 0x23F3}, {0x25FD, 0x25FE}, {0x2614, 0x2615},
+    {0x2648, 0x2653}, {0x267F, 0x267F}, {0x2693, 0x2693}, {0x26A1, 0x26A1},
+    {0x26AA, 0x26AB}, {0x26BD, 0x26BE}, {0x26C4, 0x26C5}, {0x26CE, 0x26CE},
+    {0x26D4, 0x26D4}, {0x26EA, 0x26EA}, {0x26F2, 0x26F5}, {0x26FA, 0x26FD},
+    {0x2705, 0x2705}, {0x270A, 0x270B}, {0x2728, 0x2728}, {0x274C, 0x274C},
+    {0x2753, 0x2755}, {0x2757, 0x2757}, {0x2795, 0x2797}, {0x27B0, 0x27B0},
+    {0x27BF, 0x27BF}, {0x2B1B, 0x2B1C}, {0x2B50, 0x2B50}, {0x2B55, 0x2B55},
+    {0x2E80, 0x303E}, {0x3041, 0x33FF}, {0x3400, 0x4DBF}, {0x4E00, 0x9FFF},
+    {0xA000, 0xA4CF}, {0xA960, 0xA97F}, {0xAC00, 0xD7A3}, {0xF900, 0xFAFF},
+    {0xFE10, 0xFE19}, {0xFE30, 0xFE6F}, {0xFF00, 0xFF60}, {0xFFE0, 0xFFE6},
+    {0x16FE0, 0x16FE4}, {0x17000, 0x18AFF}, {0x1B000, 0x1B2FF},
+    {0x1F004, 0x1F004}, {0x1F0CF, 0x1F0CF}, {0x1F18E, 0x1F18E},
+    {0x1F191, 0x1F19A}, {0x1F200, 0x1F251}, {0x1F300, 0x1F64F},
+    {0x1F680, 0x1F6FF}, {0x1F7E0, 0x1F7EB}, {0x1F90C, 0x1F9FF},
+    {0x1FA70, 0x1FAFF}, {0x20000, 0x2FFFD}, {0x30000, 0x3FFFD},
+};
+
+int utf8InRanges(const struct utf8Range *r, int n, int cp)
+{
+    int lo = 0, hi = n - 1;
+    while (lo <= hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (cp < r[mid].lo) { hi = mid - 1; }
+        else if (cp > r[mid].hi) { lo = mid + 1; }
+        else { return 1; }
+    }
+    return 0;
+}
+
+int utf8CharWidth(int cp)
+{
+    if (cp < 0) { return 1; }
+    if (cp < 0x300) { return 1; }
+    if (utf8InRanges(utf8ZeroWidth,
+                sizeof(utf8ZeroWidth) / sizeof(utf8ZeroWidth[0]), cp))
+    { return 0; }
+    if (utf8InRanges(utf8Wide, sizeof(utf8Wide) / sizeof(utf8Wide[0]), cp))
+    { return 2; }
+    return 1;
+}
+
+/*** syntax highlighting ***/
+
+int is_separator(int c)
+{
+    c = (unsigned char)c;
+    return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+}
+
+int editorHighlightRow(erow *row)
+{
+    // NOTE: returns 1 if the row's open comment state changed.
+    row->hl = realloc(row->hl, row->rsize);
+    memset(row->hl, HL_NORMAL, row->rsize);
+
+    if (B->syntax == NULL) { return 0; }
+
+    char **keywords = B->syntax->keywords;
+
+    char *scs = B->syntax->singleline_comment_start;
+    char *mcs = B->syntax->multiline_comment_start;
+    char *mce = B->syntax->multiline_comment_end;
+
+    int scs_len = scs ? strlen(scs) : 0;
+    int mcs_len = scs ? strlen(mcs) : 0;
+    int mce_len = scs ? strlen(mce) : 0;
+
+    int prev_sep = 1;
+    int in_string = 0;
+    int in_comment = (row->idx > 0 && B->row[row->idx - 1].hl_open_comment);
+
+    int i = 0;
+    while (i < row->rsize)
+    {
+        char c = row->render[i];
+        unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
+
+        if (scs_len && !in_string && !in_comment)
+        {
+            if (c == scs[0] && !strncmp(&row->render[i], scs, scs_len))
+            {
+                memset(&row->hl[i], HL_COMMENT, row->rsize - i);
+                break;
+            }
+        }
+
+        if (mcs_len && mce_len && !in_string)
+        {
+            if (in_comment)
+            {
+                row->hl[i] = HL_MLCOMMENT;
+                if (c == mce[0] && !strncmp(&row->render[i], mce, mce_len))
+                {
+                    memset(&row->hl[i], HL_MLCOMMENT, mce_len);
+                    i += mce_len;
+                    in_comment = 0;
+                    prev_sep = 1;
+                    continue;
+                }
+                else
+                {
+                    i++;
+                    continue;
                 }
             }
-            // If no non-blank row exists before the blank line, stay at the blank.
-            if (target == E.cy) target = i;
-            break;
+            else if (c == mcs[0] && !strncmp(&row->render[i], mcs, mcs_len))
+            {
+                memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
+                i += mcs_len;
+                in_comment = 1;
+                continue;
+            }
         }
-        // If no blank line is encountered, simply go to the top.
-        target = i;
-    }
 
-    E.cy = target;
-    int rowlen = (E.cy < E.numRows) ? E.row[E.cy].size : 0;
-    if (E.cx > rowlen) E.cx = rowlen;
+        if (B->syntax->flags & HL_HIGHLIGHT_STRINGS)
+        {
+            if (in_string)
+            {
+                row->hl[i] = HL_STRING;
+                if (c == '\\' && i + 1 < row->rsize)
+                {
+                    row->hl[i + 1] = HL_STRING;
+                    i += 2;
+                    continue;
+                }
+                if (c == in_string) { in_string = 0; }
+                i++;
+                prev_sep = 1;
+                continue;
+            }
+            else
+            {
+                if (c == '"' || c == '\'')
+                {
+                    in_string = c;
+                    row->hl[i] = HL_STRING;
+                    i++;
+                    continue;
+                }
+            }
+        }
+
+        if (B->syntax->flags & HL_HIGHLIGHT_NUMBERS)
+        {
+            if ((isdigit((unsigned char)c) && (prev_sep || prev_hl == HL_NUMBER)) ||
+                (c == '.' && prev_hl == HL_NUMBER))
+            {
+                row->hl[i] = HL_NUMBER;
+                i++;
+                prev_sep = 0;
+                continue;
+            }
+        }
+
+        if (prev_sep)
+        {
+            int j;
+            for (j = 0; keywords[j]; j++)
+            {
+                // NOTE: most words share no first byte with any keyword.
+                if (keywords[j][0] != c) { continue; }
+
+                int klen = strlen(keywords[j]);
+                int kw2 = keywords[j][klen - 1] == '|';
+                if (kw2) klen--;
+
+                if (!strncmp(&row->render[i], keywords[j], klen) &&
+                    is_separator(row->render[i + klen]))
+                {
+                    memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
+                    i += klen;
+                    break;
+                }
+
+                if (keywords[j] != NULL)
+                {
+                    prev_sep = 0;
+                    continue;
+                }
+            }
+        }
+
+        prev_sep = is_separator(c);
+        i++;
+    }
+
+    int changed = (row->hl_open_comment != in_comment);
+    row->hl_open_comment = in_comment;
+    return changed;
+}
+
+void editorUpdateSyntax(erow *row)
+{
+    // NOTE: a row that opens or closes a comment rehighlights the rows
+    // below it, until one comes out the same. A cold row is thawed, and
+    // thawing already highlights it.
+    long long t = traceNow();
+    int n = 1;
+    while (1)
+    {
+        int open = row->hl_open_comment;
+        if (row->cold) { editorRowThaw(row); }
+        int changed = editorHighlightRow(row) || row->hl_open_comment != open;
+        lineIndexRowChanged(row->idx);
+        if (!changed || row->idx + 1 >= B->numRows) { break; }
+        row = &B->row[row->idx + 1];
+        n++;
+    }
+    if (n > 1) { traceSpan("highlight cascade", t, n); }
+}
+
+int editorSyntaxToColor(int hl)
+{
+    switch (hl)
+    {
+        case HL_COMMENT:
+        case HL_MLCOMMENT: return 36;
+        case HL_KEYWORD1: return 33;
+        case HL_KEYWORD2: return 32;
+        case HL_STRING: return 35;
+        case HL_NUMBER: return 31;
+        case HL_MATCH: return 7;
+        case HL_MATCH_OTHER: return 43;
+        case HL_CURSOR:
+        case HL_SELECTION: return 7;
+        case HL_BRACKET: return 4;
+        default: return 37;
+    }
+}
+
+void editorSelectSyntaxHighlight()
+{
+    B->syntax = NULL;
+    if (B->filename == NULL) { return; }
+
+    char *ext = strrchr(B->filename, '.');
+
+    if (!ext || ext == B->filename) { return; }
+
+    for (unsigned int j = 0; j < HLDB_ENTRIES; j++)
+    {
+        struct editorSyntax *s = &HLDB[j];
+        unsigned int i = 0;
+        while (s->filematch[i])
+        {
+            int is_ext = (s->filematch[i][0] == '.');
+            if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
+                (!is_ext && strstr(B->filename, s->filematch[i])))
+            {
+                B->syntax = s;
+
+                traceBegin("highlight");
+                int filerow;
+                for (filerow = 0; filerow < B->numRows; filerow++)
+                {
+                    editorUpdateSyntax(&B->row[filerow]);
+                }
+                traceEnd("highlight", B->numRows);
+
+                return;
+            }
+            i++;
+        }
+    }
+}
+
+/*** text ***/
+
+/*
+ * Row chars are reference counted. Undo snapshots, kill ring entries
+ * and pasted rows take a reference instead of a copy, and whoever
+ * writes to shared text gets a private copy first (textReserve).
+ * Counts are only touched on the main thread, with E.lock held.
+ */
+
+struct textHeader {
+    int refs;
+    int cap; // bytes after the header
+};
+
+#define TEXT_HEADER(t) ((struct textHeader *)(t) - 1)
+
+char *textAlloc(int cap)
+{
+    struct textHeader *h = malloc(sizeof(struct textHeader) + cap);
+    h->refs = 1;
+    h->cap = cap;
+    return (char *)(h + 1);
+}
+
+char *textNew(const char *s, int len)
+{
+    char *t = textAlloc(len + 1);
+    memcpy(t, s, len);
+    t[len] = '\0';
+    return t;
+}
+
+char *textRef(char *t)
+{
+    if (t) { TEXT_HEADER(t)->refs++; }
+    return t;
+}
+
+void textFree(char *t)
+{
+    if (t && --TEXT_HEADER(t)->refs == 0) { free(TEXT_HEADER(t)); }
+}
+
+void *textBlock(char *t)
+{
+    // NOTE: the malloc'd block, for malloc_usable_size.
+    return t ? TEXT_HEADER(t) : NULL;
+}
+
+char *textReserve(char *t, int size, int need)
+{
+    /*
+     * Returns text the caller may write `need` bytes to, keeping the
+     * first `size` bytes of `t`. Shared text is copied, not resized.
+     */
+    struct textHeader *h = TEXT_HEADER(t);
+    if (h->refs > 1)
+    {
+        char *copy = textAlloc(need > size + 1 ? need : size + 1);
+        memcpy(copy, t, size);
+        copy[size] = '\0';
+        h->refs--;
+        return copy;
+    }
+    if (h->cap < need)
+    {
+        h = realloc(h, sizeof(struct textHeader) + need);
+        h->cap = need;
+    }
+    return (char *)(h + 1);
+}
+
+/*** compression ***/
+
+/*
+ * A small LZ77 codec in the LZ4 mould: a token byte holds the literal
+ * run and match lengths (15 means more length bytes follow), then the
+ * literals, then a 16-bit distance back to the match. The last sequence
+ * is literals only. Fast rather than tight; it is used for cold rows.
+ */
+
+#define LZ_HASH_BITS 13
+#define LZ_MIN_MATCH 4
+#define LZ_TAIL 8 // matches end this far from the end, see lzDecompress
+
+int lzBound(int n)
+{
+    return n + n / 255 + 16;
+}
+
+uint32_t lzRead32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+unsigned char *lzLength(unsigned char *o, int len)
+{
+    // NOTE: the part of a length that didn't fit its token nibble.
+    for (; len >= 255; len -= 255) { *o++ = 255; }
+    *o++ = len;
+    return o;
+}
+
+unsigned char *lzSequence(unsigned char *o, const unsigned char *lit, int nlit,
+                          int dist, int len)
+{
+    // NOTE: len is 0 for the closing literals-only sequence.
+    int ml = len ? len - LZ_MIN_MATCH : 0;
+    unsigned char *token = o++;
+    *token = (nlit < 15 ? nlit : 15) << 4;
+    if (nlit >= 15) { o = lzLength(o, nlit - 15); }
+    memcpy(o, lit, nlit);
+    o += nlit;
+    if (len == 0) { return o; }
+
+    *o++ = dist & 0xff;
+    *o++ = dist >> 8;
+    *token |= ml < 15 ? ml : 15;
+    if (ml >= 15) { o = lzLength(o, ml - 15); }
+    return o;
+}
+
+int lzCompress(const char *src, int n, char *dst)
+{
+    /*
+     * Compresses n bytes into dst, which needs lzBound(n) bytes, and
+     * returns the compressed size.
+     */
+    const unsigned char *s = (const unsigned char *)src;
+    unsigned char *o = (unsigned char *)dst;
+    int table[1 << LZ_HASH_BITS];
+    memset(table, 0xff, sizeof(table));
+
+    int anchor = 0;
+    int limit = n - LZ_TAIL;
+    int i = 0;
+    while (i + LZ_MIN_MATCH <= limit)
+    {
+        uint32_t v = lzRead32(s + i);
+        int h = (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+        int ref = table[h];
+        table[h] = i;
+        if (ref < 0 || i - ref > 0xffff || lzRead32(s + ref) != v)
+        {
+            // NOTE: the longer nothing matches, the faster we skip ahead.
+            i += 1 + ((i - anchor) >> 6);
+            continue;
+        }
+
+        while (i > anchor && ref > 0 && s[i - 1] == s[ref - 1]) { i--; ref--; }
+        int len = LZ_MIN_MATCH;
+        while (i + len < limit && s[i + len] == s[ref + len]) { len++; }
+
+        o = lzSequence(o, s + anchor, i - anchor, i - ref, len);
+        i += len;
+        anchor = i;
+    }
+    o = lzSequence(o, s + anchor, n - anchor, 0, 0);
+    return o - (unsigned char *)dst;
+}
+
+int lzLengthRead(const unsigned char **ip, int len)
+{
+    if (len != 15) { return len; }
+    unsigned char b;
+    do
+    {
+        b = *(*ip)++;
+        len += b;
+    } while (b == 255);
+    return len;
+}
+
+int lzDecompress(const char *src, int zn, char *dst)
+{
+    /*
+     * Returns the size of the text in dst. A match never ends within
+     * LZ_TAIL bytes of the end, so its copy can overrun by up to 7.
+     */
+    const unsigned char *ip = (const unsigned char *)src;
+    const unsigned char *end = ip + zn;
+    unsigned char *op = (unsigned char *)dst;
+    while (1)
+    {
+        int token = *ip++;
+        int nlit = lzLengthRead(&ip, token >> 4);
+        memcpy(op, ip, nlit);
+        op += nlit;
+        ip += nlit;
+        if (ip >= end) { break; }
+
+        int dist = ip[0] | ip[1] << 8;
+        ip += 2;
+        int len = lzLengthRead(&ip, token & 15) + LZ_MIN_MATCH;
+        const unsigned char *m = op - dist;
+        if (dist >= 8)
+        {
+            for (int k = 0; k < len; k += 8) { memcpy(op + k, m + k, 8); }
+        }
+        else
+        {
+            for (int k = 0; k < len; k++) { op[k] = m[k]; }
+        }
+        op += len;
+    }
+    return op - (unsigned char *)dst;
+}
+
+/*** row ops ***/
+
+long long memSlack(void *p, long long bytes)
+{
+    // NOTE: what malloc really hands out for a block, beyond what was asked.
+    if (p == NULL) { return 0; }
+    return (long long)malloc_usable_size(p) + sizeof(size_t) - bytes;
+}
+
+void editorRowUncharge(erow *row)
+{
+    struct rowMemory *m = &B->mem;
+    m->chars -= row->memChars;
+    if (row->render) { m->render -= row->rsize + 1; }
+    if (row->hl) { m->hl -= row->rsize; }
+    if (row->rxcache) { m->rxcache -= sizeof(int) * (long long)row->memChars; }
+    m->slack -= row->memSlack;
+    row->memChars = 0;
+    row->memSlack = 0;
+}
+
+void editorRowCharge(erow *row)
+{
+    /*
+     * Called with the row freshly rebuilt: no rxcache, render and hl
+     * sized to rsize.
+     */
+    struct rowMemory *m = &B->mem;
+    row->memChars = row->chars ? row->size + 1 : 0;
+    row->memSlack = memSlack(textBlock(row->chars), row->memChars) +
+                    memSlack(row->render, row->rsize + 1) +
+                    memSlack(row->hl, row->rsize);
+    m->chars += row->memChars;
+    if (row->render) { m->render += row->rsize + 1; }
+    if (row->hl) { m->hl += row->rsize; }
+    m->slack += row->memSlack;
+}
+
+void editorRowBuildRxCache(erow *row)
+{
+    /*
+     * Only rows with multibyte text pay for this: the cache records the
+     * display column of every byte offset so cursor math stays O(1).
+     * Continuation bytes share the column of their lead byte.
+     */
+    row->rxcache = malloc(sizeof(int) * (row->size + 1));
+
+    int rx = 0;
+    int j = 0;
+    while (j < row->size)
+    {
+        if (row->chars[j] == '\t')
+        {
+            row->rxcache[j++] = rx;
+            rx += WEISS_TAB_STOP - (rx % WEISS_TAB_STOP);
+            continue;
+        }
+
+        int cp;
+        int n = utf8Decode(&row->chars[j], row->size - j, &cp);
+        for (int k = 0; k < n; k++) { row->rxcache[j + k] = rx; }
+        rx += utf8CharWidth(cp);
+        j += n;
+    }
+    row->rxcache[row->size] = rx;
+
+    long long bytes = sizeof(int) * (long long)(row->size + 1);
+    int slack = memSlack(row->rxcache, bytes);
+    B->mem.rxcache += bytes;
+    B->mem.slack += slack;
+    row->memSlack += slack;
+}
+
+int editorRowCxToRx(erow *row, int cx)
+{
+    if (row->cold) { editorRowThaw(row); }
+    if (!row->ascii)
+    {
+        if (cx > row->size) { cx = row->size; }
+        if (row->rxcache == NULL) { editorRowBuildRxCache(row); }
+        return row->rxcache[cx];
+    }
+
+    int rx = 0;
+    int j;
+    for (j = 0; j < cx; j++)
+    {
+        if (row->chars[j] == '\t')
+        {
+            rx += (WEISS_TAB_STOP - 1) - (rx % WEISS_TAB_STOP);
+        }
+        rx++;
+    }
+    return rx;
+}
+
+int editorRowRxToCx(erow *row, int rx)
+{
+    if (row->cold) { editorRowThaw(row); }
+    if (!row->ascii)
+    {
+        if (row->rxcache == NULL) { editorRowBuildRxCache(row); }
+        if (rx >= row->rxcache[row->size]) { return row->size; }
+
+        // NOTE: last offset whose column is <= rx, snapped to its lead byte.
+        int lo = 0, hi = row->size - 1;
+        while (lo < hi)
+        {
+            int mid = (lo + hi + 1) / 2;
+            if (row->rxcache[mid] <= rx) { lo = mid; }
+            else { hi = mid - 1; }
+        }
+        while (lo > 0 && UTF8_IS_CONT(row->chars[lo])) { lo--; }
+        return lo;
+    }
+
+    int cur_rx = 0;
+    int cx;
+
+    for (cx = 0; cx < row->size; cx++)
+    {
+        if (row->chars[cx] == '\t')
+        {
+            cur_rx += (WEISS_TAB_STOP - 1) - (cur_rx % WEISS_TAB_STOP);
+        }
+        cur_rx++;
+
+        if (cur_rx > rx) { return cx; }
+    }
+    return cx;
+}
+
+int editorRowPrevChar(erow *row, int cx)
+{
+    if (cx <= 0) { return 0; }
+    if (row->cold) { editorRowThaw(row); }
+    cx--;
+    if (!row->ascii)
+    {
+        while (cx > 0 && UTF8_IS_CONT(row->chars[cx])) { cx--; }
+    }
+    return cx;
+}
+
+int editorRowNextChar(erow *row, int cx)
+{
+    if (cx >= row->size) { return row->size; }
+    if (row->cold) { editorRowThaw(row); }
+    cx++;
+    if (!row->ascii)
+    {
+        while (cx < row->size && UTF8_IS_CONT(row->chars[cx])) { cx++; }
+    }
+    return cx;
+}
+
+int editorRowCxToRenderIdx(erow *row, int cx)
+{
+    // NOTE: mirrors the tab expansion in editorUpdateRow.
+    if (row->cold) { editorRowThaw(row); }
+    if (row->ascii)
+    {
+        return editorRowCxToRx(row, cx);
+    }
+
+    int idx = 0;
+    int col = 0;
+    int j = 0;
+    while (j < cx && j < row->size)
+    {
+        if (row->chars[j] == '\t')
+        {
+            idx++;
+            col++;
+            while (col % WEISS_TAB_STOP != 0) { idx++; col++; }
+            j++;
+            continue;
+        }
+
+        int cp;
+        int n = utf8Decode(&row->chars[j], row->size - j, &cp);
+        idx += n;
+        col += utf8CharWidth(cp);
+        j += n;
+    }
+    return idx;
+}
+
+int editorRowRenderIdxToCx(erow *row, int idx)
+{
+    // NOTE: the chars offset of the character drawn at render index `idx`.
+    if (row->cold) { editorRowThaw(row); }
+    if (row->ascii) { return editorRowRxToCx(row, idx); }
+
+    int ridx = 0;
+    int col = 0;
+    int j = 0;
+    while (j < row->size)
+    {
+        int next = ridx;
+        int n = 1;
+        if (row->chars[j] == '\t')
+        {
+            next++;
+            col++;
+            while (col % WEISS_TAB_STOP != 0) { next++; col++; }
+        }
+        else
+        {
+            int cp;
+            n = utf8Decode(&row->chars[j], row->size - j, &cp);
+            next += n;
+            col += utf8CharWidth(cp);
+        }
+        if (next > idx) { break; }
+        ridx = next;
+        j += n;
+    }
+    return j;
+}
+
+void editorRowRender(erow *row)
+{
+    int tabs = 0;
+    int j;
+    for (j = 0; j < row->size; j++)
+    {
+        if (row->chars[j] == '\t') { tabs++; }
+    }
+
+    row->ascii = utf8IsAscii(row->chars, row->size);
+    free(row->rxcache);
+    row->rxcache = NULL;
+
+    free(row->render);
+    row->render = malloc(row->size + tabs * (WEISS_TAB_STOP - 1) + 1);
+
+    // NOTE: tab stops are display columns, which only match render bytes
+    // on ascii rows.
+    int idx = 0;
+    int col = 0;
+    for (j = 0; j < row->size; j++)
+    {
+        if (row->chars[j] == '\t')
+        {
+            row->render[idx++] = '%';
+            col++;
+            while (col % WEISS_TAB_STOP != 0)
+            {
+                row->render[idx++] = ' ';
+                col++;
+            }
+        }
+        else if (row->ascii || (unsigned char)row->chars[j] < 0x80)
+        {
+            row->render[idx++] = row->chars[j];
+            col++;
+        }
+        else
+        {
+            int cp;
+            int n = utf8Decode(&row->chars[j], row->size - j, &cp);
+            memcpy(&row->render[idx], &row->chars[j], n);
+            idx += n;
+            j += n - 1;
+            col += utf8CharWidth(cp);
+        }
+    }
+    row->render[idx] = '\0';
+    row->rsize = idx;
+}
+
+void editorUpdateRow(erow *row)
+{
+    editorStreamEdited(row->idx);
+    editorRowUncharge(row);
+    editorRowRender(row);
+    editorUpdateSyntax(row);
+    editorRowCharge(row);
+    matchIndexUpdateRow(row->idx);
+}
+
+void editorUpdateRows(int at, int n)
+{
+    /*
+     * editorUpdateRow for rows [at, at + n), with each row highlighted
+     * once, in order, and any change in comment state carried on below.
+     */
+    long long t = traceNow();
+    editorStreamEdited(at + n - 1);
+    struct matchIndex *mi = &B->match;
+    int rescan = mi->active && n > 64 && (mi->running || mi->scanned > 0);
+    if (rescan) { matchIndexReset(mi); }
+
+    int changed = 0;
+    for (int i = at; i < at + n; i++)
+    {
+        erow *row = &B->row[i];
+        editorRowUncharge(row);
+        editorRowRender(row);
+        changed = editorHighlightRow(row);
+        editorRowCharge(row);
+        if (!rescan) { matchIndexUpdateRow(i); }
+        lineIndexRowChanged(i);
+    }
+    if (changed && at + n < B->numRows) { editorUpdateSyntax(&B->row[at + n]); }
+
+    if (rescan) { matchIndexResume(mi); }
+    traceSpan("update rows", t, n);
+}
+
+void editorInsertRowText(int at, char *text, int len)
+{
+    // NOTE: the row takes over `text`, see textNew.
+    if (at < 0 || at > B->numRows) { textFree(text); return; }
+
+    B->row = realloc(B->row, sizeof(erow) * (B->numRows + 1));
+    memmove(&B->row[at + 1], &B->row[at], sizeof(erow) * (B->numRows - at));
+    for (int j = at + 1; j <= B->numRows; j++) { B->row[j].idx++; }
+
+    B->row[at].idx = at;
+
+    B->row[at].size = len;
+    B->row[at].chars = text;
+
+    B->row[at].rsize = 0;
+    B->row[at].render = NULL;
+    B->row[at].hl = NULL;
+    B->row[at].hl_open_comment = 0;
+    B->row[at].ascii = 1;
+    B->row[at].crlf = B->crlf;
+    B->row[at].rxcache = NULL;
+    B->row[at].memChars = 0;
+    B->row[at].memSlack = 0;
+    B->row[at].cold = NULL;
+    matchIndexInsertRow(at);
+    lineIndexRowsInserted(at, 1);
+    editorUpdateRow(&B->row[at]);
+
+    B->numRows++;
+    B->dirty++;
+}
+
+void editorInsertRow(int at, char *s, size_t len)
+{
+    editorInsertRowText(at, textNew(s, len), len);
+}
+
+void editorFreeRow(erow *row)
+{
+    editorRowUncharge(row);
+    free(row->render);
+    textFree(row->chars);
+    free(row->hl);
+    free(row->rxcache);
+    if (row->cold) { coldBlockRelease(row->cold); }
+}
+
+void editorDelRow(int at)
+{
+    if (at < 0 || at >= B->numRows) { return; }
+    editorStreamEdited(at);
+    lineIndexRowsDeleted(at, 1);
+    editorFreeRow(&B->row[at]);
+    memmove(&B->row[at], &B->row[at + 1], sizeof(erow) * (B->numRows - at - 1));
+    for (int j = at; j < B->numRows - 1; j++) { B->row[j].idx--; }
+    B->numRows--;
+    matchIndexDelRow(at);
+    /*B->dirty++;*/
+}
+
+void editorInsertRows(int at, char **texts, int *sizes, int n)
+{
+    /*
+     * Inserts n rows at once, taking over `texts`: one move of the rows
+     * below, and the match index is rescanned rather than spliced n times.
+     */
+    // NOTE: past a few rows, rescanning beats shifting the index per row.
+    // An index already reset (see editorUndoApply) has nothing to shift.
+    struct matchIndex *mi = &B->match;
+    int rescan = mi->active && n > 64 && (mi->running || mi->scanned > 0);
+    if (rescan) { matchIndexReset(mi); }
+
+    lineIndexRowsInserted(at, n);
+    B->row = realloc(B->row, sizeof(erow) * (B->numRows + n));
+    memmove(&B->row[at + n], &B->row[at], sizeof(erow) * (B->numRows - at));
+    for (int j = at + n; j < B->numRows + n; j++) { B->row[j].idx += n; }
+    memset(&B->row[at], 0, sizeof(erow) * n);
+    B->numRows += n;
+    for (int i = 0; i < n; i++)
+    {
+        erow *row = &B->row[at + i];
+        row->idx = at + i;
+        row->size = sizes[i];
+        row->chars = texts[i];
+        row->ascii = 1;
+        row->crlf = B->crlf;
+        if (!rescan) { matchIndexInsertRow(at + i); }
+    }
+    editorUpdateRows(at, n);
+
+    if (rescan) { matchIndexResume(mi); }
+    B->dirty++;
+}
+
+void editorDelRows(int at, int n)
+{
+    struct matchIndex *mi = &B->match;
+    int rescan = mi->active && n > 64 && (mi->running || mi->scanned > 0);
+    if (rescan) { matchIndexReset(mi); }
+
+    editorStreamEdited(at + n - 1);
+    lineIndexRowsDeleted(at, n);
+    for (int i = 0; i < n; i++) { editorFreeRow(&B->row[at + i]); }
+    memmove(&B->row[at], &B->row[at + n], sizeof(erow) * (B->numRows - at - n));
+    B->numRows -= n;
+    for (int j = at; j < B->numRows; j++) { B->row[j].idx -= n; }
+
+    if (rescan) { matchIndexResume(mi); }
+    else { for (int i = 0; i < n; i++) { matchIndexDelRow(at); } }
+}
+
+void editorRowInsertChar(erow *row, int at, int c)
+{
+    if (at < 0 || at > row->size) { at = row->size; }
+    if (row->cold) { editorRowThaw(row); }
+    row->chars = textReserve(row->chars, row->size, row->size + 2);
+    memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
+    row->size++;
+    row->chars[at] = c;
+    editorUpdateRow(row);
+    B->dirty++;
+}
+
+void editorRowAppendString(erow *row, char *s, size_t len)
+{
+    if (row->cold) { editorRowThaw(row); }
+    row->chars = textReserve(row->chars, row->size, row->size + len + 1);
+    memcpy(&row->chars[row->size], s, len);
+    row->size += len;
+    row->chars[row->size] = '\0';
+    editorUpdateRow(row);
+    B->dirty++;
+}
+
+void editorRowDelChar(erow *row, int at)
+{
+    if (at < 0 || at >= row->size) { return; }
+    if (row->cold) { editorRowThaw(row); }
+    // NOTE: removes the whole codepoint starting at `at`.
+    int n = editorRowNextChar(row, at) - at;
+    row->chars = textReserve(row->chars, row->size, row->size + 1);
+    memmove(&row->chars[at], &row->chars[at + n], row->size - at - n + 1);
+    row->size -= n;
+    editorUpdateRow(row);
+    B->dirty++;
+}
+
+/*** cold rows ***/
+
+/*
+ * Rows far from every view and cursor are frozen into blocks of up to
+ * COLD_BLOCK_BYTES of text, compressed, once a buffer's hot rows pass
+ * the budget (WEISS_HOT_MB). A cold row keeps its size, comment state
+ * and bracket summary, but its chars, render and hl are freed. Anything
+ * that needs them calls editorRowThaw; save and search only read the
+ * text, through editorRowText, from a small cache of decompressed blocks.
+ */
+
+#define COLD_BLOCK_BYTES (64 * 1024)
+#define COLD_MARGIN_ROWS 256 // around views and cursors, kept hot
+#define COLD_CACHE_BLOCKS 8
+#define COLD_BUDGET_MB 64
+
+struct coldBlock {
+    int refs; // cold rows still in it
+    int rawSize;
+    int zsize;
+    char z[];
+};
+
+struct coldCache {
+    struct coldBlock *block;
+    char *text;
+    int cap;
+    unsigned long used;
+};
+
+struct coldRows {
+    long long budget; // hot row bytes a buffer may hold before a sweep
+    struct coldCache lru[COLD_CACHE_BLOCKS]; // main thread
+    struct coldCache slots[WORKER_POOL_MAX]; // one per worker pool slot
+    unsigned long tick;
+    char *raw; // scratch for freezing
+    int rawcap;
+};
+
+struct coldRows cold = { .budget = COLD_BUDGET_MB * 1024LL * 1024 };
+
+void coldCacheFill(struct coldCache *c, struct coldBlock *b)
+{
+    if (c->cap < b->rawSize)
+    {
+        c->cap = b->rawSize;
+        free(c->text);
+        c->text = malloc(c->cap);
+    }
+    lzDecompress(b->z, b->zsize, c->text);
+    c->block = b;
+}
+
+struct coldCache *coldCacheFind(struct coldBlock *b)
+{
+    // NOTE: the least recently used entry goes on a miss.
+    struct coldCache *victim = &cold.lru[0];
+    for (int i = 0; i < COLD_CACHE_BLOCKS; i++)
+    {
+        struct coldCache *c = &cold.lru[i];
+        if (c->block == b)
+        {
+            c->used = ++cold.tick;
+            return c;
+        }
+        if (c->used < victim->used) { victim = c; }
+    }
+    coldCacheFill(victim, b);
+    victim->used = ++cold.tick;
+    return victim;
+}
+
+void coldBlockRelease(struct coldBlock *b)
+{
+    if (--b->refs > 0) { return; }
+    for (int i = 0; i < COLD_CACHE_BLOCKS; i++)
+    {
+        if (cold.lru[i].block == b) { cold.lru[i].block = NULL; cold.lru[i].used = 0; }
+    }
+    for (int i = 0; i < WORKER_POOL_MAX; i++)
+    {
+        if (cold.slots[i].block == b) { cold.slots[i].block = NULL; }
+    }
+    B->mem.cold -= sizeof(struct coldBlock) + b->zsize;
+    free(b);
+}
+
+const char *editorRowText(erow *row, int slot)
+{
+    /*
+     * The row's text, hot or cold. `slot` is the worker pool slot of the
+     * caller, or -1 on the main thread; the text is good until the next
+     * call from the same slot.
+     */
+    struct coldBlock *b = row->cold;
+    if (b == NULL) { return row->chars; }
+    struct coldCache *c;
+    if (slot < 0) { c = coldCacheFind(b); }
+    else
+    {
+        c = &cold.slots[slot];
+        if (c->block != b) { coldCacheFill(c, b); }
+    }
+    return c->text + row->coldOff;
+}
+
+char *editorRowTextRef(erow *row)
+{
+    // NOTE: a reference to the row's text, or a copy of it when cold.
+    if (row->cold) { return textNew(editorRowText(row, -1), row->size); }
+    return textRef(row->chars);
+}
+
+void editorRowThaw(erow *row)
+{
+    if (row->cold == NULL) { return; }
+    row->chars = textNew(editorRowText(row, -1), row->size);
+    coldBlockRelease(row->cold);
+    row->cold = NULL;
+    // NOTE: same text, same comment state and brackets as when it froze.
+    editorRowRender(row);
+    editorHighlightRow(row);
+    editorRowCharge(row);
+}
+
+void editorRowsThaw(int at, int n)
+{
+    if (at < 0) { n += at; at = 0; }
+    if (at + n > B->numRows) { n = B->numRows - at; }
+    for (int i = 0; i < n; i++) { editorRowThaw(&B->row[at + i]); }
+}
+
+void editorRowsFreeze(int at, int n, int bytes)
+{
+    if (cold.rawcap < lzBound(bytes))
+    {
+        cold.rawcap = lzBound(bytes);
+        free(cold.raw);
+        cold.raw = malloc(cold.rawcap * 2);
+    }
+    char *z = cold.raw + cold.rawcap;
+    int off = 0;
+    for (int i = 0; i < n; i++)
+    {
+        erow *row = &B->row[at + i];
+        memcpy(cold.raw + off, row->chars, row->size);
+        off += row->size;
+    }
+
+    int zsize = lzCompress(cold.raw, bytes, z);
+    struct coldBlock *b = malloc(sizeof(struct coldBlock) + zsize);
+    b->refs = n;
+    b->rawSize = bytes;
+    b->zsize = zsize;
+    memcpy(b->z, z, zsize);
+    B->mem.cold += sizeof(struct coldBlock) + zsize;
+
+    off = 0;
+    for (int i = 0; i < n; i++)
+    {
+        erow *row = &B->row[at + i];
+        editorRowUncharge(row);
+        textFree(row->chars);
+        free(row->render);
+        free(row->hl);
+        free(row->rxcache);
+        row->chars = row->render = NULL;
+        row->hl = NULL;
+        row->rxcache = NULL;
+        row->rsize = 0;
+        row->cold = b;
+        row->coldOff = off;
+        off += row->size;
+    }
+}
+
+long long editorHotBytes(void)
+{
+    struct rowMemory *m = &B->mem;
+    return m->chars + m->render + m->hl + m->rxcache + m->slack;
+}
+
+int coldSpanCmp(const void *a, const void *b)
+{
+    return ((const int *)a)[0] - ((const int *)b)[0];
+}
+
+int coldKeepSpans(int **spans)
+{
+    /*
+     * Row ranges [lo, hi) that stay hot, sorted by lo: the rows each
+     * view of the buffer shows, its cursor and mark, with a margin, and
+     * the lines of extra cursors.
+     */
+    int n = 0, cap = 16;
+    int *s = malloc(sizeof(int) * 2 * cap);
+    for (struct layoutNode *l = layoutFirstLeaf(E.layout); l; l = layoutNextLeaf(l))
+    {
+        struct editorView *v = l->view;
+        if (v->buf != B) { continue; }
+        int need = n + 3 + v->cursors.count;
+        if (need > cap)
+        {
+            cap = need * 2;
+            s = realloc(s, sizeof(int) * 2 * cap);
+        }
+        s[2 * n] = v->rowoff - COLD_MARGIN_ROWS;
+        s[2 * n++ + 1] = v->rowoff + v->screenRows + COLD_MARGIN_ROWS;
+        s[2 * n] = v->cy - COLD_MARGIN_ROWS;
+        s[2 * n++ + 1] = v->cy + COLD_MARGIN_ROWS;
+        if (v->markSet)
+        {
+            s[2 * n] = v->my - 1;
+            s[2 * n++ + 1] = v->my + 2;
+        }
+        for (int i = 0; i < v->cursors.count; i++)
+        {
+            s[2 * n] = v->cursors.c[i].cy - 1;
+            s[2 * n++ + 1] = v->cursors.c[i].cy + 2;
+        }
+    }
+    qsort(s, n, sizeof(int) * 2, coldSpanCmp);
+    *spans = s;
+    return n;
+}
+
+void editorColdSweep(int lo, int hi)
+{
+    /*
+     * Freezes the hot rows in [lo, hi) that no view or cursor is near,
+     * in runs of up to COLD_BLOCK_BYTES.
+     */
+    long long t = traceNow();
+    int *s;
+    int ns = coldKeepSpans(&s);
+    int k = 0;
+    int frozen = 0;
+    int i = lo;
+    while (i < hi)
+    {
+        while (k < ns && s[2 * k + 1] <= i) { k++; }
+        if (k < ns && s[2 * k] <= i) { i = s[2 * k + 1]; continue; }
+        int end = (k < ns && s[2 * k] < hi) ? s[2 * k] : hi;
+        if (B->row[i].cold) { i++; continue; }
+
+        int j = i;
+        int bytes = 0;
+        while (j < end && B->row[j].cold == NULL &&
+               (j == i || bytes + B->row[j].size <= COLD_BLOCK_BYTES))
+        {
+            bytes += B->row[j++].size;
+        }
+        editorRowsFreeze(i, j - i, bytes);
+        frozen += j - i;
+        i = j;
+    }
+    free(s);
+    B->hotFloor = editorHotBytes();
+    traceSpan("cold sweep", t, frozen);
+}
+
+int editorColdDue(void)
+{
+    return editorHotBytes() > B->hotFloor + cold.budget;
+}
+
+void editorColdCheck(void)
+{
+    if (editorColdDue()) { editorColdSweep(0, B->numRows); }
+}
+
+/*** editor ops ***/
+
+void editorInsertChar(int c)
+{
+    if (V->cursors.count) { editorCursorsInsert(c); return; }
+    editorUndoBegin(UNDO_INSERT);
+    editorUndoRecord(V->cy, V->cy < B->numRows ? 1 : 0, 1);
+    if (V->cy == B->numRows)
+    {
+        editorInsertRow(B->numRows, "", 0);
+    }
+    editorRowInsertChar(&B->row[V->cy], V->cx, c);
+    V->cx++;
+}
+
+void editorInsertNewline()
+{
+    if (V->cursors.count) { editorCursorsNewline(); return; }
+    // NOTE: a line typed together with its newline is one undo step.
+    editorUndoBegin(UNDO_INSERT);
+    if (V->cx == 0)
+    {
+        editorUndoRecord(V->cy, 0, 1);
+        editorInsertRow(V->cy, "", 0);
+    }
+    else
+    {
+        editorUndoRecord(V->cy, 1, 2);
+        erow *row = &B->row[V->cy];
+        editorInsertRow(V->cy + 1, &row->chars[V->cx], row->size - V->cx);
+        row = &B->row[V->cy];
+        row->size = V->cx;
+        row->chars = textReserve(row->chars, row->size, row->size + 1);
+        row->chars[row->size] = '\0';
+        editorUpdateRow(row);
+    }
+    editorUndoSeal();
+    V->cy++;
+    V->cx = 0;
+}
+
+void editorDelChar()
+{
+    if (V->cy == B->numRows) { return; }
+    if (V->cx == 0 && V->cy == 0) { return; }
+
+    erow *row = &B->row[V->cy];
+    editorUndoBegin(UNDO_DELETE);
+    if (V->cx > 0)
+    {
+        editorUndoRecord(V->cy, 1, 1);
+        int at = editorRowPrevChar(row, V->cx);
+        editorRowDelChar(row, at);
+        V->cx = at;
+    }
+    else if (WEISS_BACKSPACE_APPEND)// NOTE(liam): implicitly V->cx == 0
+    {
+        editorUndoRecord(V->cy - 1, 2, 1);
+        V->cx = B->row[V->cy - 1].size;
+        editorRowAppendString(&B->row[V->cy - 1], row->chars, row->size);
+        editorDelRow(V->cy);
+        V->cy--;
+    }
+}
+
+int getScreenCenter(void)
+{
+    int center = V->cy - V->screenRows / 2;
+    if (center >= B->numRows - V->screenRows)
+    {
+        center = B->numRows - V->screenRows;
+    }
+    // NOTE: a buffer shorter than the view starts at its top.
+    if (center < 0)
+    {
+        center = 0;
+    }
+    return center;
+}
+
+/*** line index ***/
+
+#define LINE_BLOCK_ROWS 512 // a block grown past twice this is split
+
+/*
+ * The rows are cut into blocks of a few hundred, each summing its rows'
+ * sizes (with the newline, as on disk), empty rows and bracket balance.
+ * Fenwick trees over the blocks give the byte offset of a row and the
+ * row at a byte offset in O(log n) plus a scan of one block; a segment
+ * tree over them finds where a bracket is closed.
+ * Inserting or removing rows only changes the count of the block they
+ * are in, and a changed row marks its block; the next query sums the
+ * marked blocks again. Blocks are split or dropped as they grow or
+ * empty, which rebuilds the trees over the blocks only.
+ */
+
+int lineIndexLowbit(int i)
+{
+    return i & -i;
+}
+
+long long lineRowBytes(erow *row)
+{
+    return row->size + 1 + row->crlf;
+}
+
+struct bracketSum bracketJoin(struct bracketSum a, struct bracketSum b)
+{
+    struct bracketSum s;
+    s.sum = a.sum + b.sum;
+    s.min = a.sum + b.min < a.min ? a.sum + b.min : a.min;
+    s.n = a.n + b.n;
+    return s;
+}
+
+const signed char bracketCodes[256] = {
+    ['('] = 1, ['['] = 1, ['{'] = 1,
+    [')'] = -1, [']'] = -1, ['}'] = -1,
+};
+
+int bracketCode(erow *row, int i)
+{
+    // NOTE: +1 for an opener, -1 for a closer, 0 for anything else or
+    // a bracket in a string or comment.
+    int code = bracketCodes[(unsigned char)row->render[i]];
+    if (code == 0) { return 0; }
+    int hl = row->hl[i];
+    if (hl == HL_STRING || hl == HL_COMMENT || hl == HL_MLCOMMENT) { return 0; }
+    return code;
+}
+
+#if defined(__SSE2__)
+int bracketAny16(const char *p)
+{
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    // NOTE: ( ) differ in bit 0; [ { and ] } in bit 5.
+    __m128i paren = _mm_cmpeq_epi8(_mm_and_si128(v, _mm_set1_epi8((char)0xFE)), _mm_set1_epi8('('));
+    __m128i fold = _mm_and_si128(v, _mm_set1_epi8((char)0xDF));
+    __m128i open = _mm_cmpeq_epi8(fold, _mm_set1_epi8('['));
+    __m128i close = _mm_cmpeq_epi8(fold, _mm_set1_epi8(']'));
+    return _mm_movemask_epi8(_mm_or_si128(paren, _mm_or_si128(open, close)));
+}
+#endif
+
+void bracketSummarize(erow *row)
+{
+    struct bracketSum s = {0, 0, 0};
+    for (int i = 0; i < row->rsize; i++)
+    {
+#if defined(__SSE2__)
+        // NOTE: most text has no brackets, skip it 16 bytes at a time.
+        if (i + 16 <= row->rsize && !bracketAny16(&row->render[i]))
+        {
+            i += 15;
+            continue;
+        }
+#endif
+        int code = bracketCode(row, i);
+        s.sum += code;
+        s.n += code != 0;
+        if (s.sum < s.min) { s.min = s.sum; }
+    }
+    row->brackets = s;
+}
+
+void lineIndexTrees(struct lineIndex *li)
+{
+    // NOTE: O(blocks), from the sums each block holds.
+    int nb = li->nblocks;
+    if (nb + 1 > li->tcap)
+    {
+        li->tcap = (nb + 1) * 2;
+        li->tree = realloc(li->tree, sizeof(long long) * li->tcap);
+        li->blank = realloc(li->blank, sizeof(int) * li->tcap);
+        li->count = realloc(li->count, sizeof(int) * li->tcap);
+    }
+    for (int i = 1; i <= nb; i++)
+    {
+        li->tree[i] = li->block[i - 1].bytes;
+        li->blank[i] = li->block[i - 1].blanks;
+        li->count[i] = li->block[i - 1].rows;
+    }
+    for (int i = 1; i <= nb; i++)
+    {
+        int j = i + lineIndexLowbit(i);
+        if (j > nb) { continue; }
+        li->tree[j] += li->tree[i];
+        li->blank[j] += li->blank[i];
+        li->count[j] += li->count[i];
+    }
+
+    if (nb > li->bcap)
+    {
+        while (li->bcap < nb) { li->bcap = li->bcap ? li->bcap * 2 : 64; }
+        free(li->brackets);
+        li->brackets = malloc(sizeof(struct bracketSum) * 2 * li->bcap);
+    }
+    for (int i = 0; i < li->bcap; i++)
+    {
+        struct bracketSum zero = {0, 0, 0};
+        li->brackets[li->bcap + i] = i < nb ? li->block[i].brackets : zero;
+    }
+    for (int i = li->bcap - 1; i > 0; i--) { li->brackets[i] = bracketJoin(li->brackets[2 * i], li->brackets[2 * i + 1]); }
+}
+
+void lineIndexBuild(struct lineIndex *li)
+{
+    li->nblocks = (B->numRows + LINE_BLOCK_ROWS - 1) / LINE_BLOCK_ROWS;
+    if (li->nblocks > li->cap)
+    {
+        li->cap = li->nblocks * 2;
+        li->block = realloc(li->block, sizeof(struct lineBlock) * li->cap);
+    }
+    for (int b = 0; b < li->nblocks; b++)
+    {
+        int rows = B->numRows - b * LINE_BLOCK_ROWS;
+        li->block[b] = (struct lineBlock){ rows < LINE_BLOCK_ROWS ? rows : LINE_BLOCK_ROWS, 0, 0, {0, 0, 0}, 1 };
+    }
+    li->dirty = li->nblocks > 0;
+    li->built = 1;
+    lineIndexTrees(li);
+}
+
+int lineIndexDescend(struct lineIndex *li, int row, int *start, long long *bytes, int *blanks)
+{
+    /*
+     * The block holding `row` with the rows, bytes and empty rows before
+     * it; nblocks when `row` is past the last.
+     */
+    int b = 0;
+    *start = 0;
+    *bytes = 0;
+    *blanks = 0;
+    int step = 1;
+    while (step * 2 <= li->nblocks) { step *= 2; }
+    for (; step > 0; step /= 2)
+    {
+        if (b + step <= li->nblocks && *start + li->count[b + step] <= row)
+        {
+            b += step;
+            *start += li->count[b];
+            *bytes += li->tree[b];
+            *blanks += li->blank[b];
+        }
+    }
+    return b;
+}
+
+int lineIndexBlockStart(struct lineIndex *li, int b)
+{
+    int rows = 0;
+    for (int i = b; i > 0; i -= lineIndexLowbit(i)) { rows += li->count[i]; }
+    return rows;
+}
+
+void lineIndexBlockAdd(struct lineIndex *li, int b, long long bytes, int blanks, int rows)
+{
+    for (int i = b + 1; i <= li->nblocks; i += lineIndexLowbit(i))
+    {
+        li->tree[i] += bytes;
+        li->blank[i] += blanks;
+        li->count[i] += rows;
+    }
+}
+
+void lineIndexReset(void)
+{
+    // NOTE: the next query builds the blocks from the rows.
+    B->lines.built = 0;
+}
+
+void lineIndexRowsInserted(int at, int n)
+{
+    // NOTE: called before the rows are counted in B->numRows.
+    struct lineIndex *li = &B->lines;
+    if (!li->built) { return; }
+    if (li->nblocks == 0)
+    {
+        lineIndexReset();
+        return;
+    }
+
+    int start, blanks;
+    long long bytes;
+    int b = lineIndexDescend(li, at, &start, &bytes, &blanks);
+    if (b == li->nblocks) { b--; }
+    struct lineBlock *blk = &li->block[b];
+    blk->rows += n;
+    blk->dirty = 1;
+    li->dirty = 1;
+    lineIndexBlockAdd(li, b, 0, 0, n);
+    if (blk->rows <= 2 * LINE_BLOCK_ROWS) { return; }
+
+    // NOTE: the first piece keeps the old sums; all of them are summed
+    // again at the next query.
+    int pieces = blk->rows / LINE_BLOCK_ROWS;
+    int rows = blk->rows;
+    if (li->nblocks + pieces - 1 > li->cap)
+    {
+        li->cap = (li->nblocks + pieces - 1) * 2;
+        li->block = realloc(li->block, sizeof(struct lineBlock) * li->cap);
+    }
+    memmove(&li->block[b + pieces], &li->block[b + 1], sizeof(struct lineBlock) * (li->nblocks - b - 1));
+    li->nblocks += pieces - 1;
+    for (int i = 0; i < pieces; i++)
+    {
+        struct lineBlock *p = &li->block[b + i];
+        if (i > 0) { *p = (struct lineBlock){ 0, 0, 0, {0, 0, 0}, 1 }; }
+        p->rows = i < pieces - 1 ? LINE_BLOCK_ROWS : rows - (pieces - 1) * LINE_BLOCK_ROWS;
+    }
+    lineIndexTrees(li);
+}
+
+void lineIndexRowsDeleted(int at, int n)
+{
+    // NOTE: called with the rows still counted in B->numRows.
+    struct lineIndex *li = &B->lines;
+    if (!li->built) { return; }
+
+    int emptied = 0;
+    while (n > 0)
+    {
+        int start, blanks;
+        long long bytes;
+        int b = lineIndexDescend(li, at, &start, &bytes, &blanks);
+        if (b == li->nblocks) { break; }
+        struct lineBlock *blk = &li->block[b];
+        int k = start + blk->rows - at < n ? start + blk->rows - at : n;
+        blk->rows -= k;
+        blk->dirty = 1;
+        li->dirty = 1;
+        lineIndexBlockAdd(li, b, 0, 0, -k);
+        emptied |= blk->rows == 0;
+        n -= k;
+    }
+    if (!emptied) { return; }
+
+    int kept = 0;
+    for (int b = 0; b < li->nblocks; b++)
+    {
+        if (li->block[b].rows > 0) { li->block[kept++] = li->block[b]; }
+    }
+    li->nblocks = kept;
+    lineIndexTrees(li);
+}
+
+void lineIndexRowChanged(int at)
+{
+    // NOTE: called whenever a row is rehighlighted.
+    struct lineIndex *li = &B->lines;
+    bracketSummarize(&B->row[at]);
+    if (!li->built) { return; }
+
+    int start, blanks;
+    long long bytes;
+    int b = lineIndexDescend(li, at, &start, &bytes, &blanks);
+    if (b == li->nblocks) { return; }
+    li->block[b].dirty = 1;
+    li->dirty = 1;
+}
+
+void lineIndexSync(void)
+{
+    /*
+     * Sums the marked blocks again and moves the difference into the
+     * trees. A block count that has come apart from the rows (it
+     * shouldn't) is rebuilt whole.
+     */
+    struct lineIndex *li = &B->lines;
+    if (li->built && lineIndexBlockStart(li, li->nblocks) != B->numRows) { li->built = 0; }
+    if (!li->built) { lineIndexBuild(li); }
+    if (!li->dirty) { return; }
+
+    int start = 0;
+    for (int b = 0; b < li->nblocks; b++)
+    {
+        struct lineBlock *blk = &li->block[b];
+        if (blk->dirty)
+        {
+            long long bytes = 0;
+            int blanks = 0;
+            struct bracketSum brackets = {0, 0, 0};
+            for (int i = start; i < start + blk->rows; i++)
+            {
+                erow *row = &B->row[i];
+                bytes += lineRowBytes(row);
+                blanks += row->size == 0;
+                brackets = bracketJoin(brackets, row->brackets);
+            }
+            lineIndexBlockAdd(li, b, bytes - blk->bytes, blanks - blk->blanks, 0);
+            blk->bytes = bytes;
+            blk->blanks = blanks;
+            blk->brackets = brackets;
+            blk->dirty = 0;
+
+            int i = li->bcap + b;
+            li->brackets[i] = brackets;
+            for (i /= 2; i > 0; i /= 2) { li->brackets[i] = bracketJoin(li->brackets[2 * i], li->brackets[2 * i + 1]); }
+        }
+        start += blk->rows;
+    }
+    li->dirty = 0;
+}
+
+long long lineIndexPrefix(struct lineIndex *li, int rows)
+{
+    // NOTE: bytes before row `rows`, with the index synced.
+    int start, blanks;
+    long long bytes;
+    lineIndexDescend(li, rows, &start, &bytes, &blanks);
+    for (int i = start; i < rows; i++) { bytes += lineRowBytes(&B->row[i]); }
+    return bytes;
+}
+
+int lineIndexBlanks(struct lineIndex *li, int rows)
+{
+    int start, blanks;
+    long long bytes;
+    lineIndexDescend(li, rows, &start, &bytes, &blanks);
+    for (int i = start; i < rows; i++) { blanks += B->row[i].size == 0; }
+    return blanks;
+}
+
+long long lineIndexOffset(int row, int col)
+{
+    lineIndexSync();
+    return 3 * B->bom + lineIndexPrefix(&B->lines, row) + col;
+}
+
+long long lineIndexTotal(void)
+{
+    // NOTE: what a save would write.
+    long long total = lineIndexOffset(B->numRows, 0);
+    if (B->noFinalEol && B->numRows > 0) { total -= 1 + B->row[B->numRows - 1].crlf; }
+    return total;
+}
+
+int lineIndexFind(long long offset, int *col)
+{
+    /*
+     * The row holding byte `offset`, and the column in it. Past the end
+     * is the row after the last.
+     */
+    struct lineIndex *li = &B->lines;
+    lineIndexSync();
+    offset -= 3 * B->bom;
+    if (offset < 0) { offset = 0; }
+    int b = 0, row = 0;
+    int step = 1;
+    while (step * 2 <= li->nblocks) { step *= 2; }
+    for (; step > 0; step /= 2)
+    {
+        if (b + step <= li->nblocks && li->tree[b + step] <= offset)
+        {
+            b += step;
+            offset -= li->tree[b];
+            row += li->count[b];
+        }
+    }
+    for (; row < B->numRows && lineRowBytes(&B->row[row]) <= offset; row++)
+    {
+        offset -= lineRowBytes(&B->row[row]);
+    }
+    *col = (int)offset;
+    return row;
+}
+
+void lineIndexFree(struct lineIndex *li)
+{
+    free(li->block);
+    free(li->tree);
+    free(li->blank);
+    free(li->count);
+    free(li->brackets);
+    memset(li, 0, sizeof(*li));
+}
+
+/*** goto ***/
+
+void editorGoto(int row, int col)
+{
+    if (row > B->numRows) { row = B->numRows; }
+    if (row < 0) { row = 0; }
+    int size = row < B->numRows ? B->row[row].size : 0;
+    if (col > size) { col = size; }
+    if (col < 0) { col = 0; }
+
+    editorCursorsClear();
+    V->cy = row;
+    V->cx = col;
+    if (row < B->numRows) { V->px = editorRowCxToRx(&B->row[row], col); }
+    V->rowoff = getScreenCenter();
+}
+
+void editorGotoPrompt(void)
+{
+    /*
+     * Takes a line, line:column, a percentage of the file, or a byte
+     * offset after 'b' (decimal, or hex with 0x).
+     */
+    char *answer = editorPrompt("Goto: %s (line[:col], N%%, b<byte offset>)", NULL);
+    if (answer == NULL) { return; }
+
+    char *p = answer;
+    while (*p == ' ') { p++; }
+    char *end;
+    if (*p == 'b' || *p == '#')
+    {
+        long long offset = strtoll(p + 1, &end, 0);
+        long long total = lineIndexTotal();
+        if (end == p + 1 || offset < 0 || offset > total)
+        {
+            editorSetStatusMessage("Byte offset out of range: %s (file is %lld bytes)", answer, total);
+        }
+        else
+        {
+            int col;
+            int row = lineIndexFind(offset, &col);
+            editorGoto(row, col);
+        }
+    }
+    else
+    {
+        long long n = strtoll(p, &end, 10);
+        if (end == p) { editorSetStatusMessage("Goto where? %s", answer); }
+        else if (*end == '%')
+        {
+            int col;
+            int row = lineIndexFind(lineIndexTotal() * (n < 0 ? 0 : n > 100 ? 100 : n) / 100, &col);
+            editorGoto(row, col);
+        }
+        else
+        {
+            // NOTE: clamped while still long long; editorGoto takes an int.
+            int col = (*end == ':') ? atoi(end + 1) : 1;
+            if (n > B->numRows + 1) { n = B->numRows + 1; }
+            if (n < 1) { n = 1; }
+            editorGoto(n - 1, col - 1);
+        }
+    }
+    free(answer);
+}
+
+/*** structure ***/
+
+/*
+ * Paragraph moves and bracket matching, on top of the line index: only
+ * the rows at either end of a jump are scanned.
+ */
+
+int structNthBlank(int k)
+{
+    // NOTE: the row of the k-th empty row (1-based), or -1.
+    struct lineIndex *li = &B->lines;
+    int b = 0, row = 0;
+    int step = 1;
+    while (step * 2 <= li->nblocks) { step *= 2; }
+    for (; step > 0; step /= 2)
+    {
+        if (b + step <= li->nblocks && li->blank[b + step] < k)
+        {
+            b += step;
+            k -= li->blank[b];
+            row += li->count[b];
+        }
+    }
+    for (; row < B->numRows; row++)
+    {
+        if (B->row[row].size == 0 && --k == 0) { return row; }
+    }
+    return -1;
+}
+
+int structNthText(int k)
+{
+    // NOTE: the row of the k-th non-empty row (1-based), or -1.
+    struct lineIndex *li = &B->lines;
+    int b = 0, row = 0;
+    int step = 1;
+    while (step * 2 <= li->nblocks) { step *= 2; }
+    for (; step > 0; step /= 2)
+    {
+        if (b + step <= li->nblocks && li->count[b + step] - li->blank[b + step] < k)
+        {
+            b += step;
+            k -= li->count[b] - li->blank[b];
+            row += li->count[b];
+        }
+    }
+    for (; row < B->numRows; row++)
+    {
+        if (B->row[row].size != 0 && --k == 0) { return row; }
+    }
+    return -1;
+}
+
+void editorMoveCursorParagraphUp(void)
+{
+    /*
+     * To the last line of the previous paragraph: the nearest non-empty
+     * row above the nearest empty row above the cursor.
+     */
+    if (V->cy <= 0) { return; }
+    lineIndexSync();
+    struct lineIndex *li = &B->lines;
+
+    int cy = V->cy < B->numRows ? V->cy : B->numRows;
+    int blanks = lineIndexBlanks(li, cy);
+    int target = 0;
+    if (blanks > 0)
+    {
+        target = structNthBlank(blanks);
+        int texts = target - lineIndexBlanks(li, target);
+        if (texts > 0) { target = structNthText(texts); }
+    }
+
+    V->cy = target;
+    int rowlen = (V->cy < B->numRows) ? B->row[V->cy].size : 0;
+    if (V->cx > rowlen) { V->cx = rowlen; }
+}
+
+void editorMoveCursorParagraphDown(void)
+{
+    // NOTE: to the first line of the next paragraph.
+    if (V->cy >= B->numRows - 1) { return; }
+    lineIndexSync();
+    struct lineIndex *li = &B->lines;
+
+    int target = structNthBlank(lineIndexBlanks(li, V->cy + 1) + 1);
+    if (target < 0) { target = B->numRows - 1; }
+    else
+    {
+        int next = structNthText(target + 1 - lineIndexBlanks(li, target + 1) + 1);
+        if (next >= 0) { target = next; }
+    }
+
+    V->cy = target;
+    int rowlen = (V->cy < B->numRows) ? B->row[V->cy].size : 0;
+    if (V->cx > rowlen) { V->cx = rowlen; }
+}
+
+int bracketForward(int node, int lo, int hi, int from, int *depth)
+{
+    /*
+     * The first block at or after `from` in which `*depth` open brackets
+     * are all closed, or -1; the blocks passed over are added to *depth.
+     */
+    struct lineIndex *li = &B->lines;
+    if (hi <= from) { return -1; }
+    if (lo >= from && *depth + li->brackets[node].min > 0)
+    {
+        *depth += li->brackets[node].sum;
+        return -1;
+    }
+    if (hi - lo == 1) { return lo; }
+    int mid = (lo + hi) / 2;
+    int r = bracketForward(2 * node, lo, mid, from, depth);
+    return r >= 0 ? r : bracketForward(2 * node + 1, mid, hi, from, depth);
+}
+
+int bracketBackward(int node, int lo, int hi, int to, int *depth)
+{
+    // NOTE: the same, right to left, over the blocks before `to`.
+    struct lineIndex *li = &B->lines;
+    struct bracketSum *s = &li->brackets[node];
+    if (lo >= to) { return -1; }
+    if (hi <= to && *depth - (s->sum - s->min) > 0)
+    {
+        *depth -= s->sum;
+        return -1;
+    }
+    if (hi - lo == 1) { return lo; }
+    int mid = (lo + hi) / 2;
+    int r = bracketBackward(2 * node + 1, mid, hi, to, depth);
+    return r >= 0 ? r : bracketBackward(2 * node, lo, mid, to, depth);
+}
+
+int bracketRows(int from, int to, int dir, int *depth)
+{
+    // NOTE: as bracketForward and bracketBackward, by row over [from, to).
+    for (int i = dir > 0 ? from : to - 1; i >= from && i < to; i += dir)
+    {
+        struct bracketSum *s = &B->row[i].brackets;
+        if (dir > 0 ? *depth + s->min <= 0 : *depth - (s->sum - s->min) <= 0) { return i; }
+        *depth += dir > 0 ? s->sum : -s->sum;
+    }
+    return -1;
+}
+
+int bracketMatch(int row, int idx, int dir, int *mrow, int *midx)
+{
+    /*
+     * Finds the bracket that closes the opener at render index `idx` of
+     * `row` (dir > 0), or opens the closer there (dir < 0). Within the
+     * two end rows the scan is by character, through their blocks by
+     * row, and in between by the tree.
+     */
+    erow *r = &B->row[row];
+    editorRowThaw(r);
+    int depth = 1;
+    // NOTE: a row of prose can be long; one without brackets is skipped.
+    int start = r->brackets.n ? idx + dir : -1;
+    for (int i = start; i >= 0 && i < r->rsize; i += dir)
+    {
+        depth -= dir < 0 ? bracketCode(r, i) : -bracketCode(r, i);
+        if (depth == 0) { *mrow = row; *midx = i; return 1; }
+    }
+
+    lineIndexSync();
+    struct lineIndex *li = &B->lines;
+    int first, blanks;
+    long long bytes;
+    int b = lineIndexDescend(li, row, &first, &bytes, &blanks);
+    if (b == li->nblocks) { return 0; }
+    int found = dir > 0 ? bracketRows(row + 1, first + li->block[b].rows, 1, &depth)
+                        : bracketRows(first, row, -1, &depth);
+    if (found < 0)
+    {
+        b = dir > 0 ? bracketForward(1, 0, li->bcap, b + 1, &depth)
+                    : bracketBackward(1, 0, li->bcap, b, &depth);
+        if (b < 0 || b >= li->nblocks) { return 0; }
+        first = lineIndexBlockStart(li, b);
+        found = bracketRows(first, first + li->block[b].rows, dir, &depth);
+    }
+    if (found < 0) { return 0; }
+
+    r = &B->row[found];
+    editorRowThaw(r);
+    for (int i = dir > 0 ? 0 : r->rsize - 1; i >= 0 && i < r->rsize; i += dir)
+    {
+        depth -= dir < 0 ? bracketCode(r, i) : -bracketCode(r, i);
+        if (depth == 0) { *mrow = found; *midx = i; return 1; }
+    }
+    return 0;
+}
+
+int bracketPairAt(int row, int idx, int *r, int *i)
+{
+    /*
+     * The pair the cursor is on, or else the innermost pair around it:
+     * r[0], i[0] the opener and r[1], i[1] the closer. Returns -1 when
+     * the two are different kinds of bracket.
+     */
+    erow *er = &B->row[row];
+    int code = idx < er->rsize ? bracketCode(er, idx) : 0;
+    int found;
+    if (code != 0)
+    {
+        int k = code > 0 ? 0 : 1;
+        r[k] = row;
+        i[k] = idx;
+        found = bracketMatch(row, idx, code, &r[1 - k], &i[1 - k]);
+    }
+    else
+    {
+        found = bracketMatch(row, idx, -1, &r[0], &i[0]) &&
+                bracketMatch(r[0], i[0], 1, &r[1], &i[1]);
+    }
+    if (!found) { return 0; }
+
+    // NOTE: the index only counts depth, so ( can land on ] or }.
+    char open = B->row[r[0]].render[i[0]];
+    char close = B->row[r[1]].render[i[1]];
+    return close == (open == '(' ? ')' : open + 2) ? 1 : -1;
+}
+
+struct bracketPair {
+    struct editorView *view;
+    int found;
+    int r[2], i[2];
+};
+
+struct bracketPair bracketPair;
+
+void editorBracketPairFind(void)
+{
+    struct bracketPair *bp = &bracketPair;
+    bp->view = V;
+    bp->found = 0;
+    if (V->cy >= B->numRows) { return; }
+    erow *row = &B->row[V->cy];
+    editorRowThaw(row);
+    int idx = row->brackets.n ? editorRowCxToRenderIdx(row, V->cx) : 0;
+    bp->found = bracketPairAt(V->cy, idx, bp->r, bp->i) == 1;
+}
+
+unsigned char *editorBracketRowHighlight(int at, unsigned char *hl)
+{
+    // NOTE: returns `hl`, or a scratch copy with the pair marked.
+    static unsigned char *buf = NULL;
+    static int bufcap = 0;
+
+    struct bracketPair *bp = &bracketPair;
+    if (!bp->found || bp->view != V || (at != bp->r[0] && at != bp->r[1])) { return hl; }
+
+    erow *row = &B->row[at];
+    if (row->rsize > bufcap)
+    {
+        bufcap = row->rsize * 2;
+        buf = realloc(buf, bufcap);
+    }
+    memcpy(buf, hl, row->rsize);
+    for (int k = 0; k < 2; k++)
+    {
+        if (bp->r[k] == at) { buf[bp->i[k]] = HL_BRACKET; }
+    }
+    return buf;
+}
+
+void editorBracketJump(void)
+{
+    /*
+     * To the bracket matching the one under the cursor, or else to the
+     * opener of the innermost pair around it.
+     */
+    if (V->cy >= B->numRows) { return; }
+    erow *row = &B->row[V->cy];
+    int idx = editorRowCxToRenderIdx(row, V->cx);
+    int r[2], i[2];
+    int found = bracketPairAt(V->cy, idx, r, i);
+    if (found <= 0)
+    {
+        editorSetStatusMessage(found ? "Mismatched bracket" : "No matching bracket");
+        return;
+    }
+    int k = (r[0] == V->cy && i[0] == idx) ? 1 : 0;
+    editorCursorsClear();
+    V->cy = r[k];
+    V->cx = editorRowRenderIdxToCx(&B->row[r[k]], i[k]);
+    V->px = editorRowCxToRx(&B->row[r[k]], V->cx);
+}
+
+/*** file i/o ***/
+
+/*
+ * Files are read in LOAD_CHUNK_BYTES at a time and split on a vector
+ * scan for newlines, which also notes the chunks with bytes >= 0x80 so
+ * only their lines are checked for valid UTF-8. How each line ended
+ * (\n or \r\n), a byte order mark and a missing final newline are kept,
+ * so a save writes back the same bytes for the lines that weren't
+ * touched; new rows end the way most of the file's did.
+ */
+
+#define LOAD_CHUNK_BYTES (1 << 20)
+
+struct fileLoad {
+    char **texts; // rows of the chunk, added in one batch
+    int *sizes;
+    unsigned char *crlf;
+    int count;
+    int cap;
+    int high; // bytes >= 0x80 since the line started, or maybe
+    long long lf, crlfs; // lines ending each way
+    int badUtf8;
+};
+
+void loadLine(struct fileLoad *L, const char *s, int len, int terminated)
+{
+    // NOTE: an unterminated last line keeps a trailing \r as text.
+    int crlf = terminated && len > 0 && s[len - 1] == '\r';
+    len -= crlf;
+    if (terminated && crlf) { L->crlfs++; }
+    else if (terminated) { L->lf++; }
+    if (L->high && !L->badUtf8 && !utf8Valid(s, len)) { L->badUtf8 = 1; }
+
+    if (L->count == L->cap)
+    {
+        L->cap = L->cap ? L->cap * 2 : 1024;
+        L->texts = realloc(L->texts, sizeof(char *) * L->cap);
+        L->sizes = realloc(L->sizes, sizeof(int) * L->cap);
+        L->crlf = realloc(L->crlf, L->cap);
+    }
+    L->texts[L->count] = textNew(s, len);
+    L->sizes[L->count] = len;
+    L->crlf[L->count++] = crlf;
+}
+
+int loadLines(struct fileLoad *L, const char *p, int n)
+{
+    /*
+     * Adds the complete lines in p to the batch. Returns where the
+     * unfinished last one starts.
+     */
+    int start = 0;
+    int i = 0;
+#if defined(__SSE2__)
+    // NOTE: 64 bytes a step: a bit per newline, and whether any byte
+    // has its high bit set.
+    const __m128i nl = _mm_set1_epi8('\n');
+    for (; i + 64 <= n; i += 64)
+    {
+        uint64_t mask = 0;
+        int high = 0;
+        for (int k = 0; k < 4; k++)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)(p + i + 16 * k));
+            mask |= (uint64_t)(unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl)) << (16 * k);
+            high |= _mm_movemask_epi8(v);
+        }
+        L->high |= high;
+        while (mask)
+        {
+            int at = i + __builtin_ctzll(mask);
+            loadLine(L, &p[start], at - start, 1);
+            start = at + 1;
+            mask &= mask - 1;
+            L->high = high != 0;
+        }
+    }
+#endif
+    const char *f;
+    while ((f = memchr(&p[i], '\n', n - i)) != NULL)
+    {
+        int at = f - p;
+        L->high |= !utf8IsAscii(&p[i], at - i);
+        loadLine(L, &p[start], at - start, 1);
+        start = i = at + 1;
+        L->high = 0;
+    }
+    L->high |= !utf8IsAscii(&p[i], n - i);
+    return start;
+}
+
+void loadFlush(struct fileLoad *L)
+{
+    if (L->count == 0) { return; }
+    int at = B->numRows;
+    editorInsertRows(at, L->texts, L->sizes, L->count);
+    // NOTE: the line index is stale from `at`, so it picks these up.
+    for (int i = 0; i < L->count; i++) { B->row[at + i].crlf = L->crlf[i]; }
+    L->count = 0;
+}
+
+#define SAVE_CHUNK_BYTES (1 << 20)
+
+int editorWriteAll(int fd, const char *buf, long long len)
+{
+    // NOTE: write() can stop short, and takes at most ~2GB at a time.
+    while (len > 0)
+    {
+        ssize_t n = write(fd, buf, len > SAVE_CHUNK_BYTES ? SAVE_CHUNK_BYTES : len);
+        if (n == -1 && errno == EINTR) { continue; }
+        if (n <= 0) { return -1; }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+long long editorRowsLength(void)
+{
+    long long total = 3 * B->bom;
+    for (int j = 0; j < B->numRows; j++)
+    {
+        total += B->row[j].size + 1 + B->row[j].crlf;
+    }
+    int last = B->numRows - 1;
+    if (B->noFinalEol && last >= 0) { total -= 1 + B->row[last].crlf; }
+    return total;
+}
+
+int editorRowsWrite(int fd)
+{
+    /*
+     * Writes the rows out as they go on disk, a chunk at a time, so cold
+     * rows are never all thawed at once. Returns -1 on error.
+     */
+    char *chunk = malloc(SAVE_CHUNK_BYTES);
+    int used = 0, ok = 1;
+    if (B->bom)
+    {
+        memcpy(chunk, "\xEF\xBB\xBF", 3);
+        used = 3;
+    }
+    int last = B->numRows - 1;
+    for (int j = 0; ok && j < B->numRows; j++)
+    {
+        erow *row = &B->row[j];
+        int eol = (j == last && B->noFinalEol) ? 0 : 1 + row->crlf;
+        if (used + row->size + eol > SAVE_CHUNK_BYTES)
+        {
+            ok = editorWriteAll(fd, chunk, used) != -1;
+            used = 0;
+        }
+        const char *text = editorRowText(row, -1);
+        // NOTE: a row longer than a chunk goes out straight from its text.
+        if (row->size + eol > SAVE_CHUNK_BYTES) { ok = ok && editorWriteAll(fd, text, row->size) != -1; }
+        else
+        {
+            memcpy(&chunk[used], text, row->size);
+            used += row->size;
+        }
+        if (eol == 2) { chunk[used++] = '\r'; }
+        if (eol) { chunk[used++] = '\n'; }
+    }
+    if (ok) { ok = editorWriteAll(fd, chunk, used) != -1; }
+    free(chunk);
+    return ok ? 0 : -1;
+}
+
+const char *editorFileFormat(char *buf, int len)
+{
+    // NOTE: how the file differs from plain LF-ended UTF-8, for the status bar.
+    snprintf(buf, len, "%s%s%s%s", B->mixedEol ? "mixed " : B->crlf ? "crlf " : "",
+             B->bom ? "bom " : "", B->noFinalEol ? "noeol " : "", B->badUtf8 ? "!utf8 " : "");
+    return buf;
+}
+
+void editorFreeRows(void)
+{
+    for (int i = 0; i < B->numRows; i++) { editorFreeRow(&B->row[i]); }
+    free(B->row);
+    B->row = NULL;
+    B->numRows = 0;
+    lineIndexReset();
+}
+
+void editorOpen(char *filename)
+{
+    free(B->filename);
+    B->filename = strdup(filename);
+
+
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1)
+    {
+        editorSetStatusMessage("Can't open %s: %s", filename, strerror(errno));
+        return;
+    }
+    traceBegin("open");
+    struct stat st;
+    B->diskSize = fstat(fd, &st) == 0 ? st.st_size : 0;
+    B->crlf = B->mixedEol = B->noFinalEol = B->bom = B->badUtf8 = B->shortRead = 0;
+
+    editorSelectSyntaxHighlight();
+
+    struct fileLoad L = {0};
+    int cap = LOAD_CHUNK_BYTES;
+    char *buf = malloc(cap);
+    int have = 0;
+    int first = 1;
+    int eof = 0;
+    int swept = 0;
+    while (!eof)
+    {
+        // NOTE: a line longer than the buffer grows it.
+        if (have == cap)
+        {
+            cap *= 2;
+            buf = realloc(buf, cap);
+        }
+        ssize_t n = read(fd, &buf[have], cap - have);
+        if (n == -1 && errno == EINTR) { continue; }
+        if (n == -1) { B->shortRead = errno; }
+        if (n <= 0) { eof = 1; }
+        else { have += n; }
+
+        int used = 0;
+        if (first)
+        {
+            if (have < 3 && !eof) { continue; }
+            B->bom = have >= 3 && memcmp(buf, "\xEF\xBB\xBF", 3) == 0;
+            used = 3 * B->bom;
+            first = 0;
+        }
+        used += loadLines(&L, &buf[used], have - used);
+        if (eof && used < have)
+        {
+            loadLine(&L, &buf[used], have - used, 0);
+            B->noFinalEol = 1;
+            used = have;
+        }
+        loadFlush(&L);
+        memmove(buf, &buf[used], have - used);
+        have -= used;
+
+        // NOTE: a big file is frozen as it comes in, not all held hot first.
+        if (editorColdDue())
+        {
+            editorColdSweep(swept, B->numRows);
+            swept = B->numRows;
+        }
+    }
+
+    B->crlf = L.crlfs > L.lf;
+    B->mixedEol = L.crlfs && L.lf;
+    B->badUtf8 = L.badUtf8;
+    free(L.texts);
+    free(L.sizes);
+    free(L.crlf);
+    free(buf);
+    close(fd);
+    B->dirty = 0;
+    if (B->shortRead)
+    {
+        editorSetStatusMessage("Can't read %s: %s (%d lines read)", filename,
+                               strerror(B->shortRead), B->numRows);
+    }
+    traceEnd("open", B->numRows);
+}
+
+void editorSave()
+{
+    // NOTE: saving a file that was only partly read over itself would cut
+    // off the rest, so that takes typing its name.
+    if (B->filename == NULL || B->shortRead) {
+        char *name = editorPrompt(B->shortRead ? "Only part of the file was read. Save as: %s"
+                                               : "Save as: %s", NULL);
+        if (name == NULL)
+        {
+            editorSetStatusMessage("Save cancelled");
+            return;
+        }
+        free(B->filename);
+        B->filename = name;
+        B->shortRead = 0;
+        editorSelectSyntaxHighlight();
+    }
+
+    traceBegin("save");
+    long long len = editorRowsLength();
+
+    int fd = open(B->filename, O_RDWR | O_CREAT, 0644);
+    if (fd != -1)
+    {
+        if (ftruncate(fd, len) != -1 && editorRowsWrite(fd) != -1)
+        {
+            close(fd);
+            B->dirty = 0;
+            B->diskSize = len;
+            traceEnd("save", len < INT_MAX ? (int)len : INT_MAX);
+            editorSetStatusMessage("%lld bytes written to disk", len);
+            return;
+        }
+        close(fd);
+    }
+    traceEnd("save", -1);
+    editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+}
+
+void editorReload() {
+    if (B->filename == NULL) {
+        editorSetStatusMessage("No file to reload.");
+        return;
+    }
+
+    // Optionally warn the user that unsaved changes will be lost.
+    // You can implement a confirmation prompt here if needed.
+
+    // NOTE: the reloaded rows are indexed again from scratch.
+    matchIndexReset(&B->match);
+    editorUndoClear();
+
+    // Free the current file contents.
+    editorFreeRows();
+
+    // Reopen the file to load its current contents.
+    char *filename = strdup(B->filename);
+    editorOpen(filename);
+
+    // Reset cursor position and preferred horizontal position.
+    /*V->cx = V->cy = 0;*/
+    /*V->px = 0;*/
+
+    // Mark the buffer as unmodified.
+    B->dirty = 0;
+
+    if (B->match.active) { matchIndexResume(&B->match); }
+
+    // Inform the user and refresh the screen.
+    editorSetStatusMessage("File reloaded successfully.");
+    editorRefreshScreen();
+}
+
+/*** stdin ***/
+
+/*
+ * `weiss -` reads a pipe. main moves the pipe off stdin and puts the
+ * terminal there instead; the event loop then calls editorStreamRead
+ * whenever the pipe has data, a chunk at a time, so keys still get
+ * through while a fast writer fills the buffer. A line without its
+ * newline yet is shown as the last row, and grows in place. An edit
+ * that reaches that row finishes it, and the pipe goes on in a new row.
+ */
+
+#define STREAM_CHUNK_BYTES (256 * 1024)
+#define STREAM_SLICE_MS 20 // reading at most this long between redraws
+
+struct editorStream {
+    struct editorBuffer *buf; // NULL when nothing was piped in
+    int open; // the buffer's last row is a line still coming in
+    int stale; // and was added to without an update since
+    int appending; // the rows being changed are the stream's own
+    int follow; // views at the last row stay there as rows come in
+    long long bytes;
+};
+
+struct editorStream stream;
+
+const char *editorBufferName(struct editorBuffer *b)
+{
+    if (b->filename) { return b->filename; }
+    return b == stream.buf ? "[stdin]" : "[.]";
+}
+
+int editorStreamStdin(void)
+{
+    /*
+     * Returns a descriptor for the pipe on stdin, after reopening stdin
+     * on the terminal, or -1 if stdin is the terminal already.
+     */
+    if (isatty(STDIN_FILENO)) { return -1; }
+    int fd = dup(STDIN_FILENO);
+    int tty = open("/dev/tty", O_RDWR);
+    if (fd == -1 || tty == -1) { die("/dev/tty"); }
+    dup2(tty, STDIN_FILENO);
+    close(tty);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+}
+
+void editorStreamOpen(int fd)
+{
+    stream.buf = editorBufferNew(NULL);
+    stream.follow = 1;
+    if (fd == -1)
+    {
+        editorSetStatusMessage("Nothing piped in on stdin");
+        return;
+    }
+    events.streamfd = fd;
+    editorEventWatch(fd);
+}
+
+void editorStreamClose(void)
+{
+    if (events.streamfd != -1)
+    {
+        epoll_ctl(events.epfd, EPOLL_CTL_DEL, events.streamfd, NULL);
+        close(events.streamfd);
+        events.streamfd = -1;
+    }
+    stream.buf = NULL;
+    stream.open = 0;
+}
+
+void editorStreamEdited(int to)
+{
+    // NOTE: called for rows up to `to` changing; the open row is the last.
+    if (stream.open && !stream.appending && B == stream.buf && to >= B->numRows - 1)
+    {
+        stream.open = 0;
+    }
+}
+
+void editorStreamGrow(const char *s, int len)
+{
+    /*
+     * Appends to the open row's text. Its capacity is doubled as needed,
+     * and render and highlight wait for editorStreamRead.
+     */
+    erow *row = &B->row[B->numRows - 1];
+    editorRowThaw(row);
+    int need = row->size + len + 1;
+    if (TEXT_HEADER(row->chars)->cap < need) { need *= 2; }
+    row->chars = textReserve(row->chars, row->size, need);
+    memcpy(&row->chars[row->size], s, len);
+    row->size += len;
+    row->chars[row->size] = '\0';
+    stream.stale = 1;
+}
+
+void editorStreamFinish(void)
+{
+    erow *row = &B->row[B->numRows - 1];
+    while (row->size > 0 && row->chars[row->size - 1] == '\r') { row->size--; }
+    row->chars[row->size] = '\0';
+    editorUpdateRow(row);
+    stream.open = 0;
+    stream.stale = 0;
+}
+
+void editorStreamAppend(const char *p, int n)
+{
+    /*
+     * Adds p to the end of the buffer: up to the first newline onto the
+     * open row if there is one, the complete lines after it in one batch,
+     * and what's left after the last newline as the new open row.
+     */
+    stream.appending = 1;
+    int start = 0;
+    const char *nl;
+    if (stream.open)
+    {
+        nl = memchr(p, '\n', n);
+        int end = nl ? nl - p : n;
+        editorStreamGrow(p, end);
+        if (nl) { editorStreamFinish(); }
+        start = nl ? end + 1 : n;
+    }
+
+    char **texts = NULL;
+    int *sizes = NULL;
+    int count = 0, cap = 0;
+    while (start < n)
+    {
+        nl = memchr(&p[start], '\n', n - start);
+        int end = nl ? nl - p : n;
+        int len = end - start;
+        while (nl && len > 0 && p[start + len - 1] == '\r') { len--; }
+        if (count == cap)
+        {
+            cap = cap ? cap * 2 : 256;
+            texts = realloc(texts, sizeof(char *) * cap);
+            sizes = realloc(sizes, sizeof(int) * cap);
+        }
+        texts[count] = textNew(&p[start], len);
+        sizes[count++] = len;
+        stream.open = nl == NULL;
+        start = end + 1;
+    }
+    if (count > 0) { editorInsertRows(B->numRows, texts, sizes, count); }
+    free(texts);
+    free(sizes);
+    stream.appending = 0;
+}
+
+void editorStreamRead(void)
+{
+    static char chunk[STREAM_CHUNK_BYTES];
+    struct editorBuffer *saved = B;
+    B = stream.buf;
+    int last = B->numRows - 1;
+    int dirty = B->dirty;
+
+    long long start = editorNowMs();
+    ssize_t n;
+    while ((n = read(events.streamfd, chunk, sizeof(chunk))) > 0)
+    {
+        stream.bytes += n;
+        editorStreamAppend(chunk, n);
+        if (editorNowMs() - start >= STREAM_SLICE_MS) { break; }
+    }
+    // NOTE: a long line still coming in is rendered once per slice.
+    if (stream.stale)
+    {
+        stream.appending = 1;
+        editorUpdateRow(&B->row[B->numRows - 1]);
+        stream.appending = 0;
+        stream.stale = 0;
+    }
+    if (n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR))
+    {
+        // NOTE: the last line keeps its row, and is now finished.
+        epoll_ctl(events.epfd, EPOLL_CTL_DEL, events.streamfd, NULL);
+        close(events.streamfd);
+        events.streamfd = -1;
+        stream.open = 0;
+        editorSetStatusMessage("stdin closed after %lld bytes, %d lines", stream.bytes, B->numRows);
+    }
+    // NOTE: what came down the pipe isn't an unsaved change.
+    B->dirty = dirty;
+
+    for (struct layoutNode *l = layoutFirstLeaf(E.layout); l; l = layoutNextLeaf(l))
+    {
+        struct editorView *v = l->view;
+        if (v->buf != B || !stream.follow || v->cy < last || B->numRows == 0) { continue; }
+        v->cy = B->numRows - 1;
+        v->cx = 0;
+        if (v->rowoff < v->cy - v->screenRows + 1) { v->rowoff = v->cy - v->screenRows + 1; }
+    }
+    editorColdCheck();
+    B = saved;
+}
+
+void editorStreamFollow(void)
+{
+    if (B != stream.buf)
+    {
+        editorSetStatusMessage("Follow is for stdin, see `weiss -`");
+        return;
+    }
+    stream.follow = !stream.follow;
+    if (stream.follow && B->numRows > 0)
+    {
+        V->cy = B->numRows - 1;
+        V->cx = 0;
+    }
+    editorSetStatusMessage("Follow %s", stream.follow ? "on" : "off");
+}
+
+/*** search ***/
+
+// NOTE: once the rarest-byte filter has produced this many false
+// candidates at a high density, the rest of the haystack goes through
+// Boyer-Moore-Horspool instead.
+#define SEARCH_FILTER_MISSES 64
+#define SEARCH_FILTER_DENSITY 32
+
+unsigned char searchFold[256];
+
+void searchInitFold(void)
+{
+    static int ready = 0;
+    if (ready) { return; }
+    for (int c = 0; c < 256; c++) { searchFold[c] = tolower(c); }
+    ready = 1;
+}
+
+int searchByteScore(unsigned char c)
+{
+    /*
+     * Rough frequency of a byte in source code and prose; the lowest
+     * scoring byte of the needle gets the fewest false candidates.
+     */
+    static const char common[] = " etaoinsrhldcumfpgwybvkxjqz";
+    const char *p = (c != '\0') ? strchr(common, c) : NULL;
+    if (p) { return 200 - (p - common); }
+    // NOTE: filler in binary data, which the hex view searches.
+    if (c == '\0' || c == 0xff) { return 150; }
+    if (isupper(c)) { return 60; }
+    if (strchr("_().,;=\t", c)) { return 80; }
+    if (isdigit(c)) { return 40; }
+    return 10;
+}
+
+void searchCompileBytes(struct searchPattern *p, const char *needle, int len, int icase)
+{
+    searchInitFold();
+
+    p->len = len;
+    p->icase = icase;
+    p->rx = NULL;
+    p->clones = NULL;
+    p->nclones = 0;
+    p->needle = malloc(p->len + 1);
+    for (int i = 0; i < p->len; i++)
+    {
+        unsigned char c = needle[i];
+        p->needle[i] = icase ? searchFold[c] : c;
+    }
+    p->needle[p->len] = '\0';
+
+    p->rare = 0;
+    for (int i = 1; i < p->len; i++)
+    {
+        if (searchByteScore(p->needle[i]) <
+            searchByteScore(p->needle[p->rare]))
+        { p->rare = i; }
+    }
+
+    for (int c = 0; c < 256; c++) { p->skip[c] = p->len; }
+    for (int i = 0; i < p->len - 1; i++)
+    {
+        p->skip[(unsigned char)p->needle[i]] = p->len - 1 - i;
+    }
+}
+
+void searchCompile(struct searchPattern *p, const char *needle, int icase)
+{
+    searchCompileBytes(p, needle, strlen(needle), icase);
+}
+
+const char *searchCompileRegex(struct searchPattern *p, const char *source, int icase)
+{
+    /*
+     * Returns NULL, or a message saying why `source` isn't a regex we
+     * can run; the pattern is left empty in that case.
+     */
+    const char *err = NULL;
+    struct regex *rx = rxCompile(source, icase, &err);
+    if (rx == NULL)
+    {
+        memset(p, 0, sizeof(*p));
+        return err;
+    }
+
+    p->len = strlen(source);
+    p->icase = icase;
+    p->needle = strdup(source);
+    p->rare = 0;
+    p->rx = rx;
+    p->clones = NULL;
+    p->nclones = 0;
+    return NULL;
+}
+
+void searchFree(struct searchPattern *p)
+{
+    for (int i = 0; i < p->nclones; i++) { searchFree(&p->clones[i]); }
+    free(p->clones);
+    free(p->needle);
+    rxFree(p->rx);
+    p->clones = NULL;
+    p->nclones = 0;
+    p->needle = NULL;
+    p->rx = NULL;
+    p->len = 0;
+}
+
+void searchPrepareClones(struct searchPattern *p, int slots)
+{
+    // NOTE: literal patterns are read-only and shared by every slot.
+    if (p->rx == NULL || p->nclones >= slots - 1) { return; }
+
+    p->clones = realloc(p->clones, sizeof(struct searchPattern) * (slots - 1));
+    for (int i = p->nclones; i < slots - 1; i++)
+    {
+        searchCompileRegex(&p->clones[i], p->needle, p->icase);
+    }
+    p->nclones = slots - 1;
+}
+
+struct searchPattern *searchPatternFor(struct searchPattern *p, int slot)
+{
+    if (p->rx == NULL || slot == 0 || slot > p->nclones) { return p; }
+    return &p->clones[slot - 1];
+}
+
+const char *searchMemchr2(const char *s, int len, unsigned char a, unsigned char b)
+{
+    int i = 0;
+#if defined(__SSE2__)
+    __m128i va = _mm_set1_epi8((char)a);
+    __m128i vb = _mm_set1_epi8((char)b);
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, va),
+                                                  _mm_cmpeq_epi8(v, vb)));
+        if (mask) { return s + i + __builtin_ctz(mask); }
+    }
+#endif
+    for (; i < len; i++)
+    {
+        unsigned char c = s[i];
+        if (c == a || c == b) { return s + i; }
+    }
+    return NULL;
+}
+
+int searchEqual(struct searchPattern *p, const char *s)
+{
+    if (!p->icase) { return memcmp(s, p->needle, p->len) == 0; }
+    for (int i = 0; i < p->len; i++)
+    {
+        if (searchFold[(unsigned char)s[i]] != (unsigned char)p->needle[i])
+        { return 0; }
+    }
+    return 1;
+}
+
+int searchFindBMH(struct searchPattern *p, const char *hay, int len, int from)
+{
+    int last = len - p->len;
+    int end = p->len - 1;
+    unsigned char tail = p->needle[end];
+    int i = from;
+    while (i <= last)
+    {
+        unsigned char c = hay[i + end];
+        if (p->icase) { c = searchFold[c]; }
+        if (c == tail && searchEqual(p, &hay[i])) { return i; }
+        i += p->skip[c];
+    }
+    return -1;
+}
+
+int searchFind(struct searchPattern *p, const char *hay, int len, int from,
+               int *mlen)
+{
+    /*
+     * Returns the offset of the first match starting at or after `from`,
+     * or -1. The length of the match goes to `mlen` when it isn't NULL.
+     */
+    if (p->len == 0 || from < 0) { return -1; }
+    if (p->rx) { return rxFind(p->rx, hay, len, from, mlen); }
+    if (mlen) { *mlen = p->len; }
+
+    int last = len - p->len;
+    if (from > last) { return -1; }
+
+    unsigned char rc = p->needle[p->rare];
+    unsigned char uc = toupper(rc);
+    int misses = 0;
+    int pos = from;
+    while (pos <= last)
+    {
+        const char *f;
+        if (p->icase && uc != rc)
+        {
+            f = searchMemchr2(&hay[pos + p->rare], last - pos + 1, rc, uc);
+        }
+        else
+        {
+            f = memchr(&hay[pos + p->rare], rc, last - pos + 1);
+        }
+        if (f == NULL) { return -1; }
+
+        int start = (f - hay) - p->rare;
+        if (searchEqual(p, &hay[start])) { return start; }
+        pos = start + 1;
+
+        if (++misses >= SEARCH_FILTER_MISSES && p->len > 2 &&
+            pos - from < misses * SEARCH_FILTER_DENSITY)
+        {
+            return searchFindBMH(p, hay, len, pos);
+        }
+    }
+    return -1;
+}
+
+int searchNext(struct searchPattern *p, int at, int mlen)
+{
+    // NOTE: literal matches may overlap, regex matches never do.
+    return p->rx ? at + mlen : at + 1;
+}
+
+int searchFindLast(struct searchPattern *p, const char *hay, int len, int before,
+                   int *mlen)
+{
+    /*
+     * Returns the offset of the last match starting before `before`, or -1.
+     */
+    int found = -1;
+    int n;
+    int at = searchFind(p, hay, len, 0, &n);
+    while (at != -1 && at < before)
+    {
+        found = at;
+        if (mlen) { *mlen = n; }
+        at = searchFind(p, hay, len, searchNext(p, at, n), &n);
+    }
+    return found;
+}
+
+// NOTE: row range handed to one worker while looking for the nearest match.
+#define SEARCH_SLICE_ROWS 4096
+#define SEARCH_SLICE_BYTES (256 << 10)
+
+struct searchRowsSlice {
+    int lo; // steps [lo, hi) away from the starting row
+    int hi;
+    int step; // first step with a match, or -1
+    int at;
+    int len;
+};
+
+struct searchRowsJob {
+    struct searchPattern *p;
+    int row;
+    int col;
+    int direction;
+    struct searchRowsSlice slices[WORKER_POOL_MAX * 2];
+};
+
+int editorSearchRowStep(struct searchPattern *p, int i, int row, int col,
+                        int direction, int slot, int *match_len)
+{
+    /*
+     * Searches the row `i` steps away from `row`. The starting row is
+     * visited twice: first from `col` on, last up to `col`.
+     */
+    int current = (row + direction * (i % B->numRows) + B->numRows) % B->numRows;
+    erow *r = &B->row[current];
+    const char *text = editorRowText(r, slot);
+    int at;
+
+    if (direction > 0)
+    {
+        at = searchFind(p, text, r->size, i == 0 ? col : 0, match_len);
+        if (i == B->numRows && at >= col) { at = -1; }
+    }
+    else
+    {
+        at = searchFindLast(p, text, r->size, i == 0 ? col : r->size + 1,
+                            match_len);
+        if (i == B->numRows && at < col) { at = -1; }
+    }
+    return at;
+}
+
+void editorSearchRowsSlice(void *arg, int task, int slot)
+{
+    struct searchRowsJob *job = arg;
+    struct searchRowsSlice *s = &job->slices[task];
+    struct searchPattern *p = searchPatternFor(job->p, slot);
+
+    traceBegin("search slice");
+    s->step = -1;
+    for (int i = s->lo; i < s->hi; i++)
+    {
+        s->at = editorSearchRowStep(p, i, job->row, job->col, job->direction, slot, &s->len);
+        if (s->at != -1)
+        {
+            s->step = i;
+            break;
+        }
+    }
+    traceEnd("search slice", s->hi - s->lo);
+}
+
+int editorSearchRows(struct searchPattern *p, int row, int col, int direction,
+                     int *match_row, int *match_col, int *match_len)
+{
+    /*
+     * Scans the buffer from (row, col) in `direction`, wrapping around once.
+     * Forward scans include `col`, backward scans stop short of it. Rows
+     * are handed out in slices to the worker pool, nearest slice first, and
+     * the nearest slice with a match wins.
+     */
+    if (B->numRows == 0 || p->len == 0) { return 0; }
+    if (row < 0 || row >= B->numRows) { row = 0; col = 0; }
+
+    struct searchRowsJob job;
+    job.p = p;
+    job.row = row;
+    job.col = col;
+    job.direction = direction;
+
+    int slots = workerPoolSize();
+    int max_slices = slots * 2;
+    searchPrepareClones(p, slots);
+
+    int i = 0;
+    while (i <= B->numRows)
+    {
+        int n = 0;
+        while (n < max_slices && i <= B->numRows)
+        {
+            struct searchRowsSlice *s = &job.slices[n++];
+            int bytes = 0;
+            s->lo = i;
+            while (i <= B->numRows && i - s->lo < SEARCH_SLICE_ROWS && bytes < SEARCH_SLICE_BYTES)
+            {
+                bytes += B->row[(row + direction * (i % B->numRows) + B->numRows) % B->numRows].size;
+                i++;
+            }
+            s->hi = i;
+        }
+
+        traceBegin("search");
+        workerPoolRun(editorSearchRowsSlice, &job, n);
+        traceEnd("search", n);
+
+        for (int k = 0; k < n; k++)
+        {
+            struct searchRowsSlice *s = &job.slices[k];
+            if (s->step == -1) { continue; }
+
+            *match_row = (row + direction * (s->step % B->numRows) + B->numRows) % B->numRows;
+            *match_col = s->at;
+            if (match_len) { *match_len = s->len; }
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*** regex ***/
+
+/*
+ * Byte-oriented regular expressions compiled to a Thompson NFA and run as
+ * a lazily built DFA, so matching is linear in the row and never
+ * backtracks. Supported: literals, '.', [...] classes, \d \w \s and their
+ * negations, (groups), |, * + ? {m,n}, with ^ and $ anchoring the whole
+ * pattern. '.' and negated classes consume a whole utf-8 sequence.
+ */
+
+#define RX_MAX_STATES 1024 // cached DFA states before the cache is flushed
+#define RX_MAX_REPEAT 256
+#define RX_MAX_NODES (1 << 16)
+
+enum rxNodeType {
+    RX_SET = 0,
+    RX_SPLIT,
+    RX_EPS,
+    RX_MATCH
+};
+
+struct rxNode {
+    int type;
+    int out;
+    int out1;
+    unsigned char set[32];
+};
+
+struct rxProg {
+    struct rxNode *nodes;
+    int n;
+    int cap;
+    int start;
+};
+
+struct rxDfa {
+    struct rxProg *prog;
+    int unanchored; // re-enter the start state at every byte
+    int nstates;
+    int **sets; // sorted nfa nodes per state, sets[i][0] holds the count
+    unsigned char *accept;
+    int *next; // nstates * 256 transitions, -1 until computed
+    int *hash;
+    int hashcap;
+    int start;
+    int flushes;
+    int *work;
+    int *stack;
+    int *mark;
+    int gen;
+};
+
+struct regex {
+    struct rxProg fwd; // forward program, matched anchored
+    struct rxProg rev; // reversed program, finds leftmost starts
+    struct rxDfa dfwd;
+    struct rxDfa drev;
+    struct rxDfa dscan; // forward program, unanchored, finds the first end
+    int bol;
+    int eol;
+    struct searchPattern prefix; // literal every match starts with
+};
+
+struct rxParser {
+    const char *p;
+    const char *end;
+    const char *err;
+    struct rxProg *prog;
+    int icase;
+    int reverse;
+};
+
+struct rxFrag {
+    int start;
+    int outs; // dangling edges, chained through the out fields
+};
+
+#define RX_SETBIT(s, c) ((s)[(unsigned char)(c) >> 3] |= 1 << ((unsigned char)(c) & 7))
+#define RX_HASBIT(s, c) ((s)[(unsigned char)(c) >> 3] & (1 << ((unsigned char)(c) & 7)))
+
+int rxNewNode(struct rxProg *prog, int type)
+{
+    if (prog->n == prog->cap)
+    {
+        prog->cap = prog->cap ? prog->cap * 2 : 64;
+        prog->nodes = realloc(prog->nodes, sizeof(struct rxNode) * prog->cap);
+    }
+    struct rxNode *node = &prog->nodes[prog->n];
+    node->type = type;
+    node->out = -1;
+    node->out1 = -1;
+    memset(node->set, 0, sizeof(node->set));
+    return prog->n++;
+}
+
+int *rxEdge(struct rxProg *prog, int ref)
+{
+    struct rxNode *node = &prog->nodes[ref >> 1];
+    return (ref & 1) ? &node->out1 : &node->out;
+}
+
+void rxPatch(struct rxProg *prog, int list, int target)
+{
+    while (list != -1)
+    {
+        int *edge = rxEdge(prog, list);
+        list = *edge;
+        *edge = target;
+    }
+}
+
+int rxAppend(struct rxProg *prog, int l1, int l2)
+{
+    if (l1 == -1) { return l2; }
+    int ref = l1;
+    while (*rxEdge(prog, ref) != -1) { ref = *rxEdge(prog, ref); }
+    *rxEdge(prog, ref) = l2;
+    return l1;
+}
+
+struct rxFrag rxFragSet(struct rxParser *P, const unsigned char *set)
+{
+    int n = rxNewNode(P->prog, RX_SET);
+    memcpy(P->prog->nodes[n].set, set, 32);
+    struct rxFrag f = { n, n << 1 };
+    return f;
+}
+
+struct rxFrag rxFragRange(struct rxParser *P, int lo, int hi)
+{
+    unsigned char set[32] = {0};
+    for (int c = lo; c <= hi; c++) { RX_SETBIT(set, c); }
+    return rxFragSet(P, set);
+}
+
+struct rxFrag rxFragEmpty(struct rxParser *P)
+{
+    int n = rxNewNode(P->prog, RX_EPS);
+    struct rxFrag f = { n, n << 1 };
+    return f;
+}
+
+struct rxFrag rxFragCat(struct rxParser *P, struct rxFrag a, struct rxFrag b)
+{
+    // NOTE: the reversed program is the same pattern read right to left.
+    if (P->reverse)
+    {
+        struct rxFrag t = a;
+        a = b;
+        b = t;
+    }
+    rxPatch(P->prog, a.outs, b.start);
+    struct rxFrag f = { a.start, b.outs };
+    return f;
+}
+
+struct rxFrag rxFragAlt(struct rxParser *P, struct rxFrag a, struct rxFrag b)
+{
+    int n = rxNewNode(P->prog, RX_SPLIT);
+    P->prog->nodes[n].out = a.start;
+    P->prog->nodes[n].out1 = b.start;
+    struct rxFrag f = { n, rxAppend(P->prog, a.outs, b.outs) };
+    return f;
+}
+
+struct rxFrag rxFragStar(struct rxParser *P, struct rxFrag a)
+{
+    int n = rxNewNode(P->prog, RX_SPLIT);
+    P->prog->nodes[n].out = a.start;
+    rxPatch(P->prog, a.outs, n);
+    struct rxFrag f = { n, (n << 1) | 1 };
+    return f;
+}
+
+struct rxFrag rxFragPlus(struct rxParser *P, struct rxFrag a)
+{
+    int n = rxNewNode(P->prog, RX_SPLIT);
+    P->prog->nodes[n].out = a.start;
+    rxPatch(P->prog, a.outs, n);
+    struct rxFrag f = { a.start, (n << 1) | 1 };
+    return f;
+}
+
+struct rxFrag rxFragQuest(struct rxParser *P, struct rxFrag a)
+{
+    int n = rxNewNode(P->prog, RX_SPLIT);
+    P->prog->nodes[n].out = a.start;
+    struct rxFrag f = { n, rxAppend(P->prog, a.outs, (n << 1) | 1) };
+    return f;
+}
+
+struct rxFrag rxFragMultibyte(struct rxParser *P)
+{
+    /*
+     * Any multibyte utf-8 sequence, plus stray continuation and invalid
+     * bytes so malformed text can still be matched by '.'.
+     */
+    struct rxFrag two = rxFragCat(P, rxFragRange(P, 0xC0, 0xDF),
+                                  rxFragRange(P, 0x80, 0xBF));
+    struct rxFrag three = rxFragCat(P, rxFragRange(P, 0xE0, 0xEF),
+                                    rxFragRange(P, 0x80, 0xBF));
+    three = rxFragCat(P, three, rxFragRange(P, 0x80, 0xBF));
+    struct rxFrag four = rxFragCat(P, rxFragRange(P, 0xF0, 0xF7),
+                                   rxFragRange(P, 0x80, 0xBF));
+    four = rxFragCat(P, four, rxFragRange(P, 0x80, 0xBF));
+    four = rxFragCat(P, four, rxFragRange(P, 0x80, 0xBF));
+
+    unsigned char stray[32] = {0};
+    for (int c = 0x80; c <= 0xBF; c++) { RX_SETBIT(stray, c); }
+    for (int c = 0xF8; c <= 0xFF; c++) { RX_SETBIT(stray, c); }
+
+    return rxFragAlt(P, rxFragSet(P, stray),
+                     rxFragAlt(P, two, rxFragAlt(P, three, four)));
+}
+
+struct rxFrag rxFragClass(struct rxParser *P, unsigned char *set, int negate)
+{
+    if (P->icase)
+    {
+        for (int c = 'a'; c <= 'z'; c++)
+        {
+            if (RX_HASBIT(set, c) || RX_HASBIT(set, toupper(c)))
+            {
+                RX_SETBIT(set, c);
+                RX_SETBIT(set, toupper(c));
+            }
+        }
+    }
+    if (!negate) { return rxFragSet(P, set); }
+
+    unsigned char ascii[32] = {0};
+    for (int c = 0; c < 0x80; c++)
+    {
+        if (!RX_HASBIT(set, c)) { RX_SETBIT(ascii, c); }
+    }
+    return rxFragAlt(P, rxFragSet(P, ascii), rxFragMultibyte(P));
+}
+
+void rxClassEscape(int c, unsigned char *set)
+{
+    switch (c)
+    {
+        case 'd': case 'D':
+        {
+            for (int i = '0'; i <= '9'; i++) { RX_SETBIT(set, i); }
+        } break;
+        case 'w': case 'W':
+        {
+            for (int i = 0; i < 0x80; i++)
+            {
+                if (isalnum(i) || i == '_') { RX_SETBIT(set, i); }
+            }
+        } break;
+        case 's': case 'S':
+        {
+            const char *ws = " \t\r\n\f\v";
+            for (; *ws; ws++) { RX_SETBIT(set, *ws); }
+        } break;
+    }
+}
+
+int rxEscapeChar(int c)
+{
+    switch (c)
+    {
+        case 't': return '\t';
+        case 'n': return '\n';
+        case 'r': return '\r';
+        case 'f': return '\f';
+        case 'v': return '\v';
+        case '0': return '\0';
+    }
+    return c;
+}
+
+struct rxFrag rxParseAlt(struct rxParser *P);
+
+struct rxFrag rxParseClass(struct rxParser *P)
+{
+    unsigned char set[32] = {0};
+    int negate = 0;
+
+    if (P->p < P->end && *P->p == '^') { negate = 1; P->p++; }
+
+    int first = 1;
+    while (P->p < P->end && (*P->p != ']' || first))
+    {
+        first = 0;
+        int lo = (unsigned char)*P->p++;
+        if (lo == '\\' && P->p < P->end)
+        {
+            int e = (unsigned char)*P->p++;
+            if (strchr("dDwWsS", e))
+            {
+                unsigned char sub[32] = {0};
+                rxClassEscape(e, sub);
+                for (int i = 0; i < 0x80; i++)
+                {
+                    if (!RX_HASBIT(sub, i) == !!isupper(e)) { RX_SETBIT(set, i); }
+                }
+                continue;
+            }
+            lo = rxEscapeChar(e);
+        }
+
+        int hi = lo;
+        if (P->p + 1 < P->end && *P->p == '-' && P->p[1] != ']')
+        {
+            P->p++;
+            hi = (unsigned char)*P->p++;
+            if (hi == '\\' && P->p < P->end) { hi = rxEscapeChar((unsigned char)*P->p++); }
+            if (hi < lo)
+            {
+                P->err = "bad class range";
+                return rxFragEmpty(P);
+            }
+        }
+        for (int c = lo; c <= hi; c++) { RX_SETBIT(set, c); }
+    }
+
+    if (P->p >= P->end)
+    {
+        P->err = "missing ]";
+        return rxFragEmpty(P);
+    }
+    P->p++;
+    return rxFragClass(P, set, negate);
+}
+
+int rxParseCount(struct rxParser *P, int *m, int *n)
+{
+    // NOTE: {m}, {m,} and {m,n}; anything else leaves '{' as a literal.
+    const char *p = P->p + 1;
+    if (p >= P->end || !isdigit((unsigned char)*p)) { return 0; }
+
+    *m = 0;
+    while (p < P->end && isdigit((unsigned char)*p)) { *m = *m * 10 + (*p++ - '0'); }
+    *n = *m;
+    if (p < P->end && *p == ',')
+    {
+        p++;
+        *n = -1;
+        if (p < P->end && isdigit((unsigned char)*p))
+        {
+            *n = 0;
+            while (p < P->end && isdigit((unsigned char)*p)) { *n = *n * 10 + (*p++ - '0'); }
+        }
+    }
+    if (p >= P->end || *p != '}') { return 0; }
+    P->p = p + 1;
+    return 1;
+}
+
+struct rxFrag rxParseAtom(struct rxParser *P)
+{
+    unsigned char c = *P->p;
+
+    if (c == '(')
+    {
+        P->p++;
+        if (P->end - P->p >= 2 && P->p[0] == '?' && P->p[1] == ':') { P->p += 2; }
+        struct rxFrag f = rxParseAlt(P);
+        if (P->p >= P->end || *P->p != ')')
+        {
+            P->err = "missing )";
+            return f;
+        }
+        P->p++;
+        return f;
+    }
+    else if (c == '.')
+    {
+        P->p++;
+        unsigned char ascii[32] = {0};
+        for (int i = 0; i < 0x80; i++) { RX_SETBIT(ascii, i); }
+        return rxFragAlt(P, rxFragSet(P, ascii), rxFragMultibyte(P));
+    }
+    else if (c == '[')
+    {
+        P->p++;
+        return rxParseClass(P);
+    }
+    else if (c == '*' || c == '+' || c == '?')
+    {
+        P->err = "nothing to repeat";
+        P->p++;
+        return rxFragEmpty(P);
+    }
+    else if (c == '{')
+    {
+        // NOTE: only a count is an error here; any other '{' is literal.
+        int m, n;
+        if (rxParseCount(P, &m, &n))
+        {
+            P->err = "nothing to repeat";
+            return rxFragEmpty(P);
+        }
+    }
+    else if (c == '^' || c == '$')
+    {
+        P->err = "anchors only at the ends of the pattern";
+        P->p++;
+        return rxFragEmpty(P);
+    }
+    else if (c == '\\')
+    {
+        P->p++;
+        if (P->p >= P->end)
+        {
+            P->err = "trailing \\";
+            return rxFragEmpty(P);
+        }
+        c = *P->p;
+        if (strchr("dDwWsS", c))
+        {
+            P->p++;
+            unsigned char set[32] = {0};
+            rxClassEscape(c, set);
+            return rxFragClass(P, set, isupper(c));
+        }
+        if (c < 0x80)
+        {
+            P->p++;
+            unsigned char set[32] = {0};
+            RX_SETBIT(set, rxEscapeChar(c));
+            return rxFragClass(P, set, 0);
+        }
+    }
+
+    // NOTE: a literal codepoint is one atom, so quantifiers apply to all
+    // of its bytes.
+    int cp;
+    int n = utf8Decode(P->p, P->end - P->p, &cp);
+    struct rxFrag f;
+    for (int i = 0; i < n; i++)
+    {
+        unsigned char set[32] = {0};
+        RX_SETBIT(set, P->p[i]);
+        struct rxFrag b = (n == 1) ? rxFragClass(P, set, 0) : rxFragSet(P, set);
+        f = (i == 0) ? b : rxFragCat(P, f, b);
+    }
+    P->p += n;
+    return f;
+}
+
+struct rxFrag rxParseRepeat(struct rxParser *P)
+{
+    const char *atom = P->p;
+    struct rxFrag f = rxParseAtom(P);
+    if (P->err || P->p >= P->end) { return f; }
+
+    char c = *P->p;
+    int m, n;
+    if (c == '*') { P->p++; f = rxFragStar(P, f); }
+    else if (c == '+') { P->p++; f = rxFragPlus(P, f); }
+    else if (c == '?') { P->p++; f = rxFragQuest(P, f); }
+    else if (c == '{' && rxParseCount(P, &m, &n))
+    {
+        if (m > RX_MAX_REPEAT || n > RX_MAX_REPEAT || (n != -1 && n < m))
+        {
+            P->err = "bad repeat count";
+            return f;
+        }
+
+        // NOTE: m required copies then either a star or n - m optional
+        // ones; every copy after the first is parsed again from the text.
+        const char *resume = P->p;
+        int copies = m + ((n == -1) ? 1 : n - m);
+        struct rxFrag r = rxFragEmpty(P);
+        for (int i = 0; i < copies && !P->err; i++)
+        {
+            struct rxFrag copy = f;
+            if (i > 0)
+            {
+                P->p = atom;
+                copy = rxParseAtom(P);
+            }
+            if (i >= m) { copy = (n == -1) ? rxFragStar(P, copy) : rxFragQuest(P, copy); }
+            r = rxFragCat(P, r, copy);
+
+            if (P->prog->n > RX_MAX_NODES) { P->err = "pattern too large"; }
+        }
+        P->p = resume;
+        f = r;
+    }
+    else
+    {
+        return f;
+    }
+
+    // NOTE: lazy quantifiers match the same set of strings.
+    if (P->p < P->end && *P->p == '?') { P->p++; }
+    return f;
+}
+
+struct rxFrag rxParseConcat(struct rxParser *P)
+{
+    struct rxFrag f = rxFragEmpty(P);
+    while (!P->err && P->p < P->end && *P->p != '|' && *P->p != ')')
+    {
+        f = rxFragCat(P, f, rxParseRepeat(P));
+    }
+    return f;
+}
+
+struct rxFrag rxParseAlt(struct rxParser *P)
+{
+    struct rxFrag f = rxParseConcat(P);
+    while (!P->err && P->p < P->end && *P->p == '|')
+    {
+        P->p++;
+        f = rxFragAlt(P, f, rxParseConcat(P));
+    }
+    return f;
+}
+
+const char *rxCompileProg(struct rxProg *prog, const char *pat, int len,
+                          int icase, int reverse)
+{
+    struct rxParser P = { pat, pat + len, NULL, prog, icase, reverse };
+    memset(prog, 0, sizeof(*prog));
+
+    struct rxFrag f = rxParseAlt(&P);
+    if (!P.err && P.p < P.end) { P.err = "unmatched )"; }
+    if (P.err) { return P.err; }
+
+    int match = rxNewNode(prog, RX_MATCH);
+    rxPatch(prog, f.outs, match);
+    prog->start = f.start;
+    return NULL;
+}
+
+int rxTopLevelAlt(const char *pat, int len)
+{
+    int depth = 0;
+    for (int i = 0; i < len; i++)
+    {
+        if (pat[i] == '\\') { i++; }
+        else if (pat[i] == '[')
+        {
+            i++;
+            if (i < len && pat[i] == '^') { i++; }
+            if (i < len && pat[i] == ']') { i++; }
+            while (i < len && pat[i] != ']') { if (pat[i] == '\\') { i++; } i++; }
+        }
+        else if (pat[i] == '(') { depth++; }
+        else if (pat[i] == ')') { depth--; }
+        else if (pat[i] == '|' && depth == 0) { return 1; }
+    }
+    return 0;
+}
+
+int rxLiteralPrefix(const char *pat, int len, char *out)
+{
+    /*
+     * Collects the literal bytes every match must start with, for the
+     * substring prefilter. Gives up on top level alternation.
+     */
+    if (rxTopLevelAlt(pat, len)) { return 0; }
+
+    int n = 0;
+    int i = 0;
+    while (i < len)
+    {
+        int c = (unsigned char)pat[i];
+        int next;
+        int bytes = 1;
+
+        if (c == '\\' && i + 1 < len && !strchr("dDwWsS", pat[i + 1]) &&
+            (unsigned char)pat[i + 1] < 0x80)
+        {
+            c = rxEscapeChar((unsigned char)pat[i + 1]);
+            next = i + 2;
+        }
+        else if (strchr(".[]()|*+?{}\\^$", c))
+        {
+            break;
+        }
+        else
+        {
+            int cp;
+            bytes = utf8Decode(&pat[i], len - i, &cp);
+            next = i + bytes;
+        }
+
+        if (next < len && strchr("*+?{", pat[next])) { break; }
+        if (bytes == 1) { out[n++] = c; }
+        else { memcpy(&out[n], &pat[i], bytes); n += bytes; }
+        i = next;
+    }
+    out[n] = '\0';
+    return n;
+}
+
+void rxDfaFlush(struct rxDfa *d)
+{
+    for (int i = 0; i < d->nstates; i++) { free(d->sets[i]); }
+    d->nstates = 0;
+    d->start = -1;
+    d->flushes++;
+    for (int i = 0; i < d->hashcap; i++) { d->hash[i] = -1; }
+}
+
+void rxDfaInit(struct rxDfa *d, struct rxProg *prog, int unanchored)
+{
+    d->prog = prog;
+    d->unanchored = unanchored;
+    d->nstates = 0;
+    d->sets = malloc(sizeof(int *) * RX_MAX_STATES);
+    d->accept = malloc(RX_MAX_STATES);
+    d->next = malloc(sizeof(int) * 256 * RX_MAX_STATES);
+    d->hashcap = RX_MAX_STATES * 2;
+    d->hash = malloc(sizeof(int) * d->hashcap);
+    d->work = malloc(sizeof(int) * (prog->n + 1));
+    d->stack = malloc(sizeof(int) * (prog->n * 2 + 2));
+    d->mark = calloc(prog->n, sizeof(int));
+    d->gen = 0;
+    d->flushes = 0;
+    rxDfaFlush(d);
+}
+
+void rxDfaFree(struct rxDfa *d)
+{
+    rxDfaFlush(d);
+    free(d->sets);
+    free(d->accept);
+    free(d->next);
+    free(d->hash);
+    free(d->work);
+    free(d->stack);
+    free(d->mark);
+}
+
+void rxDfaClosure(struct rxDfa *d, int node, int *n)
+{
+    struct rxNode *nodes = d->prog->nodes;
+    int sp = 0;
+    d->stack[sp++] = node;
+    while (sp > 0)
+    {
+        int x = d->stack[--sp];
+        if (x < 0 || d->mark[x] == d->gen) { continue; }
+        d->mark[x] = d->gen;
+
+        switch (nodes[x].type)
+        {
+            case RX_SPLIT:
+            {
+                d->stack[sp++] = nodes[x].out1;
+                d->stack[sp++] = nodes[x].out;
+            } break;
+            case RX_EPS:
+            {
+                d->stack[sp++] = nodes[x].out;
+            } break;
+            default:
+            {
+                d->work[(*n)++] = x;
+            } break;
+        }
+    }
+}
+
+int rxIntCmp(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+int rxDfaAdd(struct rxDfa *d, int n)
+{
+    /*
+     * Interns the node set in d->work as a DFA state.
+     */
+    qsort(d->work, n, sizeof(int), rxIntCmp);
+
+    unsigned int h = 2166136261u;
+    for (int i = 0; i < n; i++) { h = (h ^ d->work[i]) * 16777619u; }
+
+    int slot = h % d->hashcap;
+    while (d->hash[slot] != -1)
+    {
+        int *set = d->sets[d->hash[slot]];
+        if (set[0] == n && !memcmp(&set[1], d->work, sizeof(int) * n))
+        {
+            return d->hash[slot];
+        }
+        slot = (slot + 1) % d->hashcap;
+    }
+
+    if (d->nstates == RX_MAX_STATES)
+    {
+        rxDfaFlush(d);
+        return rxDfaAdd(d, n);
+    }
+
+    int s = d->nstates++;
+    d->sets[s] = malloc(sizeof(int) * (n + 1));
+    d->sets[s][0] = n;
+    memcpy(&d->sets[s][1], d->work, sizeof(int) * n);
+    d->accept[s] = 0;
+    for (int i = 0; i < n; i++)
+    {
+        if (d->prog->nodes[d->work[i]].type == RX_MATCH) { d->accept[s] = 1; }
+    }
+    for (int c = 0; c < 256; c++) { d->next[s * 256 + c] = -1; }
+    d->hash[slot] = s;
+    return s;
+}
+
+int rxDfaStart(struct rxDfa *d)
+{
+    if (d->start == -1)
+    {
+        int n = 0;
+        d->gen++;
+        rxDfaClosure(d, d->prog->start, &n);
+        d->start = rxDfaAdd(d, n);
+    }
+    return d->start;
+}
+
+int rxDfaStep(struct rxDfa *d, int s, unsigned char c)
+{
+    int t = d->next[s * 256 + c];
+    if (t >= 0) { return t; }
+
+    int n = 0;
+    int *set = d->sets[s];
+    d->gen++;
+    for (int i = 1; i <= set[0]; i++)
+    {
+        struct rxNode *node = &d->prog->nodes[set[i]];
+        if (node->type == RX_SET && RX_HASBIT(node->set, c))
+        {
+            rxDfaClosure(d, node->out, &n);
+        }
+    }
+    if (d->unanchored) { rxDfaClosure(d, d->prog->start, &n); }
+
+    int flushes = d->flushes;
+    t = rxDfaAdd(d, n);
+    // NOTE: if interning t flushed the cache, s is gone and t is all we keep.
+    if (d->flushes == flushes) { d->next[s * 256 + c] = t; }
+    return t;
+}
+
+#define RX_DEAD(d, s) ((d)->sets[s][0] == 0)
+
+void rxFree(struct regex *rx)
+{
+    if (rx == NULL) { return; }
+    rxDfaFree(&rx->dfwd);
+    rxDfaFree(&rx->drev);
+    rxDfaFree(&rx->dscan);
+    free(rx->fwd.nodes);
+    free(rx->rev.nodes);
+    searchFree(&rx->prefix);
+    free(rx);
+}
+
+struct regex *rxCompile(const char *pat, int icase, const char **err)
+{
+    int len = strlen(pat);
+    struct regex *rx = calloc(1, sizeof(struct regex));
+
+    if (len > 0 && pat[0] == '^') { rx->bol = 1; pat++; len--; }
+    if (len > 0 && pat[len - 1] == '$' && (len < 2 || pat[len - 2] != '\\'))
+    {
+        rx->eol = 1;
+        len--;
+    }
+
+    *err = NULL;
+    if ((rx->bol || rx->eol) && rxTopLevelAlt(pat, len))
+    {
+        *err = "anchors only at the ends of the pattern";
+    }
+    if (*err == NULL) { *err = rxCompileProg(&rx->fwd, pat, len, icase, 0); }
+    if (*err == NULL) { *err = rxCompileProg(&rx->rev, pat, len, icase, 1); }
+    if (*err)
+    {
+        free(rx->fwd.nodes);
+        free(rx->rev.nodes);
+        free(rx);
+        return NULL;
+    }
+
+    rxDfaInit(&rx->dfwd, &rx->fwd, 0);
+    rxDfaInit(&rx->drev, &rx->rev, !rx->eol);
+    rxDfaInit(&rx->dscan, &rx->fwd, 1);
+
+    if (rx->dfwd.accept[rxDfaStart(&rx->dfwd)])
+    {
+        *err = "pattern matches the empty string";
+        rxFree(rx);
+        return NULL;
+    }
+
+    char *prefix = malloc(len + 1);
+    if (!rx->bol && rxLiteralPrefix(pat, len, prefix) > 0)
+    {
+        searchCompile(&rx->prefix, prefix, icase);
+    }
+    free(prefix);
+    return rx;
+}
+
+int rxLongest(struct regex *rx, const char *s, int len, int at)
+{
+    /*
+     * Runs the forward DFA anchored at `at` and returns the end of the
+     * longest match, or -1.
+     */
+    struct rxDfa *d = &rx->dfwd;
+    int st = rxDfaStart(d);
+    int end = -1;
+
+    for (int i = at; i < len; i++)
+    {
+        st = rxDfaStep(d, st, s[i]);
+        if (RX_DEAD(d, st)) { break; }
+        if (d->accept[st] && (!rx->eol || i + 1 == len)) { end = i + 1; }
+    }
+    return end;
+}
+
+int rxFind(struct regex *rx, const char *s, int len, int from, int *mlen)
+{
+    /*
+     * Leftmost-longest match starting at or after `from`. The unanchored
+     * forward DFA finds where the first match ends. No match starts
+     * after that point, so the threads already running are stepped
+     * until they die, and the reversed DFA walks back from the last end
+     * they reached, flagging every offset a match can start at. A call
+     * costs the distance to the match rather than to the end of the row.
+     * The forward DFA then finds where the leftmost match ends.
+     */
+    if (from > len) { return -1; }
+
+    if (rx->bol)
+    {
+        if (from > 0) { return -1; }
+        int end = rxLongest(rx, s, len, 0);
+        if (end == -1) { return -1; }
+        if (mlen) { *mlen = end; }
+        return 0;
+    }
+
+    int lo = from;
+    if (rx->prefix.len > 0)
+    {
+        lo = searchFind(&rx->prefix, s, len, from, NULL);
+        if (lo == -1) { return -1; }
+    }
+
+    // NOTE: a match with $ has to end the row, so the walk back starts there.
+    int far = len;
+    if (!rx->eol)
+    {
+        struct rxDfa *u = &rx->dscan;
+        int st = rxDfaStart(u);
+        int i = lo;
+        while (i < len && !u->accept[st]) { st = rxDfaStep(u, st, s[i++]); }
+        if (!u->accept[st]) { return -1; }
+
+        // NOTE: the same threads, stepped without starting new ones.
+        struct rxDfa *d = &rx->dfwd;
+        int *set = u->sets[st];
+        memcpy(d->work, &set[1], sizeof(int) * set[0]);
+        st = rxDfaAdd(d, set[0]);
+        for (far = i; i < len; i++)
+        {
+            st = rxDfaStep(d, st, s[i]);
+            if (RX_DEAD(d, st)) { break; }
+            if (d->accept[st]) { far = i + 1; }
+        }
+    }
+
+    struct rxDfa *d = &rx->drev;
+    int st = rxDfaStart(d);
+    int start = -1;
+    for (int i = far; i > lo; i--)
+    {
+        st = rxDfaStep(d, st, s[i - 1]);
+        if (d->accept[st]) { start = i - 1; }
+        else if (RX_DEAD(d, st)) { break; }
+    }
+    if (start == -1) { return -1; }
+
+    int end = rx->eol ? len : rxLongest(rx, s, len, start);
+    if (end == -1) { return -1; }
+    if (mlen) { *mlen = end - start; }
+    return start;
+}
+
+/*** match index ***/
+
+// NOTE: bounds on one slice of a worker pool round; the lock is given
+// back between rounds.
+#define MATCH_INDEX_CHUNK_ROWS 4096
+#define MATCH_INDEX_CHUNK_BYTES (1 << 20)
+
+int matchIndexLowerBound(struct matchIndex *mi, int row, int col)
+{
+    int lo = 0, hi = mi->count;
+    while (lo < hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+        struct searchMatch *m = &mi->m[mid];
+        if (m->row < row || (m->row == row && m->col < col)) { lo = mid + 1; }
+        else { hi = mid; }
+    }
+    return lo;
+}
+
+void matchIndexReserve(struct matchIndex *mi, int n)
+{
+    if (mi->count + n <= mi->cap) { return; }
+    int cap = mi->cap ? mi->cap * 2 : 256;
+    while (cap < mi->count + n) { cap *= 2; }
+    mi->m = realloc(mi->m, sizeof(struct searchMatch) * cap);
+    mi->cap = cap;
+}
+
+int matchIndexCountRow(struct matchIndex *mi, erow *row)
+{
+    int n = 0;
+    int len;
+    int col = searchFind(&mi->pat, row->chars, row->size, 0, &len);
+    while (col != -1)
+    {
+        n++;
+        col = searchFind(&mi->pat, row->chars, row->size,
+                         searchNext(&mi->pat, col, len), &len);
+    }
+    return n;
+}
+
+void matchIndexSpliceRow(struct matchIndex *mi, int at, int lo, int hi)
+{
+    /*
+     * Replaces entries [lo, hi) with a fresh scan of row `at`. The index
+     * keeps overlapping matches so a longer query can be answered by
+     * filtering it.
+     */
+    erow *row = &mi->buf->row[at];
+    int n = matchIndexCountRow(mi, row);
+
+    if (n > hi - lo) { matchIndexReserve(mi, n - (hi - lo)); }
+    memmove(&mi->m[lo + n], &mi->m[hi], sizeof(struct searchMatch) * (mi->count - hi));
+    mi->count += n - (hi - lo);
+
+    int len;
+    int col = searchFind(&mi->pat, row->chars, row->size, 0, &len);
+    for (int i = 0; i < n; i++)
+    {
+        mi->m[lo + i].row = at;
+        mi->m[lo + i].col = col;
+        mi->m[lo + i].len = len;
+        col = searchFind(&mi->pat, row->chars, row->size,
+                         searchNext(&mi->pat, col, len), &len);
+    }
+}
+
+void matchIndexScanSlice(void *arg, int task, int slot)
+{
+    struct matchIndex *mi = arg;
+    struct matchIndexSlice *s = &mi->slices[task];
+    struct searchPattern *p = searchPatternFor(&mi->pat, slot);
+
+    s->count = 0;
+    for (int at = s->lo; at < s->hi; at++)
+    {
+        erow *row = &mi->buf->row[at];
+        const char *text = editorRowText(row, slot);
+        int len;
+        int col = searchFind(p, text, row->size, 0, &len);
+        while (col != -1)
+        {
+            if (s->count == s->cap)
+            {
+                s->cap = s->cap ? s->cap * 2 : 256;
+                s->m = realloc(s->m, sizeof(struct searchMatch) * s->cap);
+            }
+            s->m[s->count].row = at;
+            s->m[s->count].col = col;
+            s->m[s->count].len = len;
+            s->count++;
+            col = searchFind(p, text, row->size, searchNext(p, col, len), &len);
+        }
+    }
+}
+
+void *matchIndexWorker(void *arg)
+{
+    /*
+     * Each round splits the next stretch of unindexed rows into slices,
+     * scans them on the worker pool, then appends the results in buffer
+     * order. The lock is held for the whole round.
+     */
+    struct matchIndex *mi = arg;
+    long long woke = editorNowMs();
+
+    pthread_mutex_lock(&E.lock);
+    while (!mi->cancel && mi->scanned < mi->buf->numRows)
+    {
+        int at = mi->scanned;
+        int n = 0;
+        while (n < mi->nslices && at < mi->buf->numRows)
+        {
+            struct matchIndexSlice *s = &mi->slices[n++];
+            int bytes = 0;
+            s->lo = at;
+            while (at < mi->buf->numRows && at - s->lo < MATCH_INDEX_CHUNK_ROWS &&
+                   bytes < MATCH_INDEX_CHUNK_BYTES)
+            {
+                bytes += mi->buf->row[at].size;
+                at++;
+            }
+            s->hi = at;
+        }
+
+        traceBegin("match index");
+        workerPoolRun(matchIndexScanSlice, mi, n);
+        traceEnd("match index", at - mi->scanned);
+
+        for (int i = 0; i < n; i++)
+        {
+            struct matchIndexSlice *s = &mi->slices[i];
+            matchIndexReserve(mi, s->count);
+            memcpy(&mi->m[mi->count], s->m, sizeof(struct searchMatch) * s->count);
+            mi->count += s->count;
+        }
+        mi->scanned = at;
+
+        // NOTE: the running count is repainted a few times a second.
+        if (editorNowMs() - woke >= 100)
+        {
+            woke = editorNowMs();
+            editorWake();
+        }
+        editorYieldLock();
+    }
+    if (!mi->cancel) { mi->finished = 1; }
+    pthread_mutex_unlock(&E.lock);
+    editorWake();
+    return NULL;
+}
+
+void matchIndexStop(struct matchIndex *mi)
+{
+    if (!mi->running) { return; }
+
+    mi->cancel = 1;
+    editorUnlock();
+    pthread_join(mi->thread, NULL);
+    editorLock();
+    mi->running = 0;
+    mi->cancel = 0;
+}
+
+void matchIndexResume(struct matchIndex *mi)
+{
+    if (mi->running) { return; }
+    if (mi->scanned >= mi->buf->numRows)
+    {
+        mi->finished = 1;
+        return;
+    }
+
+    int slots = workerPoolSize();
+    if (mi->slices == NULL)
+    {
+        mi->nslices = slots * 2;
+        mi->slices = calloc(mi->nslices, sizeof(struct matchIndexSlice));
+    }
+    searchPrepareClones(&mi->pat, slots);
+
+    mi->finished = 0;
+    if (pthread_create(&mi->thread, NULL, matchIndexWorker, mi) == 0)
+    {
+        mi->running = 1;
+    }
+}
+
+void matchIndexReset(struct matchIndex *mi)
+{
+    matchIndexStop(mi);
+    mi->count = 0;
+    mi->scanned = 0;
+    mi->finished = 0;
+    mi->cur_row = -1;
+    mi->cur = -1;
+}
+
+void matchIndexClear(struct matchIndex *mi)
+{
+    matchIndexReset(mi);
+    searchFree(&mi->pat);
+    free(mi->m);
+    mi->m = NULL;
+    mi->cap = 0;
+    mi->active = 0;
+
+    for (int i = 0; i < mi->nslices; i++) { free(mi->slices[i].m); }
+    free(mi->slices);
+    mi->slices = NULL;
+    mi->nslices = 0;
+}
+
+const char *matchIndexStart(struct matchIndex *mi, const char *query, int icase,
+                           int regex, int refine)
+{
+    /*
+     * With `refine` set the query extends the indexed one, so every new
+     * match sits on an old one: rows already indexed are filtered in place
+     * and only the rest of the buffer is scanned again. That only holds
+     * for literal queries.
+     */
+    refine = refine && !regex && mi->active && mi->pat.rx == NULL &&
+             mi->pat.icase == icase;
+    matchIndexStop(mi);
+
+    searchFree(&mi->pat);
+    const char *err = NULL;
+    if (regex) { err = searchCompileRegex(&mi->pat, query, icase); }
+    else { searchCompile(&mi->pat, query, icase); }
+    mi->active = 1;
+    mi->cur_row = -1;
+    mi->cur = -1;
+
+    if (refine)
+    {
+        int n = 0;
+        for (int i = 0; i < mi->count; i++)
+        {
+            erow *row = &mi->buf->row[mi->m[i].row];
+            int col = mi->m[i].col;
+            if (col + mi->pat.len <= row->size &&
+                searchEqual(&mi->pat, editorRowText(row, -1) + col))
+            {
+                mi->m[n] = mi->m[i];
+                mi->m[n++].len = mi->pat.len;
+            }
+        }
+        mi->count = n;
+    }
+    else
+    {
+        mi->count = 0;
+        mi->scanned = 0;
+        mi->finished = 0;
+    }
+
+    if (mi->pat.len > 0) { matchIndexResume(mi); }
+    return err;
+}
+
+void matchIndexUpdateRow(int at)
+{
+    struct matchIndex *mi = &B->match;
+    if (!mi->active || at >= mi->scanned) { return; }
+
+    int lo = matchIndexLowerBound(mi, at, 0);
+    int hi = matchIndexLowerBound(mi, at + 1, 0);
+    matchIndexSpliceRow(mi, at, lo, hi);
+}
+
+void matchIndexInsertRow(int at)
+{
+    struct matchIndex *mi = &B->match;
+    if (!mi->active) { return; }
+
+    int lo = matchIndexLowerBound(mi, at, 0);
+    for (int i = lo; i < mi->count; i++) { mi->m[i].row++; }
+
+    // NOTE: a row appended after the worker finished is indexed here,
+    // through the editorUpdateRow that follows.
+    if (at < mi->scanned || (mi->finished && at == mi->scanned))
+    {
+        mi->scanned++;
+    }
+    if (mi->cur_row >= at) { mi->cur_row++; }
+}
+
+void matchIndexDelRow(int at)
+{
+    struct matchIndex *mi = &B->match;
+    if (!mi->active) { return; }
+
+    int lo = matchIndexLowerBound(mi, at, 0);
+    int hi = matchIndexLowerBound(mi, at + 1, 0);
+    memmove(&mi->m[lo], &mi->m[hi], sizeof(struct searchMatch) * (mi->count - hi));
+    mi->count -= hi - lo;
+    for (int i = lo; i < mi->count; i++) { mi->m[i].row--; }
+
+    if (at < mi->scanned) { mi->scanned--; }
+    if (mi->cur_row == at) { mi->cur_row = -1; }
+    else if (mi->cur_row > at) { mi->cur_row--; }
+}
+
+int matchIndexLocate(struct matchIndex *mi)
+{
+    if (mi->cur_row == -1) { return -1; }
+    if (mi->cur >= 0 && mi->cur < mi->count &&
+        mi->m[mi->cur].row == mi->cur_row && mi->m[mi->cur].col == mi->cur_col)
+    {
+        return mi->cur;
+    }
+
+    int k = matchIndexLowerBound(mi, mi->cur_row, mi->cur_col);
+    if (k < mi->count && mi->m[k].row == mi->cur_row && mi->m[k].col == mi->cur_col)
+    {
+        mi->cur = k;
+        return k;
+    }
+    return -1;
+}
+
+unsigned char *matchIndexRowHighlight(int at)
+{
+    /*
+     * Returns the row's hl, or a scratch copy of it with every match in
+     * the row marked. Rows the worker hasn't reached are scanned directly.
+     */
+    static unsigned char *buf = NULL;
+    static int bufcap = 0;
+
+    struct matchIndex *mi = &B->match;
+    erow *row = &B->row[at];
+    if (!mi->active || mi->pat.len == 0) { return row->hl; }
+
+    int lo = 0, hi = 0;
+    int first, len;
+    if (at < mi->scanned)
+    {
+        lo = matchIndexLowerBound(mi, at, 0);
+        hi = matchIndexLowerBound(mi, at + 1, 0);
+        if (lo == hi) { return row->hl; }
+        first = mi->m[lo].col;
+        len = mi->m[lo].len;
+    }
+    else
+    {
+        first = searchFind(&mi->pat, row->chars, row->size, 0, &len);
+        if (first == -1) { return row->hl; }
+    }
+
+    if (row->rsize > bufcap)
+    {
+        bufcap = row->rsize * 2;
+        buf = realloc(buf, bufcap);
+    }
+    memcpy(buf, row->hl, row->rsize);
+
+    int i = lo;
+    int col = first;
+    while (col != -1)
+    {
+        int rs = editorRowCxToRenderIdx(row, col);
+        int re = editorRowCxToRenderIdx(row, col + len);
+        memset(&buf[rs], HL_MATCH_OTHER, re - rs);
+
+        if (at < mi->scanned)
+        {
+            i++;
+            col = (i < hi) ? mi->m[i].col : -1;
+            len = (i < hi) ? mi->m[i].len : 0;
+        }
+        else
+        {
+            col = searchFind(&mi->pat, row->chars, row->size,
+                             searchNext(&mi->pat, col, len), &len);
+        }
+    }
+
+    if (mi->cur_row == at && mi->cur_col + mi->cur_len <= row->size)
+    {
+        int rs = editorRowCxToRenderIdx(row, mi->cur_col);
+        int re = editorRowCxToRenderIdx(row, mi->cur_col + mi->cur_len);
+        memset(&buf[rs], HL_MATCH, re - rs);
+    }
+    return buf;
+}
+
+int matchIndexStatus(char *buf, int len)
+{
+    struct matchIndex *mi = &B->match;
+    if (!mi->active || mi->pat.len == 0) { buf[0] = '\0'; return 0; }
+
+    const char *more = mi->finished ? "" : "+";
+    int k = matchIndexLocate(mi);
+    if (k != -1)
+    {
+        return snprintf(buf, len, "match %d of %d%s | ", k + 1, mi->count, more);
+    }
+    else if (mi->cur_row != -1)
+    {
+        return snprintf(buf, len, "match ? of %d%s | ", mi->count, more);
+    }
+    return snprintf(buf, len, "%d%s matches | ", mi->count, more);
+}
+
+/*** find ***/
+
+char findPrompt[128];
+int findOriginRow, findOriginCol;
+int findIcase, findRegex;
+
+void editorFindSetPrompt(const char *err)
+{
+    snprintf(findPrompt, sizeof(findPrompt), "Search%s%s: %%s (ESC/Arrows/Enter/C-t/C-r)%s%s",
+             findIcase ? " [i]" : "", findRegex ? " [re]" : "",
+             err ? " " : "", err ? err : "");
+}
+
+void editorFindJump(int row, int col, int len)
+{
+    B->match.cur_row = row;
+    B->match.cur_col = col;
+    B->match.cur_len = len;
+    V->cy = row;
+    V->cx = col;
+    V->rowoff = getScreenCenter();
+}
+
+void editorFindStep(int direction)
+{
+    /*
+     * Moves to the next/previous match straight through the index; only
+     * when the neighbour lies past what the worker has indexed so far do
+     * we fall back to scanning rows.
+     */
+    struct matchIndex *mi = &B->match;
+    if (!mi->active || mi->pat.len == 0)
+    {
+        editorSetStatusMessage("No active search");
+        return;
+    }
+
+    int k = matchIndexLocate(mi);
+    int next = -1;
+    if (k != -1)
+    {
+        if (direction > 0)
+        {
+            if (k + 1 < mi->count) { next = k + 1; }
+            else if (mi->finished) { next = 0; }
+        }
+        else
+        {
+            if (k > 0) { next = k - 1; }
+            else if (mi->finished) { next = mi->count - 1; }
+        }
+    }
+
+    if (next != -1)
+    {
+        editorFindJump(mi->m[next].row, mi->m[next].col, mi->m[next].len);
+        mi->cur = next;
+        return;
+    }
+
+    int row = V->cy;
+    int col = V->cx;
+    if (mi->cur_row != -1)
+    {
+        row = mi->cur_row;
+        col = mi->cur_col + (direction > 0 ? 1 : 0);
+    }
+
+    int match_row, match_col, match_len;
+    if (editorSearchRows(&mi->pat, row, col, direction, &match_row, &match_col, &match_len))
+    {
+        editorFindJump(match_row, match_col, match_len);
+    }
+}
+
+void editorFindCallback(char *query, int key)
+{
+    static char *last_query = NULL;
+
+    struct matchIndex *mi = &B->match;
+
+    if (key == '\x1b')
+    {
+        matchIndexClear(mi);
+        free(last_query);
+        last_query = NULL;
+        return;
+    }
+    else if (key == '\r')
+    {
+        // NOTE: the index outlives the prompt so matches stay highlighted
+        // and C-e/C-b keep stepping through them.
+        free(last_query);
+        last_query = NULL;
+        return;
+    }
+
+    if (key == CTRL_KEY('t') || key == CTRL_KEY('r'))
+    {
+        if (key == CTRL_KEY('t')) { findIcase = !findIcase; }
+        else { findRegex = !findRegex; }
+        editorFindSetPrompt(NULL);
+        free(last_query);
+        last_query = NULL;
+    }
+
+    if (last_query == NULL || strcmp(last_query, query) != 0)
+    {
+        // NOTE: a longer query can only match where the shorter one did, so
+        // resume from the last hit instead of the origin; if the shorter
+        // query had no hit at all there is nothing to scan.
+        int extends = (!findRegex && last_query != NULL && *last_query &&
+                       strncmp(last_query, query, strlen(last_query)) == 0);
+        int had_hit = (mi->cur_row != -1);
+        int row = findOriginRow;
+        int col = findOriginCol;
+        if (extends && had_hit)
+        {
+            row = mi->cur_row;
+            col = mi->cur_col;
+        }
+
+        free(last_query);
+        last_query = strdup(query);
+
+        if (*query == '\0')
+        {
+            matchIndexClear(mi);
+            return;
+        }
+
+        const char *err = matchIndexStart(mi, query, findIcase, findRegex, extends);
+        editorFindSetPrompt(err);
+        if (err || (extends && !had_hit)) { return; }
+
+        int match_row, match_col, match_len;
+        if (editorSearchRows(&mi->pat, row, col, 1, &match_row, &match_col, &match_len))
+        {
+            editorFindJump(match_row, match_col, match_len);
+        }
+    }
+    else if (key == ARROW_RIGHT || key == ARROW_DOWN)
+    {
+        editorFindStep(1);
+    }
+    else if (key == ARROW_LEFT || key == ARROW_UP)
+    {
+        editorFindStep(-1);
+    }
+}
+
+void editorFind()
+{
+    int saved_cx = V->cx;
+    int saved_cy = V->cy;
+    int saved_coloff = V->coloff;
+    int saved_rowoff = V->rowoff;
+
+    matchIndexClear(&B->match);
+    findOriginRow = V->cy;
+    findOriginCol = V->cx;
+    editorFindSetPrompt(NULL);
+
+    char *query = editorPrompt(findPrompt, editorFindCallback);
+    if (query)
+    {
+        free(query);
+    }
+    else
+    {
+        V->cx = saved_cx;
+        V->cy = saved_cy;
+        V->coloff = saved_coloff;
+        V->rowoff = saved_rowoff;
+    }
+}
+
+/*** replace ***/
+
+char replacePrompt[192];
+
+void editorReplaceSetPrompt(void)
+{
+    snprintf(replacePrompt, sizeof(replacePrompt), "Replace%s%s: %%s (ESC/Enter/C-t/C-r)",
+             findIcase ? " [i]" : "", findRegex ? " [re]" : "");
+}
+
+void editorReplaceCallback(char *query, int key)
+{
+    (void)query;
+    if (key == CTRL_KEY('t')) { findIcase = !findIcase; }
+    else if (key == CTRL_KEY('r')) { findRegex = !findRegex; }
+    else { return; }
+    editorReplaceSetPrompt();
+}
+
+char *editorReplaceBuild(erow *row, struct searchPattern *p, int from,
+                         const char *with, int withlen, int limit,
+                         char **buf, int *cap, int *size, int *count)
+{
+    /*
+     * Returns a copy of `row` with up to `limit` matches at or after
+     * `from` replaced (all of them when limit is -1), or NULL when
+     * nothing matched. `buf` is scratch space owned by the caller.
+     */
+    int len;
+    int m = searchFind(p, row->chars, row->size, from, &len);
+    if (m == -1) { return NULL; }
+
+    int n = 0;
+    int last = 0;
+    *count = 0;
+    while (m != -1 && (limit == -1 || *count < limit))
+    {
+        int need = n + (m - last) + withlen + (row->size - m);
+        if (need + 1 > *cap)
+        {
+            *cap = (need + 1) * 2;
+            *buf = realloc(*buf, *cap);
+        }
+        memcpy(&(*buf)[n], &row->chars[last], m - last);
+        n += m - last;
+        memcpy(&(*buf)[n], with, withlen);
+        n += withlen;
+        last = m + len;
+        (*count)++;
+        m = searchFind(p, row->chars, row->size, last, &len);
+    }
+    memcpy(&(*buf)[n], &row->chars[last], row->size - last);
+    n += row->size - last;
+
+    *size = n;
+    return textNew(*buf, n);
+}
+
+void editorReplaceRow(int at, char *chars, int size)
+{
+    erow *row = &B->row[at];
+    editorRowThaw(row);
+    editorUndoRecordRow(at, row->chars, row->size);
+    row->chars = chars;
+    row->size = size;
+    editorUpdateRow(row);
+}
+
+struct replaceEdit {
+    int at;
+    char *chars;
+    int size;
+};
+
+struct replaceSlice {
+    int lo; // rows [lo, hi)
+    int hi;
+    struct replaceEdit *e;
+    int count;
+    int cap;
+    int matches;
+    char *buf;
+    int bufcap;
+};
+
+struct replaceJob {
+    struct searchPattern *p;
+    const char *with;
+    int withlen;
+    int row;
+    int col;
+    struct replaceSlice slices[WORKER_POOL_MAX * 2];
+};
+
+void editorReplaceSlice(void *arg, int task, int slot)
+{
+    struct replaceJob *job = arg;
+    struct replaceSlice *s = &job->slices[task];
+    struct searchPattern *p = searchPatternFor(job->p, slot);
+
+    s->count = 0;
+    s->matches = 0;
+    for (int at = s->lo; at < s->hi; at++)
+    {
+        int size, count;
+        erow row = B->row[at];
+        row.chars = (char *)editorRowText(&B->row[at], slot);
+        char *chars = editorReplaceBuild(&row, p, at == job->row ? job->col : 0,
+                                         job->with, job->withlen, -1,
+                                         &s->buf, &s->bufcap, &size, &count);
+        if (chars == NULL) { continue; }
+
+        if (s->count == s->cap)
+        {
+            s->cap = s->cap ? s->cap * 2 : 64;
+            s->e = realloc(s->e, sizeof(struct replaceEdit) * s->cap);
+        }
+        s->e[s->count].at = at;
+        s->e[s->count].chars = chars;
+        s->e[s->count].size = size;
+        s->count++;
+        s->matches += count;
+    }
+}
+
+int editorReplaceRows(struct searchPattern *p, const char *with, int withlen,
+                      int row, int col)
+{
+    /*
+     * Replaces every match from (row, col) to the end of the buffer as one
+     * pass. The worker pool finds the matches and builds the new rows;
+     * each affected row is then swapped in, re-rendered and re-highlighted
+     * once, and saved as one hunk of the current undo step.
+     */
+    struct matchIndex *mi = &B->match;
+    int indexed = mi->active;
+    if (indexed) { matchIndexReset(mi); }
+
+    struct replaceJob job;
+    memset(&job, 0, sizeof(job));
+    job.p = p;
+    job.with = with;
+    job.withlen = withlen;
+    job.row = row;
+    job.col = col;
+
+    int slots = workerPoolSize();
+    searchPrepareClones(p, slots);
+
+    int total = 0;
+    int at = row;
+    while (at < B->numRows)
+    {
+        int n = 0;
+        while (n < slots * 2 && at < B->numRows)
+        {
+            struct replaceSlice *s = &job.slices[n++];
+            int bytes = 0;
+            s->lo = at;
+            while (at < B->numRows && at - s->lo < SEARCH_SLICE_ROWS && bytes < SEARCH_SLICE_BYTES)
+            {
+                bytes += B->row[at].size;
+                at++;
+            }
+            s->hi = at;
+        }
+
+        workerPoolRun(editorReplaceSlice, &job, n);
+
+        for (int i = 0; i < n; i++)
+        {
+            struct replaceSlice *s = &job.slices[i];
+            for (int k = 0; k < s->count; k++)
+            {
+                editorReplaceRow(s->e[k].at, s->e[k].chars, s->e[k].size);
+            }
+            total += s->matches;
+        }
+        editorColdCheck();
+    }
+
+    for (int i = 0; i < slots * 2; i++)
+    {
+        free(job.slices[i].e);
+        free(job.slices[i].buf);
+    }
+
+    if (indexed) { matchIndexResume(mi); }
+    if (total > 0) { B->dirty++; }
+    return total;
+}
+
+void editorReplace(int all)
+{
+    /*
+     * Query-replace from the cursor to the end of the buffer, or with
+     * `all` set a replace-all over the whole buffer. Either way the whole
+     * run is one undo step.
+     */
+    editorReplaceSetPrompt();
+    char *query = editorPrompt(replacePrompt, editorReplaceCallback);
+    if (query == NULL) { return; }
+
+    struct searchPattern p;
+    const char *err = NULL;
+    if (findRegex) { err = searchCompileRegex(&p, query, findIcase); }
+    else { searchCompile(&p, query, findIcase); }
+    if (err)
+    {
+        editorSetStatusMessage("Bad regex: %s", err);
+        free(query);
+        return;
+    }
+
+    char *with = editorPromptEmpty("Replace with: %s", NULL);
+    if (with == NULL)
+    {
+        searchFree(&p);
+        free(query);
+        return;
+    }
+    int withlen = strlen(with);
+
+    editorUndoBegin(UNDO_OTHER);
+
+    int replaced = 0;
+    if (all)
+    {
+        replaced = editorReplaceRows(&p, with, withlen, 0, 0);
+    }
+    else
+    {
+        // NOTE: the match index highlights every occurrence while asking.
+        matchIndexStart(&B->match, query, findIcase, findRegex, 0);
+
+        int row = V->cy;
+        int col = V->cx;
+        while (1)
+        {
+            int match_row, match_col, match_len;
+            if (!editorSearchRows(&p, row, col, 1, &match_row, &match_col, &match_len) ||
+                match_row < row || (match_row == row && match_col < col))
+            {
+                break;
+            }
+
+            editorFindJump(match_row, match_col, match_len);
+            editorSetStatusMessage("Replace? (y/n/!/q)");
+            editorRefreshScreen();
+
+            int c = editorReadKey();
+            if (c == 'y' || c == ' ')
+            {
+                int size, count;
+                char *buf = NULL;
+                int cap = 0;
+                // NOTE: a replayed macro skips the redraw that would thaw it.
+                editorRowThaw(&B->row[match_row]);
+                char *chars = editorReplaceBuild(&B->row[match_row], &p, match_col,
+                                                 with, withlen, 1, &buf, &cap,
+                                                 &size, &count);
+                free(buf);
+                editorReplaceRow(match_row, chars, size);
+                B->dirty++;
+                replaced++;
+                row = match_row;
+                col = match_col + withlen;
+            }
+            else if (c == 'n' || c == DEL_KEY || c == BACKSPACE)
+            {
+                row = match_row;
+                col = match_col + match_len;
+            }
+            else if (c == '!')
+            {
+                replaced += editorReplaceRows(&p, with, withlen, match_row, match_col);
+                break;
+            }
+            else
+            {
+                break;
+            }
+        }
+        matchIndexClear(&B->match);
+    }
+
+    editorSetStatusMessage("Replaced %d occurrence%s", replaced, replaced == 1 ? "" : "s");
+    searchFree(&p);
+    free(with);
+    free(query);
+}
+
+/*** undo/redo ***/
+
+/*
+ * Every edit saves the rows it is about to replace as a hunk. Undoing a
+ * hunk swaps those rows back in and leaves the inverse hunk on the other
+ * stack, so redo is the same operation run the other way.
+ */
+
+void editorUndoFreeHunk(struct undoHunk *h)
+{
+    for (int i = 0; i < h->nold; i++) { textFree(h->old[i].chars); }
+    free(h->old);
+}
+
+void editorUndoStackClear(struct undoStack *s)
+{
+    for (int i = 0; i < s->count; i++) { editorUndoFreeHunk(&s->h[i]); }
+    s->count = 0;
+}
+
+struct undoHunk *editorUndoPush(struct undoStack *s)
+{
+    if (s->count == s->cap)
+    {
+        s->cap = s->cap ? s->cap * 2 : 64;
+        s->h = realloc(s->h, sizeof(struct undoHunk) * s->cap);
+    }
+    return &s->h[s->count++];
+}
+
+void editorUndoClear(void)
+{
+    editorUndoStackClear(&B->undo);
+    editorUndoStackClear(&B->redo);
+    B->undoKind = UNDO_NONE;
+}
+
+void editorUndoSeal(void)
+{
+    B->undoKind = UNDO_NONE;
+}
+
+void editorUndoBegin(int kind)
+{
+    /*
+     * Starts a new undo step unless this edit continues a run of the
+     * same kind of edit from the previous keypress.
+     */
+    // NOTE: a macro replay is undone as a whole.
+    if (!E.macro.playing &&
+        (kind == UNDO_OTHER || kind != B->undoKind ||
+         E.keypresses > B->undoKeypress + 1))
+    {
+        B->undoGroup++;
+    }
+    B->undoKind = kind;
+    B->undoKeypress = E.keypresses;
+    editorUndoStackClear(&B->redo);
+}
+
+struct undoHunk *editorUndoCovering(int at, int nold)
+{
+    // NOTE: an edit inside rows the current step already saved needs no
+    // snapshot of its own.
+    if (B->undo.count == 0) { return NULL; }
+    struct undoHunk *h = &B->undo.h[B->undo.count - 1];
+    if (h->group != B->undoGroup) { return NULL; }
+    if (at < h->at || at + nold > h->at + h->nnew) { return NULL; }
+    return h;
+}
+
+struct undoHunk *editorUndoNewHunk(int at, int nold, int nnew)
+{
+    struct undoHunk *h = editorUndoPush(&B->undo);
+    h->group = B->undoGroup;
+    h->at = at;
+    h->nold = nold;
+    h->old = nold ? malloc(sizeof(struct undoLine) * nold) : NULL;
+    h->nnew = nnew;
+    h->cx = V->cx;
+    h->cy = V->cy;
+    return h;
+}
+
+void editorUndoRecord(int at, int nold, int nnew)
+{
+    /*
+     * Called before rows [at, at + nold) are replaced by nnew rows.
+     */
+    struct undoHunk *h = editorUndoCovering(at, nold);
+    if (h)
+    {
+        h->nnew += nnew - nold;
+        return;
+    }
+
+    h = editorUndoNewHunk(at, nold, nnew);
+    for (int i = 0; i < nold; i++)
+    {
+        erow *row = &B->row[at + i];
+        h->old[i].chars = editorRowTextRef(row);
+        h->old[i].size = row->size;
+    }
+}
+
+void editorUndoRecordRow(int at, char *chars, int size)
+{
+    /*
+     * Like editorUndoRecord for a single rewritten row, but takes over the
+     * row's old buffer instead of copying it.
+     */
+    if (editorUndoCovering(at, 1))
+    {
+        textFree(chars);
+        return;
+    }
+
+    struct undoHunk *h = editorUndoNewHunk(at, 1, 1);
+    h->old[0].chars = chars;
+    h->old[0].size = size;
+}
+
+void editorUndoApply(struct undoStack *from, struct undoStack *to)
+{
+    /*
+     * Reverts the newest step on `from`, one hunk at a time from the
+     * newest, pushing the inverse of each hunk onto `to`.
+     */
+    struct matchIndex *mi = &B->match;
+    int group = from->h[from->count - 1].group;
+
+    // NOTE: a step can touch thousands of rows; rescanning them in one go
+    // beats splicing the match index row by row.
+    int indexed = mi->active;
+    if (indexed) { matchIndexReset(mi); }
+
+    while (from->count > 0 && from->h[from->count - 1].group == group)
+    {
+        struct undoHunk h = from->h[--from->count];
+
+        struct undoHunk *inv = editorUndoPush(to);
+        inv->group = group;
+        inv->at = h.at;
+        inv->nold = h.nnew;
+        inv->old = h.nnew ? malloc(sizeof(struct undoLine) * h.nnew) : NULL;
+        inv->nnew = h.nold;
+        inv->cx = V->cx;
+        inv->cy = V->cy;
+
+        editorRowsThaw(h.at, h.nnew);
+        for (int i = 0; i < h.nnew; i++)
+        {
+            erow *row = &B->row[h.at + i];
+            inv->old[i].chars = row->chars;
+            inv->old[i].size = row->size;
+            row->chars = NULL;
+        }
+
+        int shared = h.nold < h.nnew ? h.nold : h.nnew;
+        for (int i = 0; i < shared; i++)
+        {
+            erow *row = &B->row[h.at + i];
+            row->chars = h.old[i].chars;
+            row->size = h.old[i].size;
+            editorUpdateRow(row);
+        }
+        if (h.nnew > shared) { editorDelRows(h.at + shared, h.nnew - shared); }
+        if (h.nold > shared)
+        {
+            char **texts = malloc(sizeof(char *) * (h.nold - shared));
+            int *sizes = malloc(sizeof(int) * (h.nold - shared));
+            for (int i = shared; i < h.nold; i++)
+            {
+                texts[i - shared] = h.old[i].chars;
+                sizes[i - shared] = h.old[i].size;
+            }
+            editorInsertRows(h.at + shared, texts, sizes, h.nold - shared);
+            free(texts);
+            free(sizes);
+        }
+        free(h.old);
+
+        V->cx = h.cx;
+        V->cy = h.cy;
+    }
+
+    if (V->cy > B->numRows) { V->cy = B->numRows; }
+    if (V->cy < B->numRows && V->cx > B->row[V->cy].size) { V->cx = B->row[V->cy].size; }
+    if (V->cy == B->numRows) { V->cx = 0; }
+
+    if (indexed) { matchIndexResume(mi); }
+    editorUndoSeal();
+    B->dirty++;
+}
+
+void editorUndo(void)
+{
+    if (B->undo.count == 0)
+    {
+        editorSetStatusMessage("Nothing to undo");
+        return;
+    }
+    editorUndoApply(&B->undo, &B->redo);
+}
+
+void editorRedo(void)
+{
+    if (B->redo.count == 0)
+    {
+        editorSetStatusMessage("Nothing to redo");
+        return;
+    }
+    editorUndoApply(&B->redo, &B->undo);
+}
+
+
+/*
+ * Escape sequences, CSI (ESC [) and SS3 (ESC O) alike, are read whole:
+ * an optional number, optional ";modifier", then a final byte, which
+ * are looked up in keyTable. xterm encodes the modifier as 1 + a mask
+ * of shift (1), alt (2) and ctrl (4).
+ */
+
+struct keySeq {
+    char intro; // '[' or 'O'
+    char final;
+    int num; // leading parameter, only for '~' sequences
+    int key;
+};
+
+const struct keySeq keyTable[] = {
+    { '[', 'A', 0, ARROW_UP },
+    { '[', 'B', 0, ARROW_DOWN },
+    { '[', 'C', 0, ARROW_RIGHT },
+    { '[', 'D', 0, ARROW_LEFT },
+    { '[', 'H', 0, HOME_KEY },
+    { '[', 'F', 0, END_KEY },
+    { '[', '~', 1, HOME_KEY },
+    { '[', '~', 3, DEL_KEY },
+    { '[', '~', 4, END_KEY },
+    { '[', '~', 5, PAGE_UP },
+    { '[', '~', 6, PAGE_DOWN },
+    { '[', '~', 7, HOME_KEY },
+    { '[', '~', 8, END_KEY },
+    { 'O', 'A', 0, ARROW_UP },
+    { 'O', 'B', 0, ARROW_DOWN },
+    { 'O', 'C', 0, ARROW_RIGHT },
+    { 'O', 'D', 0, ARROW_LEFT },
+    { 'O', 'H', 0, HOME_KEY },
+    { 'O', 'F', 0, END_KEY },
+};
+
+int editorDecodeEscape(void)
+{
+    /*
+     * Called after an ESC. A lone ESC is told apart from the start of a
+     * sequence by nothing following within escTimeout.
+     */
+    int next = editorPeekByte(E.escTimeout);
+    if (next == -1 || next == '\x1b') { return '\x1b'; }
+    if (next != '[' && next != 'O')
+    {
+        // NOTE: ESC followed by a printable byte is how terminals send alt.
+        if (next < 0x20 || next > 0x7e) { return '\x1b'; }
+        input.head++;
+        return next | KEY_ALT;
+    }
+    char intro = next;
+    input.head++;
+
+    int params[2] = {0, 0};
+    int nparams = 0;
+    int digits = 0;
+    char c;
+    while (1)
+    {
+        if (!editorReadByte(&c, E.escTimeout)) { return '\x1b'; }
+        if (c >= '0' && c <= '9')
+        {
+            if (nparams < 2) { params[nparams] = params[nparams] * 10 + (c - '0'); }
+            digits = 1;
+        }
+        else if (c == ';')
+        {
+            nparams++;
+            digits = 0;
+        }
+        else if (c >= 0x40 && c <= 0x7e) { break; }
+        else if (c < 0x20 || c > 0x3f) { return UNKNOWN_KEY; }
+    }
+    if (digits) { nparams++; }
+
+    int num = (c == '~') ? params[0] : 0;
+    int mod = (nparams == 2) ? params[1] - 1 : 0;
+    // NOTE: some terminals send the modifier without the "1;" (SS3 5A).
+    if (c != '~' && nparams == 1) { mod = params[0] - 1; }
+
+    for (unsigned int k = 0; k < sizeof(keyTable) / sizeof(keyTable[0]); k++)
+    {
+        const struct keySeq *s = &keyTable[k];
+        if (s->intro == intro && s->final == c && s->num == num)
+        {
+            int key = s->key;
+            if (mod > 0)
+            {
+                if (mod & 1) { key |= KEY_SHIFT; }
+                if (mod & 2) { key |= KEY_ALT; }
+                if (mod & 4) { key |= KEY_CTRL; }
+            }
+            return key;
+        }
+    }
+    return UNKNOWN_KEY;
+}
+
+int editorReadTerminalKey()
+{
+    char c;
+    do { editorWaitInput(); } while (!editorReadByte(&c, 0));
+
+    if (c == '\x1b') { return editorDecodeEscape(); }
+
+    // NOTE: keep bytes >= 0x80 positive so utf-8 input isn't
+    // mistaken for a special key.
+    return (unsigned char)c;
+}
+
+int editorReadKey()
+{
+    /*
+     * Keys come from the macro being replayed if there is one. Keys
+     * typed while recording are kept, prompts included.
+     */
+    struct keyMacro *km = &E.macro;
+    if (km->playing)
+    {
+        // NOTE: a macro ending inside a prompt cancels it.
+        return km->pos < km->count ? km->keys[km->pos++] : '\x1b';
+    }
+
+    // NOTE: background workers only get the buffer while we wait on input.
+    editorUnlock();
+    int c = editorReadTerminalKey();
+    profKey();
+    editorLock();
+
+    if (km->recording)
+    {
+        if (km->count == km->cap)
+        {
+            km->cap = km->cap ? km->cap * 2 : 64;
+            km->keys = realloc(km->keys, sizeof(int) * km->cap);
+        }
+        km->keys[km->count++] = c;
+    }
+    return c;
+}
+
+/*** cursors ***/
+
+/*
+ * Extra cursors live in V->cursors, sorted by (cy, cx), next to the main
+ * one in V->cx/V->cy. An edit gathers all of them into one sorted list and
+ * rebuilds each touched row in a single pass, so a row is re-rendered
+ * and re-highlighted once per keystroke however many cursors it holds.
+ * Cursor columns come out of that same pass.
+ */
+
+int editorCursorCmp(const void *a, const void *b)
+{
+    const struct editorCursor *x = a, *y = b;
+    if (x->cy != y->cy) { return x->cy < y->cy ? -1 : 1; }
+    return (x->cx > y->cx) - (x->cx < y->cx);
+}
+
+void editorCursorsClear(void)
+{
+    V->cursors.count = 0;
+}
+
+void editorCursorsAdd(int cy, int cx, int px)
+{
+    struct cursorSet *cs = &V->cursors;
+    if (cs->count == cs->cap)
+    {
+        cs->cap = cs->cap ? cs->cap * 2 : 16;
+        cs->c = realloc(cs->c, sizeof(struct editorCursor) * cs->cap);
+    }
+    struct editorCursor *c = &cs->c[cs->count++];
+    c->cx = cx;
+    c->cy = cy;
+    c->px = px;
+    c->primary = 0;
+}
+
+void editorCursorsNormalize(void)
+{
+    /*
+     * Clamps extra cursors to the buffer, sorts them, and drops any that
+     * landed on another cursor.
+     */
+    struct cursorSet *cs = &V->cursors;
+    if (cs->count == 0) { return; }
+
+    for (int i = 0; i < cs->count; i++)
+    {
+        struct editorCursor *c = &cs->c[i];
+        if (c->cy >= B->numRows) { c->cy = B->numRows - 1; }
+        if (c->cy < 0) { c->cy = 0; }
+        int size = B->numRows ? B->row[c->cy].size : 0;
+        if (c->cx > size) { c->cx = size; }
+    }
+    qsort(cs->c, cs->count, sizeof(struct editorCursor), editorCursorCmp);
+
+    int n = 0;
+    for (int i = 0; i < cs->count; i++)
+    {
+        struct editorCursor *c = &cs->c[i];
+        if (c->cy == V->cy && c->cx == V->cx) { continue; }
+        if (n > 0 && c->cy == cs->c[n - 1].cy && c->cx == cs->c[n - 1].cx) { continue; }
+        cs->c[n++] = *c;
+    }
+    cs->count = n;
+}
+
+struct editorCursor *editorCursorsGather(int *n)
+{
+    // NOTE: every cursor, main one included, sorted; owned by the caller.
+    struct cursorSet *cs = &V->cursors;
+    struct editorCursor *all = malloc(sizeof(struct editorCursor) * (cs->count + 1));
+    memcpy(all, cs->c, sizeof(struct editorCursor) * cs->count);
+    all[cs->count].cx = V->cx;
+    all[cs->count].cy = V->cy;
+    all[cs->count].px = V->px;
+    all[cs->count].primary = 1;
+    *n = cs->count + 1;
+    qsort(all, *n, sizeof(struct editorCursor), editorCursorCmp);
+    return all;
+}
+
+void editorCursorsScatter(struct editorCursor *all, int n)
+{
+    struct cursorSet *cs = &V->cursors;
+    cs->count = 0;
+    for (int i = 0; i < n; i++)
+    {
+        if (all[i].primary)
+        {
+            V->cx = all[i].cx;
+            V->cy = all[i].cy;
+            V->px = all[i].px;
+        }
+        else { editorCursorsAdd(all[i].cy, all[i].cx, all[i].px); }
+    }
+    free(all);
+    editorCursorsNormalize();
+}
+
+void editorCursorsMove(int key)
+{
+    // NOTE: each extra cursor is moved as if it were the main one, with
+    // the view left where the main cursor put it.
+    editorMoveCursor(key);
+
+    int cx = V->cx, cy = V->cy, px = V->px;
+    int rowoff = V->rowoff, coloff = V->coloff;
+    for (int i = 0; i < V->cursors.count; i++)
+    {
+        struct editorCursor *c = &V->cursors.c[i];
+        V->cx = c->cx;
+        V->cy = c->cy;
+        V->px = c->px;
+        editorMoveCursor(key);
+        c->cx = V->cx;
+        c->cy = V->cy;
+        c->px = V->px;
+    }
+    V->cx = cx;
+    V->cy = cy;
+    V->px = px;
+    V->rowoff = rowoff;
+    V->coloff = coloff;
+    editorCursorsNormalize();
+}
+
+void editorCursorsSetRow(erow *row, char *chars, int size)
+{
+    textFree(row->chars);
+    row->chars = chars;
+    row->size = size;
+    editorUpdateRow(row);
+    B->dirty++;
+}
+
+void editorCursorsInsert(int c)
+{
+    int n;
+    struct editorCursor *all = editorCursorsGather(&n);
+
+    editorUndoBegin(UNDO_INSERT);
+    if (all[n - 1].cy == B->numRows)
+    {
+        editorUndoRecord(B->numRows, 0, 1);
+        editorInsertRow(B->numRows, "", 0);
+    }
+
+    int i = 0;
+    while (i < n)
+    {
+        int r = all[i].cy;
+        int j = i;
+        while (j < n && all[j].cy == r) { j++; }
+
+        erow *row = &B->row[r];
+        editorUndoRecord(r, 1, 1);
+        char *chars = textAlloc(row->size + (j - i) + 1);
+        int from = 0, out = 0;
+        for (int k = i; k < j; k++)
+        {
+            int at = all[k].cx;
+            memcpy(&chars[out], &row->chars[from], at - from);
+            out += at - from;
+            chars[out++] = c;
+            from = at;
+            all[k].cx = out;
+        }
+        memcpy(&chars[out], &row->chars[from], row->size - from);
+        out += row->size - from;
+        chars[out] = '\0';
+        editorCursorsSetRow(row, chars, out);
+        i = j;
+    }
+    editorCursorsScatter(all, n);
+}
+
+void editorCursorsDelete(int forward)
+{
+    /*
+     * Deletes the character before (or after) every cursor. Cursors at
+     * the start (or end) of their row don't join rows.
+     */
+    int n;
+    struct editorCursor *all = editorCursorsGather(&n);
+
+    editorUndoBegin(UNDO_DELETE);
+    int i = 0;
+    while (i < n)
+    {
+        int r = all[i].cy;
+        int j = i;
+        while (j < n && all[j].cy == r) { j++; }
+        if (r >= B->numRows) { i = j; continue; }
+
+        erow *row = &B->row[r];
+        int changed = 0;
+        for (int k = i; k < j && !changed; k++)
+        {
+            changed = forward ? all[k].cx < row->size : all[k].cx > 0;
+        }
+        if (!changed) { i = j; continue; }
+
+        editorUndoRecord(r, 1, 1);
+        char *chars = textAlloc(row->size + 1);
+        int from = 0, out = 0;
+        for (int k = i; k < j; k++)
+        {
+            int at = all[k].cx;
+            int lo = forward ? at : editorRowPrevChar(row, at);
+            int hi = forward ? editorRowNextChar(row, at) : at;
+            memcpy(&chars[out], &row->chars[from], lo - from);
+            out += lo - from;
+            from = hi;
+            all[k].cx = out;
+        }
+        memcpy(&chars[out], &row->chars[from], row->size - from);
+        out += row->size - from;
+        chars[out] = '\0';
+        editorCursorsSetRow(row, chars, out);
+        i = j;
+    }
+    editorCursorsScatter(all, n);
+}
+
+void editorCursorsNewline(void)
+{
+    // NOTE: rows split earlier push the later cursors down; `cut` is
+    // where the current row was last split.
+    int n;
+    struct editorCursor *all = editorCursorsGather(&n);
+
+    editorUndoBegin(UNDO_INSERT);
+    int shift = 0;
+    int prev = -1, cut = 0;
+    for (int i = 0; i < n; i++)
+    {
+        if (all[i].cy != prev)
+        {
+            prev = all[i].cy;
+            cut = 0;
+        }
+        int r = all[i].cy + shift;
+        int at = all[i].cx - cut;
+        if (r >= B->numRows)
+        {
+            editorUndoRecord(r, 0, 1);
+            editorInsertRow(r, "", 0);
+        }
+        else
+        {
+            editorUndoRecord(r, 1, 2);
+            erow *row = &B->row[r];
+            editorInsertRow(r + 1, &row->chars[at], row->size - at);
+            row = &B->row[r];
+            row->size = at;
+            row->chars = textReserve(row->chars, at, at + 1);
+            row->chars[at] = '\0';
+            editorUpdateRow(row);
+        }
+        shift++;
+        cut = all[i].cx;
+        all[i].cy = r + 1;
+        all[i].cx = 0;
+        all[i].px = 0;
+    }
+    editorUndoSeal();
+    editorCursorsScatter(all, n);
+}
+
+void editorCursorsAddVertical(int dir)
+{
+    // NOTE: a new cursor one row past the furthest in `dir`, at the main
+    // cursor's display column.
+    int cy = V->cy;
+    if (V->cursors.count)
+    {
+        int edge = dir > 0 ? V->cursors.c[V->cursors.count - 1].cy : V->cursors.c[0].cy;
+        if ((dir > 0 && edge > cy) || (dir < 0 && edge < cy)) { cy = edge; }
+    }
+    cy += dir;
+    if (cy < 0 || cy >= B->numRows) { return; }
+    editorCursorsAdd(cy, editorRowRxToCx(&B->row[cy], V->px), V->px);
+    editorCursorsNormalize();
+}
+
+void editorCursorsOnLines(int lines)
+{
+    // NOTE: cursors on the `lines` rows below the main one, same column.
+    for (int i = 1; i <= lines && V->cy + i < B->numRows; i++)
+    {
+        erow *row = &B->row[V->cy + i];
+        editorCursorsAdd(V->cy + i, editorRowRxToCx(row, V->px), V->px);
+    }
+    editorCursorsNormalize();
+    editorSetStatusMessage("%d cursors", V->cursors.count + 1);
+}
+
+void editorCursorsLinesPrompt(void)
+{
+    // NOTE: with a region selected, a cursor goes on each of its lines.
+    int sy, sx, ey, ex;
+    if (editorSelection(&sy, &sx, &ey, &ex))
+    {
+        editorMarkClear();
+        V->cy = sy;
+        V->cx = editorRowRxToCx(&B->row[sy], V->px);
+        editorCursorsOnLines(ey - sy);
+        return;
+    }
+    char *answer = editorPrompt("Add cursors on the next %s lines", NULL);
+    if (answer == NULL) { return; }
+    int lines = atoi(answer);
+    free(answer);
+    if (lines > 0) { editorCursorsOnLines(lines); }
+}
+
+int editorIsWordChar(int c)
+{
+    return isalnum(c) || c == '_' || c >= 0x80;
+}
+
+void editorCursorsNextMatch(void)
+{
+    /*
+     * Adds a cursor at the end of the next match after the last cursor:
+     * the active search if there is one, else the word under the main
+     * cursor, which the first use moves to the end of.
+     */
+    if (V->cy >= B->numRows) { return; }
+
+    struct searchPattern word;
+    struct searchPattern *p = &B->match.pat;
+    int own = 0;
+    if (!B->match.active || B->match.pat.len == 0)
+    {
+        erow *row = &B->row[V->cy];
+        int lo = V->cx, hi = V->cx;
+        while (lo > 0 && editorIsWordChar((unsigned char)row->chars[lo - 1])) { lo--; }
+        while (hi < row->size && editorIsWordChar((unsigned char)row->chars[hi])) { hi++; }
+        if (lo == hi)
+        {
+            editorSetStatusMessage("No word under the cursor");
+            return;
+        }
+
+        char *needle = strndup(&row->chars[lo], hi - lo);
+        searchCompile(&word, needle, 0);
+        free(needle);
+        p = &word;
+        own = 1;
+        if (V->cursors.count == 0) { V->cx = hi; }
+    }
+
+    struct editorCursor *last = &(struct editorCursor){ V->cx, V->cy, V->px, 1 };
+    if (V->cursors.count && editorCursorCmp(&V->cursors.c[V->cursors.count - 1], last) > 0)
+    {
+        last = &V->cursors.c[V->cursors.count - 1];
+    }
+
+    int row, col, len;
+    int found = editorSearchRows(p, last->cy, last->cx, 1, &row, &col, &len);
+    if (own) { searchFree(&word); }
+
+    int before = V->cursors.count;
+    if (found)
+    {
+        editorCursorsAdd(row, col + len, editorRowCxToRx(&B->row[row], col + len));
+        editorCursorsNormalize();
+    }
+    if (V->cursors.count == before)
+    {
+        editorSetStatusMessage("No more matches");
+        return;
+    }
+    editorSetStatusMessage("%d cursors", V->cursors.count + 1);
+}
+
+unsigned char *editorCursorsRowHighlight(int at, unsigned char *hl, int *eol)
+{
+    /*
+     * Returns `hl`, or a scratch copy of it with the extra cursors in row
+     * `at` marked. `eol` is set when one sits past the end of the row.
+     */
+    static unsigned char *buf = NULL;
+    static int bufcap = 0;
+
+    struct cursorSet *cs = &V->cursors;
+    *eol = 0;
+    if (cs->count == 0) { return hl; }
+
+    int lo = 0, hi = cs->count;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (cs->c[mid].cy < at) { lo = mid + 1; }
+        else { hi = mid; }
+    }
+    if (lo == cs->count || cs->c[lo].cy != at) { return hl; }
+
+    erow *row = &B->row[at];
+    if (row->rsize > bufcap)
+    {
+        bufcap = row->rsize * 2;
+        buf = realloc(buf, bufcap);
+    }
+    memcpy(buf, hl, row->rsize);
+
+    for (int i = lo; i < cs->count && cs->c[i].cy == at; i++)
+    {
+        if (cs->c[i].cx >= row->size) { *eol = 1; continue; }
+        buf[editorRowCxToRenderIdx(row, cs->c[i].cx)] = HL_CURSOR;
+    }
+    return buf;
+}
+
+/*** append buf ***/
+
+struct abuf {
+    char *b;
+    int len;
+};
+
+#define ABUF_INIT {NULL, 0}
+
+// NOTE: when set, frames are appended here instead of written out (bench).
+struct abuf *frameSink = NULL;
+
+void abAppend(struct abuf *ab, const char *s, int len)
+{
+    char *new = realloc(ab->b, ab->len + len);
+    prof.cur.reallocs++;
+
+    if (new == NULL)
+    {
+        return;
+    }
+    memcpy(&new[ab->len], s, len);
+    ab->b = new;
+    ab->len += len;
+}
+
+void abFree(struct abuf *ab)
+{
+    free(ab->b);
+}
+
+/*** selection ***/
+
+/*
+ * The mark is per view and the selection runs from it to the cursor.
+ * Cut and copy push onto a kill ring shared by all buffers. Whole rows
+ * in an entry share their text with the buffer (see textRef): copying
+ * a large region costs a pointer per row, and pasting it splices the
+ * rows in with one insert.
+ */
+
+#define KILL_RING_SIZE 16
+#define OSC52_MAX_BYTES (1 << 20) // terminals drop longer clipboard writes
+
+struct killEntry {
+    char **lines; // joined by newlines; shared with rows where whole
+    int *sizes;
+    int n;
+    long long bytes;
+};
+
+struct killRing {
+    struct killEntry e[KILL_RING_SIZE];
+    int head; // newest entry
+    int count;
+    int yank; // entry the last paste used
+    int yankKeypress; // keypress of the last paste, -1 if none
+    int sy, sx; // where the last paste went
+    int osc52; // also copy to the terminal's clipboard
+};
+
+struct killRing kills = { .yankKeypress = -1 };
+
+void editorMarkSet(void)
+{
+    V->markSet = 1;
+    V->my = V->cy;
+    V->mx = V->cx;
+}
+
+void editorMarkClear(void)
+{
+    V->markSet = 0;
+}
+
+int editorSelection(int *sy, int *sx, int *ey, int *ex)
+{
+    /*
+     * Orders the mark and the cursor. Returns 0 when there is no mark or
+     * nothing between them. A position past the last row is the end of
+     * the last row.
+     */
+    if (!V->markSet || B->numRows == 0) { return 0; }
+    int ay = V->my, ax = V->mx, by = V->cy, bx = V->cx;
+    if (ay > by || (ay == by && ax > bx))
+    {
+        int t = ay; ay = by; by = t;
+        t = ax; ax = bx; bx = t;
+    }
+    if (ay >= B->numRows) { ay = B->numRows - 1; ax = B->row[ay].size; }
+    if (by >= B->numRows) { by = B->numRows - 1; bx = B->row[by].size; }
+    if (ax > B->row[ay].size) { ax = B->row[ay].size; }
+    if (bx > B->row[by].size) { bx = B->row[by].size; }
+    *sy = ay; *sx = ax; *ey = by; *ex = bx;
+    return ay != by || ax != bx;
+}
+
+unsigned char *editorSelectionRowHighlight(int at, unsigned char *hl)
+{
+    // NOTE: returns `hl`, or a scratch copy with the selected part marked.
+    static unsigned char *buf = NULL;
+    static int bufcap = 0;
+
+    int sy, sx, ey, ex;
+    if (!editorSelection(&sy, &sx, &ey, &ex) || at < sy || at > ey) { return hl; }
+
+    erow *row = &B->row[at];
+    if (row->rsize == 0) { return hl; }
+    if (row->rsize > bufcap)
+    {
+        bufcap = row->rsize * 2;
+        buf = realloc(buf, bufcap);
+    }
+    memcpy(buf, hl, row->rsize);
+
+    int lo = (at == sy) ? editorRowCxToRenderIdx(row, sx) : 0;
+    int hi = (at == ey) ? editorRowCxToRenderIdx(row, ex) : row->rsize;
+    memset(&buf[lo], HL_SELECTION, hi - lo);
+    return buf;
+}
+
+void killEntryFree(struct killEntry *k)
+{
+    for (int i = 0; i < k->n; i++) { textFree(k->lines[i]); }
+    free(k->lines);
+    free(k->sizes);
+    memset(k, 0, sizeof(*k));
+}
+
+void editorOsc52(struct killEntry *k)
+{
+    /*
+     * Hands the text to the terminal's clipboard, which also works over
+     * ssh. Enabled with WEISS_OSC52.
+     */
+    static const char b64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    if (k->bytes > OSC52_MAX_BYTES) { return; }
+
+    struct abuf ab = ABUF_INIT;
+    abAppend(&ab, "\x1b]52;c;", 7);
+    unsigned char in[3];
+    int have = 0;
+    for (int i = 0; i < k->n; i++)
+    {
+        for (int j = 0; j <= k->sizes[i]; j++)
+        {
+            if (j == k->sizes[i] && i == k->n - 1) { break; }
+            in[have++] = (j == k->sizes[i]) ? '\n' : k->lines[i][j];
+            if (have < 3) { continue; }
+            char out[4] = { b64[in[0] >> 2], b64[((in[0] & 3) << 4) | (in[1] >> 4)],
+                            b64[((in[1] & 15) << 2) | (in[2] >> 6)], b64[in[2] & 63] };
+            abAppend(&ab, out, 4);
+            have = 0;
+        }
+    }
+    if (have)
+    {
+        if (have == 1) { in[1] = 0; }
+        char out[4] = { b64[in[0] >> 2], b64[((in[0] & 3) << 4) | (in[1] >> 4)],
+                        have == 2 ? b64[(in[1] & 15) << 2] : '=', '=' };
+        abAppend(&ab, out, 4);
+    }
+    abAppend(&ab, "\x07", 1);
+    if (!frameSink && !serverWrite(ab.b, ab.len)) { write(STDOUT_FILENO, ab.b, ab.len); }
+    abFree(&ab);
+}
+
+struct killEntry *editorKillPush(int sy, int sx, int ey, int ex)
+{
+    /*
+     * Copies the region onto the kill ring. A row wholly inside it is
+     * shared, not copied.
+     */
+    kills.head = (kills.head + 1) % KILL_RING_SIZE;
+    if (kills.count < KILL_RING_SIZE) { kills.count++; }
+    struct killEntry *k = &kills.e[kills.head];
+    killEntryFree(k);
+
+    k->n = ey - sy + 1;
+    k->lines = malloc(sizeof(char *) * k->n);
+    k->sizes = malloc(sizeof(int) * k->n);
+    for (int i = 0; i < k->n; i++)
+    {
+        erow *row = &B->row[sy + i];
+        int lo = (i == 0) ? sx : 0;
+        int hi = (i == k->n - 1) ? ex : row->size;
+        k->lines[i] = (lo == 0 && hi == row->size) ? editorRowTextRef(row)
+                                                   : textNew(editorRowText(row, -1) + lo, hi - lo);
+        k->sizes[i] = hi - lo;
+        k->bytes += hi - lo + 1;
+    }
+    k->bytes--;
+    if (kills.osc52) { editorOsc52(k); }
+    return k;
+}
+
+void editorDeleteRegion(int sy, int sx, int ey, int ex)
+{
+    // NOTE: one undo hunk; the rows in between go in one batch.
+    editorUndoRecord(sy, ey - sy + 1, 1);
+    editorRowThaw(&B->row[sy]);
+    editorRowThaw(&B->row[ey]);
+
+    erow *first = &B->row[sy];
+    if (sy == ey)
+    {
+        first->chars = textReserve(first->chars, first->size, first->size + 1);
+        memmove(&first->chars[sx], &first->chars[ex], first->size - ex + 1);
+        first->size -= ex - sx;
+    }
+    else
+    {
+        erow *last = &B->row[ey];
+        int tail = last->size - ex;
+        first->chars = textReserve(first->chars, sx, sx + tail + 1);
+        memcpy(&first->chars[sx], &last->chars[ex], tail);
+        first->size = sx + tail;
+        first->chars[first->size] = '\0';
+        editorDelRows(sy + 1, ey - sy);
+    }
+    editorUpdateRow(&B->row[sy]);
+    B->dirty++;
+
+    V->cy = sy;
+    V->cx = sx;
+}
+
+void editorPaste(struct killEntry *k)
+{
+    /*
+     * Inserts `k` at the cursor and leaves the cursor after it. The
+     * cursor's row is rebuilt once and the rows in between are spliced
+     * in as one batch, sharing the entry's text.
+     */
+    if (V->cy == B->numRows)
+    {
+        editorUndoRecord(B->numRows, 0, 1);
+        editorInsertRow(B->numRows, "", 0);
+    }
+    editorUndoRecord(V->cy, 1, k->n);
+
+    erow *row = &B->row[V->cy];
+    if (k->n == 1)
+    {
+        int len = k->sizes[0];
+        row->chars = textReserve(row->chars, row->size, row->size + len + 1);
+        memmove(&row->chars[V->cx + len], &row->chars[V->cx], row->size - V->cx + 1);
+        memcpy(&row->chars[V->cx], k->lines[0], len);
+        row->size += len;
+        editorUpdateRow(row);
+        V->cx += len;
+    }
+    else
+    {
+        int n = k->n - 1;
+        char **texts = malloc(sizeof(char *) * n);
+        int *sizes = malloc(sizeof(int) * n);
+        for (int i = 1; i < n; i++)
+        {
+            texts[i - 1] = textRef(k->lines[i]);
+            sizes[i - 1] = k->sizes[i];
+        }
+
+        // NOTE: the last line takes the rest of the cursor's row.
+        int tail = row->size - V->cx;
+        int lastlen = k->sizes[n];
+        if (tail == 0) { texts[n - 1] = textRef(k->lines[n]); }
+        else
+        {
+            texts[n - 1] = textAlloc(lastlen + tail + 1);
+            memcpy(texts[n - 1], k->lines[n], lastlen);
+            memcpy(&texts[n - 1][lastlen], &row->chars[V->cx], tail + 1);
+        }
+        sizes[n - 1] = lastlen + tail;
+
+        row->chars = textReserve(row->chars, V->cx, V->cx + k->sizes[0] + 1);
+        memcpy(&row->chars[V->cx], k->lines[0], k->sizes[0]);
+        row->size = V->cx + k->sizes[0];
+        row->chars[row->size] = '\0';
+
+        int at = V->cy;
+        editorInsertRows(at + 1, texts, sizes, n);
+        editorUpdateRow(&B->row[at]);
+        free(texts);
+        free(sizes);
+        V->cy = at + n;
+        V->cx = lastlen;
+    }
+    B->dirty++;
+}
+
+void editorCopy(int cut)
+{
+    int sy, sx, ey, ex;
+    if (!editorSelection(&sy, &sx, &ey, &ex))
+    {
+        editorSetStatusMessage(V->markSet ? "Nothing selected" : "No mark set (C-a)");
+        return;
+    }
+    struct killEntry *k = editorKillPush(sy, sx, ey, ex);
+    if (cut)
+    {
+        editorUndoBegin(UNDO_OTHER);
+        editorDeleteRegion(sy, sx, ey, ex);
+        editorUndoSeal();
+    }
+    editorMarkClear();
+    editorSetStatusMessage("%s %d line%s%s", cut ? "Cut" : "Copied", k->n, k->n == 1 ? "" : "s",
+                           kills.osc52 && k->bytes > OSC52_MAX_BYTES ? " (too big for the terminal clipboard)" : "");
+}
+
+void editorYank(void)
+{
+    if (kills.count == 0)
+    {
+        editorSetStatusMessage("Kill ring is empty");
+        return;
+    }
+    // NOTE: pasting over a selection replaces it, as one undo step.
+    editorCursorsClear();
+    editorUndoBegin(UNDO_OTHER);
+    int sy, sx, ey, ex;
+    if (editorSelection(&sy, &sx, &ey, &ex)) { editorDeleteRegion(sy, sx, ey, ex); }
+    editorMarkClear();
+
+    kills.yank = kills.head;
+    kills.sy = V->cy;
+    kills.sx = V->cx;
+    editorPaste(&kills.e[kills.yank]);
+    editorUndoSeal();
+    kills.yankKeypress = E.keypresses;
+}
+
+void editorYankPop(void)
+{
+    /*
+     * Right after a paste, swaps what was pasted for the next older
+     * entry of the kill ring.
+     */
+    if (kills.yankKeypress < 0 || kills.yankKeypress != E.keypresses - 1)
+    {
+        editorSetStatusMessage("Previous command was not a paste");
+        return;
+    }
+    editorUndoBegin(UNDO_OTHER);
+    editorDeleteRegion(kills.sy, kills.sx, V->cy, V->cx);
+    kills.yank = (kills.yank + KILL_RING_SIZE - 1) % KILL_RING_SIZE;
+    if (kills.e[kills.yank].lines == NULL) { kills.yank = kills.head; }
+    editorPaste(&kills.e[kills.yank]);
+    editorUndoSeal();
+    kills.yankKeypress = E.keypresses;
+    editorSetStatusMessage("Kill ring entry %d of %d",
+                           (kills.head - kills.yank + KILL_RING_SIZE) % KILL_RING_SIZE + 1, kills.count);
+}
+
+/*** line ops ***/
+
+/*
+ * Commands on whole lines: the lines of the selection, or the cursor's
+ * line. Each rewrites a line's text once, takes one undo snapshot of the
+ * range, and has editorUpdateRows highlight the range in a single pass.
+ */
+
+int editorLineRange(int *sy, int *ey)
+{
+    // NOTE: a selection ending at column 0 leaves that line out.
+    int sx, ex;
+    if (editorSelection(sy, &sx, ey, &ex))
+    {
+        if (ex == 0 && *ey > *sy) { (*ey)--; }
+    }
+    else
+    {
+        if (V->cy >= B->numRows) { return 0; }
+        *sy = *ey = V->cy;
+    }
+    // NOTE: with the lines either side, which a move swaps in.
+    editorRowsThaw(*sy - 1, *ey - *sy + 3);
+    return 1;
+}
+
+void editorLineShiftCursors(int y, int at, int delta)
+{
+    // NOTE: positions at or after `at` on line y follow `delta` bytes
+    // inserted (or removed, if negative) there.
+    if (V->cy == y && V->cx >= at) { V->cx = V->cx + delta < at ? at : V->cx + delta; }
+    if (V->markSet && V->my == y && V->mx >= at) { V->mx = V->mx + delta < at ? at : V->mx + delta; }
+    for (int i = 0; i < V->cursors.count; i++)
+    {
+        struct editorCursor *c = &V->cursors.c[i];
+        if (c->cy == y && c->cx >= at) { c->cx = c->cx + delta < at ? at : c->cx + delta; }
+    }
+}
+
+void editorLineSplice(int y, int at, int del, const char *ins, int inslen)
+{
+    // NOTE: leaves the row for editorUpdateRows.
+    erow *row = &B->row[y];
+    char *t = textAlloc(row->size - del + inslen + 1);
+    memcpy(t, row->chars, at);
+    memcpy(&t[at], ins, inslen);
+    memcpy(&t[at + inslen], &row->chars[at + del], row->size - at - del + 1);
+    textFree(row->chars);
+    row->chars = t;
+    row->size += inslen - del;
+    editorLineShiftCursors(y, at, inslen - del);
+}
+
+int editorLineIndentWidth(erow *row)
+{
+    int i = 0;
+    while (i < row->size && (row->chars[i] == ' ' || row->chars[i] == '\t')) { i++; }
+    return i;
+}
+
+void editorLinesIndent(int dir)
+{
+    /*
+     * Indents (dir > 0) or dedents the lines by one level. Blank lines
+     * aren't indented.
+     */
+    int sy, ey;
+    if (!editorLineRange(&sy, &ey)) { return; }
+
+    char indent[WEISS_TAB_STOP];
+    int indentSize = WEISS_TAB_AS_SPACES ? WEISS_TAB_STOP : 1;
+    memset(indent, WEISS_TAB_AS_SPACES ? ' ' : '\t', indentSize);
+
+    int changed = 0;
+    for (int y = sy; y <= ey; y++)
+    {
+        erow *row = &B->row[y];
+        int remove = 0;
+        if (dir < 0 && row->size && row->chars[0] == '\t') { remove = 1; }
+        else if (dir < 0)
+        {
+            while (remove < WEISS_TAB_STOP && remove < row->size && row->chars[remove] == ' ') { remove++; }
+        }
+        if (dir > 0 ? row->size == 0 : remove == 0) { continue; }
+
+        // NOTE: no undo step unless some line changes.
+        if (changed++ == 0)
+        {
+            editorUndoBegin(UNDO_OTHER);
+            editorUndoRecord(sy, ey - sy + 1, ey - sy + 1);
+        }
+        if (dir > 0) { editorLineSplice(y, 0, 0, indent, indentSize); }
+        else { editorLineSplice(y, 0, remove, "", 0); }
+    }
+    if (changed == 0) { return; }
+    editorUndoSeal();
+
+    editorUpdateRows(sy, ey - sy + 1);
+    B->dirty++;
+}
+
+void editorLinesComment(void)
+{
+    /*
+     * Comments the lines out at their shallowest indent, or uncomments
+     * them if every non-blank one already is.
+     */
+    if (B->syntax == NULL || B->syntax->singleline_comment_start == NULL)
+    {
+        editorSetStatusMessage("No line comments for this file type");
+        return;
+    }
+    int sy, ey;
+    if (!editorLineRange(&sy, &ey)) { return; }
+
+    char *scs = B->syntax->singleline_comment_start;
+    int scslen = strlen(scs);
+    int commented = 1;
+    int col = -1;
+    for (int y = sy; y <= ey; y++)
+    {
+        erow *row = &B->row[y];
+        int ind = editorLineIndentWidth(row);
+        if (ind == row->size) { continue; }
+        if (col < 0 || ind < col) { col = ind; }
+        if (row->size - ind < scslen || strncmp(&row->chars[ind], scs, scslen) != 0) { commented = 0; }
+    }
+    if (col < 0) { return; }
+
+    char prefix[16];
+    int prefixlen = snprintf(prefix, sizeof(prefix), "%s ", scs);
+
+    editorUndoBegin(UNDO_OTHER);
+    editorUndoRecord(sy, ey - sy + 1, ey - sy + 1);
+    for (int y = sy; y <= ey; y++)
+    {
+        erow *row = &B->row[y];
+        int ind = editorLineIndentWidth(row);
+        if (ind == row->size) { continue; }
+        if (commented)
+        {
+            int del = scslen;
+            if (ind + del < row->size && row->chars[ind + del] == ' ') { del++; }
+            editorLineSplice(y, ind, del, "", 0);
+        }
+        else { editorLineSplice(y, col, 0, prefix, prefixlen); }
+    }
+    editorUndoSeal();
+
+    editorUpdateRows(sy, ey - sy + 1);
+    B->dirty++;
+}
+
+void editorLinesDelete(void)
+{
+    int sy, ey;
+    if (!editorLineRange(&sy, &ey)) { return; }
+
+    editorUndoBegin(UNDO_OTHER);
+    editorUndoRecord(sy, ey - sy + 1, 0);
+    editorDelRows(sy, ey - sy + 1);
+    editorUndoSeal();
+    // NOTE: the line that moved up may have been inside a deleted comment.
+    if (sy < B->numRows) { editorUpdateRows(sy, 1); }
+
+    editorMarkClear();
+    editorCursorsClear();
+    V->cy = sy;
+    V->cx = 0;
+    B->dirty++;
+}
+
+void editorLinesDuplicate(void)
+{
+    // NOTE: the copies share their text with the originals.
+    int sy, ey;
+    if (!editorLineRange(&sy, &ey)) { return; }
+    int n = ey - sy + 1;
+
+    char **texts = malloc(sizeof(char *) * n);
+    int *sizes = malloc(sizeof(int) * n);
+    for (int i = 0; i < n; i++)
+    {
+        texts[i] = textRef(B->row[sy + i].chars);
+        sizes[i] = B->row[sy + i].size;
+    }
+
+    editorUndoBegin(UNDO_OTHER);
+    editorUndoRecord(ey + 1, 0, n);
+    editorInsertRows(ey + 1, texts, sizes, n);
+    editorUndoSeal();
+    free(texts);
+    free(sizes);
+
+    // NOTE: the cursor and selection move onto the copy.
+    editorCursorsClear();
+    V->cy += n;
+    if (V->markSet) { V->my += n; }
+}
+
+void editorLinesMove(int dir)
+{
+    /*
+     * Moves the lines up or down past their neighbour. Rows are moved
+     * whole, rendering and all; only the highlighting is redone.
+     */
+    int sy, ey;
+    if (!editorLineRange(&sy, &ey)) { return; }
+    if ((dir < 0 && sy == 0) || (dir > 0 && ey + 1 >= B->numRows)) { return; }
+
+    int n = ey - sy + 1;
+    int lo = dir < 0 ? sy - 1 : sy;
+    editorUndoBegin(UNDO_OTHER);
+    editorUndoRecord(lo, n + 1, n + 1);
+    editorUndoSeal();
+
+    erow other;
+    if (dir < 0)
+    {
+        other = B->row[sy - 1];
+        memmove(&B->row[sy - 1], &B->row[sy], sizeof(erow) * n);
+        B->row[ey] = other;
+    }
+    else
+    {
+        other = B->row[ey + 1];
+        memmove(&B->row[sy + 1], &B->row[sy], sizeof(erow) * n);
+        B->row[sy] = other;
+    }
+    for (int i = lo; i <= lo + n; i++) { B->row[i].idx = i; }
+    editorUpdateRows(lo, n + 1);
+
+    editorCursorsClear();
+    V->cy += dir;
+    if (V->markSet) { V->my += dir; }
+    B->dirty++;
+}
+
+/*** grep ***/
+
+/*
+ * Find in files. A set of threads shares one queue of directories and
+ * files below the working directory: directories are expanded through
+ * their .gitignore rules, files are mmap'ed and scanned with the
+ * buffer's matcher. Hits stream into a list the main thread shows in
+ * place of the buffer while the search runs.
+ */
+
+#define GREP_MAX_HITS 100000
+#define GREP_MAX_TEXT 256 // bytes of a hit's line kept for display
+#define GREP_BINARY_PROBE 8000 // a NUL in this prefix marks a binary file
+
+struct grepRule {
+    char *pat;
+    int negate;
+    int dironly;
+    int anchored; // matched against the path below base, not the name
+    int deep; // has a "**", so '*' may cross directories
+};
+
+struct grepIgnore {
+    struct grepIgnore *parent;
+    struct grepIgnore *next; // every node, freed with the search
+    char *base; // directory holding the .gitignore, "" for the root
+    struct grepRule *rules;
+    int count;
+};
+
+struct grepItem {
+    char *path;
+    int isdir;
+    struct grepIgnore *ig;
+};
+
+struct grepHit {
+    char *path;
+    int line;
+    int col;
+    char *text;
+};
+
+struct grepState {
+    pthread_mutex_t mu;
+    pthread_cond_t cv;
+    pthread_t threads[WORKER_POOL_MAX];
+    int nthreads;
+    int cancel;
+    int finished;
+    struct searchPattern pat;
+    struct grepItem *queue; // used as a stack, depth first keeps it short
+    int qcount;
+    int qcap;
+    int busy; // threads working on an item
+    int rootfd; // item paths are relative to it, not to the cwd
+    char *root;
+    struct grepIgnore *ignores;
+    struct grepHit *hits;
+    int count;
+    int cap;
+    int files;
+    int truncated;
+    int visible; // results replace the buffer on screen
+    int sel;
+    int top;
+};
+
+struct grepState grep = {
+    .mu = PTHREAD_MUTEX_INITIALIZER,
+    .cv = PTHREAD_COND_INITIALIZER,
+    .rootfd = -1,
+};
+
+char grepPrompt[128];
+
+void grepAddRule(struct grepIgnore *ig, char *line)
+{
+    int len = strlen(line);
+    while (len > 0 && isspace((unsigned char)line[len - 1])) { line[--len] = '\0'; }
+    if (len == 0 || line[0] == '#') { return; }
+
+    struct grepRule r = {0};
+    if (line[0] == '!') { r.negate = 1; line++; len--; }
+    else if (line[0] == '\\') { line++; len--; }
+    if (len > 0 && line[len - 1] == '/') { r.dironly = 1; line[--len] = '\0'; }
+    if (len == 0) { return; }
+
+    if (strncmp(line, "**/", 3) == 0) { line += 3; len -= 3; }
+    if (len >= 3 && strcmp(&line[len - 3], "/**") == 0) { line[len - 1] = '\0'; len--; }
+    if (strchr(line, '/')) { r.anchored = 1; }
+    if (line[0] == '/') { line++; }
+    r.deep = (strstr(line, "**") != NULL);
+    r.pat = strdup(line);
+
+    ig->rules = realloc(ig->rules, sizeof(struct grepRule) * (ig->count + 1));
+    ig->rules[ig->count++] = r;
+}
+
+struct grepIgnore *grepLoadIgnore(const char *dir, const char *base, struct grepIgnore *parent)
+{
+    /*
+     * Returns the ignore chain in effect inside `dir`: parent's, plus the
+     * rules of dir/.gitignore when there is one.
+     */
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/.gitignore", dir);
+    int fd = openat(grep.rootfd, path, O_RDONLY | O_CLOEXEC);
+    FILE *fp = fd == -1 ? NULL : fdopen(fd, "r");
+    if (!fp)
+    {
+        if (fd != -1) { close(fd); }
+        return parent;
+    }
+
+    struct grepIgnore *ig = calloc(1, sizeof(struct grepIgnore));
+    ig->parent = parent;
+    ig->base = strdup(base);
+
+    char *line = NULL;
+    size_t linecap = 0;
+    while (getline(&line, &linecap, fp) != -1) { grepAddRule(ig, line); }
+    free(line);
+    fclose(fp);
+
+    pthread_mutex_lock(&grep.mu);
+    ig->next = grep.ignores;
+    grep.ignores = ig;
+    pthread_mutex_unlock(&grep.mu);
+    return ig;
+}
+
+void grepMatchIgnore(struct grepIgnore *ig, const char *rel, const char *name,
+                     int isdir, int *ignored)
+{
+    // NOTE: outer files first so the deepest, last matching rule wins.
+    if (ig == NULL) { return; }
+    grepMatchIgnore(ig->parent, rel, name, isdir, ignored);
+
+    int blen = strlen(ig->base);
+    const char *sub = blen ? rel + blen + 1 : rel;
+    for (int i = 0; i < ig->count; i++)
+    {
+        struct grepRule *r = &ig->rules[i];
+        if (r->dironly && !isdir) { continue; }
+
+        int flags = r->deep ? 0 : FNM_PATHNAME;
+        int hit = r->anchored ? fnmatch(r->pat, sub, flags) == 0
+                              : fnmatch(r->pat, name, 0) == 0;
+        if (hit) { *ignored = !r->negate; }
+    }
+}
+
+void grepPush(struct grepItem *items, int n)
+{
+    pthread_mutex_lock(&grep.mu);
+    if (grep.qcount + n > grep.qcap)
+    {
+        grep.qcap = (grep.qcount + n) * 2;
+        grep.queue = realloc(grep.queue, sizeof(struct grepItem) * grep.qcap);
+    }
+    memcpy(&grep.queue[grep.qcount], items, sizeof(struct grepItem) * n);
+    grep.qcount += n;
+    pthread_cond_broadcast(&grep.cv);
+    pthread_mutex_unlock(&grep.mu);
+}
+
+void grepWalkDir(struct grepItem *item)
+{
+    int fd = openat(grep.rootfd, item->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *dir = fd == -1 ? NULL : fdopendir(fd);
+    if (!dir)
+    {
+        if (fd != -1) { close(fd); }
+        return;
+    }
+
+    int root = (strcmp(item->path, ".") == 0);
+    struct grepIgnore *ig = grepLoadIgnore(item->path, root ? "" : item->path, item->ig);
+
+    struct grepItem *items = NULL;
+    int n = 0, cap = 0;
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL)
+    {
+        const char *name = de->d_name;
+        if (!strcmp(name, ".") || !strcmp(name, "..") || !strcmp(name, ".git")) { continue; }
+
+        char path[PATH_MAX];
+        if (root) { snprintf(path, sizeof(path), "%s", name); }
+        else { snprintf(path, sizeof(path), "%s/%s", item->path, name); }
+
+        int type = de->d_type;
+        if (type == DT_UNKNOWN)
+        {
+            struct stat st;
+            if (fstatat(grep.rootfd, path, &st, AT_SYMLINK_NOFOLLOW) == -1) { continue; }
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_LNK;
+        }
+        // NOTE: symlinks are skipped so the walk can't loop.
+        if (type != DT_DIR && type != DT_REG) { continue; }
+
+        int ignored = 0;
+        grepMatchIgnore(ig, path, name, type == DT_DIR, &ignored);
+        if (ignored) { continue; }
+
+        if (n == cap)
+        {
+            cap = cap ? cap * 2 : 64;
+            items = realloc(items, sizeof(struct grepItem) * cap);
+        }
+        items[n].path = strdup(path);
+        items[n].isdir = (type == DT_DIR);
+        items[n].ig = ig;
+        n++;
+    }
+    closedir(dir);
+
+    if (n) { grepPush(items, n); }
+    free(items);
+}
+
+void grepAddHit(struct grepHit **hits, int *n, int *cap, const char *path,
+                int line, int col, const char *text, int len)
+{
+    if (*n == *cap)
+    {
+        *cap = *cap ? *cap * 2 : 16;
+        *hits = realloc(*hits, sizeof(struct grepHit) * *cap);
+    }
+    if (len > 0 && text[len - 1] == '\r') { len--; }
+    if (len > GREP_MAX_TEXT) { len = GREP_MAX_TEXT; }
+
+    struct grepHit *h = &(*hits)[(*n)++];
+    h->path = strdup(path);
+    h->line = line;
+    h->col = col;
+    h->text = malloc(len + 1);
+    memcpy(h->text, text, len);
+    h->text[len] = '\0';
+}
+
+void grepScanFile(struct searchPattern *p, const char *path)
+{
+    /*
+     * Literal patterns run over the whole mapping and newlines are only
+     * counted up to each hit; a regex is run line by line so it can't
+     * match across them. Either way there is at most one hit per line.
+     */
+    int fd = openat(grep.rootfd, path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) { return; }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0 ||
+        st.st_size > INT_MAX)
+    {
+        close(fd);
+        return;
+    }
+
+    int size = st.st_size;
+    char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) { return; }
+
+    struct grepHit *hits = NULL;
+    int n = 0, cap = 0;
+
+    int probe = size < GREP_BINARY_PROBE ? size : GREP_BINARY_PROBE;
+    if (memchr(data, '\0', probe) == NULL)
+    {
+        madvise(data, size, MADV_SEQUENTIAL);
+
+        int line = 1;
+        int start = 0; // start of `line`
+        int pos = 0;
+        while (pos < size && !__atomic_load_n(&grep.cancel, __ATOMIC_RELAXED))
+        {
+            int mlen;
+            int at;
+            if (p->rx)
+            {
+                const char *nl = memchr(&data[pos], '\n', size - pos);
+                int end = nl ? nl - data : size;
+                at = searchFind(p, &data[pos], end - pos, 0, &mlen);
+                if (at == -1)
+                {
+                    pos = end + 1;
+                    start = pos;
+                    line++;
+                    continue;
+                }
+                at += pos;
+            }
+            else
+            {
+                at = searchFind(p, data, size, pos, &mlen);
+                if (at == -1) { break; }
+                const char *nl;
+                while ((nl = memchr(&data[start], '\n', at - start)) != NULL)
+                {
+                    start = nl - data + 1;
+                    line++;
+                }
+            }
+
+            const char *nl = memchr(&data[at], '\n', size - at);
+            int end = nl ? nl - data : size;
+            grepAddHit(&hits, &n, &cap, path, line, at - start, &data[start], end - start);
+
+            pos = end + 1;
+            start = pos;
+            line++;
+        }
+    }
+    munmap(data, size);
+
+    pthread_mutex_lock(&grep.mu);
+    grep.files++;
+    int room = GREP_MAX_HITS - grep.count;
+    if (n > room)
+    {
+        for (int i = room; i < n; i++)
+        {
+            free(hits[i].path);
+            free(hits[i].text);
+        }
+        n = room;
+        grep.truncated = 1;
+        __atomic_store_n(&grep.cancel, 1, __ATOMIC_RELAXED);
+    }
+    if (grep.count + n > grep.cap)
+    {
+        grep.cap = (grep.count + n) * 2;
+        grep.hits = realloc(grep.hits, sizeof(struct grepHit) * grep.cap);
+    }
+    memcpy(&grep.hits[grep.count], hits, sizeof(struct grepHit) * n);
+    grep.count += n;
+    pthread_mutex_unlock(&grep.mu);
+    free(hits);
+    if (n) { editorWake(); }
+}
+
+void *grepWorker(void *arg)
+{
+    int slot = (int)(intptr_t)arg;
+    struct searchPattern *p = searchPatternFor(&grep.pat, slot);
+
+    traceBegin("grep worker");
+    pthread_mutex_lock(&grep.mu);
+    while (1)
+    {
+        while (!grep.cancel && grep.qcount == 0 && grep.busy > 0)
+        {
+            pthread_cond_wait(&grep.cv, &grep.mu);
+        }
+        if (grep.cancel || grep.qcount == 0) { break; }
+
+        struct grepItem item = grep.queue[--grep.qcount];
+        grep.busy++;
+        pthread_mutex_unlock(&grep.mu);
+
+        if (item.isdir) { grepWalkDir(&item); }
+        else { grepScanFile(p, item.path); }
+        free(item.path);
+
+        pthread_mutex_lock(&grep.mu);
+        grep.busy--;
+    }
+    if (grep.busy == 0) { grep.finished = 1; }
+    pthread_cond_broadcast(&grep.cv);
+    pthread_mutex_unlock(&grep.mu);
+    traceEnd("grep worker", -1);
+    editorWake();
+    return NULL;
+}
+
+void grepStop(void)
+{
+    pthread_mutex_lock(&grep.mu);
+    __atomic_store_n(&grep.cancel, 1, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&grep.cv);
+    pthread_mutex_unlock(&grep.mu);
+
+    for (int i = 0; i < grep.nthreads; i++) { pthread_join(grep.threads[i], NULL); }
+    grep.nthreads = 0;
+
+    for (int i = 0; i < grep.qcount; i++) { free(grep.queue[i].path); }
+    grep.qcount = 0;
+    grep.busy = 0;
+    grep.cancel = 0;
+    if (grep.rootfd != -1) { close(grep.rootfd); }
+    grep.rootfd = -1;
+}
+
+void grepClear(void)
+{
+    grepStop();
+
+    for (int i = 0; i < grep.count; i++)
+    {
+        free(grep.hits[i].path);
+        free(grep.hits[i].text);
+    }
+    grep.count = 0;
+    grep.files = 0;
+    grep.truncated = 0;
+    grep.finished = 0;
+    grep.sel = 0;
+    grep.top = 0;
+    free(grep.root);
+    grep.root = NULL;
+
+    while (grep.ignores)
+    {
+        struct grepIgnore *ig = grep.ignores;
+        grep.ignores = ig->next;
+        for (int i = 0; i < ig->count; i++) { free(ig->rules[i].pat); }
+        free(ig->rules);
+        free(ig->base);
+        free(ig);
+    }
+    searchFree(&grep.pat);
+}
+
+void grepStart(void)
+{
+    int slots = workerPoolSize();
+    searchPrepareClones(&grep.pat, slots);
+
+    // NOTE: a server changes its cwd to each client's in turn, so the
+    // walk is pinned to the directory grep was started in.
+    grep.rootfd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    char cwd[PATH_MAX];
+    grep.root = strdup(getcwd(cwd, sizeof(cwd)) ? cwd : ".");
+    if (grep.rootfd == -1)
+    {
+        grep.finished = 1;
+        return;
+    }
+
+    struct grepItem root = { strdup("."), 1, NULL };
+    grepPush(&root, 1);
+
+    // NOTE: the root is queued before any thread runs, so none of them
+    // can see an empty queue with nobody busy and quit early.
+    for (int i = 0; i < slots; i++)
+    {
+        if (pthread_create(&grep.threads[grep.nthreads], NULL, grepWorker,
+                           (void *)(intptr_t)i) == 0)
+        {
+            grep.nthreads++;
+        }
+    }
+}
+
+void editorGrepDrawRows(struct abuf *ab)
+{
+    pthread_mutex_lock(&grep.mu);
+    int count = grep.count;
+    int running = !grep.finished && !grep.truncated;
+    if (grep.sel >= count) { grep.sel = count ? count - 1 : 0; }
+    if (grep.sel < grep.top) { grep.top = grep.sel; }
+    if (grep.sel >= grep.top + E.screenRows) { grep.top = grep.sel - E.screenRows + 1; }
+
+    editorSetStatusMessage("grep: %d hit%s in %d file%s%s | Enter: open | C-g: new | ESC",
+                           count, count == 1 ? "" : "s", grep.files, grep.files == 1 ? "" : "s",
+                           running ? " ..." : grep.truncated ? " (truncated)" : "");
+
+    for (int y = 0; y < E.screenRows; y++)
+    {
+        int i = grep.top + y;
+        if (i < grep.count)
+        {
+            struct grepHit *h = &grep.hits[i];
+            char head[PATH_MAX + 32];
+            int hlen = snprintf(head, sizeof(head), "%s:%d:", h->path, h->line);
+            if (hlen > E.screenCols) { hlen = E.screenCols; }
+
+            if (i == grep.sel) { abAppend(ab, "\x1b[7m", 4); }
+            abAppend(ab, "\x1b[35m", 5);
+            abAppend(ab, head, hlen);
+            abAppend(ab, "\x1b[39m ", 6);
+
+            // NOTE: hit text is raw file content, so tabs and control
+            // bytes are flattened and wide glyphs counted.
+            int cols = hlen + 1;
+            const char *s = h->text;
+            int len = strlen(s);
+            int j = 0;
+            while (j < len && cols < E.screenCols)
+            {
+                int cp;
+                int n = utf8Decode(&s[j], len - j, &cp);
+                int width = (cp < 0) ? 1 : (cp < 0x20 || cp == 0x7f) ? 1 : utf8CharWidth(cp);
+                if (cols + width > E.screenCols) { break; }
+
+                if (cp < 0) { abAppend(ab, "?", 1); }
+                else if (cp < 0x20 || cp == 0x7f) { abAppend(ab, " ", 1); }
+                else { abAppend(ab, &s[j], n); }
+                cols += width;
+                j += n;
+            }
+            if (i == grep.sel) { abAppend(ab, "\x1b[m", 3); }
+        }
+        else
+        {
+            abAppend(ab, "~", 1);
+        }
+        abAppend(ab, "\x1b[K", 3);
+        abAppend(ab, "\r\n", 2);
+    }
+    pthread_mutex_unlock(&grep.mu);
+
+    // NOTE: the bar the views' status bars are drawn over.
+    abAppend(ab, "\x1b[7m", 4);
+    int len = snprintf(NULL, 0, "grep: %.*s", grep.pat.len, grep.pat.needle);
+    if (len > E.screenCols) { len = E.screenCols; }
+    char *bar = malloc(E.screenCols + 1);
+    snprintf(bar, E.screenCols + 1, "grep: %.*s", grep.pat.len, grep.pat.needle);
+    memset(&bar[len], ' ', E.screenCols - len);
+    abAppend(ab, bar, E.screenCols);
+    free(bar);
+    abAppend(ab, "\x1b[m", 3);
+}
+
+void editorGrepPromptCallback(char *query, int key)
+{
+    (void)query;
+    if (key == CTRL_KEY('t')) { findIcase = !findIcase; }
+    else if (key == CTRL_KEY('r')) { findRegex = !findRegex; }
+    snprintf(grepPrompt, sizeof(grepPrompt), "Grep%s%s: %%s (ESC/Enter/C-t/C-r)",
+             findIcase ? " [i]" : "", findRegex ? " [re]" : "");
+}
+
+int editorGrepQuery(void)
+{
+    editorGrepPromptCallback(NULL, 0);
+    char *query = editorPrompt(grepPrompt, editorGrepPromptCallback);
+    if (query == NULL) { return 0; }
+
+    grepClear();
+    const char *err = NULL;
+    if (findRegex) { err = searchCompileRegex(&grep.pat, query, findIcase); }
+    else { searchCompile(&grep.pat, query, findIcase); }
+    free(query);
+
+    if (err)
+    {
+        editorSetStatusMessage("Bad regex: %s", err);
+        return 0;
+    }
+    grepStart();
+    return 1;
+}
+
+void editorGrepOpen(void)
+{
+    /*
+     * Shows the selected hit's file in the current view, cursor on the
+     * hit; a file already open is switched to, not read again.
+     */
+    pthread_mutex_lock(&grep.mu);
+    struct grepHit h = grep.hits[grep.sel];
+    char *path = malloc(strlen(grep.root) + strlen(h.path) + 2);
+    if (serverActive()) { sprintf(path, "%s/%s", grep.root, h.path); }
+    else { strcpy(path, h.path); }
+    pthread_mutex_unlock(&grep.mu);
+
+    if (access(path, R_OK) == -1)
+    {
+        editorSetStatusMessage("Can't open %s: %s", path, strerror(errno));
+        free(path);
+        return;
+    }
+
+    editorBufferOpen(path);
+    free(path);
+
+    V->cy = h.line - 1 < B->numRows ? h.line - 1 : B->numRows;
+    V->cx = (V->cy < B->numRows && h.col <= B->row[V->cy].size) ? h.col : 0;
+    V->rowoff = getScreenCenter();
+    if (V->rowoff < 0) { V->rowoff = 0; }
+    V->coloff = 0;
+}
+
+void editorGrep(void)
+{
+    /*
+     * The first C-g asks for a query, later ones bring the last results
+     * back. Results keep streaming in while they are on screen: the
+     * workers wake the event loop, which redraws.
+     */
+    if (grep.pat.len == 0 && !editorGrepQuery()) { return; }
+
+    grep.visible = 1;
+    while (1)
+    {
+        editorRefreshScreen();
+        int c = editorReadKey();
+
+        pthread_mutex_lock(&grep.mu);
+        int count = grep.count;
+        pthread_mutex_unlock(&grep.mu);
+
+        if (c == '\r')
+        {
+            if (count == 0) { continue; }
+            editorGrepOpen();
+            break;
+        }
+
+        if (c == '\x1b' || c == CTRL_KEY('q')) { break; }
+        else if (c == CTRL_KEY('g'))
+        {
+            grep.visible = 0;
+            if (!editorGrepQuery()) { return; }
+            grep.visible = 1;
+        }
+        else if (c == ARROW_DOWN || c == CTRL_KEY('n')) { grep.sel++; }
+        else if (c == ARROW_UP || c == CTRL_KEY('p')) { if (grep.sel > 0) { grep.sel--; } }
+        else if (c == PAGE_DOWN) { grep.sel += E.screenRows; }
+        else if (c == PAGE_UP) { grep.sel = grep.sel > E.screenRows ? grep.sel - E.screenRows : 0; }
+        else if (c == HOME_KEY) { grep.sel = 0; }
+        else if (c == END_KEY) { grep.sel = count; }
+    }
+    grep.visible = 0;
+    editorSetStatusMessage("");
+}
+
+/*** hex view ***/
+
+/*
+ * A buffer can show its file as bytes instead of lines: offset, hex and
+ * text columns, drawn straight from a mapping of the file. Only a window
+ * of HEX_WINDOW_BYTES is mapped at a time and moved as the views scroll,
+ * so a file of any size costs about the pages on screen. Overwritten
+ * bytes are kept as patches on top of the mapping until they're saved,
+ * in place, with pwrite.
+ */
+
+#define HEX_WINDOW_BYTES (1 << 20) // mapped at a time, a multiple of the page size
+#define HEX_SEARCH_CHUNK (1 << 20) // read per step of a search
+#define HEX_PATTERN_MAX 256
+
+struct hexPatch {
+    long long off;
+    unsigned char byte;
+    int seq; // order they were made in, for undo
+};
+
+struct hexFile {
+    int fd;
+    int readonly;
+    long long size;
+    char *map; // the window, NULL when nothing is mapped
+    long long mapOff;
+    long long mapLen;
+    struct hexPatch *patch; // by offset
+    int npatch;
+    int cap;
+    int seq;
+    struct searchPattern pat;
+    long long found; // start of the last match, -1 for none
+};
+
+int hexIsBinary(const char *path)
+{
+    // NOTE: same test as grep, a NUL near the start.
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) { return 0; }
+    char probe[GREP_BINARY_PROBE];
+    int n = read(fd, probe, sizeof(probe));
+    close(fd);
+    return n > 0 && memchr(probe, '\0', n) != NULL;
+}
+
+struct hexFile *hexFileOpen(const char *path)
+{
+    int readonly = 0;
+    int fd = open(path, O_RDWR);
+    if (fd == -1)
+    {
+        readonly = 1;
+        fd = open(path, O_RDONLY);
+    }
+    if (fd == -1) { return NULL; }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))
+    {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct hexFile *h = calloc(1, sizeof(struct hexFile));
+    h->fd = fd;
+    h->readonly = readonly;
+    h->size = st.st_size;
+    h->found = -1;
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return h;
+}
+
+void hexUnmap(struct hexFile *h)
+{
+    if (h->map) { munmap(h->map, h->mapLen); }
+    h->map = NULL;
+    h->mapLen = 0;
+}
+
+void hexFileClose(struct hexFile *h)
+{
+    if (h == NULL) { return; }
+    hexUnmap(h);
+    close(h->fd);
+    free(h->patch);
+    searchFree(&h->pat);
+    free(h);
+}
+
+int hexWindow(struct hexFile *h, long long off)
+{
+    /*
+     * Maps the window holding `off`, if it isn't already. Returns 0 past
+     * the end of the file or when the mapping fails.
+     */
+    if (h->map && off >= h->mapOff && off < h->mapOff + h->mapLen) { return 1; }
+    if (off < 0 || off >= h->size) { return 0; }
+
+    hexUnmap(h);
+    long long at = off - off % HEX_WINDOW_BYTES;
+    long long len = h->size - at < HEX_WINDOW_BYTES ? h->size - at : HEX_WINDOW_BYTES;
+    char *map = mmap(NULL, len, PROT_READ, MAP_SHARED, h->fd, at);
+    if (map == MAP_FAILED) { return 0; }
+    h->map = map;
+    h->mapOff = at;
+    h->mapLen = len;
+    return 1;
+}
+
+int hexPatchFind(struct hexFile *h, long long off)
+{
+    // NOTE: index of the first patch at or after `off`.
+    int lo = 0, hi = h->npatch;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (h->patch[mid].off < off) { lo = mid + 1; }
+        else { hi = mid; }
+    }
+    return lo;
+}
+
+void hexPatchApply(struct hexFile *h, long long off, unsigned char *dst, int n)
+{
+    for (int i = hexPatchFind(h, off); i < h->npatch && h->patch[i].off < off + n; i++)
+    {
+        dst[h->patch[i].off - off] = h->patch[i].byte;
+    }
+}
+
+int hexRead(struct hexFile *h, long long off, unsigned char *dst, int n)
+{
+    /*
+     * Copies up to `n` bytes at `off`, as they'll be once saved. Returns
+     * how many there were.
+     */
+    int got = 0;
+    while (got < n && hexWindow(h, off + got))
+    {
+        long long at = off + got - h->mapOff;
+        int take = h->mapLen - at < n - got ? h->mapLen - at : n - got;
+        memcpy(&dst[got], &h->map[at], take);
+        got += take;
+    }
+    hexPatchApply(h, off, dst, got);
+    return got;
+}
+
+int hexReadBulk(struct hexFile *h, long long off, unsigned char *dst, int n)
+{
+    // NOTE: for whole chunks pread beats faulting in a fresh mapping.
+    int got = 0;
+    while (got < n)
+    {
+        ssize_t r = pread(h->fd, &dst[got], n - got, off + got);
+        if (r == -1 && errno == EINTR) { continue; }
+        if (r <= 0) { break; }
+        got += r;
+    }
+    hexPatchApply(h, off, dst, got);
+    return got;
+}
+
+void hexWrite(struct hexFile *h, long long off, unsigned char byte)
+{
+    // NOTE: writing back what's on disk drops the patch.
+    int i = hexPatchFind(h, off);
+    int found = i < h->npatch && h->patch[i].off == off;
+    unsigned char disk;
+    if (!hexWindow(h, off)) { return; }
+    disk = h->map[off - h->mapOff];
+
+    if (byte == disk)
+    {
+        if (found)
+        {
+            memmove(&h->patch[i], &h->patch[i + 1], sizeof(struct hexPatch) * (h->npatch - i - 1));
+            h->npatch--;
+        }
+        return;
+    }
+    if (!found)
+    {
+        if (h->npatch == h->cap)
+        {
+            h->cap = h->cap ? h->cap * 2 : 64;
+            h->patch = realloc(h->patch, sizeof(struct hexPatch) * h->cap);
+        }
+        memmove(&h->patch[i + 1], &h->patch[i], sizeof(struct hexPatch) * (h->npatch - i));
+        h->npatch++;
+        h->patch[i].off = off;
+    }
+    h->patch[i].byte = byte;
+    h->patch[i].seq = ++h->seq;
+}
+
+int hexDigits(void)
+{
+    int digits = 8;
+    while (digits < 16 && (B->hex->size >> (4 * digits)) > 0) { digits++; }
+    return digits;
+}
+
+int hexRowBytes(void)
+{
+    // NOTE: 16 bytes a row when the view is wide enough, else 8 or 4.
+    int n = 16;
+    int digits = hexDigits();
+    while (n > 4 && digits + 2 + 3 * n + (n - 1) / 8 + 1 + n > V->screenCols) { n /= 2; }
+    return n;
+}
+
+void editorHexOpen(struct editorBuffer *b)
+{
+    b->loaded = 1;
+    b->hex = hexFileOpen(b->filename);
+    if (b->hex == NULL)
+    {
+        editorSetStatusMessage("Can't open %s: %s", b->filename, strerror(errno));
+        return;
+    }
+    b->diskSize = b->hex->size;
+    b->syntax = NULL;
+}
+
+void editorHexToggle(void)
+{
+    /*
+     * Swaps the buffer between lines and bytes. The cursor keeps its
+     * place in the file either way.
+     */
+    if (B->filename == NULL || B == stream.buf)
+    {
+        editorSetStatusMessage("No file to show as hex");
+        return;
+    }
+    if (B->dirty)
+    {
+        editorSetStatusMessage("Save the buffer first");
+        return;
+    }
+
+    if (B->hex)
+    {
+        long long off = V->hexCur;
+        hexFileClose(B->hex);
+        B->hex = NULL;
+        char *filename = strdup(B->filename);
+        editorOpen(filename);
+        free(filename);
+        for (struct layoutNode *n = layoutFirstLeaf(E.layout); n; n = layoutNextLeaf(n))
+        {
+            if (n->view->buf == B) { n->view->cx = n->view->cy = n->view->rowoff = 0; }
+        }
+        V->cy = lineIndexFind(off, &V->cx);
+        return;
+    }
+
+    long long off = lineIndexOffset(V->cy, V->cx);
+    matchIndexClear(&B->match);
+    editorCursorsClear();
+    editorMarkClear();
+    editorUndoClear();
+    editorFreeRows();
+    editorHexOpen(B);
+    if (B->hex == NULL)
+    {
+        char *filename = strdup(B->filename);
+        editorOpen(filename);
+        free(filename);
+        return;
+    }
+    for (struct layoutNode *n = layoutFirstLeaf(E.layout); n; n = layoutNextLeaf(n))
+    {
+        if (n->view->buf == B) { n->view->hexCur = n->view->hexTop = 0; }
+    }
+    V->hexCur = off;
+}
+
+void editorHexScroll(void)
+{
+    struct hexFile *h = B->hex;
+    // NOTE: the file may have grown or shrunk under us.
+    struct stat st;
+    if (fstat(h->fd, &st) == 0 && st.st_size != h->size)
+    {
+        h->size = st.st_size;
+        hexUnmap(h);
+    }
+
+    V->cx = V->cy = V->rx = V->rowoff = V->coloff = 0;
+    if (V->hexCur >= h->size) { V->hexCur = h->size ? h->size - 1 : 0; }
+    if (V->hexCur < 0) { V->hexCur = 0; }
+
+    int n = hexRowBytes();
+    long long page = (long long)n * V->screenRows;
+    long long row = V->hexCur - V->hexCur % n;
+    V->hexTop -= V->hexTop % n;
+    if (row < V->hexTop) { V->hexTop = row; }
+    if (row >= V->hexTop + page) { V->hexTop = row - page + n; }
+}
+
+int hexColumn(int i, int n, int text)
+{
+    // NOTE: screen column of byte `i` of a row, in the hex or text column.
+    int digits = hexDigits();
+    if (text) { return digits + 2 + 3 * n + (n - 1) / 8 + 1 + i; }
+    return digits + 2 + 3 * i + i / 8;
+}
+
+void hexAppend(struct abuf *ab, int *col, const char *s, int len)
+{
+    // NOTE: clipped at the right edge of the view.
+    if (*col + len > V->screenCols) { len = V->screenCols - *col; }
+    if (len > 0)
+    {
+        abAppend(ab, s, len);
+        *col += len;
+    }
+}
+
+void hexAttr(struct abuf *ab, int *cur, int want)
+{
+    // NOTE: 1 is an unsaved byte, 2 a search match, 4 the cursor.
+    if (*cur == want) { return; }
+    abAppend(ab, "\x1b[m", 3);
+    if (want & 1) { abAppend(ab, "\x1b[31m", 5); }
+    if (want & 2)
+    {
+        char seq[16];
+        int len = snprintf(seq, sizeof(seq), "\x1b[%dm", editorSyntaxToColor(HL_MATCH_OTHER));
+        abAppend(ab, seq, len);
+    }
+    if (want & 4) { abAppend(ab, "\x1b[7m", 4); }
+    *cur = want;
+}
+
+void editorHexDrawRows(struct abuf *ab)
+{
+    struct hexFile *h = B->hex;
+    int n = hexRowBytes();
+    int digits = hexDigits();
+    long long found = h->found;
+    int flen = h->pat.len;
+
+    for (int y = 0; y < V->screenRows; y++)
+    {
+        char pos[32];
+        int plen = snprintf(pos, sizeof(pos), "\x1b[%d;%dH", V->top + y + 1, V->left + 1);
+        abAppend(ab, pos, plen);
+
+        long long off = V->hexTop + (long long)y * n;
+        unsigned char bytes[16];
+        int got = off < h->size ? hexRead(h, off, bytes, n) : 0;
+        int col = 0;
+        if (got == 0)
+        {
+            if (off == 0) { hexAppend(ab, &col, "(empty file)", 12); }
+            else { hexAppend(ab, &col, "~", 1); }
+            abAppend(ab, "\x1b[K", 3);
+            continue;
+        }
+
+        char cell[24];
+        int len = snprintf(cell, sizeof(cell), "%0*llx  ", digits, off);
+        hexAppend(ab, &col, cell, len);
+
+        int attr[16];
+        int pi = hexPatchFind(h, off);
+        for (int i = 0; i < got; i++)
+        {
+            attr[i] = 0;
+            while (pi < h->npatch && h->patch[pi].off < off + i) { pi++; }
+            if (pi < h->npatch && h->patch[pi].off == off + i) { attr[i] |= 1; }
+            if (found != -1 && off + i >= found && off + i < found + flen) { attr[i] |= 2; }
+        }
+
+        // NOTE: the column without the terminal cursor marks it instead.
+        int mark = (V->hexCur >= off && V->hexCur < off + got) ? V->hexCur - off : -1;
+        int cur = 0;
+        for (int i = 0; i < n; i++)
+        {
+            if (i < got)
+            {
+                hexAttr(ab, &cur, attr[i] | (i == mark && V->hexText ? 4 : 0));
+                len = snprintf(cell, sizeof(cell), "%02x", bytes[i]);
+            }
+            else { len = snprintf(cell, sizeof(cell), "  "); }
+            hexAppend(ab, &col, cell, len);
+            hexAttr(ab, &cur, 0);
+            hexAppend(ab, &col, i % 8 == 7 && i < n - 1 ? "  " : " ", i % 8 == 7 && i < n - 1 ? 2 : 1);
+        }
+        hexAppend(ab, &col, " ", 1);
+        for (int i = 0; i < got; i++)
+        {
+            hexAttr(ab, &cur, attr[i] | (i == mark && !V->hexText ? 4 : 0));
+            char c = (bytes[i] >= 0x20 && bytes[i] < 0x7f) ? bytes[i] : '.';
+            hexAppend(ab, &col, &c, 1);
+        }
+        hexAttr(ab, &cur, 0);
+        abAppend(ab, "\x1b[K", 3);
+    }
+}
+
+void editorHexCursor(int *y, int *x)
+{
+    int n = hexRowBytes();
+    long long i = V->hexCur - V->hexTop;
+    int col = hexColumn(i % n, n, V->hexText) + (!V->hexText && V->hexLow);
+    *y = V->top + i / n;
+    *x = V->left + (col < V->screenCols ? col : V->screenCols - 1);
+}
+
+int editorHexStatus(char *status, int size, char *rstatus, int rsize)
+{
+    // NOTE: fills both halves of the status bar, returns the right's length.
+    struct hexFile *h = B->hex;
+    char dirt[16] = "";
+    if (B->dirty) { snprintf(dirt, sizeof(dirt), "[%d]", B->dirty < 999 ? B->dirty : 999); }
+    snprintf(status, size, "%.20s - %lld bytes %s%s", editorBufferName(B), h->size,
+             h->readonly ? "[ro] " : "", dirt);
+    unsigned char byte = 0;
+    hexRead(h, V->hexCur, &byte, 1);
+    return snprintf(rstatus, rsize, "byte %lld of %lld | %02x | hex", V->hexCur, h->size, byte);
+}
+
+void editorHexSave(void)
+{
+    /*
+     * Writes the patched bytes in place, a run of neighbours per call;
+     * the rest of the file isn't touched.
+     */
+    struct hexFile *h = B->hex;
+    if (h->npatch == 0)
+    {
+        editorSetStatusMessage("No changes to save");
+        return;
+    }
+    if (h->readonly)
+    {
+        editorSetStatusMessage("Can't save! %s is read-only", B->filename);
+        return;
+    }
+
+    traceBegin("save");
+    unsigned char run[256];
+    int written = 0;
+    int i = 0;
+    while (i < h->npatch)
+    {
+        int n = 0;
+        long long at = h->patch[i].off;
+        while (i < h->npatch && n < (int)sizeof(run) && h->patch[i].off == at + n)
+        {
+            run[n++] = h->patch[i++].byte;
+        }
+        if (pwrite(h->fd, run, n, at) != n)
+        {
+            traceEnd("save", -1);
+            editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+            return;
+        }
+        written += n;
+    }
+    h->npatch = 0;
+    B->dirty = 0;
+    traceEnd("save", written);
+    editorSetStatusMessage("%d bytes written to disk", written);
+}
+
+void editorHexUndo(void)
+{
+    // NOTE: drops the latest patch, which puts the disk byte back.
+    struct hexFile *h = B->hex;
+    int last = -1;
+    for (int i = 0; i < h->npatch; i++)
+    {
+        if (last == -1 || h->patch[i].seq > h->patch[last].seq) { last = i; }
+    }
+    if (last == -1)
+    {
+        editorSetStatusMessage("Nothing to undo");
+        return;
+    }
+    V->hexCur = h->patch[last].off;
+    V->hexLow = 0;
+    memmove(&h->patch[last], &h->patch[last + 1], sizeof(struct hexPatch) * (h->npatch - last - 1));
+    h->npatch--;
+}
+
+void editorHexType(int c)
+{
+    /*
+     * Overwrites the byte under the cursor: a nibble at a time in the hex
+     * column, a whole character in the text column. The file never grows.
+     */
+    struct hexFile *h = B->hex;
+    if (V->hexCur >= h->size) { return; }
+    if (h->readonly)
+    {
+        editorSetStatusMessage("%s is read-only", B->filename);
+        return;
+    }
+
+    unsigned char byte = 0;
+    hexRead(h, V->hexCur, &byte, 1);
+    if (V->hexText)
+    {
+        hexWrite(h, V->hexCur, c);
+        if (V->hexCur + 1 < h->size) { V->hexCur++; }
+        return;
+    }
+
+    int nibble = isdigit(c) ? c - '0' : tolower(c) - 'a' + 10;
+    if (V->hexLow) { byte = (byte & 0xf0) | nibble; }
+    else { byte = (byte & 0x0f) | (nibble << 4); }
+    hexWrite(h, V->hexCur, byte);
+    if (!V->hexLow) { V->hexLow = 1; }
+    else if (V->hexCur + 1 < h->size)
+    {
+        V->hexCur++;
+        V->hexLow = 0;
+    }
+}
+
+int hexParsePattern(const char *s, char *out)
+{
+    /*
+     * "7f 45 4c 46", "7f454c46" or "7f\"ELF\"": hex digit pairs, with
+     * spaces anywhere between them and quoted text taken as is. Returns
+     * the length, or -1.
+     */
+    int n = 0;
+    while (*s)
+    {
+        if (*s == ' ') { s++; continue; }
+        if (*s == '"')
+        {
+            for (s++; *s && *s != '"' && n < HEX_PATTERN_MAX; s++) { out[n++] = *s; }
+            if (*s != '"') { return -1; }
+            s++;
+            continue;
+        }
+        if (!isxdigit((unsigned char)s[0]) || !isxdigit((unsigned char)s[1]) || n == HEX_PATTERN_MAX)
+        {
+            return -1;
+        }
+        char pair[3] = { s[0], s[1], '\0' };
+        out[n++] = strtol(pair, NULL, 16);
+        s += 2;
+    }
+    return n;
+}
+
+long long hexSearch(struct hexFile *h, long long from, int dir, int *stopped)
+{
+    /*
+     * Finds the pattern from `from` on, or before it when dir is -1, a
+     * chunk at a time and wrapping around the file once. Gives up early,
+     * setting `stopped`, when a key is pressed.
+     */
+    int len = h->pat.len;
+    int span = HEX_SEARCH_CHUNK + len - 1;
+    unsigned char *chunk = malloc(span);
+    long long hit = -1;
+    long long scanned = 0;
+    long long at = from;
+    *stopped = 0;
+
+    while (hit == -1 && scanned < h->size + HEX_SEARCH_CHUNK)
+    {
+        if (dir > 0)
+        {
+            if (at >= h->size) { at = 0; }
+            int got = hexReadBulk(h, at, chunk, span);
+            int i = searchFind(&h->pat, (char *)chunk, got, 0, NULL);
+            if (i != -1) { hit = at + i; }
+            at += HEX_SEARCH_CHUNK;
+        }
+        else
+        {
+            if (at <= 0) { at = h->size; }
+            long long lo = at > HEX_SEARCH_CHUNK ? at - HEX_SEARCH_CHUNK : 0;
+            int got = hexReadBulk(h, lo, chunk, (at - lo) + len - 1);
+            int i = searchFindLast(&h->pat, (char *)chunk, got, at - lo, NULL);
+            if (i != -1) { hit = lo + i; }
+            at = lo;
+        }
+        scanned += HEX_SEARCH_CHUNK;
+        if (hit == -1 && editorPeekByte(0) != -1)
+        {
+            *stopped = 1;
+            break;
+        }
+    }
+    free(chunk);
+    return hit;
+}
+
+void editorHexFindStep(int dir)
+{
+    struct hexFile *h = B->hex;
+    if (h->pat.len == 0)
+    {
+        editorSetStatusMessage("No pattern; C-f to search");
+        return;
+    }
+
+    int stopped;
+    long long from = dir > 0 ? V->hexCur + (h->found == V->hexCur) : V->hexCur;
+    long long hit = hexSearch(h, from, dir, &stopped);
+    h->found = hit;
+    if (hit == -1)
+    {
+        editorSetStatusMessage(stopped ? "Search stopped" : "Not found");
+        return;
+    }
+    V->hexCur = hit;
+    V->hexLow = 0;
+    editorSetStatusMessage("Found at 0x%llx", hit);
+}
+
+void editorHexFind(void)
+{
+    char *query = editorPrompt("Hex search: %s (bytes like 7f 45 4c 46 or \"text\")", NULL);
+    if (query == NULL) { return; }
+
+    char bytes[HEX_PATTERN_MAX];
+    int n = hexParsePattern(query, bytes);
+    free(query);
+    if (n <= 0)
+    {
+        editorSetStatusMessage("Bad pattern: want pairs of hex digits or \"text\"");
+        return;
+    }
+
+    struct hexFile *h = B->hex;
+    searchFree(&h->pat);
+    searchCompileBytes(&h->pat, bytes, n, 0);
+    h->found = -1;
+    editorHexFindStep(1);
+}
+
+void editorHexGoto(void)
+{
+    char *answer = editorPrompt("Goto offset (0x hex or decimal, +/- relative): %s", NULL);
+    if (answer == NULL) { return; }
+
+    char *s = answer;
+    int rel = (*s == '+') ? 1 : (*s == '-') ? -1 : 0;
+    if (rel) { s++; }
+    char *end;
+    long long off = strtoll(s, &end, (s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) ? 16 : 10);
+    if (end == s || *end != '\0') { editorSetStatusMessage("Bad offset: %s", answer); }
+    else
+    {
+        V->hexCur = rel ? V->hexCur + rel * off : off;
+        V->hexLow = 0;
+    }
+    free(answer);
+}
+
+int editorHexProcessKey(int c)
+{
+    /*
+     * Keys for a hex buffer. Returns 0 for the ones that work the same
+     * on any buffer, which are left to editorProcessKeypress.
+     */
+    struct hexFile *h = B->hex;
+    int n = hexRowBytes();
+    long long page = (long long)n * V->screenRows;
+    long long before = V->hexCur;
+
+    switch (c)
+    {
+        case CTRL_KEY('q'):
+        case CTRL_KEY('x'):
+        case CTRL_KEY('g'):
+        case KEY_ALT | 'p':
+        case KEY_ALT | 'm':
+        case KEY_ALT | 't':
+            return 0;
+
+        case CTRL_KEY('s'): editorHexSave(); break;
+        case CTRL_KEY('f'): editorHexFind(); break;
+        case CTRL_KEY('e'): editorHexFindStep(1); break;
+        case CTRL_KEY('b'): editorHexFindStep(-1); break;
+        case CTRL_KEY('z'): editorHexUndo(); break;
+        case KEY_ALT | 'g': editorHexGoto(); break;
+        case '\x1b': h->found = -1; break;
+        case '\t': V->hexText = !V->hexText; V->hexLow = 0; break;
+
+        case ARROW_LEFT:
+        case BACKSPACE:
+        case CTRL_KEY('h'):
+            if (!V->hexText && V->hexLow) { V->hexLow = 0; }
+            else if (V->hexCur > 0) { V->hexCur--; }
+            break;
+        case ARROW_RIGHT: V->hexCur++; break;
+        case ARROW_UP: if (V->hexCur >= n) { V->hexCur -= n; } break;
+        case ARROW_DOWN: if (V->hexCur + n < h->size) { V->hexCur += n; } break;
+        case PAGE_UP:
+            V->hexCur = V->hexCur >= page ? V->hexCur - page : V->hexCur % n;
+            V->hexTop = V->hexTop >= page ? V->hexTop - page : 0;
+            break;
+        case PAGE_DOWN:
+            if (V->hexCur + page < h->size)
+            {
+                V->hexCur += page;
+                V->hexTop += page;
+            }
+            else { V->hexCur = h->size - 1; }
+            break;
+        case HOME_KEY: V->hexCur -= V->hexCur % n; break;
+        case END_KEY: V->hexCur += n - 1 - V->hexCur % n; break;
+        case CTRL_ARROW_UP: V->hexCur = 0; break;
+        case CTRL_ARROW_DOWN: V->hexCur = h->size - 1; break;
+
+        default:
+            if (V->hexText ? (c >= 0x20 && c < 0x7f) : (c < 0x80 && isxdigit(c))) { editorHexType(c); }
+    }
+    if (V->hexCur != before) { V->hexLow = 0; }
+    B->dirty = h->npatch;
+    return 1;
+}
+
+/*** output ***/
+
+void editorScroll()
+{
+    if (B->hex)
+    {
+        editorHexScroll();
+        return;
+    }
+    // NOTE: another view of the buffer may have deleted the rows under us.
+    if (V->cy > B->numRows) { V->cy = B->numRows; }
+    if (V->cy < B->numRows && V->cx > B->row[V->cy].size) { V->cx = B->row[V->cy].size; }
+    if (V->cy == B->numRows) { V->cx = 0; }
+
+    V->rx = 0;
+    if (V->cy < B->numRows)
+    {
+        V->rx = editorRowCxToRx(&B->row[V->cy], V->cx);
+    }
+
+    if (V->cy < V->rowoff)
+    {
+        V->rowoff = V->cy;
+    }
+    if (V->cy >= V->rowoff + V->screenRows)
+    {
+        V->rowoff = V->cy - V->screenRows + 1;
+    }
+    if (V->rx < V->coloff)
+    {
+        V->coloff = V->rx;
+    }
+    if (V->rx >= V->coloff + V->screenCols)
+    {
+        V->coloff = V->rx - V->screenCols + 1;
+    }
+}
+
+void editorRowAppendToPrev()
+{
+    if (V->cy == 0) { return; }
+
+    erow *currentRow = &B->row[V->cy];
+    erow *prevRow = &B->row[V->cy - 1];
+
+    int indent = 0;
+    while (indent < currentRow->size &&
+            (currentRow->chars[indent] == ' ' ||
+             currentRow->chars[indent] == '\t'))
+    { indent++; }
+
+    editorUndoBegin(UNDO_OTHER);
+    editorUndoRecord(V->cy - 1, 2, 1);
+    editorRowAppendString(prevRow, currentRow->chars + indent, currentRow->size - indent);
+
+    editorDelRow(V->cy);
+
+    V->cy--;
+    V->cx = prevRow->size;
+}
+
+void editorDrawRows(struct abuf *ab)
+{
+    if (B->hex)
+    {
+        editorHexDrawRows(ab);
+        return;
+    }
+    editorBracketPairFind();
+    int y;
+    for (y = 0; y < V->screenRows; y++)
+    {
+        char pos[32];
+        int plen = snprintf(pos, sizeof(pos), "\x1b[%d;%dH", V->top + y + 1, V->left + 1);
+        abAppend(ab, pos, plen);
+        int filerow = y + V->rowoff;
+        if (filerow >= B->numRows) {
+            if (B->numRows == 0 && y == V->screenRows / 3)
+            {
+                char welcome[80];
+                int welcomelen = snprintf(welcome, sizeof(welcome),
+                        "weiss editor -- version %s", WEISS_VERSION);
+                if (welcomelen > V->screenCols)
+                {
+                    welcomelen = V->screenCols;
+                }
+
+                int padding = (V->screenCols - welcomelen) / 2;
+                if (padding)
+                {
+                    abAppend(ab, "~", 1);
+                    padding--;
+                }
+                while (padding--) abAppend(ab, " ", 1);
+
+                abAppend(ab, welcome, welcomelen);
+            }
+            else
+            {
+                /*write(STDOUT_FILENO, "~", 1);*/
+                abAppend(ab, "~", 1);
+            }
+        }
+        else
+        {
+            erow *row = &B->row[filerow];
+            editorRowThaw(row);
+            char *c = row->render;
+            int eol;
+            unsigned char *hl = matchIndexRowHighlight(filerow);
+            hl = editorBracketRowHighlight(filerow, hl);
+            hl = editorSelectionRowHighlight(filerow, hl);
+            hl = editorCursorsRowHighlight(filerow, hl, &eol);
+            int current_color = -1;
+            int maxcol = V->coloff + V->screenCols;
+            int col, j;
+
+            if (row->ascii)
+            {
+                // NOTE: fast path, every render byte is one column.
+                j = (V->coloff < row->rsize) ? V->coloff : row->rsize;
+                col = j;
+            }
+            else
+            {
+                // NOTE: skip whole glyphs left of the view; a wide glyph cut
+                // by the left edge leaves blank cells behind.
+                j = 0;
+                col = 0;
+                while (j < row->rsize)
+                {
+                    int cp;
+                    int n = utf8Decode(&c[j], row->rsize - j, &cp);
+                    int w = utf8CharWidth(cp);
+                    if (col + w > V->coloff) { break; }
+                    col += w;
+                    j += n;
+                }
+                while (col < V->coloff && j < row->rsize)
+                {
+                    abAppend(ab, " ", 1);
+                    col++;
+                }
+            }
+
+            while (j < row->rsize && col < maxcol)
+            {
+                unsigned char ch = c[j];
+                int n = 1;
+                int cp = ch;
+
+                if (ch >= 0x80)
+                {
+                    n = utf8Decode(&c[j], row->rsize - j, &cp);
+                    int w = utf8CharWidth(cp);
+                    if (col + w > maxcol) { break; }
+                    if (cp < 0)
+                    {
+                        // NOTE: invalid byte, shown like a control char.
+                        abAppend(ab, "\x1b[7m?\x1b[m", 8);
+                        if (current_color != -1)
+                        {
+                            char buf[16];
+                            int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
+                            abAppend(ab, buf, clen);
+                        }
+                        col++;
+                        j++;
+                        continue;
+                    }
+                    col += w;
+                }
+                else
+                {
+                    col++;
+                }
+
+                if (ch < 0x80 && iscntrl(ch))
+                {
+                    char sym = (ch <= 26) ? '@' + ch : '?';
+                    abAppend(ab, "\x1b[7m", 4);
+                    abAppend(ab, &sym, 1);
+                    abAppend(ab, "\x1b[m", 3);
+                    if (current_color != -1)
+                    {
+                        char buf[16];
+                        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
+                        abAppend(ab, buf, clen);
+                    }
+                }
+                else if (hl[j] == HL_NORMAL)
+                {
+                    if (current_color != -1)
+                    {
+                        abAppend(ab, "\x1b[39m", 5);
+                        current_color = -1;
+                    }
+                    abAppend(ab, &c[j], n);
+                }
+                else
+                {
+                    int color = editorSyntaxToColor(hl[j]);
+                    if (color != current_color)
+                    {
+                        char buf[16];
+                        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
+                        abAppend(ab, buf, clen);
+                        current_color = color;
+                    }
+                    abAppend(ab, &c[j], n);
+                    if (hl[j] == HL_MATCH || hl[j] == HL_MATCH_OTHER || hl[j] == HL_CURSOR ||
+                        hl[j] == HL_SELECTION || hl[j] == HL_BRACKET)
+                    {
+                        // NOTE(liam): removes highlighting
+                        abAppend(ab, "\x1b[m", 3);
+                        current_color = -1;
+                    }
+                }
+                j += n;
+            }
+            if (eol && j >= row->rsize && col < maxcol) { abAppend(ab, "\x1b[7m \x1b[m", 8); }
+            abAppend(ab, "\x1b[39m", 5);
+        }
+
+        // NOTE(liam): Erase inline. Views to the right are drawn after this one.
+        abAppend(ab, "\x1b[K", 3);
+    }
+}
+
+void editorDrawStatusBar(struct abuf *ab, int active)
+{
+    char pos[32];
+    int plen = snprintf(pos, sizeof(pos), "\x1b[%d;%dH", V->top + V->screenRows + 1, V->left + 1);
+    abAppend(ab, pos, plen);
+    // NOTE: views without the cursor get a dimmed bar.
+    if (active) { abAppend(ab, "\x1b[7m", 4); }
+    else { abAppend(ab, "\x1b[2;7m", 6); }
+    char status[80], rstatus[160], dirtstatus[6];
+
+    int dirtlen = snprintf(dirtstatus, sizeof(dirtstatus), "[%d]", B->dirty < 999 ? B->dirty : 999);
+
+    const char *piped = "";
+    if (B == stream.buf && events.streamfd != -1) { piped = stream.follow ? "following " : "reading "; }
+    int len = snprintf(status, sizeof(status), "%.20s - %d lines %s%s",
+                       editorBufferName(B), B->numRows, piped,
+                       WEISS_DISPLAY_DIRT_COUNTER ? (B->dirty && dirtlen ? dirtstatus : "") :
+                       (B->dirty ? "[+]" : ""));
+    int rlen;
+    // NOTE: a hex buffer counts bytes where the rows would be.
+    if (B->hex)
+    {
+        rlen = editorHexStatus(status, sizeof(status), rstatus, sizeof(rstatus));
+        len = strlen(status);
+    }
+    else
+    {
+        char mstatus[40];
+        matchIndexStatus(mstatus, sizeof(mstatus));
+        char format[32];
+        editorFileFormat(format, sizeof(format));
+        char offset[64];
+        snprintf(offset, sizeof(offset), " | byte %lld of %lld",
+                 lineIndexOffset(V->cy, V->cx), lineIndexTotal());
+        // NOTE: what doesn't fit goes: the offset, then matches, then the format.
+        int room = V->screenCols - (len < (int)sizeof(status) ? len : (int)sizeof(status) - 1) - 1;
+        for (int drop = 0; drop < 4; drop++)
+        {
+            rlen = snprintf(rstatus, sizeof(rstatus), "%s%d:%d%s | %s%s",
+                            drop < 2 ? mstatus : "", V->cy + 1, V->cx + 1,
+                            drop < 1 ? offset : "", drop < 3 ? format : "",
+                            B->syntax ? B->syntax->filetype : "nil");
+            if (rlen <= room) { break; }
+        }
+    }
+    if (len > (int)sizeof(status) - 1) { len = sizeof(status) - 1; }
+    if (rlen > (int)sizeof(rstatus) - 1) { rlen = sizeof(rstatus) - 1; }
+    if (rlen > V->screenCols) { rlen = V->screenCols; }
+    if (len > V->screenCols) { len = V->screenCols; }
+    abAppend(ab, status, len);
+    while (len < V->screenCols)
+    {
+        if (V->screenCols - len == rlen)
+        {
+            abAppend(ab, rstatus, rlen);
+            break;
+        }
+        else
+        {
+            abAppend(ab, " ", 1);
+            len++;
+        }
+    }
+    abAppend(ab, "\x1b[m", 3);
+}
+
+void editorDrawMessageBar(struct abuf *ab)
+{
+    char pos[32];
+    int plen = snprintf(pos, sizeof(pos), "\x1b[%d;1H", E.screenRows + 2);
+    abAppend(ab, pos, plen);
+    abAppend(ab, "\x1b[K", 3);
+
+    // NOTE: the profiler summary sits on the right, the message gets the rest.
+    char stats[160];
+    int slen = prof.visible ? profSummary(stats, sizeof(stats)) : 0;
+    if (slen > E.screenCols) { slen = E.screenCols; }
+    int room = slen ? E.screenCols - slen - 1 : E.screenCols;
+
+    int msglen = strlen(E.statusMsg);
+    if (msglen > room) { msglen = room > 0 ? room : 0; }
+    if (msglen && time(NULL) - E.statusMsgTime < 5)
+    {
+        abAppend(ab, E.statusMsg, msglen);
+    }
+    else { msglen = 0; }
+    if (slen)
+    {
+        for (int pad = E.screenCols - slen - msglen; pad > 0; pad--) { abAppend(ab, " ", 1); }
+        abAppend(ab, "\x1b[7m", 4);
+        abAppend(ab, stats, slen);
+        abAppend(ab, "\x1b[m", 3);
+    }
+}
+
+void editorDrawLayout(struct abuf *ab, struct layoutNode *n, struct editorView *focus)
+{
+    if (n->view)
+    {
+        V = n->view;
+        B = V->buf;
+        editorBufferLoad(B);
+        long long t = profNowUs();
+        editorScroll();
+        profAdd(PROF_SCROLL, t);
+        t = profNowUs();
+        traceBegin("draw rows");
+        editorDrawRows(ab);
+        traceEnd("draw rows", V->screenRows);
+        profAdd(PROF_ROWS, t);
+        editorDrawStatusBar(ab, V == focus);
+        return;
+    }
+    editorDrawLayout(ab, n->child[0], focus);
+    editorDrawLayout(ab, n->child[1], focus);
+    if (n->vertical)
+    {
+        struct layoutNode *right = n->child[1];
+        for (int y = 0; y < n->rows; y++)
+        {
+            char pos[32];
+            int plen = snprintf(pos, sizeof(pos), "\x1b[%d;%dH\x1b[7m \x1b[m",
+                                right->top + y + 1, right->left);
+            abAppend(ab, pos, plen);
+        }
+    }
+}
+
+void editorRefreshScreen()
+{
+    long long t = profNowUs();
+    editorScroll();
+    // NOTE: a replayed macro is drawn once, when it's done.
+    if (E.macro.playing) { return; }
+    if (prof.keyAt) { prof.cur.phase[PROF_KEY] = t - prof.keyAt; }
+    profAdd(PROF_SCROLL, t);
+    traceBegin("refresh");
+
+    struct abuf ab = ABUF_INIT;
+
+    /*write(STDOUT_FILENO, "\x1b[2J", 4);*/
+    /*write(STDOUT_FILENO, "\x1b[H", 3);*/
+    abAppend(&ab, "\x1b[?25l", 6);
+    /*abAppend(&ab, "\x1b[2J", 4);*/
+    abAppend(&ab, "\x1b[H", 3);
+
+    if (grep.visible) { editorGrepDrawRows(&ab); }
+    else
+    {
+        // NOTE: V and B follow the view being drawn, then go back.
+        struct editorView *focus = V;
+        editorDrawLayout(&ab, E.layout, focus);
+        V = focus;
+        B = focus->buf;
+    }
+    editorDrawMessageBar(&ab);
+
+    char buf[32];
+    if (grep.visible) { snprintf(buf, sizeof(buf), "\x1b[%d;1H", grep.sel - grep.top + 1); }
+    else if (B->hex)
+    {
+        int y, x;
+        editorHexCursor(&y, &x);
+        snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, x + 1);
+    }
+    else
+    {
+        snprintf(buf, sizeof(buf), "\x1b[%d;%dH", V->top + (V->cy - V->rowoff) + 1,
+                                                  V->left + (V->rx - V->coloff) + 1);
+    }
+    abAppend(&ab, buf, strlen(buf));
+
+    abAppend(&ab, "\x1b[?25h", 6);
+
+    t = profNowUs();
+    traceBegin("write");
+    if (frameSink) { abAppend(frameSink, ab.b, ab.len); }
+    else if (!serverFrame(ab.b, ab.len)) { write(STDOUT_FILENO, ab.b, ab.len); }
+    traceEnd("write", ab.len);
+    profAdd(PROF_WRITE, t);
+    profFrameEnd(ab.len);
+    traceEnd("refresh", -1);
+    abFree(&ab);
+}
+
+void editorSetStatusMessage(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(E.statusMsg, sizeof(E.statusMsg), fmt, ap);
+    va_end(ap);
+    E.statusMsgTime = time(NULL);
+    editorTimerSet(TIMER_STATUS_MSG, 5000, NULL);
+}
+
+/*** macros ***/
+
+void editorMacroRecord(void)
+{
+    struct keyMacro *km = &E.macro;
+    if (km->recording)
+    {
+        // NOTE: the key that stopped recording isn't part of the macro.
+        km->recording = 0;
+        km->count--;
+        editorSetStatusMessage("Macro recorded: %d key%s", km->count, km->count == 1 ? "" : "s");
+        return;
+    }
+    km->count = 0;
+    km->recording = 1;
+    editorSetStatusMessage("Recording macro... C-k to stop");
+}
+
+void editorMacroPlay(int times, int lines)
+{
+    /*
+     * Replays the macro `times` times, or once at the start of each of
+     * the next `lines` lines (-1 for all of them). Nothing is drawn in
+     * between.
+     */
+    struct keyMacro *km = &E.macro;
+    if (km->recording)
+    {
+        editorSetStatusMessage("Can't replay a macro while recording one");
+        km->count--;
+        return;
+    }
+    if (km->count == 0)
+    {
+        editorSetStatusMessage("No macro recorded (C-k to record)");
+        return;
+    }
+
+    long long start = editorNowMs();
+    int line = V->cy;
+    int runs = lines ? lines : times;
+    int done = 0;
+    editorUndoSeal();
+    B->undoGroup++;
+    km->playing = 1;
+    while (runs < 0 || done < runs)
+    {
+        int before = B->numRows;
+        if (lines)
+        {
+            if (line >= B->numRows) { break; }
+            V->cy = line;
+            V->cx = 0;
+        }
+
+        km->pos = 0;
+        while (km->pos < km->count) { editorProcessKeypress(); }
+        done++;
+
+        // NOTE: lines the macro added or removed shift the ones after.
+        // Having removed more than its own, the next line is where this
+        // one was: rows above it were already done.
+        int next = line + 1 + B->numRows - before;
+        line = next > line ? next : line;
+    }
+    km->playing = 0;
+    editorUndoSeal();
+
+    editorSetStatusMessage("Macro replayed %d time%s in %lld ms", done,
+                           done == 1 ? "" : "s", editorNowMs() - start);
+}
+
+void editorMacroPrompt(void)
+{
+    if (E.macro.recording)
+    {
+        editorMacroPlay(0, 0);
+        return;
+    }
+    char *answer = editorPrompt("Replay macro: %s (N times, Nl on N lines, l to the end, r on the region)", NULL);
+    if (answer == NULL) { return; }
+
+    int n = atoi(answer);
+    int sy, sx, ey, ex;
+    if (strchr(answer, 'r'))
+    {
+        if (editorSelection(&sy, &sx, &ey, &ex))
+        {
+            editorMarkClear();
+            V->cy = sy;
+            editorMacroPlay(0, ey - sy + 1);
+        }
+        else { editorSetStatusMessage("No region selected"); }
+    }
+    else if (strchr(answer, 'l')) { editorMacroPlay(0, n > 0 ? n : -1); }
+    else if (n > 0) { editorMacroPlay(n, 0); }
+    else { editorSetStatusMessage("Replay what? %s", answer); }
+    free(answer);
+}
+
+/*** buffers ***/
+
+/*
+ * Every open file is a buffer in E.buffers; a view is a window onto one,
+ * with its own cursor and scroll position. Views of the same buffer
+ * share its rows, highlighting and match index. Files named on the
+ * command line are only read in when a view first shows them.
+ */
+
+struct editorBuffer *editorBufferNew(const char *filename)
+{
+    struct editorBuffer *b = calloc(1, sizeof(struct editorBuffer));
+    b->filename = filename ? strdup(filename) : NULL;
+    b->loaded = (filename == NULL);
+    b->match.buf = b;
+    b->match.cur_row = -1;
+
+    E.buffers = realloc(E.buffers, sizeof(struct editorBuffer *) * (E.nbuffers + 1));
+    E.buffers[E.nbuffers++] = b;
+    return b;
+}
+
+void editorBufferLoad(struct editorBuffer *b)
+{
+    if (b->loaded) { return; }
+    b->loaded = 1;
+
+    struct editorBuffer *saved = B;
+    B = b;
+    // NOTE: a file that doesn't exist yet is a new, empty buffer, and a
+    // binary one is shown as hex.
+    char *filename = strdup(b->filename);
+    if (access(filename, F_OK) != 0) { editorSelectSyntaxHighlight(); }
+    else if (hexIsBinary(filename)) { editorHexOpen(b); }
+    else { editorOpen(filename); }
+    free(filename);
+    B = saved;
+}
+
+struct editorBuffer *editorBufferFind(const char *filename)
+{
+    for (int i = 0; i < E.nbuffers; i++)
+    {
+        struct editorBuffer *b = E.buffers[i];
+        if (b->filename && strcmp(b->filename, filename) == 0) { return b; }
+    }
+    return NULL;
+}
+
+int editorBufferIndex(struct editorBuffer *b)
+{
+    for (int i = 0; i < E.nbuffers; i++)
+    {
+        if (E.buffers[i] == b) { return i; }
+    }
+    return -1;
+}
+
+void editorViewShow(struct editorView *v, struct editorBuffer *b)
+{
+    /*
+     * Points `v` at `b`, starting where another view of `b` is, or at
+     * the top.
+     */
+    if (v->buf == b) { return; }
+    v->buf = b;
+    v->cx = v->cy = v->px = 0;
+    v->rowoff = v->coloff = 0;
+    v->hexCur = v->hexTop = 0;
+    v->cursors.count = 0;
+    v->markSet = 0;
+    editorBufferLoad(b);
+
+    struct editorView *other = NULL;
+    for (struct layoutNode *n = layoutFirstLeaf(E.layout); n && !other; n = layoutNextLeaf(n))
+    {
+        if (n->view != v && n->view->buf == b) { other = n->view; }
+    }
+    // NOTE: or where a view of another of the server's clients is.
+    if (other == NULL) { other = serverViewOf(b, v); }
+    if (other)
+    {
+        v->cx = other->cx;
+        v->cy = other->cy;
+        v->rowoff = other->rowoff;
+        v->hexCur = other->hexCur;
+        v->hexTop = other->hexTop;
+    }
+    if (v == V) { B = b; }
+}
+
+void editorBufferOpen(const char *filename)
+{
+    // NOTE: the server's clients each have their own working directory,
+    // so its buffers are kept by full path.
+    char *path = serverActive() ? editorPathAbsolute(filename) : strdup(filename);
+    struct editorBuffer *b = editorBufferFind(path);
+    if (b == NULL) { b = editorBufferNew(path); }
+    free(path);
+    editorViewShow(V, b);
+}
+
+void editorBufferOpenPrompt(void)
+{
+    char *filename = editorPrompt("Open file: %s", NULL);
+    if (filename == NULL) { return; }
+    editorBufferOpen(filename);
+    free(filename);
+}
+
+void editorBufferCycle(int dir)
+{
+    if (E.nbuffers < 2) { return; }
+    int i = editorBufferIndex(B);
+    editorViewShow(V, E.buffers[(i + dir + E.nbuffers) % E.nbuffers]);
+}
+
+void editorBufferSwitch(void)
+{
+    /*
+     * Lists the buffers in the prompt; takes a number, or any part of a
+     * file name.
+     */
+    char list[160];
+    int len = 0;
+    for (int i = 0; i < E.nbuffers && len < (int)sizeof(list) - 1; i++)
+    {
+        struct editorBuffer *b = E.buffers[i];
+        const char *name = editorBufferName(b);
+        const char *slash = strrchr(name, '/');
+        // NOTE: the prompt is a format string, so a '%' in a name is doubled.
+        char entry[64];
+        int elen = 0;
+        for (const char *c = slash ? slash + 1 : name; *c && elen < (int)sizeof(entry) - 2; c++)
+        {
+            if (*c == '%') { entry[elen++] = '%'; }
+            entry[elen++] = *c;
+        }
+        entry[elen] = '\0';
+        len += snprintf(&list[len], sizeof(list) - len, "%s%d:%s%s",
+                        i ? " " : "", i + 1, entry, b->dirty ? "+" : "");
+    }
+    // NOTE: and the list must not be cut between the two.
+    if (len >= (int)sizeof(list)) { len = sizeof(list) - 1; }
+    if (len > 0 && list[len - 1] == '%')
+    {
+        int run = 0;
+        while (run < len && list[len - 1 - run] == '%') { run++; }
+        if (run % 2) { list[len - 1] = '\0'; }
+    }
+
+    char prompt[192];
+    snprintf(prompt, sizeof(prompt), "Buffer [%s]: %%s", list);
+    char *answer = editorPrompt(prompt, NULL);
+    if (answer == NULL) { return; }
+
+    struct editorBuffer *b = NULL;
+    int n = atoi(answer);
+    if (n >= 1 && n <= E.nbuffers) { b = E.buffers[n - 1]; }
+    for (int i = 0; b == NULL && i < E.nbuffers; i++)
+    {
+        if (E.buffers[i]->filename && strstr(E.buffers[i]->filename, answer))
+        {
+            b = E.buffers[i];
+        }
+    }
+
+    if (b) { editorViewShow(V, b); }
+    else { editorSetStatusMessage("No buffer matches %s", answer); }
+    free(answer);
+}
+
+void editorBufferKill(void)
+{
+    if (B->dirty)
+    {
+        char *answer = editorPrompt("Buffer modified; kill anyway? (y/n) %s", NULL);
+        int yes = answer && (answer[0] == 'y' || answer[0] == 'Y');
+        free(answer);
+        if (!yes) { return; }
+    }
+
+    struct editorBuffer *dead = B;
+    if (dead == stream.buf) { editorStreamClose(); }
+    int i = editorBufferIndex(dead);
+    memmove(&E.buffers[i], &E.buffers[i + 1], sizeof(struct editorBuffer *) * (E.nbuffers - i - 1));
+    E.nbuffers--;
+    if (E.nbuffers == 0) { editorBufferNew(NULL); }
+
+    struct editorBuffer *next = E.buffers[i < E.nbuffers ? i : E.nbuffers - 1];
+    for (struct layoutNode *n = layoutFirstLeaf(E.layout); n; n = layoutNextLeaf(n))
+    {
+        if (n->view->buf == dead) { editorViewShow(n->view, next); }
+    }
+    serverBufferGone(dead, next);
+
+    B = dead;
+    matchIndexClear(&dead->match);
+    editorUndoClear();
+    editorFreeRows();
+    B = V->buf;
+    // NOTE: clearing leaves the stacks' arrays for reuse.
+    free(dead->undo.h);
+    free(dead->redo.h);
+    lineIndexFree(&dead->lines);
+    hexFileClose(dead->hex);
+    free(dead->filename);
+    free(dead);
+}
+
+int editorBuffersDirty(void)
+{
+    int n = 0;
+    for (int i = 0; i < E.nbuffers; i++) { n += E.buffers[i]->dirty != 0; }
+    return n;
+}
+
+long long editorUndoMemory(struct undoStack *s)
+{
+    long long n = sizeof(struct undoHunk) * (long long)s->cap;
+    for (int i = 0; i < s->count; i++)
+    {
+        struct undoHunk *h = &s->h[i];
+        n += sizeof(struct undoLine) * (long long)h->nold;
+        for (int j = 0; j < h->nold; j++) { n += h->old[j].size + 1; }
+    }
+    return n;
+}
+
+long long editorBufferMemory(struct editorBuffer *b, long long *rows, long long *undo, long long *search)
+{
+    /*
+     * Row memory is kept up to date in b->mem; the row array, undo
+     * history and match index are sized here, on request.
+     */
+    struct rowMemory *m = &b->mem;
+    struct matchIndex *mi = &b->match;
+    *rows = b->row ? malloc_usable_size(b->row) : 0;
+    *undo = editorUndoMemory(&b->undo) + editorUndoMemory(&b->redo);
+    *search = sizeof(struct searchMatch) * (long long)mi->cap;
+    for (int i = 0; i < mi->nslices; i++)
+    {
+        *search += sizeof(struct searchMatch) * (long long)mi->slices[i].cap;
+    }
+    if (b->hex) { *undo += sizeof(struct hexPatch) * (long long)b->hex->cap; }
+    return *rows + m->chars + m->render + m->hl + m->rxcache + m->slack + m->cold +
+           *undo + *search;
+}
+
+char *memFormat(char *buf, long long bytes)
+{
+    // NOTE: buf needs room for 16 bytes.
+    if (bytes >= 1024 * 1024) { snprintf(buf, 16, "%.1fM", bytes / (1024.0 * 1024)); }
+    else if (bytes >= 1024) { snprintf(buf, 16, "%.1fK", bytes / 1024.0); }
+    else { snprintf(buf, 16, "%dB", (int)bytes); }
+    return buf;
 }
 
+void editorMemoryReport(void)
+{
+    long long rows, undo, search;
+    long long total = editorBufferMemory(B, &rows, &undo, &search);
+    long long all = 0;
+    for (int i = 0; i < E.nbuffers; i++)
+    {
+        long long r, u, s;
+        all += editorBufferMemory(E.buffers[i], &r, &u, &s);
+    }
 
-
-// Jump to the next paragraph: search downward for a blank line and then to the
-// first non-blank row after that blank.
-void editorMoveCursorParagraphDown() {
-    if (E.cy >= E.numRows - 1) return;  // Already at the bottom.
-
-    int target = E.cy;
-    // Search downward for a blank row.
-    for (int i = E.cy + 1; i < E.numRows; i++) {
-        if (E.row[i].size == 0) {
-            // Found a blank line. Now, jump to the first non-blank row after it.
-            for (int j = i + 1; j < E.numRows; j++) {
-                if (E.row[j].size != 0) {
-                    target = j;
-                    break;
-                }
-            }
-            // If no non-blank row exists after the blank line, stay at the blank.
-            if (target == E.cy) target = i;
-            break;
-        }
-        // If no blank line is encountered, simply go to the bottom.
-        target = i;
+    if (B->hex)
+    {
+        // NOTE: mapped pages belong to the page cache, not to us.
+        char b[4][16];
+        editorSetStatusMessage("mem %s | hex: %s mapped of %s, %d unsaved bytes | %d buffers %s",
+                               memFormat(b[0], total), memFormat(b[1], B->hex->mapLen),
+                               memFormat(b[2], B->hex->size), B->hex->npatch,
+                               E.nbuffers, memFormat(b[3], all));
+        return;
     }
 
-    E.cy = target;
-    int rowlen = (E.cy < E.numRows) ? E.row[E.cy].size : 0;
-    if (E.cx > rowlen) E.cx = rowlen;
+    char ratio[32] = "new file";
+    if (B->diskSize > 0) { snprintf(ratio, sizeof(ratio), "%.1fx disk", (double)total / B->diskSize); }
+
+    char b[11][16];
+    struct rowMemory *m = &B->mem;
+    editorSetStatusMessage("mem %s (%s) | rows %s chars %s render %s hl %s rx %s "
+                           "malloc %s cold %s undo %s search %s | %d buffers %s",
+                           memFormat(b[0], total), ratio, memFormat(b[1], rows),
+                           memFormat(b[2], m->chars), memFormat(b[3], m->render),
+                           memFormat(b[4], m->hl), memFormat(b[5], m->rxcache),
+                           memFormat(b[6], m->slack), memFormat(b[7], m->cold),
+                           memFormat(b[8], undo), memFormat(b[9], search),
+                           E.nbuffers, memFormat(b[10], all));
 }
 
-void editorFreeRow(erow *row)
-{
-    free(row->render);
-    free(row->chars);
-    free(row->hl);
-}
+/*** windows ***/
 
-void editorDelRow(int at)
+/*
+ * Views are the leaves of a binary layout tree; each split divides its
+ * area between two children, stacked or side by side.
+ */
+
+struct layoutNode *layoutLeaf(struct editorView *v)
 {
-    if (at < 0 || at >= E.numRows) { return; }
-    editorFreeRow(&E.row[at]);
-    memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numRows - at - 1));
-    for (int j = at; j < E.numRows - 1; j++) { E.row[j].idx--; }
-    E.numRows--;
-    /*E.dirty++;*/
+    struct layoutNode *n = calloc(1, sizeof(struct layoutNode));
+    n->view = v;
+    return n;
 }
 
-void editorRowInsertChar(erow *row, int at, int c)
+struct layoutNode *layoutFirstLeaf(struct layoutNode *n)
 {
-    if (at < 0 || at > row->size) { at = row->size; }
-    row->chars = realloc(row->chars, row->size + 2);
-    memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-    row->size++;
-    row->chars[at] = c;
-    editorUpdateRow(row);
-    E.dirty++;
+    while (n->child[0]) { n = n->child[0]; }
+    return n;
 }
 
-void editorRowAppendString(erow *row, char *s, size_t len)
+struct layoutNode *layoutNextLeaf(struct layoutNode *n)
 {
-    row->chars = realloc(row->chars, row->size + len + 1);
-    memcpy(&row->chars[row->size], s, len);
-    row->size += len;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
-    E.dirty++;
+    // NOTE: in drawing order, left/top before right/bottom.
+    while (n->parent && n->parent->child[1] == n) { n = n->parent; }
+    if (n->parent == NULL) { return NULL; }
+    return layoutFirstLeaf(n->parent->child[1]);
 }
 
-void editorRowDelChar(erow *row, int at)
+struct layoutNode *layoutFind(struct editorView *v)
 {
-    if (at < 0 || at >= row->size) { return; }
-    memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-    row->size--;
-    editorUpdateRow(row);
-    E.dirty++;
+    struct layoutNode *n = layoutFirstLeaf(E.layout);
+    while (n && n->view != v) { n = layoutNextLeaf(n); }
+    return n;
 }
 
-/*** editor ops ***/
-
-void editorInsertChar(int c)
+void layoutResize(struct layoutNode *n, int top, int left, int rows, int cols)
 {
-    if (E.cy == E.numRows)
+    n->top = top;
+    n->left = left;
+    n->rows = rows;
+    n->cols = cols;
+    if (n->view)
     {
-        editorInsertRow(E.numRows, "", 0);
+        n->view->top = top;
+        n->view->left = left;
+        n->view->screenRows = rows > 1 ? rows - 1 : 1;
+        n->view->screenCols = cols > 0 ? cols : 1;
+        return;
     }
-    editorRowInsertChar(&E.row[E.cy], E.cx, c);
-    E.cx++;
-}
-
-void editorInsertNewline()
-{
-    if (E.cx == 0)
+    if (n->vertical)
     {
-        editorInsertRow(E.cy, "", 0);
+        // NOTE: one column between the two is the separator.
+        int a = (cols - 1) / 2;
+        layoutResize(n->child[0], top, left, rows, a);
+        layoutResize(n->child[1], top, left + a + 1, rows, cols - a - 1);
     }
     else
     {
-        erow *row = &E.row[E.cy];
-        editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-        row = &E.row[E.cy];
-        row->size = E.cx;
-        row->chars[row->size] = '\0';
-        editorUpdateRow(row);
+        int a = rows / 2;
+        layoutResize(n->child[0], top, left, a, cols);
+        layoutResize(n->child[1], top + a, left, rows - a, cols);
     }
-    E.cy++;
-    E.cx = 0;
 }
 
-void editorDelChar()
+void editorLayoutResize(void)
 {
-    if (E.cy == E.numRows) { return; }
-    if (E.cx == 0 && E.cy == 0) { return; }
-
-    erow *row = &E.row[E.cy];
-    if (E.cx > 0)
-    {
-        editorRowDelChar(row, E.cx - 1);
-        E.cx--;
-    }
-    else if (WEISS_BACKSPACE_APPEND)// NOTE(liam): implicitly E.cx == 0
-    {
-        E.cx = E.row[E.cy - 1].size;
-        editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
-        editorDelRow(E.cy);
-        E.cy--;
-    }
+    layoutResize(E.layout, 0, 0, E.screenRows + 1, E.screenCols);
 }
 
-int getScreenCenter(void)
+void editorFocus(struct editorView *v)
 {
-    int center = E.cy - E.screenRows / 2;
-    if (center < 0)
-    {
-        center = 0;
-    }
-    else if (center >= E.numRows - E.screenRows)
-    {
-        center = E.numRows - E.screenRows;
-    }
-    return center;
+    V = v;
+    B = v->buf;
+    editorBufferLoad(B);
 }
 
-/*** file i/o ***/
-
-char *editorRowsToString(int *buflen)
+void editorWindowSplit(int vertical)
 {
-    int totlen = 0;
-    int j;
-    for (j = 0; j < E.numRows; j++)
+    struct layoutNode *leaf = layoutFind(V);
+    if ((vertical && leaf->cols < 21) || (!vertical && leaf->rows < 6))
     {
-        totlen += E.row[j].size + 1;
-    }
-    *buflen = totlen;
-
-    char *buf = malloc(totlen);
-    char *p = buf;
-    for (j = 0; j < E.numRows; j++)
-    {
-        memcpy(p, E.row[j].chars, E.row[j].size);
-        p += E.row[j].size;
-        *p = '\n';
-        p++;
+        editorSetStatusMessage("Window too small to split");
+        return;
     }
 
-    return buf;
+    struct editorView *v = calloc(1, sizeof(struct editorView));
+    *v = *V;
+    v->cursors.c = NULL;
+    v->cursors.count = v->cursors.cap = 0;
+
+    // NOTE: the leaf becomes the split, and the old view moves down.
+    struct layoutNode *a = layoutLeaf(V);
+    struct layoutNode *b = layoutLeaf(v);
+    a->parent = b->parent = leaf;
+    leaf->view = NULL;
+    leaf->vertical = vertical;
+    leaf->child[0] = a;
+    leaf->child[1] = b;
+    editorLayoutResize();
 }
 
-void editorOpen(char *filename)
+void editorWindowsInit(void)
 {
-    free(E.filename);
-    E.filename = strdup(filename);
+    // NOTE: one view of the first buffer fills the screen.
+    if (E.nbuffers == 0) { editorBufferNew(NULL); }
+    struct editorView *view = calloc(1, sizeof(struct editorView));
+    view->buf = E.buffers[0];
+    E.layout = layoutLeaf(view);
+    editorLayoutResize();
+    editorFocus(view);
+}
 
+void editorWindowNext(void)
+{
+    struct layoutNode *n = layoutNextLeaf(layoutFind(V));
+    editorFocus((n ? n : layoutFirstLeaf(E.layout))->view);
+}
 
-    FILE *fp = fopen(filename, "r");
-    if (!fp) die("fopen");
+void editorViewFree(struct editorView *v)
+{
+    free(v->cursors.c);
+    free(v);
+}
 
-    editorSelectSyntaxHighlight();
+void layoutFree(struct layoutNode *n, struct editorView *keep)
+{
+    if (n == NULL) { return; }
+    layoutFree(n->child[0], keep);
+    layoutFree(n->child[1], keep);
+    if (n->view && n->view != keep) { editorViewFree(n->view); }
+    free(n);
+}
 
-    char *line = NULL;
-    size_t linecap = 0;
-    ssize_t linelen;
-    while ((linelen = getline(&line, &linecap, fp)) != -1)
+void editorWindowClose(void)
+{
+    struct layoutNode *leaf = layoutFind(V);
+    struct layoutNode *parent = leaf->parent;
+    if (parent == NULL)
     {
-        while (linelen > 0 && (line[linelen - 1] == '\n' ||
-                    line[linelen - 1] == '\r'))
-        { linelen--; }
-        editorInsertRow(E.numRows, line, linelen);
+        editorSetStatusMessage("Can't close the only window");
+        return;
     }
 
-    free(line);
-    fclose(fp);
-    E.dirty = 0;
+    // NOTE: the sibling takes the parent's place in the tree.
+    struct layoutNode *sibling = parent->child[parent->child[0] == leaf];
+    sibling->parent = parent->parent;
+    if (parent->parent == NULL) { E.layout = sibling; }
+    else { parent->parent->child[parent->parent->child[1] == parent] = sibling; }
+
+    editorViewFree(leaf->view);
+    free(leaf);
+    free(parent);
+    editorLayoutResize();
+    editorFocus(layoutFirstLeaf(sibling)->view);
 }
 
-void editorSave()
+void editorWindowOnly(void)
 {
-    if (E.filename == NULL) {
-        E.filename = editorPrompt("Save as: %s", NULL);
-        if (E.filename == NULL)
-        {
-            editorSetStatusMessage("Save cancelled");
-            return;
-        }
-        editorSelectSyntaxHighlight();
-    }
+    struct editorView *v = V;
+    layoutFree(E.layout, v);
+    E.layout = layoutLeaf(v);
+    editorLayoutResize();
+}
 
-    int len;
-    char *buf = editorRowsToString(&len);
+void editorWindowCommand(void)
+{
+    // NOTE: C-x prefix, emacs style.
+    editorSetStatusMessage("C-x -");
+    editorRefreshScreen();
+    int c = editorReadKey();
+    editorSetStatusMessage("");
 
-    int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-    if (fd != -1)
+    switch (c)
     {
-
-        if (ftruncate(fd, len) != -1)
-        {
-            if (write(fd, buf, len) == len)
-            {
-                close(fd);
-                free(buf);
-                E.dirty = 0;
-                editorSetStatusMessage("%d bytes written to disk", len);
-                return;
-            }
-        }
-        close(fd);
+        case '2': editorWindowSplit(0); break;
+        case '3': editorWindowSplit(1); break;
+        case 'o': editorWindowNext(); break;
+        case '0': editorWindowClose(); break;
+        case '1': editorWindowOnly(); break;
+        case 'b': editorBufferSwitch(); break;
+        case 'f': case CTRL_KEY('f'): editorBufferOpenPrompt(); break;
+        case 'k': editorBufferKill(); break;
+        case 'h': editorHexToggle(); break;
+        case 'n': case ARROW_RIGHT: editorBufferCycle(1); break;
+        case 'p': case ARROW_LEFT: editorBufferCycle(-1); break;
+        default: editorSetStatusMessage("C-x: 2/3 split, o other, 0/1 close, b/n/p buffer, f open, k kill, h hex");
     }
-    free(buf);
-    editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
 }
 
-void editorReload() {
-    if (E.filename == NULL) {
-        editorSetStatusMessage("No file to reload.");
-        return;
-    }
-
-    // Optionally warn the user that unsaved changes will be lost.
-    // You can implement a confirmation prompt here if needed.
+/*** server ***/
+
+/*
+ * `weiss --server` keeps buffers loaded, highlighted and indexed with no
+ * terminal of its own. `weiss -c file...` is a thin client: it puts its
+ * terminal in raw mode, forwards keys over a Unix socket and writes out
+ * whatever comes back, starting a server first if none is running.
+ *
+ * Each client has its own layout, views, screen size, message and key
+ * ring; serverSwitch() swaps them into E, V and B, so the rest of the
+ * editor only ever deals with one terminal. Keys are handled one client
+ * at a time, and a client sitting in a prompt holds the others' keys
+ * until it's done.
+ *
+ * Client to server is framed: a type byte, a little-endian 16-bit
+ * length, then the payload. Server to client is terminal output, where
+ * a frame only carries the rows that changed since the last one.
+ */
+
+#define SERVER_MSG_MAX PATH_MAX
+#define SERVER_KEYS_MAX 1024 // bytes of input per message
+#define SERVER_SPAWN_WAIT_MS 2000
+
+enum serverMsg {
+    SERVER_MSG_KEYS = 1,
+    SERVER_MSG_SIZE, // rows and columns, 16 bits each
+    SERVER_MSG_CWD,
+    SERVER_MSG_OPEN, // a full path
+    SERVER_MSG_HEX, // same, but shown as hex
+    SERVER_MSG_ATTACH // done opening, show the first file
+};
 
-    // Free the current file contents.
-    for (int i = 0; i < E.numRows; i++) {
-        free(E.row[i].chars);
-        // Free additional allocated members (e.g., rendered line) if applicable.
-    }
-    free(E.row);
-    E.row = NULL;
-    E.numRows = 0;
+struct editorClient {
+    int fd;
+    struct inputRing input; // keys not handled yet, while not current
+    unsigned char msg[SERVER_MSG_MAX + 3]; // read, but not yet whole
+    int msgLen;
+    struct layoutNode *layout; // NULL until attached
+    struct editorView *view;
+    struct editorBuffer *first; // first file opened, shown on attach
+    int screenRows;
+    int screenCols;
+    char statusMsg[160];
+    time_t statusMsgTime;
+    char *cwd;
+    char *frame; // last frame sent, the next one is diffed against it
+    int frameLen;
+};
 
-    // Reopen the file to load its current contents.
-    char *filename = strdup(E.filename);
-    editorOpen(filename);
+struct editorServer {
+    int listenfd;
+    char path[108];
+    struct editorClient **clients;
+    int count;
+    struct editorClient *current; // whose state is in E, V and B
+};
 
-    // Reset cursor position and preferred horizontal position.
-    /*E.cx = E.cy = 0;*/
-    /*E.px = 0;*/
+struct editorServer server = { -1, "", NULL, 0, NULL };
 
-    // Mark the buffer as unmodified.
-    E.dirty = 0;
+void initEditor(void);
 
-    // Inform the user and refresh the screen.
-    editorSetStatusMessage("File reloaded successfully.");
-    editorRefreshScreen();
+int serverActive(void)
+{
+    return server.listenfd != -1;
 }
 
-/*** find ***/
-
-void editorFindCallback(char *query, int key)
+char *editorPathAbsolute(const char *name)
 {
-    static int last_match = -1;
-    static int direction = 1;
+    if (name[0] == '/') { return strdup(name); }
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) { return strdup(name); }
+    char *path = malloc(strlen(cwd) + strlen(name) + 2);
+    sprintf(path, "%s/%s", cwd, name);
+    return path;
+}
 
-    static int saved_hl_line;
-    static char *saved_hl = NULL;
+int serverSocketPath(char *path, int size)
+{
+    // NOTE: WEISS_SOCKET picks another socket, e.g. for a second server.
+    char *env = getenv("WEISS_SOCKET");
+    char *runtime = getenv("XDG_RUNTIME_DIR");
+    if (env && *env) { snprintf(path, size, "%s", env); return 0; }
+    if (runtime && *runtime) { snprintf(path, size, "%s/weiss.sock", runtime); return 0; }
 
-    if (saved_hl)
+    /*
+     * Without a runtime dir the socket goes in a directory of our own in
+     * /tmp. One somebody else made first, or left open to others, would
+     * let them take the socket's place, so it is refused.
+     */
+    char dir[64];
+    snprintf(dir, sizeof(dir), "/tmp/weiss-%d", (int)getuid());
+    snprintf(path, size, "%s/weiss.sock", dir);
+    if (mkdir(dir, 0700) == -1 && errno != EEXIST) { return -1; }
+    struct stat st;
+    if (lstat(dir, &st) == -1) { return -1; }
+    if (!S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077))
     {
-        memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
-        free(saved_hl);
-        saved_hl = NULL;
+        errno = EACCES;
+        return -1;
     }
+    return 0;
+}
 
-    if (key == '\r' || key == '\x1b')
+int serverConnect(const char *path)
+{
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) { return -1; }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
     {
-        last_match = -1;
-        direction = 1;
-        return;
+        close(fd);
+        return -1;
     }
-    else if (key == ARROW_RIGHT || key == ARROW_DOWN)
+    // NOTE: a server run by another user would see everything typed.
+    struct ucred cred;
+    socklen_t size = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &size) == -1 || cred.uid != getuid())
     {
-        direction = 1;
+        close(fd);
+        errno = EACCES;
+        return -1;
     }
-    else if (key == ARROW_LEFT || key == ARROW_UP)
+    return fd;
+}
+
+int serverListen(void)
+{
+    if (serverSocketPath(server.path, sizeof(server.path)) == -1) { return -1; }
+    // NOTE: a socket nobody answers on is left over from a server that died.
+    int fd = serverConnect(server.path);
+    if (fd != -1)
     {
-        direction = -1;
+        close(fd);
+        errno = EADDRINUSE;
+        return -1;
     }
-    else
+    if (errno == EACCES) { return -1; }
+    unlink(server.path);
+
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", server.path);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) { return -1; }
+    // NOTE: only the owner can connect, and the peer's uid is checked too.
+    mode_t mask = umask(077);
+    int bound = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(mask);
+    if (bound == -1 || listen(fd, 16) == -1)
     {
-        last_match = -1;
-        direction = 1;
+        close(fd);
+        return -1;
     }
+    server.listenfd = fd;
+    return 0;
+}
 
-    if (last_match == -1) { direction = 1; }
-    int current = last_match;
-    int i;
-    for (i = 0; i < E.numRows; i++)
-    {
-        current += direction;
-        if (current == -1) { current = E.numRows - 1; }
-        else if (current == E.numRows) { current = 0; }
-
-        erow *row = &E.row[current];
-        char *match = strstr(row->render, query);
-        if (match)
-        {
-            last_match = current;
-            E.cy = current;
-            E.cx = editorRowRxToCx(row, match - row->render);
-            E.rowoff = getScreenCenter();
+struct inputRing *serverRing(struct editorClient *c)
+{
+    return c == server.current ? &input : &c->input;
+}
 
-            saved_hl_line = current;
-            saved_hl = malloc(row->rsize);
-            memcpy(saved_hl, row->hl, row->rsize);
+void serverHangup(struct editorClient *c)
+{
+    // NOTE: the fd is closed when the client is reaped, see serverLoop.
+    struct inputRing *in = serverRing(c);
+    if (in->closed) { return; }
+    in->closed = 1;
+    epoll_ctl(events.epfd, EPOLL_CTL_DEL, c->fd, NULL);
+}
 
-            memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-            break;
-        }
+void serverSend(struct editorClient *c, const char *b, int len)
+{
+    while (len > 0 && !serverRing(c)->closed)
+    {
+        ssize_t n = send(c->fd, b, len, MSG_NOSIGNAL);
+        if (n == -1 && errno == EINTR) { continue; }
+        if (n <= 0) { serverHangup(c); return; }
+        b += n;
+        len -= n;
     }
 }
 
-void editorFind()
+void serverSwitch(struct editorClient *c)
 {
-    int saved_cx = E.cx;
-    int saved_cy = E.cy;
-    int saved_coloff = E.coloff;
-    int saved_rowoff = E.rowoff;
-
-    char *query = editorPrompt("Search: %s (ESC/Arrows/Enter)", editorFindCallback);
-    if (query)
+    /*
+     * Makes `c` the client whose layout, screen and keys are in E, V, B
+     * and the input ring; NULL makes none current.
+     */
+    struct editorClient *cur = server.current;
+    if (cur == c) { return; }
+    if (cur)
     {
-        free(query);
+        cur->layout = E.layout;
+        cur->view = V;
+        cur->screenRows = E.screenRows;
+        cur->screenCols = E.screenCols;
+        memcpy(cur->statusMsg, E.statusMsg, sizeof(E.statusMsg));
+        cur->statusMsgTime = E.statusMsgTime;
+        cur->input = input;
     }
-    else
+    server.current = c;
+    if (c == NULL)
+    {
+        input.head = input.tail = 0;
+        input.closed = 0;
+        return;
+    }
+
+    E.layout = c->layout;
+    V = c->view;
+    if (V) { B = V->buf; }
+    E.screenRows = c->screenRows;
+    E.screenCols = c->screenCols;
+    memcpy(E.statusMsg, c->statusMsg, sizeof(E.statusMsg));
+    E.statusMsgTime = c->statusMsgTime;
+    input = c->input;
+    // NOTE: relative paths typed at a prompt, and grep, go by the client's.
+    if (c->cwd && chdir(c->cwd) == -1)
     {
-        E.cx = saved_cx;
-        E.cy = saved_cy;
-        E.coloff = saved_coloff;
-        E.rowoff = saved_rowoff;
+        free(c->cwd);
+        c->cwd = NULL;
     }
 }
 
-/*** undo/redo ***/
-
-// TODO(liam): make these
-void editorUndo(void);
-void editorRedo(void);
-
-
-int editorReadKey()
+struct editorView *serverViewOf(struct editorBuffer *b, struct editorView *except)
 {
-    int nread;
-    char c;
-
-    while ((nread = read(STDIN_FILENO, &c, 1)) != 1)
+    // NOTE: a view of `b` in another client's layout.
+    for (int i = 0; i < server.count; i++)
     {
-        if (nread == -1 && errno != EAGAIN)
+        struct editorClient *c = server.clients[i];
+        if (c == server.current || c->layout == NULL) { continue; }
+        for (struct layoutNode *n = layoutFirstLeaf(c->layout); n; n = layoutNextLeaf(n))
         {
-            die("read");
+            if (n->view != except && n->view->buf == b) { return n->view; }
         }
     }
+    return NULL;
+}
 
-    if (c == '\x1b')
+void serverBufferGone(struct editorBuffer *dead, struct editorBuffer *next)
+{
+    // NOTE: other clients' views of a killed buffer move on to `next`.
+    for (int i = 0; i < server.count; i++)
     {
-        char seq[6] = {0};
-
-        if (read(STDIN_FILENO, &seq[0], 1) != 1) { return '\x1b'; }
-        if (read(STDIN_FILENO, &seq[1], 1) != 1) { return '\x1b'; }
-
-        if (seq[0] == '[')
-        {
-            if (seq[1] >= '0' && seq[1] <= '9')
-            {
-                if (read(STDIN_FILENO, &seq[2], 1) != 1) { return '\x1b'; }
-
-                if (seq[2] == ';')
-                {
-                    // TODO(liam): arrow case here; check gpt
-                    if (read(STDIN_FILENO, &seq[3], 1) != 1) return '\x1b';
-                    // Read the final letter that indicates the arrow direction.
-                    if (read(STDIN_FILENO, &seq[4], 1) != 1) return '\x1b';
-
-                    if (seq[3] == '5') { // Modifier 5 means Ctrl.
-                        switch (seq[4]) {
-                            case 'A': return CTRL_ARROW_UP;
-                            case 'B': return CTRL_ARROW_DOWN;
-                            case 'C': return CTRL_ARROW_RIGHT;
-                            case 'D': return CTRL_ARROW_LEFT;
-                        }
-                    }
-                }
-                else if (seq[2] == '~')
-                {
-                    switch (seq[1])
-                    {
-                        case '1': return HOME_KEY;
-                        case '3': return DEL_KEY;
-                        case '4': return END_KEY;
-                        case '5': return PAGE_UP;
-                        case '6': return PAGE_DOWN;
-                        case '7': return HOME_KEY;
-                        case '8': return END_KEY;
-                    }
-                }
-            }
-            else
-            {
-                switch (seq[1])
-                {
-                    case 'A': return ARROW_UP;
-                    case 'B': return ARROW_DOWN;
-                    case 'C': return ARROW_RIGHT;
-                    case 'D': return ARROW_LEFT;
-                    case 'H': return HOME_KEY;
-                    case 'F': return END_KEY;
-                }
-            }
-        }
-        else if (seq[0] == 'O')
+        struct editorClient *c = server.clients[i];
+        if (c->first == dead) { c->first = NULL; }
+        if (c == server.current || c->layout == NULL) { continue; }
+        for (struct layoutNode *n = layoutFirstLeaf(c->layout); n; n = layoutNextLeaf(n))
         {
-            switch(seq[1])
-            {
-                case 'H': return HOME_KEY;
-                case 'F': return END_KEY;
-            }
+            if (n->view->buf == dead) { editorViewShow(n->view, next); }
         }
-
-        return '\x1b';
-    }
-    else
-    {
-        return c;
     }
 }
 
-/*** append buf ***/
-
-struct abuf {
-    char *b;
-    int len;
-};
-
-#define ABUF_INIT {NULL, 0}
-
-void abAppend(struct abuf *ab, const char *s, int len)
+void serverAttach(struct editorClient *c)
 {
-    char *new = realloc(ab->b, ab->len + len);
+    /*
+     * Gives the current client its one window, on the first file it
+     * opened or else the first buffer. A buffer that is already loaded
+     * shows at once, where another client has its cursor.
+     */
+    if (E.nbuffers == 0) { editorBufferNew(NULL); }
+    struct editorView *view = calloc(1, sizeof(struct editorView));
+    E.layout = layoutLeaf(view);
+    editorLayoutResize();
+    editorViewShow(view, c->first ? c->first : E.buffers[0]);
+    editorFocus(view);
+    editorSetStatusMessage("HELP: C-S = save | C-Q = detach | C-F = find | C-T = replace | C-G = grep | C-X = windows");
+}
 
-    if (new == NULL)
+void serverMessage(struct editorClient *c, int type, const char *p, int len)
+{
+    struct editorClient *prev = server.current;
+    serverSwitch(c);
+    switch (type)
     {
-        return;
+        case SERVER_MSG_SIZE:
+        {
+            if (len < 4) { break; }
+            int rows = (unsigned char)p[0] | (unsigned char)p[1] << 8;
+            int cols = (unsigned char)p[2] | (unsigned char)p[3] << 8;
+            E.screenRows = rows > 3 ? rows - 2 : 1;
+            E.screenCols = cols > 0 ? cols : 1;
+            if (E.layout) { editorLayoutResize(); }
+            c->frameLen = 0;
+        } break;
+        case SERVER_MSG_CWD:
+        {
+            free(c->cwd);
+            c->cwd = strndup(p, len);
+        } break;
+        case SERVER_MSG_OPEN:
+        case SERVER_MSG_HEX:
+        {
+            if (len == 0) { break; }
+            char *path = strndup(p, len);
+            struct editorBuffer *b = editorBufferFind(path);
+            if (b == NULL) { b = editorBufferNew(path); }
+            if (type == SERVER_MSG_HEX && !b->loaded) { editorHexOpen(b); }
+            if (c->first == NULL) { c->first = b; }
+            free(path);
+        } break;
+        case SERVER_MSG_ATTACH:
+        {
+            if (E.layout == NULL) { serverAttach(c); }
+        } break;
     }
-    memcpy(&new[ab->len], s, len);
-    ab->b = new;
-    ab->len += len;
+    serverSwitch(prev);
 }
 
-void abFree(struct abuf *ab)
+int serverClientParse(struct editorClient *c, int all)
 {
-    free(ab->b);
+    /*
+     * Handles the whole messages read from `c` so far. Unless `all`,
+     * stops at the first one that isn't keys, as the rest need E.lock.
+     * Returns the bytes added to the client's key ring.
+     */
+    struct inputRing *in = serverRing(c);
+    int keys = 0, at = 0;
+    while (c->msgLen - at >= 3 && !in->closed)
+    {
+        unsigned char *m = &c->msg[at];
+        int len = m[1] | m[2] << 8;
+        if (len > SERVER_MSG_MAX) { serverHangup(c); break; }
+        if (c->msgLen - at - 3 < len) { break; }
+        if (m[0] == SERVER_MSG_KEYS)
+        {
+            // NOTE: left where they are until the ring has room.
+            if (INPUT_RING_SIZE - (in->tail - in->head) < (unsigned int)len) { break; }
+            for (int i = 0; i < len; i++) { in->buf[in->tail++ & (INPUT_RING_SIZE - 1)] = m[3 + i]; }
+            keys += len;
+        }
+        else if (!all)
+        {
+            editorWake();
+            break;
+        }
+        else { serverMessage(c, m[0], (char *)&m[3], len); }
+        at += 3 + len;
+    }
+    memmove(c->msg, &c->msg[at], c->msgLen - at);
+    c->msgLen -= at;
+    return keys;
 }
 
-/*** output ***/
-
-void editorScroll()
+int serverClientRead(struct editorClient *c, int all)
 {
-    E.rx = 0;
-    if (E.cy < E.numRows)
+    int room = sizeof(c->msg) - c->msgLen;
+    if (room > 0 && !serverRing(c)->closed)
     {
-        E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+        ssize_t n = recv(c->fd, &c->msg[c->msgLen], room, MSG_DONTWAIT);
+        if (n > 0) { c->msgLen += n; }
+        else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+        {
+            serverHangup(c);
+        }
     }
+    return serverClientParse(c, all);
+}
 
-    if (E.cy < E.rowoff)
-    {
-        E.rowoff = E.cy;
-    }
-    if (E.cy >= E.rowoff + E.screenRows)
+void serverAccept(void)
+{
+    int fd = accept4(server.listenfd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd == -1) { return; }
+    struct ucred cred;
+    socklen_t size = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &size) == -1 || cred.uid != getuid())
     {
-        E.rowoff = E.cy - E.screenRows + 1;
+        close(fd);
+        return;
     }
-    if (E.rx < E.coloff)
+    // NOTE: a client that stops reading is dropped, not left to stall the rest.
+    struct timeval tv = { 1, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    struct editorClient *c = calloc(1, sizeof(struct editorClient));
+    c->fd = fd;
+    c->screenRows = 22;
+    c->screenCols = 80;
+    server.clients = realloc(server.clients, sizeof(struct editorClient *) * (server.count + 1));
+    server.clients[server.count++] = c;
+    editorEventWatch(fd);
+}
+
+int serverHandle(int fd)
+{
+    // NOTE: with E.lock held; returns 0 if `fd` isn't the server's.
+    if (!serverActive()) { return 0; }
+    if (fd == server.listenfd)
     {
-        E.coloff = E.rx;
+        serverAccept();
+        return 1;
     }
-    if (E.rx >= E.coloff + E.screenCols)
+    for (int i = 0; i < server.count; i++)
     {
-        E.coloff = E.rx - E.screenCols + 1;
-    }
-}
-
-void editorIndentDown() {
-    if (E.cy >= E.numRows) return;
-    erow *row = &E.row[E.cy];
-    if (row->size == 0) return;  // Nothing to unindent.
-
-    int removeCount = 0;
-    if (WEISS_TAB_AS_SPACES) {
-        // Count up to WEISS_TAB_STOP leading spaces.
-        for (int i = 0; i < WEISS_TAB_STOP && i < row->size; i++) {
-            if (row->chars[i] == ' ') {
-                removeCount++;
-            } else {
-                break;
-            }
+        if (server.clients[i]->fd == fd)
+        {
+            serverClientRead(server.clients[i], 1);
+            return 1;
         }
-    } else {
-        // If not using spaces, remove a tab if present.
-        if (row->chars[0] == '\t')
-            removeCount = 1;
     }
-    if (removeCount == 0) return;  // No indent found.
-
-    // Remove the indent by shifting the rest of the row left.
-    memmove(row->chars, row->chars + removeCount, row->size - removeCount + 1); // include null terminator
-    row->size -= removeCount;
-    editorUpdateRow(row);
-
-    // Adjust the cursor: reduce E.cx by removeCount, ensuring it doesn't go negative.
-    if (E.cx >= removeCount) {
-        E.cx -= removeCount;
-    } else {
-        E.cx = 0;
-    }
-    E.dirty++;
-}
-
-void editorIndentUp() {
-    if (E.cy >= E.numRows) return;
-    erow *row = &E.row[E.cy];
-
-    // Determine indent string and length.
-    int indentSize = WEISS_TAB_STOP;  // Number of spaces if using spaces.
-    char indentStr[WEISS_TAB_STOP + 1];
-    if (WEISS_TAB_AS_SPACES) {
-        memset(indentStr, ' ', indentSize);
-    } else {
-        // If not using spaces, just insert a tab.
-        indentStr[0] = '\t';
-        indentSize = 1;
-    }
-    indentStr[indentSize] = '\0';
-
-    // Reallocate to make room for the indent.
-    row->chars = realloc(row->chars, row->size + indentSize + 1);
-    // Shift existing characters to the right.
-    memmove(row->chars + indentSize, row->chars, row->size + 1); // include null terminator
-    // Copy the indent string into the beginning.
-    memcpy(row->chars, indentStr, indentSize);
-    row->size += indentSize;
-    editorUpdateRow(row);
+    return 0;
+}
 
-    // Adjust the cursor: if not at the beginning, shift it right.
-    E.cx += indentSize;
-    E.dirty++;
+void serverParseAll(void)
+{
+    for (int i = 0; i < server.count; i++) { serverClientParse(server.clients[i], 1); }
 }
 
-void editorRowAppendToPrev()
+int serverInputFill(int ms)
 {
-    if (E.cy == 0) { return; }
+    /*
+     * editorInputFill() for the current client: waits at most `ms` for
+     * keys on its socket. Safe with or without E.lock held.
+     */
+    struct editorClient *c = server.current;
+    if (c == NULL || input.closed) { return 0; }
+    if (serverClientParse(c, 0)) { return 1; }
+    struct pollfd pfd = { c->fd, POLLIN, 0 };
+    if (poll(&pfd, 1, ms) < 1) { return 0; }
+    return serverClientRead(c, 0) > 0;
+}
 
-    erow *currentRow = &E.row[E.cy];
-    erow *prevRow = &E.row[E.cy - 1];
+int serverPending(void)
+{
+    // NOTE: keys, or a hangup, that the server's main loop has to see to.
+    if (!serverActive()) { return 0; }
+    if (input.head != input.tail || input.closed) { return 1; }
+    for (int i = 0; i < server.count; i++)
+    {
+        struct editorClient *c = server.clients[i];
+        if (c == server.current) { continue; }
+        if (c->input.closed || (c->layout && c->input.head != c->input.tail)) { return 1; }
+    }
+    return 0;
+}
 
-    int indent = 0;
-    while (indent < currentRow->size &&
-            (currentRow->chars[indent] == ' ' ||
-             currentRow->chars[indent] == '\t'))
-    { indent++; }
+int serverDetach(void)
+{
+    if (server.current == NULL) { return 0; }
+    serverHangup(server.current);
+    return 1;
+}
 
+int serverWrite(const char *b, int len)
+{
+    if (server.current == NULL) { return 0; }
+    serverSend(server.current, b, len);
+    return 1;
+}
 
-    editorRowAppendString(prevRow, currentRow->chars + indent, currentRow->size - indent);
+struct frameSeg {
+    int off, len; // frame bytes from one cursor move up to the next
+    int row, col; // where the move goes, -1 before the first
+};
 
-    editorDelRow(E.cy);
+int serverFrameSegs(const char *b, int len, struct frameSeg **segs)
+{
+    /*
+     * Cuts a frame at each cursor move, which the frame makes for every
+     * row, status bar and separator it draws. Returns the count.
+     */
+    int n = 0, cap = 64;
+    struct frameSeg *s = malloc(sizeof(struct frameSeg) * cap);
+    s[n++] = (struct frameSeg){ 0, 0, -1, -1 };
+    for (int i = 0; i + 1 < len; i++)
+    {
+        if (b[i] != '\x1b' || b[i + 1] != '[') { continue; }
+        int j = i + 2, row = 0, col = 0, semi = 0;
+        for (; j < len && (isdigit((unsigned char)b[j]) || b[j] == ';'); j++)
+        {
+            if (b[j] == ';') { semi++; }
+            else if (semi) { col = col * 10 + b[j] - '0'; }
+            else { row = row * 10 + b[j] - '0'; }
+        }
+        if (j == len || b[j] != 'H') { continue; }
 
-    E.cy--;
-    E.cx = prevRow->size;
+        if (n == cap)
+        {
+            cap *= 2;
+            s = realloc(s, sizeof(struct frameSeg) * cap);
+        }
+        s[n - 1].len = i - s[n - 1].off;
+        s[n++] = (struct frameSeg){ i, 0, row, col };
+        i = j;
+    }
+    s[n - 1].len = len - s[n - 1].off;
+    *segs = s;
+    return n;
 }
 
-void editorDrawRows(struct abuf *ab)
+int serverFrame(const char *b, int len)
 {
-    int y;
-    for (y = 0; y < E.screenRows; y++)
+    /*
+     * Sends the current client what changed since its last frame, plus
+     * the cursor at the end. A frame cut up differently (a resize, a
+     * split, grep) goes out whole. Returns 0 with no client current.
+     */
+    struct editorClient *c = server.current;
+    if (c == NULL) { return 0; }
+
+    struct frameSeg *now, *was = NULL;
+    int n = serverFrameSegs(b, len, &now);
+    int m = c->frameLen ? serverFrameSegs(c->frame, c->frameLen, &was) : 0;
+    int whole = n != m;
+    for (int i = 0; !whole && i < n - 1; i++)
     {
-        int filerow = y + E.rowoff;
-        if (filerow >= E.numRows) {
-            if (E.numRows == 0 && y == E.screenRows / 3)
-            {
-                char welcome[80];
-                int welcomelen = snprintf(welcome, sizeof(welcome),
-                        "weiss editor -- version %s", WEISS_VERSION);
-                if (welcomelen > E.screenCols)
-                {
-                    welcomelen = E.screenCols;
-                }
-
-                int padding = (E.screenCols - welcomelen) / 2;
-                if (padding)
-                {
-                    abAppend(ab, "~", 1);
-                    padding--;
-                }
-                while (padding--) abAppend(ab, " ", 1);
+        whole = now[i].row != was[i].row || now[i].col != was[i].col;
+    }
 
-                abAppend(ab, welcome, welcomelen);
-            }
-            else
+    struct abuf ab = ABUF_INIT;
+    if (whole)
+    {
+        abAppend(&ab, "\x1b[m\x1b[2J", 7);
+        abAppend(&ab, b, len);
+    }
+    else
+    {
+        /*
+         * A segment ends by clearing the rest of its line, which takes out
+         * whatever is drawn right of it, e.g. the other side of a split.
+         * So a change anywhere on a screen line resends all of that line.
+         */
+        int rows = 0;
+        for (int i = 0; i < n; i++) { if (now[i].row > rows) { rows = now[i].row; } }
+        char *changed = calloc(rows + 1, 1);
+        for (int i = 1; i < n - 1; i++)
+        {
+            if (now[i].len != was[i].len ||
+                memcmp(&b[now[i].off], &c->frame[was[i].off], now[i].len) != 0)
             {
-                /*write(STDOUT_FILENO, "~", 1);*/
-                abAppend(ab, "~", 1);
+                changed[now[i].row] = 1;
             }
         }
-        else
+        // NOTE: the first segment hides the cursor and the last shows it.
+        for (int i = 0; i < n; i++)
         {
-            int len = E.row[filerow].rsize - E.coloff;
-            if (len < 0) { len = 0; }
-            if (len > E.screenCols) { len = E.screenCols; }
-
-            char *c = &E.row[filerow].render[E.coloff];
-            unsigned char *hl = &E.row[filerow].hl[E.coloff];
-            int current_color = -1;
-            int j;
-
-            for (j = 0; j < len; j++)
-            {
-                if (iscntrl(c[j]))
-                {
-                    char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-                    abAppend(ab, "\x1b[7m", 4);
-                    abAppend(ab, &sym, 1);
-                    abAppend(ab, "\x1b[m", 3);
-                    if (current_color != -1)
-                    {
-                        char buf[16];
-                        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
-                        abAppend(ab, buf, clen);
-                    }
-                }
-                else if (hl[j] == HL_NORMAL)
-                {
-                    if (current_color != -1)
-                    {
-                        abAppend(ab, "\x1b[39m", 5);
-                        current_color = -1;
-                    }
-                    abAppend(ab, &c[j], 1);
-                }
-                else
-                {
-                    int color = editorSyntaxToColor(hl[j]);
-                    if (color != current_color)
-                    {
-                        char buf[16];
-                        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-                        abAppend(ab, buf, clen);
-                    }
-                    abAppend(ab, &c[j], 1);
-                    if (hl[j] == HL_MATCH)
-                    {
-                        // NOTE(liam): removes highlighting
-                        abAppend(ab, "\x1b[m", 3);
-                    }
-                }
-            }
-            abAppend(ab, "\x1b[39m", 5);
+            int edge = i == 0 || i == n - 1;
+            if (!edge && !changed[now[i].row]) { continue; }
+            if (!edge) { abAppend(&ab, "\x1b[m", 3); }
+            abAppend(&ab, &b[now[i].off], now[i].len);
         }
-
-        // NOTE(liam): Erase inline.
-        abAppend(ab, "\x1b[K", 3);
-        /*write(STDOUT_FILENO, "\r\n", 2);*/
-        abAppend(ab, "\r\n", 2);
+        free(changed);
     }
+    serverSend(c, ab.b, ab.len);
+    abFree(&ab);
+    free(now);
+    free(was);
+
+    c->frame = realloc(c->frame, len);
+    memcpy(c->frame, b, len);
+    c->frameLen = len;
+    return 1;
 }
 
-void editorDrawStatusBar(struct abuf *ab)
+void serverRefreshAll(void)
 {
-    abAppend(ab, "\x1b[7m", 4);
-    char status[80], rstatus[80], dirtstatus[6];
-
-    int dirtlen = snprintf(dirtstatus, sizeof(dirtstatus), "[%d]", E.dirty < 999 ? E.dirty : 999);
+    struct editorClient *prev = server.current;
+    for (int i = 0; i < server.count; i++)
+    {
+        serverSwitch(server.clients[i]);
+        if (E.layout && !input.closed) { editorRefreshScreen(); }
+    }
+    serverSwitch(prev);
+}
 
-    int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
-                       E.filename ? E.filename : "[.]", E.numRows,
-                       WEISS_DISPLAY_DIRT_COUNTER ? (E.dirty && dirtlen ? dirtstatus : "") :
-                       (E.dirty ? "[+]" : ""));
-    int rlen = snprintf(rstatus, sizeof(rstatus), "%d:%d | %s",
-                        E.cy + 1, E.cx + 1,
-                        E.syntax ? E.syntax->filetype : "nil");
-    if (len > E.screenCols) { len = E.screenCols; }
-    abAppend(ab, status, len);
-    while (len < E.screenCols)
+void serverReap(void)
+{
+    // NOTE: with no client current.
+    int kept = 0;
+    for (int i = 0; i < server.count; i++)
     {
-        if (E.screenCols - len == rlen)
+        struct editorClient *c = server.clients[i];
+        if (!c->input.closed)
         {
-            abAppend(ab, rstatus, rlen);
-            break;
+            server.clients[kept++] = c;
+            continue;
         }
-        else
+        close(c->fd);
+        if (E.layout == c->layout)
         {
-            abAppend(ab, " ", 1);
-            len++;
+            E.layout = NULL;
+            V = NULL;
         }
+        layoutFree(c->layout, NULL);
+        free(c->cwd);
+        free(c->frame);
+        free(c);
     }
-    abAppend(ab, "\x1b[m", 3);
-    abAppend(ab, "\r\n", 2);
+    server.count = kept;
 }
 
-void editorDrawMessageBar(struct abuf *ab)
+void serverLoop(void)
 {
-    abAppend(ab, "\x1b[K", 3);
-    int msglen = strlen(E.statusMsg);
-    if (msglen > E.screenCols) { msglen = E.screenCols; }
-    if (msglen && time(NULL) - E.statusMsgTime < 5)
+    /*
+     * Takes the keys each attached client has sent, then redraws them
+     * all: an edit in one shows in every view of the buffer.
+     */
+    while (1)
     {
-        abAppend(ab, E.statusMsg, msglen);
+        editorUnlock();
+        while (!serverPending()) { editorEventsPoll(); }
+        editorLock();
+
+        for (int i = 0; i < server.count; i++)
+        {
+            if (server.clients[i]->layout == NULL) { continue; }
+            serverSwitch(server.clients[i]);
+            while (input.head != input.tail && !input.closed) { editorProcessKeypress(); }
+            serverSwitch(NULL);
+        }
+        serverReap();
+        serverRefreshAll();
+        serverParseAll();
     }
 }
 
-void editorRefreshScreen()
+int serverMain(void)
 {
-    editorScroll();
+    if (serverListen() == -1)
+    {
+        fprintf(stderr, "weiss: can't listen on %s: %s\n", server.path, strerror(errno));
+        return 1;
+    }
+    // NOTE: clients come and go; the server stays up until it's killed.
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGHUP, SIG_IGN);
+    initEditor();
+    editorEventWatch(server.listenfd);
+    serverLoop();
+    return 0;
+}
 
-    struct abuf ab = ABUF_INIT;
+void clientSend(int fd, int type, const char *p, int len)
+{
+    char msg[SERVER_MSG_MAX + 3];
+    msg[0] = type;
+    msg[1] = len & 0xff;
+    msg[2] = len >> 8;
+    memcpy(&msg[3], p, len);
+    for (int at = 0; at < len + 3;)
+    {
+        ssize_t n = send(fd, &msg[at], len + 3 - at, MSG_NOSIGNAL);
+        if (n == -1 && errno == EINTR) { continue; }
+        if (n <= 0) { exit(1); }
+        at += n;
+    }
+}
 
-    /*write(STDOUT_FILENO, "\x1b[2J", 4);*/
-    /*write(STDOUT_FILENO, "\x1b[H", 3);*/
-    abAppend(&ab, "\x1b[?25l", 6);
-    /*abAppend(&ab, "\x1b[2J", 4);*/
-    abAppend(&ab, "\x1b[H", 3);
+void clientSendSize(int fd)
+{
+    int rows, cols;
+    if (getWindowSize(&rows, &cols) == -1)
+    {
+        rows = 24;
+        cols = 80;
+    }
+    char size[4] = { rows & 0xff, rows >> 8, cols & 0xff, cols >> 8 };
+    clientSend(fd, SERVER_MSG_SIZE, size, 4);
+}
 
-    editorDrawRows(&ab);
-    editorDrawStatusBar(&ab);
-    editorDrawMessageBar(&ab);
+void clientSpawnServer(void)
+{
+    // NOTE: forked twice so the server is nobody's child, then exec'd so
+    // it starts clean.
+    pid_t pid = fork();
+    if (pid == -1) { return; }
+    if (pid > 0)
+    {
+        waitpid(pid, NULL, 0);
+        return;
+    }
+    setsid();
+    if (fork() != 0) { _exit(0); }
+
+    int null = open("/dev/null", O_RDWR);
+    dup2(null, STDIN_FILENO);
+    dup2(null, STDOUT_FILENO);
+    dup2(null, STDERR_FILENO);
+    if (null > STDERR_FILENO) { close(null); }
+    char *args[] = { "weiss", "--server", NULL };
+    execv("/proc/self/exe", args);
+    _exit(1);
+}
 
-    char buf[32];
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1,
-                                              (E.rx - E.coloff) + 1);
-    abAppend(&ab, buf, strlen(buf));
+int clientMain(int argc, char **argv)
+{
+    /*
+     * `weiss -c [-x] file...`: hands the files to the server and relays
+     * the terminal until C-q detaches.
+     */
+    char path[108];
+    if (serverSocketPath(path, sizeof(path)) == -1)
+    {
+        fprintf(stderr, "weiss: can't use %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    int fd = serverConnect(path);
+    if (fd == -1 && errno == EACCES)
+    {
+        fprintf(stderr, "weiss: %s belongs to another user\n", path);
+        return 1;
+    }
+    if (fd == -1)
+    {
+        clientSpawnServer();
+        for (int waited = 0; fd == -1 && waited < SERVER_SPAWN_WAIT_MS; waited += 20)
+        {
+            usleep(20 * 1000);
+            fd = serverConnect(path);
+        }
+    }
+    if (fd == -1)
+    {
+        fprintf(stderr, "weiss: no server at %s\n", path);
+        return 1;
+    }
 
-    abAppend(&ab, "\x1b[?25h", 6);
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd))) { clientSend(fd, SERVER_MSG_CWD, cwd, strlen(cwd)); }
+    for (int i = 0; i < argc; i++)
+    {
+        int type = SERVER_MSG_OPEN;
+        if (strcmp(argv[i], "-x") == 0 && i + 1 < argc)
+        {
+            type = SERVER_MSG_HEX;
+            i++;
+        }
+        // NOTE: a pipe on stdin can't be handed over; the server has no stdin.
+        else if (strcmp(argv[i], "-") == 0) { continue; }
+        char *file = editorPathAbsolute(argv[i]);
+        if (strlen(file) <= SERVER_MSG_MAX) { clientSend(fd, type, file, strlen(file)); }
+        free(file);
+    }
+    enableRawMode();
+    clientSendSize(fd);
+    clientSend(fd, SERVER_MSG_ATTACH, NULL, 0);
 
-    write(STDOUT_FILENO, ab.b, ab.len);
-    abFree(&ab);
-}
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGWINCH);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    int sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
 
-void editorSetStatusMessage(const char *fmt, ...)
-{
-    va_list ap;
-    va_start(ap, fmt);
-    vsnprintf(E.statusMsg, sizeof(E.statusMsg), fmt, ap);
-    va_end(ap);
-    E.statusMsgTime = time(NULL);
+    struct pollfd pfd[3] = { { STDIN_FILENO, POLLIN, 0 }, { fd, POLLIN, 0 }, { sigfd, POLLIN, 0 } };
+    char buf[65536];
+    while (1)
+    {
+        if (poll(pfd, 3, -1) == -1)
+        {
+            if (errno == EINTR) { continue; }
+            die("poll");
+        }
+        if (pfd[1].revents)
+        {
+            ssize_t n = read(fd, buf, sizeof(buf));
+            if (n <= 0) { break; }
+            for (ssize_t at = 0, w; at < n; at += w)
+            {
+                w = write(STDOUT_FILENO, &buf[at], n - at);
+                if (w == -1 && errno == EINTR) { w = 0; }
+                else if (w <= 0) { return 1; }
+            }
+        }
+        if (pfd[0].revents)
+        {
+            ssize_t n = read(STDIN_FILENO, buf, SERVER_KEYS_MAX);
+            if (n == -1 && errno != EAGAIN && errno != EINTR) { break; }
+            if (n == 0 && (pfd[0].revents & (POLLHUP | POLLERR))) { break; }
+            if (n > 0) { clientSend(fd, SERVER_MSG_KEYS, buf, n); }
+        }
+        if (pfd[2].revents)
+        {
+            struct signalfd_siginfo si;
+            while (read(sigfd, &si, sizeof(si)) == sizeof(si)) {}
+            clientSendSize(fd);
+        }
+    }
+    return 0;
 }
 
 /*** input ***/
 
-char *editorPrompt(char *prompt, void (*callback)(char *, int))
+char *editorPromptRead(char *prompt, void (*callback)(char *, int), int allow_empty)
 {
     size_t bufsize = 128;
     char *buf = malloc(bufsize);
@@ -1347,14 +10511,14 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int))
         }
         else if (c == '\r')
         {
-            if (buflen != 0)
+            if (buflen != 0 || allow_empty)
             {
                 editorSetStatusMessage("");
                 if (callback) { callback(buf, c); }
                 return buf;
             }
         }
-        else if (!iscntrl(c) && c < 128)
+        else if ((c < 128 && !iscntrl(c)) || (c >= 128 && c < 256))
         {
             if (buflen == bufsize - 1)
             {
@@ -1369,9 +10533,25 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int))
     }
 }
 
+char *editorPrompt(char *prompt, void (*callback)(char *, int))
+{
+    return editorPromptRead(prompt, callback, 0);
+}
+
+char *editorPromptEmpty(char *prompt, void (*callback)(char *, int))
+{
+    return editorPromptRead(prompt, callback, 1);
+}
+
+int editorCursorRx(void)
+{
+    if (V->cy >= B->numRows) { return 0; }
+    return editorRowCxToRx(&B->row[V->cy], V->cx);
+}
+
 void editorMoveCursor(int key)
 {
-    erow *row = (E.cy >= E.numRows) ? NULL : &E.row[E.cy];
+    erow *row = (V->cy >= B->numRows) ? NULL : &B->row[V->cy];
 
     switch (key)
     {
@@ -1385,20 +10565,20 @@ void editorMoveCursor(int key)
         } break;
         case CTRL_ARROW_LEFT:
         {
-            if (E.cy >= E.numRows) { break; }
-            row = &E.row[E.cy];
-            if (E.cx == 0)
+            if (V->cy >= B->numRows) { break; }
+            row = &B->row[V->cy];
+            if (V->cx == 0)
             {
-                if (E.cy > 0)
+                if (V->cy > 0)
                 {
-                    E.cy--;
-                    row = &E.row[E.cy];
-                    E.cx = row->size;
+                    V->cy--;
+                    row = &B->row[V->cy];
+                    V->cx = row->size;
                 }
                 break;
             }
 
-            int pos = E.cx - 1;
+            int pos = V->cx - 1;
             while (pos > 0 && (row->chars[pos] == ' ' || row->chars[pos] == '\t'))
             { pos--; }
 
@@ -1409,7 +10589,7 @@ void editorMoveCursor(int key)
 
             /*if (pos < 0)*/
             /*{*/
-            /*    E.cx = 0;*/
+            /*    V->cx = 0;*/
             /*    break;*/
             /*}*/
             /**/
@@ -1423,96 +10603,104 @@ void editorMoveCursor(int key)
             /*{ wordEnd++; }*/
             /**/
             /*// Set the cursor to the end of the word (i.e. just past the last character).*/
-            /*E.cx = wordEnd;*/
-            E.cx = pos;
-            E.px = E.cx;
+            /*V->cx = wordEnd;*/
+            V->cx = pos;
+            V->px = editorCursorRx();
         } break;
         case CTRL_ARROW_RIGHT:
         {
-            if (E.cy >= E.numRows) { break; }
-            row = &E.row[E.cy];
+            if (V->cy >= B->numRows) { break; }
+            row = &B->row[V->cy];
 
-            if (E.cx >= row->size)
+            if (V->cx >= row->size)
             {
-                if (E.cy < E.numRows - 1)
+                if (V->cy < B->numRows - 1)
                 {
-                    E.cy++;
-                    E.cx = 0;
+                    V->cy++;
+                    V->cx = 0;
                 }
                 break;
             }
-            int pos = E.cx;
+            int pos = V->cx;
 
             while (pos < row->size && (row->chars[pos] != ' ' && row->chars[pos] != '\t'))
             { pos++; }
             // Skip whitespace until the next word.
             while (pos < row->size && (row->chars[pos] == ' ' || row->chars[pos] == '\t'))
             { pos++; }
-            E.cx = pos;
-            E.px = E.cx;
+            V->cx = pos;
+            V->px = editorCursorRx();
         } break;
         case ARROW_LEFT:
         {
-            if (E.cx != 0)
+            if (V->cx != 0)
             {
-                E.cx--;
+                V->cx = editorRowPrevChar(row, V->cx);
             }
-            else if (E.cy > 0)
+            else if (V->cy > 0)
             {
-                E.cy--;
-                E.cx = E.row[E.cy].size;
+                V->cy--;
+                V->cx = B->row[V->cy].size;
             }
-            E.px = E.cx;
+            V->px = editorCursorRx();
         } break;
         case ARROW_RIGHT:
         {
-            if (row && E.cx < row->size)
+            if (row && V->cx < row->size)
             {
-                E.cx++;
+                V->cx = editorRowNextChar(row, V->cx);
             }
-            else if (row && E.cx == row->size)
+            else if (row && V->cx == row->size)
             {
-                E.cy++;
-                E.cx = 0;
+                V->cy++;
+                V->cx = 0;
             }
-            E.px = E.cx;
+            V->px = editorCursorRx();
+        } break;
+        case HOME_KEY:
+        {
+            V->cx = 0;
+        } break;
+        case END_KEY:
+        {
+            if (row) { V->cx = row->size; }
         } break;
         case ARROW_UP:
         {
-            if (E.cy > 0)
+            if (V->cy > 0)
             {
-                E.cy--;
-                row = &E.row[E.cy];
-                E.cx = (E.px > row->size ? row->size : E.px);
+                V->cy--;
+                row = &B->row[V->cy];
+                V->cx = editorRowRxToCx(row, V->px);
             }
         } break;
         case ARROW_DOWN:
         {
-            if (E.cy < E.numRows - 1)
+            if (V->cy < B->numRows - 1)
             {
-                E.cy++;
-                row = &E.row[E.cy];
-                E.cx = (E.px > row->size ? row->size : E.px);
+                V->cy++;
+                row = &B->row[V->cy];
+                V->cx = editorRowRxToCx(row, V->px);
             }
         } break;
     }
 
-    row = (E.cy >= E.numRows) ? NULL : &E.row[E.cy];
+    row = (V->cy >= B->numRows) ? NULL : &B->row[V->cy];
     int rowlen = row ? row->size : 0;
-    if (E.cx > rowlen) { E.cx = rowlen; }
+    if (V->cx > rowlen) { V->cx = rowlen; }
 
 
     // NOTE(liam): margin adjust scroll
     int margin = WEISS_SCROLL_Y_MARGIN;
 
-    if (E.cy < E.rowoff + margin)
+    if (V->cy < V->rowoff + margin)
     {
-        E.rowoff = E.cy - margin;
-        if (E.rowoff < 0) { E.rowoff = 0; }
+        V->rowoff = V->cy - margin;
+        if (V->rowoff < 0) { V->rowoff = 0; }
     }
-    else if (E.cy >= E.rowoff + E.screenRows - margin)
+    else if (V->cy >= V->rowoff + V->screenRows - margin)
     {
-        E.rowoff = E.cy - E.screenRows + margin + 1;
+        V->rowoff = V->cy - V->screenRows + margin + 1;
     }
 }
 
@@ -1521,6 +10709,19 @@ void editorProcessKeypress()
     static int quitTimes = WEISS_QUIT_CONFIRM_COUNTER;
     static int resetTimes = WEISS_QUIT_CONFIRM_COUNTER;
     int c = editorReadKey();
+    E.keypresses++;
+    if (B->hex && editorHexProcessKey(c))
+    {
+        quitTimes = WEISS_QUIT_CONFIRM_COUNTER;
+        return;
+    }
+    struct editorBuffer *buf = B;
+    int dirty = B->dirty;
+    int keepMark = 0;
+
+    // NOTE: the rows any cursor can edit this keypress are hot.
+    editorRowsThaw(V->cy - 1, 3);
+    for (int i = 0; i < V->cursors.count; i++) { editorRowsThaw(V->cursors.c[i].cy - 1, 3); }
 
     switch (c)
     {
@@ -1530,10 +10731,13 @@ void editorProcessKeypress()
         } break;
         case CTRL_KEY('q'):
         {
-            if (E.dirty && quitTimes > 0)
+            // NOTE: a client of the server only detaches; buffers stay loaded.
+            if (serverDetach()) { break; }
+            int dirty = editorBuffersDirty();
+            if (dirty && quitTimes > 0)
             {
-                editorSetStatusMessage("UNSAVED CHANGES: "
-                    "Press C-Q %d more times to quit.", quitTimes);
+                editorSetStatusMessage("UNSAVED CHANGES in %d buffer%s: "
+                    "Press C-Q %d more times to quit.", dirty, dirty == 1 ? "" : "s", quitTimes);
                 quitTimes--;
                 return;
             }
@@ -1548,15 +10752,22 @@ void editorProcessKeypress()
             editorSave();
         } break;
 
+        case CTRL_KEY('x'):
+        {
+            // NOTE: cuts when there is a selection, else the window prefix.
+            if (V->markSet) { editorCopy(1); }
+            else { editorWindowCommand(); }
+        } break;
+
         case CTRL_KEY('l'):
         {
-            E.rowoff = getScreenCenter();
+            V->rowoff = getScreenCenter();
         } break;
 
         case CTRL_KEY('r'):
         {
             // NOTE(liam): reopens current file without saving.
-            if (E.dirty && resetTimes > 0)
+            if (B->dirty && resetTimes > 0)
             {
                 editorSetStatusMessage("UNSAVED CHANGES: "
                         "Press C-R %d more times to reset file.", resetTimes);
@@ -1567,11 +10778,36 @@ void editorProcessKeypress()
         } break;
 
         case CTRL_KEY('a'):
+        {
+            if (V->markSet) { editorMarkClear(); }
+            else
+            {
+                editorMarkSet();
+                editorSetStatusMessage("Mark set");
+            }
+        } break;
         case CTRL_KEY('c'):
+        {
+            editorCopy(0);
+        } break;
         case CTRL_KEY('v'):
+        {
+            editorYank();
+        } break;
+        case KEY_ALT | 'y':
+        {
+            editorYankPop();
+        } break;
+
         case CTRL_KEY('z'):
         {
-            editorSetStatusMessage("not implemented!");
+            editorCursorsClear();
+            editorUndo();
+        } break;
+        case CTRL_KEY('y'):
+        {
+            editorCursorsClear();
+            editorRedo();
         } break;
 
         case CTRL_KEY('j'):
@@ -1579,35 +10815,96 @@ void editorProcessKeypress()
             editorRowAppendToPrev();
         } break;
         case HOME_KEY:
-        {
-            E.cx = 0;
-        } break;
         case END_KEY:
         {
-            if (E.cy < E.numRows)
-            {
-                E.cx = E.row[E.cy].size;
-            }
+            editorCursorsMove(c);
         } break;
 
         case CTRL_KEY('n'):
         {
-            editorIndentDown();
+            editorLinesIndent(-1);
+            keepMark = 1;
         } break;
         case CTRL_KEY('p'):
         {
-            editorIndentUp();
+            editorLinesIndent(1);
+            keepMark = 1;
+        } break;
+        case KEY_ALT | ';':
+        {
+            editorLinesComment();
+            keepMark = 1;
+        } break;
+        case KEY_ALT | 'k':
+        {
+            editorLinesDelete();
+        } break;
+        case KEY_ALT | 'd':
+        {
+            editorLinesDuplicate();
+            keepMark = 1;
+        } break;
+        case KEY_ALT | KEY_SHIFT | ARROW_UP:
+        case KEY_ALT | KEY_SHIFT | ARROW_DOWN:
+        {
+            editorLinesMove(c == (KEY_ALT | KEY_SHIFT | ARROW_UP) ? -1 : 1);
+            keepMark = 1;
         } break;
 
         case CTRL_KEY('f'):
         {
             editorFind();
         } break;
+        case CTRL_KEY('t'):
+        {
+            editorReplace(0);
+        } break;
+        case CTRL_KEY('w'):
+        {
+            editorReplace(1);
+        } break;
+        case CTRL_KEY('g'):
+        {
+            editorGrep();
+        } break;
+        case CTRL_KEY('k'):
+        {
+            editorMacroRecord();
+        } break;
+        case CTRL_KEY('o'):
+        {
+            editorMacroPlay(1, 0);
+        } break;
+        case CTRL_KEY('u'):
+        {
+            editorMacroPrompt();
+        } break;
+        case CTRL_KEY('e'):
+        {
+            editorFindStep(1);
+        } break;
+        case CTRL_KEY('b'):
+        {
+            editorFindStep(-1);
+        } break;
 
         case BACKSPACE:
         case CTRL_KEY('h'):
         case DEL_KEY:
         {
+            int sy, sx, ey, ex;
+            if (editorSelection(&sy, &sx, &ey, &ex))
+            {
+                editorUndoBegin(UNDO_OTHER);
+                editorDeleteRegion(sy, sx, ey, ex);
+                editorUndoSeal();
+                break;
+            }
+            if (V->cursors.count)
+            {
+                editorCursorsDelete(c == DEL_KEY);
+                break;
+            }
             if (c == DEL_KEY) { editorMoveCursor(ARROW_RIGHT); }
             editorDelChar();
         } break;
@@ -1617,15 +10914,15 @@ void editorProcessKeypress()
         {
             if (c == PAGE_UP)
             {
-                E.cy = E.rowoff;
+                V->cy = V->rowoff;
             }
             else if (c == PAGE_DOWN)
             {
-                E.cy = E.rowoff + E.screenRows - 1;
-                if (E.cy > E.numRows) { E.cy = E.numRows; }
+                V->cy = V->rowoff + V->screenRows - 1;
+                if (V->cy > B->numRows) { V->cy = B->numRows; }
             }
 
-            int times = E.screenRows;
+            int times = V->screenRows;
             while (times--)
             {
                 editorMoveCursor(c == PAGE_UP ? ARROW_UP : ARROW_DOWN);
@@ -1641,12 +10938,73 @@ void editorProcessKeypress()
         case ARROW_LEFT:
         case ARROW_RIGHT:
         {
-            editorMoveCursor(c);
+            editorCursorsMove(c);
+        } break;
+        case KEY_SHIFT | ARROW_UP:
+        case KEY_SHIFT | ARROW_DOWN:
+        case KEY_SHIFT | ARROW_LEFT:
+        case KEY_SHIFT | ARROW_RIGHT:
+        case KEY_SHIFT | CTRL_ARROW_UP:
+        case KEY_SHIFT | CTRL_ARROW_DOWN:
+        case KEY_SHIFT | CTRL_ARROW_LEFT:
+        case KEY_SHIFT | CTRL_ARROW_RIGHT:
+        case KEY_SHIFT | HOME_KEY:
+        case KEY_SHIFT | END_KEY:
+        {
+            if (!V->markSet) { editorMarkSet(); }
+            editorCursorsMove(c & ~KEY_SHIFT);
+        } break;
+
+        case CTRL_KEY('d'):
+        {
+            editorCursorsNextMatch();
+        } break;
+        case KEY_ALT | ARROW_UP:
+        case KEY_ALT | ARROW_DOWN:
+        {
+            editorCursorsAddVertical(c == (KEY_ALT | ARROW_UP) ? -1 : 1);
+        } break;
+        case KEY_ALT | 'l':
+        {
+            editorCursorsLinesPrompt();
+        } break;
+
+        case KEY_ALT | 'p':
+        {
+            prof.visible = !prof.visible;
+        } break;
+
+        case CTRL_KEY(']'):
+        {
+            editorBracketJump();
+        } break;
+        case KEY_ALT | 'f':
+        {
+            editorStreamFollow();
+        } break;
+        case KEY_ALT | 'g':
+        {
+            editorGotoPrompt();
+        } break;
+
+        case KEY_ALT | 'm':
+        {
+            editorMemoryReport();
+        } break;
+
+        case KEY_ALT | 't':
+        {
+            int n = traceDump();
+            if (n < 0) { editorSetStatusMessage("Tracing is off; set WEISS_TRACE to a file to turn it on"); }
+            else { editorSetStatusMessage("Trace: %d events written to %s", n, trace.path); }
         } break;
 
         /*case CTRL_KEY('l'):*/
         case '\x1b':
         {
+            matchIndexClear(&B->match);
+            editorCursorsClear();
+            editorMarkClear();
         } break;
 
         case '\t':
@@ -1663,9 +11021,15 @@ void editorProcessKeypress()
         }
         default:
         {
-            editorInsertChar(c);
+            // NOTE: unbound special and modified keys don't insert.
+            if (c < ARROW_LEFT) { editorInsertChar(c); }
         } break;
     }
+    // NOTE: commands that only know the main cursor can strand the others.
+    editorCursorsNormalize();
+    // NOTE: any edit but a line command ends the selection.
+    if (B == buf && B->dirty > dirty && !keepMark) { editorMarkClear(); }
+    editorColdCheck();
 
     quitTimes = WEISS_QUIT_CONFIRM_COUNTER;
     resetTimes = WEISS_QUIT_CONFIRM_COUNTER;
@@ -1673,37 +11037,84 @@ void editorProcessKeypress()
 
 void initEditor()
 {
-    E.cx = 0;
-    E.cy = 0;
-    E.rx = 0;
-    E.rowoff = 0;
-    E.coloff = 0;
-    E.numRows = 0;
-    E.row = NULL;
-    E.dirty = 0;
+    traceInit();
+    pthread_mutex_init(&E.lock, NULL);
+    editorLock();
+    editorEventsInit();
+    if (!serverActive()) { editorEventWatch(STDIN_FILENO); }
+
     E.mode = 0;
-    E.filename = NULL;
     E.statusMsg[0] = '\0';
     E.statusMsgTime = 0;
-    E.syntax = NULL;
-
-    if (getWindowSize(&E.screenRows, &E.screenCols) == -1)
+    E.buffers = NULL;
+    E.nbuffers = 0;
+
+    // NOTE: WEISS_ESCDELAY overrides the ESC timeout, e.g. 25 over ssh.
+    E.escTimeout = WEISS_ESC_TIMEOUT_MS;
+    char *escdelay = getenv("WEISS_ESCDELAY");
+    if (escdelay && *escdelay) { E.escTimeout = atoi(escdelay); }
+    // NOTE: WEISS_PROFILE starts with the profiler summary shown.
+    char *profile = getenv("WEISS_PROFILE");
+    prof.visible = profile && *profile && strcmp(profile, "0") != 0;
+    // NOTE: WEISS_OSC52 also copies to the terminal's clipboard.
+    char *osc52 = getenv("WEISS_OSC52");
+    kills.osc52 = osc52 && *osc52 && strcmp(osc52, "0") != 0;
+    // NOTE: WEISS_HOT_MB is how much row text a buffer keeps uncompressed.
+    char *hot = getenv("WEISS_HOT_MB");
+    if (hot && *hot) { cold.budget = atoll(hot) * 1024 * 1024; }
+
+    // NOTE: the server has no terminal; each client sends its size.
+    if (serverActive())
+    {
+        E.screenRows = 24;
+        E.screenCols = 80;
+    }
+    else if (getWindowSize(&E.screenRows, &E.screenCols) == -1)
     {
         die("getWindowSize");
     }
     E.screenRows -= 2;
 }
 
+#ifndef WEISS_BENCH
 int main(int argc, char **argv)
 {
+    // NOTE: --server and -c come first, see server.
+    if (argc > 1 && strcmp(argv[1], "--server") == 0) { return serverMain(); }
+    if (argc > 1 && strcmp(argv[1], "-c") == 0) { return clientMain(argc - 2, argv + 2); }
+    // NOTE: `-` is a pipe on stdin, which has to make way for the terminal
+    // before raw mode is set on it.
+    int piped = -2;
+    for (int i = 1; i < argc && piped == -2; i++)
+    {
+        if (strcmp(argv[i], "-") == 0) { piped = editorStreamStdin(); }
+    }
     enableRawMode();
     initEditor();
-    if (argc >= 2)
+    // NOTE: only the file shown first is read in now; the rest wait for a view.
+    for (int i = 1; i < argc; i++)
     {
-        editorOpen(argv[1]);
+        if (strcmp(argv[i], "-") == 0)
+        {
+            if (stream.buf == NULL) { editorStreamOpen(piped); }
+        }
+        else if (strcmp(argv[i], "-x") == 0 && i + 1 < argc)
+        {
+            // NOTE: `-x file` opens the file as hex, whatever it holds.
+            i++;
+            struct editorBuffer *b = editorBufferFind(argv[i]);
+            if (b == NULL) { b = editorBufferNew(argv[i]); }
+            if (!b->loaded) { editorHexOpen(b); }
+        }
+        else if (editorBufferFind(argv[i]) == NULL) { editorBufferNew(argv[i]); }
     }
+    editorWindowsInit();
 
-    editorSetStatusMessage("HELP: C-S = save | C-Q = quit | C-F = find");
+    // NOTE: a file that failed to load says so instead.
+    if (E.statusMsg[0] == '\0')
+    {
+        editorSetStatusMessage("HELP: C-S = save | C-Q = quit | C-F = find | C-T = replace | C-G = grep | C-X = windows");
+    }
     editorRefreshScreen();
     while (1)
     {
@@ -1712,3 +11123,579 @@ int main(int argc, char **argv)
     }
     return 0;
 }
+#endif
+
+/*** bench ***/
+
+#ifdef WEISS_BENCH
+
+/*
+ * `make bench` builds weiss with -DWEISS_BENCH, which swaps main for a
+ * headless driver over the editor core: no terminal, and frames are
+ * rendered into frameSink. Inputs are generated into a temporary
+ * directory. Every case prints one JSON line with its ops/sec, per-op
+ * latency percentiles in microseconds and the peak RSS so far.
+ *
+ *   weiss-bench [-s scale] [case...]
+ */
+
+#define BENCH_ROWS 50
+#define BENCH_COLS 160
+
+struct benchTimer {
+    double *us;
+    int count;
+    int cap;
+    long long bytes; // read, written or drawn by all ops, for MB/s
+    double start;
+};
+
+char benchDir[] = "/tmp/weiss-bench-XXXXXX";
+int benchScale = 1;
+char **benchFilters;
+int benchNFilters;
+struct abuf benchSink = ABUF_INIT;
+
+double benchNowUs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+int benchWanted(const char *name)
+{
+    if (benchNFilters == 0) { return 1; }
+    for (int i = 0; i < benchNFilters; i++)
+    {
+        if (strstr(name, benchFilters[i])) { return 1; }
+    }
+    return 0;
+}
+
+void benchStart(struct benchTimer *t)
+{
+    t->start = benchNowUs();
+}
+
+void benchStop(struct benchTimer *t)
+{
+    double us = benchNowUs() - t->start;
+    if (t->count == t->cap)
+    {
+        t->cap = t->cap ? t->cap * 2 : 256;
+        t->us = realloc(t->us, sizeof(double) * t->cap);
+    }
+    t->us[t->count++] = us;
+}
+
+int benchCmp(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+double benchPercentile(struct benchTimer *t, double p)
+{
+    // NOTE: nearest rank, over sorted samples; 0 with none.
+    if (t->count == 0) { return 0; }
+    int i = (int)(p * t->count + 0.999999) - 1;
+    if (i < 0) { i = 0; }
+    return t->us[i];
+}
+
+void benchReport(const char *name, const char *inputName, struct benchTimer *t)
+{
+    double total = 0;
+    for (int i = 0; i < t->count; i++) { total += t->us[i]; }
+    if (t->count > 0) { qsort(t->us, t->count, sizeof(double), benchCmp); }
+
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+
+    printf("{\"bench\":\"%s\",\"input\":\"%s\",\"ops\":%d,\"ops_per_sec\":%.1f,"
+           "\"p50_us\":%.1f,\"p90_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f,"
+           "\"mb_per_sec\":%.1f,\"peak_rss_kb\":%ld}\n",
+           name, inputName, t->count, total > 0 ? t->count / (total / 1e6) : 0,
+           benchPercentile(t, 0.5), benchPercentile(t, 0.9), benchPercentile(t, 0.99),
+           benchPercentile(t, 1), total > 0 ? t->bytes / total : 0, ru.ru_maxrss);
+    fflush(stdout);
+
+    free(t->us);
+    memset(t, 0, sizeof(*t));
+}
+
+/* inputs */
+
+void benchPath(char *path, const char *inputName)
+{
+    snprintf(path, PATH_MAX, "%s/%s", benchDir, inputName);
+}
+
+FILE *benchCreate(const char *inputName)
+{
+    char path[PATH_MAX];
+    benchPath(path, inputName);
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) { die("fopen"); }
+    return fp;
+}
+
+void benchGenerate(void)
+{
+    // NOTE: huge.c is many ordinary rows of highlighted code.
+    FILE *fp = benchCreate("huge.c");
+    for (int i = 0; i < 200000 * benchScale; i++)
+    {
+        if (i % 40 == 0) { fprintf(fp, "static int function_%d(int arg, const char *name)\n{\n", i); }
+        else if (i % 40 == 39) { fprintf(fp, "    return value_%d;\n}\n\n", i - 1); }
+        else
+        {
+            fprintf(fp, "    int value_%d = compute(arg, %d, \"label %d\"); // step %d\n",
+                    i, i * 7 % 1000, i % 97, i);
+        }
+    }
+    fclose(fp);
+
+    // NOTE: long.txt is a few rows of half a megabyte each.
+    fp = benchCreate("long.txt");
+    for (int i = 0; i < 20 * benchScale; i++)
+    {
+        for (int j = 0; j < 50000; j++) { fprintf(fp, "word%d ", (i + j) % 1000); }
+        fputc('\n', fp);
+    }
+    fclose(fp);
+
+    // NOTE: comments.c is one block comment over most of the file, so
+    // opening or closing it rehighlights every row below.
+    fp = benchCreate("comments.c");
+    fprintf(fp, "int header;\n/*\n");
+    for (int i = 0; i < 100000 * benchScale; i++)
+    {
+        fprintf(fp, " * int commented_%d = %d; \"not a string\" // nor this\n", i, i);
+    }
+    fprintf(fp, " */\nint footer;\n");
+    fclose(fp);
+
+    // NOTE: log.txt is a server log, for cold rows.
+    fp = benchCreate("log.txt");
+    const char *levels[] = { "INFO", "WARN", "ERROR" };
+    for (int i = 0; i < 300000 * benchScale; i++)
+    {
+        fprintf(fp, "2026-10-%02d 12:%02d:%02d.%03d [%s] GET /api/v1/items/%d status=%d "
+                    "latency_ms=%d user=%d\n", i % 28 + 1, i / 60 % 60, i % 60, i % 1000,
+                levels[i % 7 % 3], i * 31 % 5000, i % 13 ? 200 : 500, i * 17 % 900, i % 4099);
+    }
+    fclose(fp);
+
+    // NOTE: crlf.txt is plain text with DOS line endings, so opening it
+    // is mostly splitting lines.
+    fp = benchCreate("crlf.txt");
+    for (int i = 0; i < 300000 * benchScale; i++)
+    {
+        fprintf(fp, "row %d of a file written on windows, caf\xc3\xa9 %d\r\n", i, i * 7 % 1000);
+    }
+    fclose(fp);
+}
+
+void benchCleanup(void)
+{
+    const char *names[] = { "huge.c", "long.txt", "comments.c", "log.txt", "crlf.txt", "saved.c" };
+    for (unsigned int i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+    {
+        char path[PATH_MAX];
+        benchPath(path, names[i]);
+        unlink(path);
+    }
+    rmdir(benchDir);
+}
+
+void benchOpen(const char *inputName)
+{
+    char path[PATH_MAX];
+    benchPath(path, inputName);
+    editorViewShow(V, editorBufferNew(path));
+}
+
+void benchClose(void)
+{
+    B->dirty = 0;
+    editorBufferKill();
+}
+
+void benchFrame(struct benchTimer *t)
+{
+    benchSink.len = 0;
+    editorRefreshScreen();
+    t->bytes += benchSink.len;
+}
+
+/* cases */
+
+void benchCaseOpen(const char *inputName)
+{
+    struct benchTimer t = {0};
+    for (int i = 0; i < 3; i++)
+    {
+        char path[PATH_MAX];
+        benchPath(path, inputName);
+        struct stat st;
+        if (stat(path, &st) == 0) { t.bytes += st.st_size; }
+
+        benchStart(&t);
+        benchOpen(inputName);
+        benchStop(&t);
+        benchClose();
+    }
+    benchReport("open", inputName, &t);
+}
+
+void benchCaseSave(const char *inputName)
+{
+    struct benchTimer t = {0};
+    benchOpen(inputName);
+    char path[PATH_MAX];
+    benchPath(path, "saved.c");
+    free(B->filename);
+    B->filename = strdup(path);
+    for (int i = 0; i < 5; i++)
+    {
+        benchStart(&t);
+        editorSave();
+        benchStop(&t);
+        struct stat st;
+        if (stat(path, &st) == 0) { t.bytes += st.st_size; }
+    }
+    benchClose();
+    benchReport("save", inputName, &t);
+}
+
+void benchCaseType(const char *inputName, int ops)
+{
+    /*
+     * A keypress as the main loop sees it: the edit, then a frame. A
+     * newline every 60 keys.
+     */
+    struct benchTimer t = {0};
+    benchOpen(inputName);
+    V->cy = B->numRows / 2;
+    V->cx = B->numRows ? B->row[V->cy].size / 2 : 0;
+    for (int i = 0; i < ops; i++)
+    {
+        benchStart(&t);
+        if (i % 60 == 59) { editorInsertNewline(); }
+        else { editorInsertChar('a' + i % 26); }
+        editorScroll();
+        benchFrame(&t);
+        benchStop(&t);
+    }
+    benchClose();
+    benchReport("type", inputName, &t);
+}
+
+void benchCasePaste(const char *inputName, int bytes)
+{
+    /*
+     * Pasted text arrives as terminal input: it goes through the input
+     * ring and the key decoder, and each key is handled like a typed one.
+     * One op is one ring's worth of input.
+     */
+    struct benchTimer t = {0};
+    benchOpen(inputName);
+    V->cy = B->numRows / 2;
+
+    char chunk[INPUT_RING_SIZE];
+    for (int done = 0; done < bytes; done += sizeof(chunk))
+    {
+        for (unsigned int i = 0; i < sizeof(chunk); i++)
+        {
+            chunk[i] = (i % 64 == 63) ? '\r' : "paste the quick brown fox; "[i % 27];
+        }
+        memcpy(input.buf, chunk, sizeof(chunk));
+        input.head = 0;
+        input.tail = sizeof(chunk);
+
+        benchStart(&t);
+        while (input.head != input.tail)
+        {
+            editorProcessKeypress();
+            benchFrame(&t);
+        }
+        benchStop(&t);
+        t.bytes += sizeof(chunk);
+    }
+    benchClose();
+    benchReport("paste", inputName, &t);
+}
+
+void benchCaseYank(const char *inputName, int ops)
+{
+    // NOTE: copying the whole buffer and pasting it in the middle, then
+    // undoing the paste; only the copy and the paste are timed.
+    struct benchTimer t = {0};
+    benchOpen(inputName);
+    for (int i = 0; i < ops; i++)
+    {
+        V->cy = V->cx = 0;
+        editorMarkSet();
+        V->cy = B->numRows;
+
+        benchStart(&t);
+        editorCopy(0);
+        V->cy = B->numRows / 2;
+        V->cx = 0;
+        editorYank();
+        benchStop(&t);
+        t.bytes += kills.e[kills.head].bytes;
+        editorUndo();
+    }
+    benchClose();
+    benchReport("yank", inputName, &t);
+}
+
+void benchCaseIndent(const char *inputName, int ops)
+{
+    // NOTE: indenting then dedenting every line, one op each.
+    struct benchTimer t = {0};
+    benchOpen(inputName);
+    V->cy = V->cx = 0;
+    editorMarkSet();
+    V->cy = B->numRows;
+    for (int i = 0; i < ops; i++)
+    {
+        benchStart(&t);
+        editorLinesIndent(i % 2 ? -1 : 1);
+        benchFrame(&t);
+        benchStop(&t);
+    }
+    benchClose();
+    benchReport("indent", inputName, &t);
+}
+
+void benchCaseSearch(const char *name, const char *inputName, const char *query, int regex, int ops)
+{
+    // NOTE: one op is a find-next from just past the previous match.
+    struct benchTimer t = {0};
+    benchOpen(inputName);
+    struct searchPattern p;
+    memset(&p, 0, sizeof(p));
+    if (regex)
+    {
+        const char *err = searchCompileRegex(&p, query, 0);
+        if (err) { die(err); }
+    }
+    else { searchCompile(&p, query, 0); }
+
+    int row = 0, col = 0;
+    for (int i = 0; i < ops; i++)
+    {
+        int mrow = 0, mcol = 0, mlen = 0;
+        benchStart(&t);
+        int found = editorSearchRows(&p, row, col, 1, &mrow, &mcol, &mlen);
+        benchStop(&t);
+        if (!found) { break; }
+        // NOTE: bytes scanned are those up to the match's end, wrapping.
+        long long span = lineIndexOffset(mrow, mcol + mlen) - lineIndexOffset(row, col);
+        t.bytes += span >= 0 ? span : span + lineIndexTotal();
+        row = mrow;
+        col = mcol + (mlen ? mlen : 1);
+    }
+    searchFree(&p);
+    benchClose();
+    benchReport(name, inputName, &t);
+}
+
+void benchCaseHighlight(const char *inputName, int ops)
+{
+    /*
+     * Deletes and retypes the comment opener on row 1: each op reopens it
+     * over every row below, twice.
+     */
+    struct benchTimer t = {0};
+    benchOpen(inputName);
+    for (int i = 0; i < ops; i++)
+    {
+        V->cy = 1;
+        V->cx = 2;
+        benchStart(&t);
+        editorDelChar();
+        editorDelChar();
+        editorInsertChar('/');
+        editorInsertChar('*');
+        benchStop(&t);
+    }
+    benchClose();
+    benchReport("highlight", inputName, &t);
+}
+
+void benchCaseRender(const char *inputName, int ops)
+{
+    // NOTE: one op scrolls a page and draws the whole frame.
+    struct benchTimer t = {0};
+    benchOpen(inputName);
+    for (int i = 0; i < ops; i++)
+    {
+        V->cy = B->numRows ? (long long)i * V->screenRows % B->numRows : 0;
+        V->cx = (V->cy < B->numRows) ? B->row[V->cy].size * (i % 4) / 4 : 0;
+        V->rowoff = V->cy;
+        benchStart(&t);
+        benchFrame(&t);
+        benchStop(&t);
+    }
+    benchClose();
+    benchReport("render", inputName, &t);
+}
+
+void benchCaseCold(const char *inputName)
+{
+    /*
+     * With a hot budget of a few MB nearly every row is compressed as it
+     * is read in; saving and searching then go through the block cache.
+     */
+    long long budget = cold.budget;
+    cold.budget = 4 * 1024 * 1024;
+    char path[PATH_MAX];
+    benchPath(path, inputName);
+    struct stat st;
+    long long size = stat(path, &st) == 0 ? st.st_size : 0;
+
+    struct benchTimer t = {0};
+    benchStart(&t);
+    benchOpen(inputName);
+    benchStop(&t);
+    t.bytes += size;
+    benchReport("cold-open", inputName, &t);
+
+    benchPath(path, "saved.c");
+    free(B->filename);
+    B->filename = strdup(path);
+    for (int i = 0; i < 5; i++)
+    {
+        benchStart(&t);
+        editorSave();
+        benchStop(&t);
+        t.bytes += size;
+    }
+    benchReport("cold-save", inputName, &t);
+
+    struct searchPattern p;
+    memset(&p, 0, sizeof(p));
+    searchCompile(&p, "status=404", 0);
+    for (int i = 0; i < 20; i++)
+    {
+        int mrow, mcol, mlen;
+        benchStart(&t);
+        editorSearchRows(&p, B->numRows / 2, 0, 1, &mrow, &mcol, &mlen);
+        benchStop(&t);
+        t.bytes += size;
+    }
+    searchFree(&p);
+    benchReport("cold-search", inputName, &t);
+
+    benchClose();
+    cold.budget = budget;
+}
+
+void benchCaseRegex(void)
+{
+    /*
+     * Not timed: checks what a few patterns compile to and match, so a
+     * parser change that breaks them fails the run.
+     */
+    struct { const char *pat, *text; int at, len; } checks[] = {
+        { "f(x) {", "int fx {", 4, 4 },
+        { "a{x}", "ba{x}", 1, 4 },
+        { "a{2}", "baaa", 1, 2 },
+        { "a{2,}b", "caaab", 1, 4 },
+        { "a{", "xa{", 1, 2 },
+        { "{", "}{", 1, 1 },
+        { "{2}", NULL, -1, 0 },
+        { "*", NULL, -1, 0 },
+    };
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(checks) / sizeof(checks[0]); i++)
+    {
+        const char *err = NULL;
+        struct regex *rx = rxCompile(checks[i].pat, 0, &err);
+        int at = -1, len = 0;
+        if (rx && checks[i].text)
+        {
+            at = rxFind(rx, checks[i].text, strlen(checks[i].text), 0, &len);
+        }
+        if ((rx != NULL) != (checks[i].text != NULL) || at != checks[i].at ||
+            (at != -1 && len != checks[i].len))
+        {
+            fprintf(stderr, "regex-check: %s: %s, at %d len %d\n", checks[i].pat,
+                    err ? err : "compiled", at, len);
+            failed++;
+        }
+        if (rx) { rxFree(rx); }
+    }
+    printf("{\"bench\":\"regex-check\",\"patterns\":%d,\"failed\":%d}\n",
+           (int)(sizeof(checks) / sizeof(checks[0])), failed);
+    fflush(stdout);
+    if (failed) { exit(1); }
+}
+
+int main(int argc, char **argv)
+{
+    int first = 1;
+    if (argc > 2 && strcmp(argv[1], "-s") == 0)
+    {
+        benchScale = atoi(argv[2]) > 0 ? atoi(argv[2]) : 1;
+        first = 3;
+    }
+    benchFilters = &argv[first];
+    benchNFilters = argc - first;
+
+    traceInit();
+    pthread_mutex_init(&E.lock, NULL);
+    editorLock();
+    editorEventsInit();
+    E.screenRows = BENCH_ROWS - 2;
+    E.screenCols = BENCH_COLS;
+    editorWindowsInit();
+    frameSink = &benchSink;
+
+    if (mkdtemp(benchDir) == NULL) { die("mkdtemp"); }
+    benchGenerate();
+
+    if (benchWanted("regex")) { benchCaseRegex(); }
+    if (benchWanted("open"))
+    {
+        benchCaseOpen("huge.c");
+        benchCaseOpen("long.txt");
+        benchCaseOpen("comments.c");
+        benchCaseOpen("crlf.txt");
+    }
+    if (benchWanted("save")) { benchCaseSave("huge.c"); }
+    if (benchWanted("type"))
+    {
+        benchCaseType("huge.c", 20000);
+        benchCaseType("long.txt", 2000);
+    }
+    if (benchWanted("paste")) { benchCasePaste("huge.c", 64 * 1024); }
+    if (benchWanted("yank")) { benchCaseYank("huge.c", 20); }
+    if (benchWanted("indent")) { benchCaseIndent("huge.c", 20); }
+    if (benchWanted("search"))
+    {
+        benchCaseSearch("search-common", "huge.c", "compute", 0, 5000);
+        benchCaseSearch("search-rare", "huge.c", "value_199998 ", 0, 20);
+        benchCaseSearch("search-regex", "huge.c", "label [0-9]+7\"", 1, 2000);
+        benchCaseSearch("search-long", "long.txt", "word999 word0 ", 0, 200);
+    }
+    if (benchWanted("highlight")) { benchCaseHighlight("comments.c", 20); }
+    if (benchWanted("cold")) { benchCaseCold("log.txt"); }
+    if (benchWanted("render"))
+    {
+        benchCaseRender("huge.c", 2000);
+        benchCaseRender("long.txt", 200);
+        benchCaseRender("comments.c", 2000);
+    }
+
+    benchCleanup();
+    abFree(&benchSink);
+    return 0;
+}
+
+#endif